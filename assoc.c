@@ -100,6 +100,28 @@ item *assoc_find(const char *key, const size_t nkey, const uint32_t hv) {
     return ret;
 }
 
+/*
+ * Prefetch hints for item_get_multi(), which gives them for a batch of keys
+ * before looking any of them up: first the buckets, then the items chained
+ * first to them. The head is read without the item lock. That is only safe
+ * with granular item locks: the table is swapped and freed only once every
+ * worker thread has moved to the global lock. A stale head does no harm,
+ * as it is merely prefetched.
+ */
+void assoc_prefetch_bucket(const uint32_t hv) {
+    __builtin_prefetch(&primary_hashtable[hv & hashmask(hashpower)]);
+}
+
+void assoc_prefetch_head(const uint32_t hv) {
+    item *it = primary_hashtable[hv & hashmask(hashpower)];
+
+    if (it != NULL) {
+        __builtin_prefetch(it);
+        /* and the key behind the header */
+        __builtin_prefetch(it->data);
+    }
+}
+
 /* returns the address of the item pointer before the key.  if *item == 0,
    the item wasn't found */
 
@@ -248,7 +270,7 @@ static void *assoc_maintenance_thread(void *arg) {
             /* We are done expanding.. just wait for next invocation */
             mutex_lock(&cache_lock);
             started_expanding = false;
-            pthread_cond_wait(&maintenance_cond, &cache_lock);
+            mutex_cond_wait(&maintenance_cond, &cache_lock);
             /* Before doing anything, tell threads to use a global lock */
             mutex_unlock(&cache_lock);
             slabs_rebalancer_pause();
@@ -0,0 +1,84 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include <stddef.h>
+#include <stdint.h>
+
+#include "base64.h"
+
+static const char base64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+size_t base64_encode(const unsigned char *in, size_t len,
+                     char *out, size_t olen) {
+    size_t i, o = 0;
+
+    if (olen < (len + 2) / 3 * 4)
+        return 0;
+
+    for (i = 0; i + 2 < len; i += 3) {
+        uint32_t v = in[i] << 16 | in[i + 1] << 8 | in[i + 2];
+        out[o++] = base64_chars[v >> 18];
+        out[o++] = base64_chars[(v >> 12) & 0x3f];
+        out[o++] = base64_chars[(v >> 6) & 0x3f];
+        out[o++] = base64_chars[v & 0x3f];
+    }
+    if (i < len) {
+        uint32_t v = in[i] << 16;
+        if (i + 1 < len)
+            v |= in[i + 1] << 8;
+        out[o++] = base64_chars[v >> 18];
+        out[o++] = base64_chars[(v >> 12) & 0x3f];
+        out[o++] = i + 1 < len ? base64_chars[(v >> 6) & 0x3f] : '=';
+        out[o++] = '=';
+    }
+    return o;
+}
+
+static int base64_value(const char ch) {
+    if (ch >= 'A' && ch <= 'Z')
+        return ch - 'A';
+    if (ch >= 'a' && ch <= 'z')
+        return ch - 'a' + 26;
+    if (ch >= '0' && ch <= '9')
+        return ch - '0' + 52;
+    if (ch == '+')
+        return 62;
+    if (ch == '/')
+        return 63;
+    return -1;
+}
+
+size_t base64_decode(const char *in, size_t len,
+                     unsigned char *out, size_t olen) {
+    size_t i, o = 0;
+    int pad = 0;
+
+    if (len == 0 || len % 4 != 0)
+        return 0;
+    if (in[len - 1] == '=')
+        pad = in[len - 2] == '=' ? 2 : 1;
+    if (olen < len / 4 * 3 - pad)
+        return 0;
+
+    for (i = 0; i < len; i += 4) {
+        int a = base64_value(in[i]);
+        int b = base64_value(in[i + 1]);
+        int c = base64_value(in[i + 2]);
+        int d = base64_value(in[i + 3]);
+        int last = i + 4 == len;
+
+        if (a < 0 || b < 0)
+            return 0;
+        out[o++] = a << 2 | b >> 4;
+        if (last && pad == 2)
+            break;
+        if (c < 0)
+            return 0;
+        out[o++] = (b & 0xf) << 4 | c >> 2;
+        if (last && pad == 1)
+            break;
+        if (d < 0)
+            return 0;
+        out[o++] = (c & 0x3) << 6 | d;
+    }
+    return o;
+}
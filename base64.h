@@ -0,0 +1,15 @@
+#ifndef BASE64_H
+#define BASE64_H
+
+/*
+ * Standard base64 (RFC 4648) with padding, for keys in the meta commands.
+ *
+ * Both return the number of bytes written to out, or 0 if out is too small
+ * or, for base64_decode, if in is not valid base64. Neither terminates out.
+ */
+size_t base64_encode(const unsigned char *in, size_t len,
+                     char *out, size_t olen);
+size_t base64_decode(const char *in, size_t len,
+                     unsigned char *out, size_t olen);
+
+#endif    /* BASE64_H */
@@ -0,0 +1,320 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Command stream capture, for replaying production traffic offline with the
+ * replay tool.
+ *
+ * With -o capture=<file>, commands read from sampled connections are logged
+ * with the time they were parsed and the connection they came from. One
+ * connection in capture_sample is sampled, and all of its commands are kept,
+ * so each captured stream can be replayed as it was sent.
+ *
+ * Records go into a buffer owned by the worker thread. Full buffers are
+ * queued for the writer thread, so a worker never waits on the disk; if the
+ * writer falls CAPTURE_MAX_QUEUED buffers behind, the records are dropped.
+ * Once a second, and when the server exits, the writer also takes whatever
+ * the workers have buffered, so records of idle threads get out too.
+ */
+#include "memcached.h"
+#include "capture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#define CAPTURE_BUFFER_SIZE (64 * 1024)
+#define CAPTURE_MAX_QUEUED 64
+#define CAPTURE_SKIP UINT32_MAX
+
+struct capture_buffer {
+    size_t used;
+    uint64_t records;
+    struct capture_buffer *next;
+    char data[CAPTURE_BUFFER_SIZE];
+};
+
+/* A worker thread's buffer. lock is only contended when the writer comes to
+ * take it; it is taken before capture_lock. */
+struct capture_thread {
+    pthread_mutex_t lock;
+    struct capture_buffer *buf;
+    struct capture_thread *next;
+};
+
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t capture_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t capture_tid;
+static int capture_fd = -1;
+static uint64_t capture_start;
+
+/* Guarded by capture_lock */
+static struct capture_thread *capture_threads;
+static struct capture_buffer *queue_head;
+static struct capture_buffer *queue_tail;
+static int queued;
+static struct capture_buffer *spare_buffers;
+static bool capture_stopping;
+static uint64_t conns_seen;
+static uint32_t conns_sampled;
+static uint64_t records_written;
+static uint64_t bytes_written;
+static uint64_t records_dropped;
+static uint64_t write_errors;
+
+static void *capture_writer(void *arg);
+static void capture_stop(void);
+
+int capture_init(void) {
+    capture_file_header header;
+    int ret;
+
+    capture_fd = open(settings.capture_file, O_WRONLY | O_CREAT | O_TRUNC,
+                      0644);
+    if (capture_fd == -1) {
+        fprintf(stderr, "Failed to open capture file %s: %s\n",
+                settings.capture_file, strerror(errno));
+        return -1;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = CAPTURE_VERSION;
+    header.byteorder = CAPTURE_BYTEORDER;
+    header.started = (uint64_t)time(NULL);
+    if (write(capture_fd, &header, sizeof(header)) != sizeof(header)) {
+        perror("Failed to write capture file header");
+        close(capture_fd);
+        capture_fd = -1;
+        return -1;
+    }
+    capture_start = latency_now();
+    if ((ret = pthread_create(&capture_tid, NULL, capture_writer, NULL)) != 0) {
+        fprintf(stderr, "Can't create capture writer thread: %s\n",
+                strerror(ret));
+        close(capture_fd);
+        capture_fd = -1;
+        return -1;
+    }
+    atexit(capture_stop);
+    return 0;
+}
+
+/* Hands a buffer to the writer. capture_lock must be held. */
+static void capture_queue(struct capture_buffer *buf) {
+    if (queued >= CAPTURE_MAX_QUEUED) {
+        records_dropped += buf->records;
+        buf->next = spare_buffers;
+        spare_buffers = buf;
+        return;
+    }
+    buf->next = NULL;
+    if (queue_tail != NULL)
+        queue_tail->next = buf;
+    else
+        queue_head = buf;
+    queue_tail = buf;
+    queued++;
+    pthread_cond_signal(&capture_cond);
+}
+
+/* Queues every buffer the workers have filled so far. */
+static void capture_collect(void) {
+    struct capture_thread *ct;
+
+    mutex_lock_blocking(&capture_lock);
+    ct = capture_threads;
+    mutex_unlock(&capture_lock);
+
+    /* Threads are only ever added at the head. */
+    for (; ct != NULL; ct = ct->next) {
+        mutex_lock_blocking(&ct->lock);
+        if (ct->buf != NULL && ct->buf->used > 0) {
+            mutex_lock_blocking(&capture_lock);
+            capture_queue(ct->buf);
+            mutex_unlock(&capture_lock);
+            ct->buf = NULL;
+        }
+        mutex_unlock(&ct->lock);
+    }
+}
+
+static void capture_write(struct capture_buffer *buf) {
+    size_t done = 0;
+    ssize_t res;
+
+    while (done < buf->used) {
+        res = write(capture_fd, buf->data + done, buf->used - done);
+        if (res == -1 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            break;
+        done += res;
+    }
+
+    mutex_lock_blocking(&capture_lock);
+    if (done == buf->used) {
+        records_written += buf->records;
+        bytes_written += done;
+    } else {
+        write_errors++;
+        records_dropped += buf->records;
+    }
+    buf->next = spare_buffers;
+    spare_buffers = buf;
+    mutex_unlock(&capture_lock);
+}
+
+static void *capture_writer(void *arg) {
+    rel_time_t collected = current_time;
+    bool stop = false;
+
+    while (!stop) {
+        struct capture_buffer *buf, *next;
+
+        mutex_lock_blocking(&capture_lock);
+        if (queue_head == NULL && !capture_stopping) {
+            struct timeval tv;
+            struct timespec ts;
+            gettimeofday(&tv, NULL);
+            ts.tv_sec = tv.tv_sec + 1;
+            ts.tv_nsec = tv.tv_usec * 1000;
+            pthread_cond_timedwait(&capture_cond, &capture_lock, &ts);
+        }
+        stop = capture_stopping;
+        mutex_unlock(&capture_lock);
+
+        if (stop || collected != current_time) {
+            capture_collect();
+            collected = current_time;
+        }
+
+        mutex_lock_blocking(&capture_lock);
+        buf = queue_head;
+        queue_head = queue_tail = NULL;
+        queued = 0;
+        mutex_unlock(&capture_lock);
+
+        for (; buf != NULL; buf = next) {
+            next = buf->next;
+            capture_write(buf);
+        }
+    }
+    return NULL;
+}
+
+/* Writes out what is left when the server exits. */
+static void capture_stop(void) {
+    mutex_lock_blocking(&capture_lock);
+    capture_stopping = true;
+    pthread_cond_signal(&capture_cond);
+    mutex_unlock(&capture_lock);
+    pthread_join(capture_tid, NULL);
+}
+
+/* Decides once per connection whether it is sampled. */
+static bool capture_sampled(conn *c) {
+    if (c->capture_id == 0) {
+        mutex_lock(&capture_lock);
+        if (conns_seen++ % settings.capture_sample == 0) {
+            c->capture_id = ++conns_sampled;
+        } else {
+            c->capture_id = CAPTURE_SKIP;
+        }
+        mutex_unlock(&capture_lock);
+    }
+    return c->capture_id != CAPTURE_SKIP;
+}
+
+static struct capture_thread *capture_thread_new(void) {
+    struct capture_thread *ct = calloc(1, sizeof(struct capture_thread));
+    if (ct == NULL)
+        return NULL;
+    pthread_mutex_init(&ct->lock, NULL);
+    mutex_lock(&capture_lock);
+    ct->next = capture_threads;
+    capture_threads = ct;
+    mutex_unlock(&capture_lock);
+    return ct;
+}
+
+static void capture_append(conn *c, const enum capture_protocol protocol,
+                           const void *data, const size_t len) {
+    struct capture_thread *ct = c->thread->capture;
+    struct capture_buffer *buf;
+    capture_record rec;
+    size_t need = sizeof(rec) + len;
+
+    if (ct == NULL && (ct = c->thread->capture = capture_thread_new()) == NULL) {
+        STATS_LOCK();
+        stats.malloc_fails++;
+        STATS_UNLOCK();
+        return;
+    }
+
+    if (need > CAPTURE_BUFFER_SIZE) {
+        mutex_lock(&capture_lock);
+        records_dropped++;
+        mutex_unlock(&capture_lock);
+        return;
+    }
+
+    mutex_lock(&ct->lock);
+    buf = ct->buf;
+    if (buf == NULL || buf->used + need > CAPTURE_BUFFER_SIZE) {
+        mutex_lock(&capture_lock);
+        if (buf != NULL)
+            capture_queue(buf);
+        if ((buf = spare_buffers) != NULL)
+            spare_buffers = buf->next;
+        mutex_unlock(&capture_lock);
+        if (buf == NULL && (buf = malloc(sizeof(struct capture_buffer))) == NULL) {
+            ct->buf = NULL;
+            mutex_unlock(&ct->lock);
+            STATS_LOCK();
+            stats.malloc_fails++;
+            STATS_UNLOCK();
+            return;
+        }
+        buf->used = 0;
+        buf->records = 0;
+        ct->buf = buf;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    rec.time = latency_now() - capture_start;
+    rec.conn = c->capture_id;
+    rec.len = len;
+    rec.protocol = protocol;
+    memcpy(buf->data + buf->used, &rec, sizeof(rec));
+    memcpy(buf->data + buf->used + sizeof(rec), data, len);
+    buf->used += need;
+    buf->records++;
+    mutex_unlock(&ct->lock);
+}
+
+void capture_ascii(conn *c, const char *command) {
+    if (capture_fd == -1 || !capture_sampled(c))
+        return;
+    capture_append(c, CAPTURE_ASCII, command, strlen(command));
+}
+
+void capture_binary(conn *c, const void *request) {
+    if (capture_fd == -1 || !capture_sampled(c))
+        return;
+    capture_append(c, CAPTURE_BINARY, request,
+                   sizeof(protocol_binary_request_header) +
+                   c->binary_header.request.extlen +
+                   c->binary_header.request.keylen);
+}
+
+void capture_stats(ADD_STAT add_stats, void *c) {
+    mutex_lock(&capture_lock);
+    APPEND_STAT("capture_conns", "%u", conns_sampled);
+    APPEND_STAT("capture_records", "%llu", (unsigned long long)records_written);
+    APPEND_STAT("capture_bytes", "%llu", (unsigned long long)bytes_written);
+    APPEND_STAT("capture_dropped", "%llu", (unsigned long long)records_dropped);
+    APPEND_STAT("capture_write_errors", "%llu", (unsigned long long)write_errors);
+    mutex_unlock(&capture_lock);
+}
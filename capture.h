@@ -0,0 +1,34 @@
+/* command stream capture file format, shared with the replay tool */
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#define CAPTURE_MAGIC "MCCAPTUR"
+#define CAPTURE_VERSION 1
+#define CAPTURE_BYTEORDER 0x01020304
+
+/* The file starts with this header, followed by records. Fields are in the
+ * byte order of the machine that wrote them; byteorder lets a reader check
+ * that it matches. */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteorder;
+    uint64_t started;   /* unix time the capture started */
+} capture_file_header;
+
+enum capture_protocol {
+    CAPTURE_ASCII = 1,  /* the command line, without "\r\n" */
+    CAPTURE_BINARY      /* the request header (as sent), extras and key */
+};
+
+/* Each record is followed by len bytes of command. Values of storage
+ * commands are not captured. */
+typedef struct {
+    uint64_t time;      /* nanoseconds since the capture started */
+    uint32_t conn;      /* sampled connection, numbered from 1 */
+    uint32_t len;
+    uint8_t protocol;   /* enum capture_protocol */
+    uint8_t unused[7];
+} capture_record;
+
+#endif
@@ -0,0 +1,180 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Per-thread replicas of the hottest items, with -o hotcache.
+ *
+ * Under heavy skew every worker hashes the same key, takes the same item lock
+ * stripe and bounces the same refcount for each get of a hot item. With
+ * -o hotcache a worker keeps its own reference to up to HOTCACHE_SLOTS items
+ * once the thread's hot key sketch (see hotkeys.c) has certainly sampled
+ * HOTCACHE_PROMOTE gets of them, and serves ASCII get and gets for those
+ * keys from that reference without any of the above.
+ *
+ * Every hit checks the entry first. do_item_unlink(), and so
+ * do_item_replace(), clears ITEM_LINKED, so an item that was overwritten,
+ * deleted or evicted is never served, nor is one that became a lease
+ * placeholder; expiry, flush_all and slab moves are checked as in
+ * do_item_get(). Entries are dropped after HOTCACHE_TTL
+ * seconds, so that the item gets its LRU bump through the normal path, and a
+ * timer drops stale entries on idle threads so they don't pin items.
+ *
+ * A hit hands out a reference counted in the entry (pins) instead of in the
+ * item, and hotcache_release() takes it back. References are interchangeable,
+ * so any reference the connection holds to the item may be returned there.
+ */
+#include "memcached.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HOTCACHE_SLOTS 8
+#define HOTCACHE_TTL 10
+
+typedef struct {
+    item *it;                   /* NULL while the slot is free */
+    uint32_t hv;
+    uint32_t pins;              /* references handed out by hits */
+    uint64_t samples;           /* how hot the key was when it was added */
+    rel_time_t filled;
+    bool dead;                  /* not served, released once unpinned */
+} hotcache_entry;
+
+struct hotcache {
+    struct event sweep_event;
+    hotcache_entry entries[HOTCACHE_SLOTS];
+};
+
+static bool hotcache_valid(const hotcache_entry *e) {
+    const item *it = e->it;
+
+    if (e->dead || current_time - e->filled >= HOTCACHE_TTL)
+        return false;
+    if ((*(volatile uint8_t *)&it->it_flags & (ITEM_LINKED | ITEM_LEASE)) !=
+        ITEM_LINKED)
+        return false;
+    if (it->exptime != 0 && it->exptime <= current_time)
+        return false;
+    if (settings.oldest_live != 0 && settings.oldest_live <= current_time &&
+        it->time <= settings.oldest_live)
+        return false;
+    if (slab_rebalance_signal &&
+        ((void *)it >= slab_rebal.slab_start && (void *)it < slab_rebal.slab_end))
+        return false;
+    return true;
+}
+
+static void hotcache_drop(hotcache_entry *e) {
+    e->dead = true;
+    if (e->pins == 0) {
+        item_remove(e->it);
+        e->it = NULL;
+        e->dead = false;
+    }
+}
+
+static void hotcache_sweep(const int fd, const short which, void *arg) {
+    struct hotcache *hc = arg;
+    struct timeval t = {.tv_sec = 1, .tv_usec = 0};
+    int i;
+
+    for (i = 0; i < HOTCACHE_SLOTS; i++) {
+        hotcache_entry *e = &hc->entries[i];
+        if (e->it != NULL && !e->dead && !hotcache_valid(e))
+            hotcache_drop(e);
+    }
+    evtimer_add(&hc->sweep_event, &t);
+}
+
+void hotcache_thread_init(LIBEVENT_THREAD *me) {
+    struct timeval t = {.tv_sec = 1, .tv_usec = 0};
+    struct hotcache *hc = calloc(1, sizeof(struct hotcache));
+
+    if (hc == NULL) {
+        fprintf(stderr, "Failed to allocate the hot item cache\n");
+        exit(EXIT_FAILURE);
+    }
+    evtimer_set(&hc->sweep_event, hotcache_sweep, hc);
+    event_base_set(me->base, &hc->sweep_event);
+    evtimer_add(&hc->sweep_event, &t);
+    me->hotcache = hc;
+}
+
+item *hotcache_get(conn *c, const char *key, const size_t nkey) {
+    struct hotcache *hc = c->thread->hotcache;
+    int i;
+
+    for (i = 0; i < HOTCACHE_SLOTS; i++) {
+        hotcache_entry *e = &hc->entries[i];
+        item *it = e->it;
+
+        if (it == NULL || it->nkey != nkey ||
+            memcmp(ITEM_key(it), key, nkey) != 0)
+            continue;
+        if (!hotcache_valid(e)) {
+            if (!e->dead)
+                hotcache_drop(e);
+            continue;
+        }
+        e->pins++;
+        THR_STATS_INCR(c, hotcache_hits);
+        if (e->hv < mrc_threshold)
+            mrc_record_get(e->hv, it);
+        return it;
+    }
+    return NULL;
+}
+
+void hotcache_add(conn *c, item *it, const uint64_t samples) {
+    struct hotcache *hc = c->thread->hotcache;
+    hotcache_entry *e = NULL;
+    int i;
+
+    if (hc == NULL || samples < HOTCACHE_PROMOTE ||
+        (it->it_flags & ITEM_LINKED) == 0)
+        return;
+
+    /* Take a free slot, or replace the coldest entry nobody is reading if
+     * this key is hotter. */
+    for (i = 0; i < HOTCACHE_SLOTS; i++) {
+        hotcache_entry *cur = &hc->entries[i];
+        if (cur->it == NULL) {
+            e = cur;
+            break;
+        }
+        if (!cur->dead && cur->pins == 0 &&
+            (e == NULL || cur->samples < e->samples))
+            e = cur;
+    }
+    if (e == NULL)
+        return;
+    if (e->it != NULL) {
+        if (e->samples >= samples)
+            return;
+        hotcache_drop(e);
+    }
+
+    /* The caller holds a reference, so the item can't go away meanwhile. */
+    refcount_incr(&it->refcount);
+    e->it = it;
+    e->hv = hash(ITEM_key(it), it->nkey);
+    e->pins = 0;
+    e->samples = samples;
+    e->filled = current_time;
+    THR_STATS_INCR(c, hotcache_fills);
+}
+
+void hotcache_release(LIBEVENT_THREAD *me, item *it) {
+    struct hotcache *hc = me->hotcache;
+    int i;
+
+    if (hc != NULL) {
+        for (i = 0; i < HOTCACHE_SLOTS; i++) {
+            hotcache_entry *e = &hc->entries[i];
+            if (e->it == it && e->pins > 0) {
+                if (--e->pins == 0 && e->dead)
+                    hotcache_drop(e);
+                return;
+            }
+        }
+    }
+    item_remove(it);
+}
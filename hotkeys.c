@@ -0,0 +1,276 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Hot key detection, see "stats hotkeys".
+ *
+ * Each worker thread keeps a space-saving sketch of HOTKEY_SLOTS counters
+ * for the keys its commands touched. Only about one keyed command in
+ * hotkey_sample reaches the sketch; the others cost a decrement in
+ * hotkey_sample(). A key that is not tracked takes over the counter with the
+ * smallest count, and inherits that count as its possible overestimate, so
+ * any key seen more than samples / HOTKEY_SLOTS times is always tracked.
+ *
+ * Counts are halved once they cover HOTKEY_WINDOW seconds, so that keys
+ * which cooled down age out. Rates are the counts scaled back up by the
+ * sampling rate and divided by the time they cover.
+ *
+ * The sketch lock is only contended while "stats hotkeys" copies it out.
+ */
+#include "memcached.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define HOTKEY_SLOTS 64
+#define HOTKEY_WINDOW 60
+#define HOTKEY_REPORT 20
+
+typedef struct {
+    uint32_t hv;
+    uint8_t cmd;                /* enum latency_cmd */
+    uint8_t nkey;
+    uint64_t count;
+    uint64_t error;             /* count may be this much too high */
+    char key[KEY_MAX_LENGTH];
+} hotkey_counter;
+
+struct hotkey_sketch {
+    pthread_mutex_t lock;
+    struct hotkey_sketch *next;
+    rel_time_t started;         /* time the counts start from */
+    uint32_t rng;
+    int used;
+    hotkey_counter counters[HOTKEY_SLOTS];
+};
+
+/* A counter merged across threads, rates in commands per second. */
+typedef struct {
+    hotkey_counter counter;
+    double rate;
+    double error;
+} hotkey_rate;
+
+static pthread_mutex_t hotkeys_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hotkey_sketch *sketches; /* guarded by hotkeys_lock */
+
+static const char *hotkey_cmd_names[LAT_MAX] = {
+    NULL, "get", "set", "delete", "incr", "touch"
+};
+
+static struct hotkey_sketch *hotkey_sketch_new(LIBEVENT_THREAD *me) {
+    struct hotkey_sketch *sk = calloc(1, sizeof(struct hotkey_sketch));
+    if (sk == NULL) {
+        STATS_LOCK();
+        stats.malloc_fails++;
+        STATS_UNLOCK();
+        return NULL;
+    }
+    pthread_mutex_init(&sk->lock, NULL);
+    sk->started = current_time;
+    sk->rng = (uint32_t)(uintptr_t)me | 1;
+
+    mutex_lock(&hotkeys_lock);
+    sk->next = sketches;
+    sketches = sk;
+    mutex_unlock(&hotkeys_lock);
+    return sk;
+}
+
+/* Picks the distance to the next sample at random, averaging hotkey_sample,
+ * so that requests arriving in a fixed pattern are not always skipped. */
+static int hotkey_next_sample(struct hotkey_sketch *sk) {
+    sk->rng ^= sk->rng << 13;
+    sk->rng ^= sk->rng >> 17;
+    sk->rng ^= sk->rng << 5;
+    return 1 + sk->rng % (2 * settings.hotkey_sample - 1);
+}
+
+static void hotkey_decay(struct hotkey_sketch *sk) {
+    int i;
+
+    for (i = 0; i < sk->used; i++) {
+        sk->counters[i].count /= 2;
+        sk->counters[i].error /= 2;
+    }
+    sk->started = current_time - HOTKEY_WINDOW / 2;
+}
+
+uint64_t hotkey_record(LIBEVENT_THREAD *me, const enum latency_cmd cmd,
+                       const char *key, const size_t nkey) {
+    struct hotkey_sketch *sk = me->hotkeys;
+    hotkey_counter *hc = NULL;
+    uint64_t samples;
+    uint32_t hv;
+    int i;
+
+    if (sk == NULL) {
+        sk = me->hotkeys = hotkey_sketch_new(me);
+        if (sk == NULL) {
+            me->hotkey_countdown = settings.hotkey_sample;
+            return 0;
+        }
+    }
+    me->hotkey_countdown = hotkey_next_sample(sk);
+    if (nkey > KEY_MAX_LENGTH)
+        return 0;
+    hv = hash(key, nkey);
+
+    mutex_lock(&sk->lock);
+    if (current_time - sk->started >= HOTKEY_WINDOW)
+        hotkey_decay(sk);
+
+    for (i = 0; i < sk->used; i++) {
+        hotkey_counter *cur = &sk->counters[i];
+        if (cur->hv == hv && cur->cmd == cmd && cur->nkey == nkey &&
+            memcmp(cur->key, key, nkey) == 0) {
+            hc = cur;
+            break;
+        }
+    }
+
+    if (hc == NULL) {
+        if (sk->used < HOTKEY_SLOTS) {
+            hc = &sk->counters[sk->used++];
+            hc->count = 0;
+            hc->error = 0;
+        } else {
+            hc = &sk->counters[0];
+            for (i = 1; i < HOTKEY_SLOTS; i++) {
+                if (sk->counters[i].count < hc->count)
+                    hc = &sk->counters[i];
+            }
+            hc->error = hc->count;
+        }
+        hc->hv = hv;
+        hc->cmd = cmd;
+        hc->nkey = nkey;
+        memcpy(hc->key, key, nkey);
+    }
+    hc->count++;
+    samples = hc->count - hc->error;
+    mutex_unlock(&sk->lock);
+    return samples;
+}
+
+void hotkeys_reset(void) {
+    struct hotkey_sketch *sk;
+
+    mutex_lock(&hotkeys_lock);
+    for (sk = sketches; sk != NULL; sk = sk->next) {
+        mutex_lock(&sk->lock);
+        sk->used = 0;
+        sk->started = current_time;
+        mutex_unlock(&sk->lock);
+    }
+    mutex_unlock(&hotkeys_lock);
+}
+
+static int hotkey_key_cmp(const void *a, const void *b) {
+    const hotkey_counter *x = &((const hotkey_rate *)a)->counter;
+    const hotkey_counter *y = &((const hotkey_rate *)b)->counter;
+
+    if (x->hv != y->hv)
+        return x->hv < y->hv ? -1 : 1;
+    if (x->cmd != y->cmd)
+        return x->cmd - y->cmd;
+    if (x->nkey != y->nkey)
+        return x->nkey - y->nkey;
+    return memcmp(x->key, y->key, x->nkey);
+}
+
+static int hotkey_rate_cmp(const void *a, const void *b) {
+    const hotkey_rate *x = a;
+    const hotkey_rate *y = b;
+
+    if (x->rate != y->rate)
+        return x->rate > y->rate ? -1 : 1;
+    return 0;
+}
+
+/* Keys may be binary protocol keys, so escape anything that would not
+ * survive a stats line. */
+static int hotkey_escape(char *buf, const char *key, const int nkey) {
+    int i, len = 0;
+
+    for (i = 0; i < nkey; i++) {
+        unsigned char ch = key[i];
+        if (ch > ' ' && ch < 0x7f && ch != '\\') {
+            buf[len++] = ch;
+        } else {
+            len += sprintf(buf + len, "\\x%02x", ch);
+        }
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+void hotkeys_stats(ADD_STAT add_stats, void *c) {
+    struct hotkey_sketch *sk;
+    hotkey_rate *rates;
+    char key_str[STAT_KEY_LEN];
+    char val_str[STAT_VAL_LEN];
+    char escaped[KEY_MAX_LENGTH * 4 + 1];
+    int klen = 0, vlen = 0;
+    int n = 0, merged = 0, nsketches = 0;
+    int i;
+
+    APPEND_STAT("sample", "%d", settings.hotkey_sample);
+
+    mutex_lock(&hotkeys_lock);
+    for (sk = sketches; sk != NULL; sk = sk->next)
+        nsketches++;
+    rates = malloc(sizeof(hotkey_rate) * HOTKEY_SLOTS * (nsketches + 1));
+    if (rates == NULL) {
+        mutex_unlock(&hotkeys_lock);
+        STATS_LOCK();
+        stats.malloc_fails++;
+        STATS_UNLOCK();
+        add_stats(NULL, 0, NULL, 0, c);
+        return;
+    }
+
+    /* Rates are taken per thread, as their counts cover different spans. */
+    for (sk = sketches; sk != NULL; sk = sk->next) {
+        double scale;
+
+        mutex_lock(&sk->lock);
+        scale = (double)settings.hotkey_sample /
+            (current_time > sk->started ? current_time - sk->started : 1);
+        for (i = 0; i < sk->used; i++, n++) {
+            rates[n].counter = sk->counters[i];
+            rates[n].rate = sk->counters[i].count * scale;
+            rates[n].error = sk->counters[i].error * scale;
+        }
+        mutex_unlock(&sk->lock);
+    }
+    mutex_unlock(&hotkeys_lock);
+
+    /* Sum the rates of keys tracked by more than one thread. */
+    qsort(rates, n, sizeof(hotkey_rate), hotkey_key_cmp);
+    for (i = 0; i < n; i++) {
+        if (merged > 0 && hotkey_key_cmp(&rates[merged - 1], &rates[i]) == 0) {
+            rates[merged - 1].rate += rates[i].rate;
+            rates[merged - 1].error += rates[i].error;
+        } else {
+            rates[merged++] = rates[i];
+        }
+    }
+    qsort(rates, merged, sizeof(hotkey_rate), hotkey_rate_cmp);
+
+    for (i = 0; i < merged && i < HOTKEY_REPORT; i++) {
+        hotkey_counter *hc = &rates[i].counter;
+
+        klen = snprintf(key_str, STAT_KEY_LEN, "hotkey_%d:key", i + 1);
+        vlen = hotkey_escape(escaped, hc->key, hc->nkey);
+        add_stats(key_str, klen, escaped, vlen, c);
+        APPEND_NUM_FMT_STAT("hotkey_%d:%s", i + 1, "cmd",
+                            "%s", hotkey_cmd_names[hc->cmd]);
+        APPEND_NUM_FMT_STAT("hotkey_%d:%s", i + 1, "rate",
+                            "%.1f", rates[i].rate);
+        APPEND_NUM_FMT_STAT("hotkey_%d:%s", i + 1, "error",
+                            "%.1f", rates[i].error);
+    }
+    free(rates);
+
+    add_stats(NULL, 0, NULL, 0, c);
+}
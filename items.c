@@ -17,6 +17,7 @@
 /* Forward Declarations */
 static void item_link_q(item *it);
 static void item_unlink_q(item *it);
+static void item_wheel_insert(item *it, const rel_time_t was);
 
 #define LARGEST_ID POWER_LARGEST
 typedef struct {
@@ -30,6 +31,8 @@ typedef struct {
     uint64_t evicted_unfetched;
     uint64_t crawler_reclaimed;
     uint64_t lrutail_reflocked;
+    uint64_t wheel_reclaimed;
+    uint64_t ghost_hits;
 } itemstats_t;
 
 static item *heads[LARGEST_ID];
@@ -43,10 +46,232 @@ static volatile int do_run_lru_crawler_thread = 0;
 static int lru_crawler_initialized = 0;
 static pthread_mutex_t lru_crawler_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t  lru_crawler_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t wheel_entries = 0; /* entries held by the expiry wheel */
+
+/*** EVICTION POLICIES ***/
+
+/* When a slab class is out of memory, do_item_alloc() looks at up to
+ * POLICY_MAX_SPARES items from the LRU tail up and evicts the one the active
+ * policy ranks lowest. Those passed over stay where they are. Plain LRU has
+ * no rank and always evicts the tail.
+ *
+ * GDSF (GreedyDual-Size-Frequency) gives every item a priority of
+ * clock + hits * cost / size, and sets the per-class clock to the priority
+ * of each item it evicts. Small, frequently fetched or expensive items thus
+ * outlive large cold ones that happened to be touched recently. The cost is
+ * taken from the top byte of the client flags with -o gdsf_cost_flags, and
+ * is 1 otherwise.
+ */
+#define GDSF_SCALE (1 << 20)
+/* Max items looked at for a single eviction. */
+#define POLICY_MAX_SPARES 50
+
+typedef struct {
+    const char *name;
+    void (*init)(item *it);         /* new item, before it is linked */
+    void (*access)(item *it);       /* item was fetched */
+    int32_t (*rank)(item *it);      /* lowest is evicted first */
+    void (*evicted)(item *search);  /* item is being evicted */
+} eviction_policy;
+
+typedef struct {
+    uint64_t evicted;
+    uint64_t spared;
+    uint64_t get_hits;
+    uint64_t get_misses;
+    rel_time_t active_time;
+} policystats_t;
+
+static uint32_t gdsf_clock[LARGEST_ID];
+
+static inline void gdsf_set_priority(item *it) {
+    uint64_t value = (uint64_t)it->hits * it->cost * GDSF_SCALE / ITEM_ntotal(it);
+    it->priority = gdsf_clock[it->slabs_clsid] + (uint32_t)value;
+}
+
+static void gdsf_init(item *it) {
+    gdsf_set_priority(it);
+}
+
+static void gdsf_access(item *it) {
+    if (it->hits < UINT8_MAX)
+        it->hits++;
+    gdsf_set_priority(it);
+}
+
+/* Relative to the clock, for wraparound. */
+static int32_t gdsf_rank(item *it) {
+    return (int32_t)(it->priority - gdsf_clock[it->slabs_clsid]);
+}
+
+static void gdsf_evicted(item *search) {
+    gdsf_clock[search->slabs_clsid] = search->priority;
+}
+
+static eviction_policy eviction_policies[EVICTION_POLICY_COUNT] = {
+    [EVICTION_LRU] = { "lru", NULL, NULL, NULL, NULL },
+    [EVICTION_GDSF] = { "gdsf", gdsf_init, gdsf_access, gdsf_rank, gdsf_evicted },
+};
+
+static policystats_t policystats[EVICTION_POLICY_COUNT];
+/* get_hits/get_misses/current_time when the active policy took over. */
+static uint64_t policy_since_hits = 0;
+static uint64_t policy_since_misses = 0;
+static rel_time_t policy_since_time = 0;
+
+int eviction_policy_id(const char *name) {
+    int i;
+    for (i = 0; i < EVICTION_POLICY_COUNT; i++) {
+        if (strcmp(name, eviction_policies[i].name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+const char *eviction_policy_name(const int policy) {
+    return eviction_policies[policy].name;
+}
+
+static void policy_get_totals(uint64_t *hits, uint64_t *misses) {
+    struct thread_stats thread_stats;
+    struct slab_stats slab_stats;
+    threadlocal_stats_aggregate(&thread_stats);
+    slab_stats_aggregate(&thread_stats, &slab_stats);
+    *hits = slab_stats.get_hits;
+    *misses = thread_stats.get_misses;
+}
+
+/* Credits hits and misses since the last call to the active policy.
+ * cache_lock must be held. */
+static void do_policy_account(const uint64_t hits, const uint64_t misses) {
+    policystats_t *ps = &policystats[settings.eviction_policy];
+    /* A stats reset may have happened under us. */
+    if (hits >= policy_since_hits)
+        ps->get_hits += hits - policy_since_hits;
+    if (misses >= policy_since_misses)
+        ps->get_misses += misses - policy_since_misses;
+    ps->active_time += current_time - policy_since_time;
+    policy_since_hits = hits;
+    policy_since_misses = misses;
+    policy_since_time = current_time;
+}
+
+void item_set_eviction_policy(const int policy) {
+    uint64_t hits, misses;
+    policy_get_totals(&hits, &misses);
+    mutex_lock(&cache_lock);
+    do_policy_account(hits, misses);
+    settings.eviction_policy = policy;
+    mutex_unlock(&cache_lock);
+}
+
+void item_stats_eviction(ADD_STAT add_stats, void *c) {
+    uint64_t hits, misses;
+    int i;
+    policy_get_totals(&hits, &misses);
+    mutex_lock(&cache_lock);
+    do_policy_account(hits, misses);
+    APPEND_STAT("eviction_policy", "%s",
+                eviction_policies[settings.eviction_policy].name);
+    for (i = 0; i < EVICTION_POLICY_COUNT; i++) {
+        const char *fmt = "%s:%s";
+        char key_str[STAT_KEY_LEN];
+        char val_str[STAT_VAL_LEN];
+        int klen = 0, vlen = 0;
+        policystats_t *ps = &policystats[i];
+        uint64_t lookups = ps->get_hits + ps->get_misses;
+        const char *name = eviction_policies[i].name;
+
+        APPEND_NUM_FMT_STAT(fmt, name, "active_time", "%u", ps->active_time);
+        APPEND_NUM_FMT_STAT(fmt, name, "get_hits",
+                            "%llu", (unsigned long long)ps->get_hits);
+        APPEND_NUM_FMT_STAT(fmt, name, "get_misses",
+                            "%llu", (unsigned long long)ps->get_misses);
+        APPEND_NUM_FMT_STAT(fmt, name, "hit_ratio", "%.4f",
+                            lookups ? (double)ps->get_hits / lookups : 0.0);
+        APPEND_NUM_FMT_STAT(fmt, name, "evicted",
+                            "%llu", (unsigned long long)ps->evicted);
+        APPEND_NUM_FMT_STAT(fmt, name, "spared",
+                            "%llu", (unsigned long long)ps->spared);
+    }
+    mutex_unlock(&cache_lock);
+
+    add_stats(NULL, 0, NULL, 0, c);
+}
+
+/*** GHOST LISTS ***/
+
+/* Every class that evicts keeps the hashes of the keys it recently evicted,
+ * in a direct mapped table sized to a couple of pages worth of its items. A
+ * get miss whose hash is found there would have been a hit had the class
+ * owned about one more page, which is what the slab automover wants to know.
+ *
+ * Tables are written under cache_lock and never freed; the miss path scans
+ * them without the lock, with atomic loads, and only takes it to count a
+ * match. An empty slot is 0, so a hash of 0 is kept as 1.
+ */
+#define GHOST_MIN_SIZE 64
+
+typedef struct {
+    uint32_t mask;
+    uint32_t hashes[];
+} ghost_table;
+
+static ghost_table *ghosts[LARGEST_ID];
+static int ghost_max = 0; /* highest class with a table */
+
+static inline uint32_t ghost_hash(const uint32_t hv) {
+    return hv != 0 ? hv : 1;
+}
+
+static void do_ghost_add(const int id, const size_t ntotal, const uint32_t hv) {
+    ghost_table *g = ghosts[id];
+    uint32_t gh = ghost_hash(hv);
+    if (g == NULL) {
+        size_t per_page = settings.item_size_max / ntotal;
+        uint32_t size = GHOST_MIN_SIZE;
+        while (size < per_page * 2)
+            size <<= 1;
+        g = calloc(1, sizeof(ghost_table) + sizeof(uint32_t) * size);
+        if (g == NULL)
+            return;
+        g->mask = size - 1;
+        __atomic_store_n(&ghosts[id], g, __ATOMIC_RELEASE);
+        if (id > ghost_max)
+            __atomic_store_n(&ghost_max, id, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&g->hashes[gh & g->mask], gh, __ATOMIC_RELAXED);
+}
+
+void item_ghost_miss(const char *key, const size_t nkey) {
+    int max = __atomic_load_n(&ghost_max, __ATOMIC_ACQUIRE);
+    uint32_t gh;
+    int i;
+    if (max == 0)
+        return;
+    gh = ghost_hash(hash(key, nkey));
+    for (i = POWER_SMALLEST; i <= max; i++) {
+        ghost_table *g = __atomic_load_n(&ghosts[i], __ATOMIC_ACQUIRE);
+        if (g == NULL ||
+            __atomic_load_n(&g->hashes[gh & g->mask], __ATOMIC_RELAXED) != gh)
+            continue;
+        mutex_lock(&cache_lock);
+        if (g->hashes[gh & g->mask] == gh) {
+            /* Count each eviction at most once. */
+            __atomic_store_n(&g->hashes[gh & g->mask], 0, __ATOMIC_RELAXED);
+            itemstats[i].ghost_hits++;
+        }
+        mutex_unlock(&cache_lock);
+        return;
+    }
+}
 
 void item_stats_reset(void) {
     mutex_lock(&cache_lock);
     memset(itemstats, 0, sizeof(itemstats));
+    memset(policystats, 0, sizeof(policystats));
+    policy_since_hits = policy_since_misses = 0;
+    policy_since_time = current_time;
     mutex_unlock(&cache_lock);
 }
 
@@ -87,6 +312,73 @@ static size_t item_make_header(const uint8_t nkey, const int flags, const int nb
     return sizeof(item) + nkey + *nsuffix + nbytes;
 }
 
+/* Items that couldn't be taken for eviction, and so aren't looked at again. */
+#define POLICY_MAX_SKIPS 5
+
+/*
+ * Swaps the tail item about to be evicted for the one of lowest rank among
+ * the POLICY_MAX_SPARES items from it up. Anything ranked at or below zero
+ * can't be outranked by much, so the search stops there. The item picked must
+ * be locked and unused, as in the tail walk of do_item_alloc(); if it isn't,
+ * the next lowest is tried, and after a few the tail item is evicted.
+ */
+static void policy_victim(eviction_policy *policy, item **search,
+                          uint32_t *hv, void **hold_lock,
+                          const uint32_t cur_hv) {
+    item *skip[POLICY_MAX_SKIPS];
+    int nskip = 0;
+
+    while (nskip < POLICY_MAX_SKIPS) {
+        item *victim = *search;
+        int32_t low = policy->rank(victim);
+        item *it;
+        uint32_t vhv;
+        void *lock;
+        int i, n;
+
+        for (it = victim->prev, n = 1; low > 0 && it != NULL &&
+                 n < POLICY_MAX_SPARES; it = it->prev, n++) {
+            int32_t rank;
+            /* Skip the crawler's place holder. */
+            if (it->nbytes == 0 && it->nkey == 0 && it->it_flags == 1)
+                continue;
+            for (i = 0; i < nskip && skip[i] != it; i++)
+                ;
+            if (i < nskip || (rank = policy->rank(it)) >= low)
+                continue;
+            victim = it;
+            low = rank;
+        }
+        if (victim == *search)
+            return;
+
+        vhv = hash(ITEM_key(victim), victim->nkey);
+        /* It may share the lock we hold on the tail item. */
+        lock = item_lock_ptr(vhv);
+        if (vhv == cur_hv ||
+            (lock != *hold_lock && item_trylock(vhv) == NULL)) {
+            skip[nskip++] = victim;
+            continue;
+        }
+        if (refcount_incr(&victim->refcount) != 2) {
+            refcount_decr(&victim->refcount);
+            if (lock != *hold_lock)
+                item_trylock_unlock(lock);
+            skip[nskip++] = victim;
+            continue;
+        }
+
+        policystats[settings.eviction_policy].spared++;
+        refcount_decr(&(*search)->refcount);
+        if (*hold_lock && *hold_lock != lock)
+            item_trylock_unlock(*hold_lock);
+        *search = victim;
+        *hv = vhv;
+        *hold_lock = lock;
+        return;
+    }
+}
+
 /*@null@*/
 item *do_item_alloc(char *key, const size_t nkey, const int flags,
                     const rel_time_t exptime, const int nbytes,
@@ -109,6 +401,7 @@ item *do_item_alloc(char *key, const size_t nkey, const int flags,
     /* Avoid hangs if a slab has nothing but refcounted stuff in it. */
     int tries_lrutail_reflocked = 1000;
     int tried_alloc = 0;
+    eviction_policy *policy = &eviction_policies[settings.eviction_policy];
     item *search;
     item *next_it;
     void *hold_lock = NULL;
@@ -175,8 +468,14 @@ item *do_item_alloc(char *key, const size_t nkey, const int flags,
             if (settings.evict_to_free == 0) {
                 itemstats[id].outofmemory++;
             } else {
+                if (policy->rank != NULL)
+                    policy_victim(policy, &search, &hv, &hold_lock, cur_hv);
+                if (policy->evicted != NULL)
+                    policy->evicted(search);
+                policystats[settings.eviction_policy].evicted++;
                 itemstats[id].evicted++;
                 itemstats[id].evicted_time = current_time - search->time;
+                do_ghost_add(id, ntotal, hv);
                 if (search->exptime != 0)
                     itemstats[id].evicted_nonzero++;
                 if ((search->it_flags & ITEM_FETCHED) == 0) {
@@ -235,6 +534,13 @@ item *do_item_alloc(char *key, const size_t nkey, const int flags,
     it->exptime = exptime;
     memcpy(ITEM_suffix(it), suffix, (size_t)nsuffix);
     it->nsuffix = nsuffix;
+    it->cost = settings.gdsf_cost_flags ? (unsigned int)flags >> 24 : 0;
+    if (it->cost == 0)
+        it->cost = 1;
+    it->hits = 1;
+    it->priority = 0;
+    if (policy->init != NULL)
+        policy->init(it);
     return it;
 }
 
@@ -328,6 +634,7 @@ int do_item_link(item *it, const uint32_t hv) {
     ITEM_set_cas(it, (settings.use_cas) ? get_cas_id() : 0);
     assoc_insert(it, hv);
     item_link_q(it);
+    item_wheel_insert(it, 0);
     refcount_incr(&it->refcount);
     mutex_unlock(&cache_lock);
 
@@ -467,6 +774,33 @@ void item_stats_evictions(uint64_t *evicted) {
     mutex_unlock(&cache_lock);
 }
 
+void item_stats_ghost_hits(uint64_t *ghost_hits) {
+    int i;
+    mutex_lock(&cache_lock);
+    for (i = 0; i < LARGEST_ID; i++) {
+        ghost_hits[i] = itemstats[i].ghost_hits;
+    }
+    mutex_unlock(&cache_lock);
+}
+
+/* Seconds since the LRU tail of each class was last accessed. Classes with
+ * nothing in them report the age of the server. */
+void item_stats_tail_ages(rel_time_t *ages) {
+    int i;
+    item *search;
+    mutex_lock(&cache_lock);
+    for (i = 0; i < LARGEST_ID; i++) {
+        search = tails[i];
+        /* Skip over a crawler parked at the tail. */
+        while (search != NULL && search->nbytes == 0 && search->nkey == 0 &&
+               search->it_flags == 1) {
+            search = search->prev;
+        }
+        ages[i] = current_time - (search ? search->time : 0);
+    }
+    mutex_unlock(&cache_lock);
+}
+
 void do_item_stats_totals(ADD_STAT add_stats, void *c) {
     itemstats_t totals;
     memset(&totals, 0, sizeof(itemstats_t));
@@ -478,6 +812,7 @@ void do_item_stats_totals(ADD_STAT add_stats, void *c) {
         totals.reclaimed += itemstats[i].reclaimed;
         totals.crawler_reclaimed += itemstats[i].crawler_reclaimed;
         totals.lrutail_reflocked += itemstats[i].lrutail_reflocked;
+        totals.wheel_reclaimed += itemstats[i].wheel_reclaimed;
     }
     APPEND_STAT("expired_unfetched", "%llu",
                 (unsigned long long)totals.expired_unfetched);
@@ -491,6 +826,12 @@ void do_item_stats_totals(ADD_STAT add_stats, void *c) {
                 (unsigned long long)totals.crawler_reclaimed);
     APPEND_STAT("lrutail_reflocked", "%llu",
                 (unsigned long long)totals.lrutail_reflocked);
+    if (settings.expiry_wheel) {
+        APPEND_STAT("wheel_reclaimed", "%llu",
+                    (unsigned long long)totals.wheel_reclaimed);
+        APPEND_STAT("expiry_wheel_entries", "%llu",
+                    (unsigned long long)wheel_entries);
+    }
 }
 
 void do_item_stats(ADD_STAT add_stats, void *c) {
@@ -527,6 +868,10 @@ void do_item_stats(ADD_STAT add_stats, void *c) {
                                 "%llu", (unsigned long long)itemstats[i].crawler_reclaimed);
             APPEND_NUM_FMT_STAT(fmt, i, "lrutail_reflocked",
                                 "%llu", (unsigned long long)itemstats[i].lrutail_reflocked);
+            APPEND_NUM_FMT_STAT(fmt, i, "wheel_reclaimed",
+                                "%llu", (unsigned long long)itemstats[i].wheel_reclaimed);
+            APPEND_NUM_FMT_STAT(fmt, i, "ghost_hits",
+                                "%llu", (unsigned long long)itemstats[i].ghost_hits);
         }
     }
 
@@ -571,7 +916,8 @@ void do_item_stats_sizes(ADD_STAT add_stats, void *c) {
 }
 
 /** wrapper around assoc_find which does the lazy expiration logic */
-item *do_item_get(const char *key, const size_t nkey, const uint32_t hv) {
+/* Like do_item_get(), but also returns lease placeholders. */
+item *do_item_get_any(const char *key, const size_t nkey, const uint32_t hv) {
     //mutex_lock(&cache_lock);
     item *it = assoc_find(key, nkey, hv);
     if (it != NULL) {
@@ -619,7 +965,10 @@ item *do_item_get(const char *key, const size_t nkey, const uint32_t hv) {
                 fprintf(stderr, " -nuked by expire");
             }
         } else {
+            eviction_policy *policy = &eviction_policies[settings.eviction_policy];
             it->it_flags |= ITEM_FETCHED;
+            if (policy->access != NULL)
+                policy->access(it);
             DEBUG_REFCNT(it, '+');
         }
     }
@@ -630,11 +979,98 @@ item *do_item_get(const char *key, const size_t nkey, const uint32_t hv) {
     return it;
 }
 
+/* Lease placeholders are not visible to ordinary commands. */
+item *do_item_get(const char *key, const size_t nkey, const uint32_t hv) {
+    item *it = do_item_get_any(key, nkey, hv);
+    if (it != NULL && (it->it_flags & ITEM_LEASE)) {
+        do_item_remove(it);
+        it = NULL;
+    }
+    return it;
+}
+
+/*
+ * Get for lget. A miss hands out a lease: a placeholder item is linked in
+ * the key's place, and its CAS is the token a later lset must present. Until
+ * the placeholder is replaced or expires after lease_ttl seconds, other lgets
+ * get a hot miss. With lease_stale, an expired item becomes the placeholder
+ * itself, and its old value is served to those lgets instead.
+ */
+item *do_item_lease_get(const char *key, const size_t nkey, const uint32_t hv,
+                        enum lease_result *res) {
+    item *it = assoc_find(key, nkey, hv);
+
+    if (it != NULL) {
+        refcount_incr(&it->refcount);
+        if ((slab_rebalance_signal &&
+             ((void *)it >= slab_rebal.slab_start && (void *)it < slab_rebal.slab_end)) ||
+            (settings.oldest_live != 0 && settings.oldest_live <= current_time &&
+             it->time <= settings.oldest_live)) {
+            do_item_unlink(it, hv);
+            do_item_remove(it);
+            it = NULL;
+        } else if (it->exptime != 0 && it->exptime <= current_time) {
+            if (settings.lease_stale && (it->it_flags & ITEM_LEASE) == 0) {
+                rel_time_t was = it->exptime;
+                it->it_flags |= ITEM_LEASE | ITEM_STALE;
+                it->exptime = current_time + settings.lease_ttl;
+                ITEM_set_cas(it, get_cas_id());
+                if (settings.expiry_wheel) {
+                    mutex_lock(&cache_lock);
+                    if ((it->it_flags & ITEM_LINKED) != 0)
+                        item_wheel_insert(it, was);
+                    mutex_unlock(&cache_lock);
+                }
+                *res = LEASE_GRANTED;
+                return it;
+            }
+            do_item_unlink(it, hv);
+            do_item_remove(it);
+            it = NULL;
+        }
+    }
+
+    if (it == NULL) {
+        it = do_item_alloc((char *)key, nkey, 0,
+                           current_time + settings.lease_ttl, 2, hv);
+        if (it == NULL) {
+            *res = LEASE_NOMEM;
+            return NULL;
+        }
+        memcpy(ITEM_data(it), "\r\n", 2);
+        it->it_flags |= ITEM_LEASE;
+        do_item_link(it, hv);
+        *res = LEASE_GRANTED;
+    } else if (it->it_flags & ITEM_LEASE) {
+        if (settings.lease_stale && (it->it_flags & ITEM_STALE)) {
+            *res = LEASE_STALE;
+        } else {
+            do_item_remove(it);
+            it = NULL;
+            *res = LEASE_HOT_MISS;
+        }
+    } else {
+        eviction_policy *policy = &eviction_policies[settings.eviction_policy];
+        it->it_flags |= ITEM_FETCHED;
+        if (policy->access != NULL)
+            policy->access(it);
+        *res = LEASE_HIT;
+    }
+    return it;
+}
+
 item *do_item_touch(const char *key, size_t nkey, uint32_t exptime,
                     const uint32_t hv) {
     item *it = do_item_get(key, nkey, hv);
     if (it != NULL) {
+        rel_time_t was = it->exptime;
         it->exptime = exptime;
+        if (settings.expiry_wheel) {
+            mutex_lock(&cache_lock);
+            if ((it->it_flags & ITEM_LINKED) != 0)
+                item_wheel_insert(it, was);
+            mutex_unlock(&cache_lock);
+        }
     }
     return it;
 }
@@ -814,7 +1250,7 @@ static void *item_crawler_thread(void *arg) {
             if (crawlers[i].it_flags != 1) {
                 continue;
             }
-            pthread_mutex_lock(&cache_lock);
+            mutex_lock_blocking(&cache_lock);
             search = crawler_crawl_q((item *)&crawlers[i]);
             if (search == NULL ||
                 (crawlers[i].remaining && --crawlers[i].remaining < 1)) {
@@ -823,7 +1259,7 @@ static void *item_crawler_thread(void *arg) {
                 crawlers[i].it_flags = 0;
                 crawler_count--;
                 crawler_unlink_q((item *)&crawlers[i]);
-                pthread_mutex_unlock(&cache_lock);
+                mutex_unlock(&cache_lock);
                 continue;
             }
             uint32_t hv = hash(ITEM_key(search), search->nkey);
@@ -831,7 +1267,7 @@ static void *item_crawler_thread(void *arg) {
              * other callers can incr the refcount
              */
             if ((hold_lock = item_trylock(hv)) == NULL) {
-                pthread_mutex_unlock(&cache_lock);
+                mutex_unlock(&cache_lock);
                 continue;
             }
             /* Now see if the item is refcount locked */
@@ -839,7 +1275,7 @@ static void *item_crawler_thread(void *arg) {
                 refcount_decr(&search->refcount);
                 if (hold_lock)
                     item_trylock_unlock(hold_lock);
-                pthread_mutex_unlock(&cache_lock);
+                mutex_unlock(&cache_lock);
                 continue;
             }
 
@@ -850,7 +1286,7 @@ static void *item_crawler_thread(void *arg) {
 
             if (hold_lock)
                 item_trylock_unlock(hold_lock);
-            pthread_mutex_unlock(&cache_lock);
+            mutex_unlock(&cache_lock);
 
             if (settings.lru_crawler_sleep)
                 usleep(settings.lru_crawler_sleep);
@@ -912,7 +1348,7 @@ enum crawler_result_type lru_crawler_crawl(char *slabs) {
     if (pthread_mutex_trylock(&lru_crawler_lock) != 0) {
         return CRAWLER_RUNNING;
     }
-    pthread_mutex_lock(&cache_lock);
+    mutex_lock_blocking(&cache_lock);
 
     if (strcmp(slabs, "all") == 0) {
         for (sid = 0; sid < LARGEST_ID; sid++) {
@@ -925,7 +1361,7 @@ enum crawler_result_type lru_crawler_crawl(char *slabs) {
 
             if (!safe_strtoul(p, &sid) || sid < POWER_SMALLEST
                     || sid > POWER_LARGEST) {
-                pthread_mutex_unlock(&cache_lock);
+                mutex_unlock(&cache_lock);
                 pthread_mutex_unlock(&lru_crawler_lock);
                 return CRAWLER_BADCLASS;
             }
@@ -949,7 +1385,7 @@ enum crawler_result_type lru_crawler_crawl(char *slabs) {
             crawler_count++;
         }
     }
-    pthread_mutex_unlock(&cache_lock);
+    mutex_unlock(&cache_lock);
     pthread_cond_signal(&lru_crawler_cond);
     STATS_LOCK();
     stats.lru_crawler_running = true;
@@ -969,3 +1405,282 @@ int init_lru_crawler(void) {
     }
     return 0;
 }
+
+/*** EXPIRY WHEEL ***/
+
+/* Hierarchical timing wheel indexing linked items by exptime, so the memory
+ * held by short TTL items can be given back as soon as they expire instead of
+ * waiting for a fetch, for the LRU tail or for a full crawl.
+ *
+ * Level 0 has one slot per second, and each level above covers WHEEL_SLOTS
+ * times the span of the level below it. When level 0 wraps, the next slot of
+ * level 1 is cascaded down, and so on. Each slot is a flat array of
+ * (item, exptime) pairs guarded by cache_lock; entries are checked lazily
+ * when their slot comes up, so unlinking an item never has to touch the
+ * wheel. That costs sizeof(wheel_entry) per item with a TTL.
+ *
+ * An item has one entry, marked by ITEM_WHEEL, however often it is touched.
+ * When its TTL is extended the entry is left where it is and filed again
+ * under the new time when it comes up. Only a shorter TTL adds an entry, and
+ * the later one is then dropped.
+ */
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN(level) (1U << (WHEEL_BITS * (level)))
+
+typedef struct {
+    item *it;
+    rel_time_t exptime;
+} wheel_entry;
+
+typedef struct {
+    wheel_entry *entries;
+    unsigned int count;
+    unsigned int size;
+} wheel_slot;
+
+static wheel_slot wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+/* The level 0 slot being reclaimed, taken out of the wheel. Entries purged
+ * while it is worked on are cleared rather than removed. */
+static wheel_slot wheel_due;
+/* The next second to be processed. Anything older is put in its slot. */
+static rel_time_t wheel_time = 0;
+static volatile int do_run_expiry_wheel_thread = 0;
+static pthread_t expiry_wheel_tid;
+
+static void wheel_add(item *it, const rel_time_t exptime);
+
+/* True if the entry still describes a linked item with the same expiration
+ * time. Otherwise it is dropped, or filed again if the item's TTL was
+ * extended since. Item memory stays in its slab class until
+ * do_item_wheel_purge() is told the page is moving, so the header is always
+ * safe to read here. cache_lock must be held. */
+static bool wheel_entry_valid(const wheel_entry *e) {
+    item *it = e->it;
+
+    if ((it->it_flags & ITEM_LINKED) == 0)
+        return false;
+    if (it->exptime == e->exptime)
+        return true;
+    if (it->exptime == 0)
+        it->it_flags &= ~ITEM_WHEEL;
+    else if (it->exptime > e->exptime)
+        wheel_add(it, it->exptime);
+    return false;
+}
+
+/* cache_lock must be held. */
+static void wheel_add(item *it, const rel_time_t exptime) {
+    wheel_slot *slot;
+    rel_time_t when = exptime < wheel_time ? wheel_time : exptime;
+    int level = 0;
+
+    while (level < WHEEL_LEVELS - 1 && when - wheel_time >= WHEEL_SPAN(level + 1))
+        level++;
+    /* Beyond the top level; park it in the furthest slot and let it cascade
+     * back around until it is in range. */
+    if (when - wheel_time >= WHEEL_SPAN(WHEEL_LEVELS))
+        when = wheel_time + WHEEL_SPAN(WHEEL_LEVELS) - 1;
+
+    slot = &wheel[level][(when >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    if (slot->count == slot->size) {
+        unsigned int size = slot->size ? slot->size * 2 : 16;
+        wheel_entry *new_entries = realloc(slot->entries,
+                                           size * sizeof(wheel_entry));
+        if (new_entries == NULL) {
+            /* Item will still be expired lazily. */
+            it->it_flags &= ~ITEM_WHEEL;
+            STATS_LOCK();
+            stats.malloc_fails++;
+            STATS_UNLOCK();
+            return;
+        }
+        slot->entries = new_entries;
+        slot->size = size;
+    }
+    slot->entries[slot->count].it = it;
+    slot->entries[slot->count].exptime = exptime;
+    slot->count++;
+    wheel_entries++;
+    it->it_flags |= ITEM_WHEEL;
+}
+
+/* Called from do_item_link(), do_item_touch() and do_item_lease_get() with
+ * cache_lock held, was being the expiration time before the change. */
+static void item_wheel_insert(item *it, const rel_time_t was) {
+    if (settings.expiry_wheel && it->exptime != 0 &&
+        ((it->it_flags & ITEM_WHEEL) == 0 || it->exptime < was))
+        wheel_add(it, it->exptime);
+}
+
+/* Drops every entry pointing into [start, end), as that memory is about to
+ * be handed to another slab class. cache_lock must be held. */
+void do_item_wheel_purge(void *start, void *end) {
+    int level, i;
+    unsigned int j, kept;
+
+    if (!settings.expiry_wheel)
+        return;
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        for (i = 0; i < WHEEL_SLOTS; i++) {
+            wheel_slot *slot = &wheel[level][i];
+            for (j = 0, kept = 0; j < slot->count; j++) {
+                void *it = slot->entries[j].it;
+                if (it >= start && it < end) {
+                    continue;
+                }
+                slot->entries[kept++] = slot->entries[j];
+            }
+            wheel_entries -= slot->count - kept;
+            slot->count = kept;
+        }
+    }
+    for (j = 0; j < wheel_due.count; j++) {
+        void *it = wheel_due.entries[j].it;
+        if (it >= start && it < end)
+            wheel_due.entries[j].it = NULL;
+    }
+}
+
+/* Redistributes a slot of a higher level into the levels below it.
+ * cache_lock must be held. */
+static void wheel_cascade(const int level, const int idx) {
+    wheel_slot old = wheel[level][idx];
+    unsigned int j;
+
+    memset(&wheel[level][idx], 0, sizeof(wheel_slot));
+    wheel_entries -= old.count;
+    for (j = 0; j < old.count; j++) {
+        if (wheel_entry_valid(&old.entries[j]))
+            wheel_add(old.entries[j].it, old.entries[j].exptime);
+    }
+    free(old.entries);
+}
+
+/* Same checks as the LRU crawler: the item lock is only tried, since we are
+ * acquiring it out of order, and an item with references is left alone. */
+static void wheel_reclaim(const unsigned int j) {
+    const wheel_entry *e;
+    item *it;
+    uint32_t hv;
+    void *hold_lock;
+
+    mutex_lock_blocking(&cache_lock);
+    e = &wheel_due.entries[j];
+    it = e->it;
+    if (it == NULL || !wheel_entry_valid(e)) {
+        mutex_unlock(&cache_lock);
+        return;
+    }
+    if (e->exptime > current_time) {
+        wheel_add(it, e->exptime);
+        mutex_unlock(&cache_lock);
+        return;
+    }
+    hv = hash(ITEM_key(it), it->nkey);
+    if ((hold_lock = item_trylock(hv)) == NULL) {
+        wheel_add(it, e->exptime);
+        mutex_unlock(&cache_lock);
+        return;
+    }
+    if (refcount_incr(&it->refcount) != 2) {
+        refcount_decr(&it->refcount);
+        wheel_add(it, e->exptime);
+        item_trylock_unlock(hold_lock);
+        mutex_unlock(&cache_lock);
+        return;
+    }
+
+    itemstats[it->slabs_clsid].wheel_reclaimed++;
+    if ((it->it_flags & ITEM_FETCHED) == 0) {
+        itemstats[it->slabs_clsid].expired_unfetched++;
+    }
+    if (settings.verbose > 1) {
+        int ii;
+        char *key = ITEM_key(it);
+        fprintf(stderr, "Expiry wheel reclaimed an item (slab: %d): ",
+            it->slabs_clsid);
+        for (ii = 0; ii < it->nkey; ++ii) {
+            fprintf(stderr, "%c", key[ii]);
+        }
+        fprintf(stderr, "\n");
+    }
+    do_item_unlink_nolock(it, hv);
+    do_item_remove(it);
+
+    item_trylock_unlock(hold_lock);
+    mutex_unlock(&cache_lock);
+}
+
+/* Advances the wheel up to current_time, freeing what has expired. */
+static void wheel_run(void) {
+    while (do_run_expiry_wheel_thread) {
+        rel_time_t now;
+        unsigned int j;
+        int level;
+
+        mutex_lock_blocking(&cache_lock);
+        now = wheel_time;
+        if (now > current_time) {
+            mutex_unlock(&cache_lock);
+            break;
+        }
+        for (level = 0; level < WHEEL_LEVELS - 1 &&
+             (now & (WHEEL_SPAN(level + 1) - 1)) == 0; level++)
+            ;
+        for (; level > 0; level--) {
+            wheel_cascade(level, (now >> (WHEEL_BITS * level)) & WHEEL_MASK);
+        }
+        wheel_due = wheel[0][now & WHEEL_MASK];
+        memset(&wheel[0][now & WHEEL_MASK], 0, sizeof(wheel_slot));
+        wheel_entries -= wheel_due.count;
+        wheel_time = now + 1;
+        mutex_unlock(&cache_lock);
+
+        /* Only this thread changes the count, so it can be read unlocked;
+         * each entry is read under cache_lock, after any purge. */
+        for (j = 0; j < wheel_due.count && do_run_expiry_wheel_thread; j++) {
+            wheel_reclaim(j);
+        }
+
+        mutex_lock_blocking(&cache_lock);
+        free(wheel_due.entries);
+        memset(&wheel_due, 0, sizeof(wheel_slot));
+        mutex_unlock(&cache_lock);
+    }
+}
+
+static void *expiry_wheel_thread(void *arg) {
+    if (settings.verbose > 2)
+        fprintf(stderr, "Starting expiry wheel background thread\n");
+    while (do_run_expiry_wheel_thread) {
+        wheel_run();
+        sleep(1);
+    }
+    if (settings.verbose > 2)
+        fprintf(stderr, "Expiry wheel thread stopping\n");
+    return NULL;
+}
+
+int start_expiry_wheel_thread(void) {
+    int ret;
+
+    mutex_lock_blocking(&cache_lock);
+    wheel_time = current_time;
+    mutex_unlock(&cache_lock);
+    do_run_expiry_wheel_thread = 1;
+    if ((ret = pthread_create(&expiry_wheel_tid, NULL,
+        expiry_wheel_thread, NULL)) != 0) {
+        fprintf(stderr, "Can't create expiry wheel thread: %s\n",
+            strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
+void stop_expiry_wheel_thread(void) {
+    do_run_expiry_wheel_thread = 0;
+    pthread_join(expiry_wheel_tid, NULL);
+}
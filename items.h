@@ -23,10 +23,21 @@ void do_item_stats_sizes(ADD_STAT add_stats, void *c);
 void do_item_flush_expired(void);
 
 item *do_item_get(const char *key, const size_t nkey, const uint32_t hv);
+item *do_item_get_any(const char *key, const size_t nkey, const uint32_t hv);
+item *do_item_lease_get(const char *key, const size_t nkey, const uint32_t hv,
+                        enum lease_result *res);
 item *do_item_touch(const char *key, const size_t nkey, uint32_t exptime, const uint32_t hv);
 void item_stats_reset(void);
 extern pthread_mutex_t cache_lock;
 void item_stats_evictions(uint64_t *evicted);
+void item_stats_ghost_hits(uint64_t *ghost_hits);
+void item_ghost_miss(const char *key, const size_t nkey);
+void item_stats_tail_ages(rel_time_t *ages);
+void item_stats_eviction(ADD_STAT add_stats, void *c);
+
+int eviction_policy_id(const char *name);
+const char *eviction_policy_name(const int policy);
+void item_set_eviction_policy(const int policy);
 
 enum crawler_result_type {
     CRAWLER_OK=0, CRAWLER_RUNNING, CRAWLER_BADCLASS
@@ -36,3 +47,7 @@ int start_item_crawler_thread(void);
 int stop_item_crawler_thread(void);
 int init_lru_crawler(void);
 enum crawler_result_type lru_crawler_crawl(char *slabs);
+
+int start_expiry_wheel_thread(void);
+void stop_expiry_wheel_thread(void);
+void do_item_wheel_purge(void *start, void *end);
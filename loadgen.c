@@ -0,0 +1,1030 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Load generator for memcached.
+ *
+ * Every thread drives its own set of connections with poll(). A connection
+ * sends a batch of -d requests (the pipeline depth), waits until all of them
+ * are answered, and starts over, so the latency of a request is the time from
+ * its batch being written to its response being parsed. Gets may ask for
+ * several keys at once (-m); keys are drawn uniformly or from a zipfian
+ * distribution and values are sized uniformly between two bounds.
+ *
+ * Results are printed as "name value" lines, or as one JSON object with -J,
+ * so runs can be compared by scripts. With -S the server's own CPU time per
+ * request is reported too, from its rusage stats, for comparing server
+ * settings such as -o zerocopy with large values (-v 100000-1000000).
+ *
+ * With -U requests go to the UDP port instead, one datagram each, framed
+ * the way the server expects. Connections are then connected UDP sockets,
+ * responses to anything but the oldest unanswered request are dropped, and
+ * a batch that isn't answered within a second counts what is left as
+ * errors.
+ */
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "protocol_binary.h"
+
+#define KEY_MAX_LENGTH 250
+
+/* How long to wait for a UDP response, and the largest one. */
+#define UDP_TIMEOUT_NS 1000000000ULL
+#define UDP_MAX_DATAGRAM 65536
+
+/* Latency histograms: each power of two of nanoseconds is split into eight
+ * buckets, the same layout the server uses for "stats latency". */
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (40 * HIST_SUB_BUCKETS)
+
+enum op_type { OP_GET = 0, OP_SET, OP_MAX };
+static const char *op_names[OP_MAX] = { "get", "set" };
+
+enum key_dist { DIST_UNIFORM, DIST_ZIPF };
+
+static struct {
+    const char *host;
+    const char *port;
+    const char *udp_port;   /* requests go over UDP when set */
+    bool binary;
+    int threads;
+    int conns;          /* per thread */
+    int depth;          /* requests in flight per connection */
+    int multiget;       /* keys per get */
+    unsigned int keys;  /* size of the key space */
+    const char *prefix;
+    enum key_dist dist;
+    double zipf_theta;
+    unsigned int value_min;
+    unsigned int value_max;
+    double set_ratio;
+    int duration;
+    bool preload;
+    bool json;
+    bool server_cpu;
+} cfg = {
+    .host = "127.0.0.1",
+    .port = "11211",
+    .udp_port = NULL,
+    .binary = false,
+    .threads = 4,
+    .conns = 4,
+    .depth = 1,
+    .multiget = 1,
+    .keys = 100000,
+    .prefix = "key:",
+    .dist = DIST_UNIFORM,
+    .zipf_theta = 0.99,
+    .value_min = 32,
+    .value_max = 32,
+    .set_ratio = 0.1,
+    .duration = 10,
+    .preload = false,
+    .json = false,
+    .server_cpu = false,
+};
+
+/* Zipfian key ranks, from Gray et al., "Quickly Generating Billion-Record
+ * Synthetic Databases" (the same generator YCSB uses). */
+static struct {
+    double zetan;
+    double alpha;
+    double eta;
+    double half_pow_theta;
+} zipf;
+
+static char *value_buf;
+static struct addrinfo *server_addr;
+static struct addrinfo *udp_addr;
+static volatile bool stop = false;
+
+/* Threads wait here between preloading and the timed run. */
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
+static int threads_ready = 0;
+static bool started = false;
+
+typedef struct {
+    uint8_t op;
+    uint8_t nkeys;
+    uint8_t hits;
+    uint32_t opaque;    /* of the response that ends the request (binary) */
+    uint16_t udp_id;
+    uint64_t start;
+} request;
+
+typedef struct {
+    int fd;
+    char *wbuf;
+    size_t wsize, wlen, wsent;
+    char *rbuf;
+    size_t rsize, rlen;
+    request *reqs;
+    int nreqs, head;    /* requests in the batch, first unanswered one */
+    uint32_t opaque;
+    size_t *ends;       /* UDP: where each request's datagram ends in wbuf */
+    int wnext;          /* UDP: the next datagram to send */
+    uint16_t udp_id;
+} lg_conn;
+
+typedef struct {
+    pthread_t tid;
+    int id;
+    uint64_t rng;
+    lg_conn *conns;
+    uint64_t ops[OP_MAX];
+    uint64_t hits, misses, errors;
+    uint64_t hist[OP_MAX][HIST_BUCKETS];
+    uint64_t max_ns[OP_MAX];
+    unsigned int preload_next, preload_end;
+} lg_thread;
+
+static uint64_t now_ns(void) {
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+    {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return (uint64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+    }
+}
+
+/* xorshift64* */
+static uint64_t rng_next(lg_thread *t) {
+    t->rng ^= t->rng >> 12;
+    t->rng ^= t->rng << 25;
+    t->rng ^= t->rng >> 27;
+    return t->rng * 2685821657736338717ULL;
+}
+
+static double rng_double(lg_thread *t) {
+    return (rng_next(t) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void zipf_init(void) {
+    double zeta2 = 1.0 + pow(0.5, cfg.zipf_theta);
+    unsigned int i;
+
+    zipf.zetan = 0;
+    for (i = 1; i <= cfg.keys; i++)
+        zipf.zetan += 1.0 / pow((double)i, cfg.zipf_theta);
+    zipf.alpha = 1.0 / (1.0 - cfg.zipf_theta);
+    zipf.eta = (1.0 - pow(2.0 / cfg.keys, 1.0 - cfg.zipf_theta)) /
+               (1.0 - zeta2 / zipf.zetan);
+    zipf.half_pow_theta = pow(0.5, cfg.zipf_theta);
+}
+
+static unsigned int next_key(lg_thread *t) {
+    double u, uz;
+    unsigned int k;
+
+    if (cfg.dist == DIST_UNIFORM)
+        return rng_next(t) % cfg.keys;
+
+    u = rng_double(t);
+    uz = u * zipf.zetan;
+    if (uz < 1.0)
+        return 0;
+    if (uz < 1.0 + zipf.half_pow_theta)
+        return 1;
+    k = (unsigned int)(cfg.keys * pow(zipf.eta * u - zipf.eta + 1.0,
+                                      zipf.alpha));
+    return k < cfg.keys ? k : cfg.keys - 1;
+}
+
+static unsigned int next_value_size(lg_thread *t) {
+    if (cfg.value_max == cfg.value_min)
+        return cfg.value_min;
+    return cfg.value_min + rng_next(t) % (cfg.value_max - cfg.value_min + 1);
+}
+
+static int hist_bucket(const uint64_t ns) {
+    int msb = 0, idx;
+    uint64_t v = ns;
+    if (ns < HIST_SUB_BUCKETS)
+        return (int)ns;
+    while (v >>= 1)
+        msb++;
+    idx = (msb - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS +
+          (int)((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+static uint64_t hist_bucket_floor(const int idx) {
+    int power = idx / HIST_SUB_BUCKETS;
+    if (power == 0)
+        return idx;
+    return (uint64_t)(HIST_SUB_BUCKETS + idx % HIST_SUB_BUCKETS)
+        << (power - 1);
+}
+
+/* Upper edge of the bucket holding the given quantile. */
+static uint64_t hist_quantile(const uint64_t *hist, const double q) {
+    uint64_t count = 0, seen = 0, rank;
+    int b;
+    for (b = 0; b < HIST_BUCKETS; b++)
+        count += hist[b];
+    if (count == 0)
+        return 0;
+    rank = (uint64_t)(count * q);
+    if (rank >= count)
+        rank = count - 1;
+    for (b = 0; seen + hist[b] <= rank; b++)
+        seen += hist[b];
+    return hist_bucket_floor(b + 1) - 1;
+}
+
+static void *lg_malloc(size_t size) {
+    void *ptr = malloc(size);
+    if (ptr == NULL) {
+        fprintf(stderr, "Failed to allocate %lu bytes\n",
+                (unsigned long)size);
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+static void ensure_space(char **buf, size_t *size, const size_t need) {
+    if (need <= *size)
+        return;
+    while (*size < need)
+        *size *= 2;
+    *buf = realloc(*buf, *size);
+    if (*buf == NULL) {
+        fprintf(stderr, "Failed to grow buffer to %lu bytes\n",
+                (unsigned long)*size);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static int connect_server(const struct addrinfo *ai) {
+    int fd, flag = 1;
+
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd == -1) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+        perror("connect");
+        exit(EXIT_FAILURE);
+    }
+    if (ai->ai_socktype == SOCK_STREAM)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+/* The server's CPU time in seconds, from "stats". */
+static double server_cpu(void) {
+    char buf[65536];
+    size_t len = 0;
+    double secs = 0;
+    char *p;
+    int fd = connect_server(server_addr);
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    if (write(fd, "stats\r\n", 7) != 7) {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+    buf[0] = '\0';
+    while (len < sizeof(buf) - 1 && strstr(buf, "END\r\n") == NULL) {
+        ssize_t n = read(fd, buf + len, sizeof(buf) - 1 - len);
+        if (n <= 0)
+            break;
+        len += n;
+        buf[len] = '\0';
+    }
+    close(fd);
+
+    if ((p = strstr(buf, "STAT rusage_user ")) != NULL)
+        secs += strtod(p + 17, NULL);
+    if ((p = strstr(buf, "STAT rusage_system ")) != NULL)
+        secs += strtod(p + 19, NULL);
+    return secs;
+}
+
+static int format_key(char *buf, const unsigned int key) {
+    return snprintf(buf, KEY_MAX_LENGTH + 1, "%s%u", cfg.prefix, key);
+}
+
+static void add_bin_header(lg_conn *c, const uint8_t opcode,
+                           const uint8_t extlen, const uint16_t keylen,
+                           const uint32_t bodylen, const uint32_t opaque) {
+    protocol_binary_request_header *req;
+    ensure_space(&c->wbuf, &c->wsize, c->wlen + sizeof(*req));
+    req = (protocol_binary_request_header *)(c->wbuf + c->wlen);
+    memset(req, 0, sizeof(*req));
+    req->request.magic = PROTOCOL_BINARY_REQ;
+    req->request.opcode = opcode;
+    req->request.keylen = htons(keylen);
+    req->request.extlen = extlen;
+    req->request.bodylen = htonl(bodylen);
+    req->request.opaque = opaque;
+    c->wlen += sizeof(*req);
+}
+
+static void append(lg_conn *c, const void *data, const size_t len) {
+    ensure_space(&c->wbuf, &c->wsize, c->wlen + len);
+    memcpy(c->wbuf + c->wlen, data, len);
+    c->wlen += len;
+}
+
+/* The frame header of a UDP request: its id, datagram 0 of 1. */
+static void add_udp_header(lg_conn *c, request *r) {
+    unsigned char hdr[8] = { 0 };
+
+    r->udp_id = c->udp_id++;
+    hdr[0] = r->udp_id >> 8;
+    hdr[1] = r->udp_id & 0xff;
+    hdr[5] = 1;
+    append(c, hdr, sizeof(hdr));
+}
+
+static void queue_get(lg_thread *t, lg_conn *c, request *r) {
+    char key[KEY_MAX_LENGTH + 1];
+    int i, nkey;
+
+    r->op = OP_GET;
+    r->nkeys = cfg.multiget;
+    if (!cfg.binary) {
+        append(c, "get", 3);
+        for (i = 0; i < cfg.multiget; i++) {
+            nkey = format_key(key, next_key(t));
+            append(c, " ", 1);
+            append(c, key, nkey);
+        }
+        append(c, "\r\n", 2);
+        return;
+    }
+    /* Quiet gets for all keys but the last, whose reply ends the request. */
+    for (i = 0; i < cfg.multiget; i++) {
+        bool last = i == cfg.multiget - 1;
+        nkey = format_key(key, next_key(t));
+        r->opaque = c->opaque++;
+        add_bin_header(c, last ? PROTOCOL_BINARY_CMD_GETK :
+                       PROTOCOL_BINARY_CMD_GETKQ, 0, nkey, nkey, r->opaque);
+        append(c, key, nkey);
+    }
+}
+
+static void queue_set(lg_thread *t, lg_conn *c, request *r,
+                      const unsigned int keyno) {
+    char key[KEY_MAX_LENGTH + 1];
+    char line[KEY_MAX_LENGTH + 64];
+    unsigned int vlen = next_value_size(t);
+    int nkey = format_key(key, keyno);
+
+    r->op = OP_SET;
+    r->nkeys = 1;
+    if (!cfg.binary) {
+        int len = snprintf(line, sizeof(line), "set %s 0 0 %u\r\n", key, vlen);
+        append(c, line, len);
+        append(c, value_buf, vlen);
+        append(c, "\r\n", 2);
+        return;
+    }
+    r->opaque = c->opaque++;
+    add_bin_header(c, PROTOCOL_BINARY_CMD_SET, 8, nkey, 8 + nkey + vlen,
+                   r->opaque);
+    /* flags and expiration, both zero */
+    memset(line, 0, 8);
+    append(c, line, 8);
+    append(c, key, nkey);
+    append(c, value_buf, vlen);
+}
+
+/* Queues the next batch of requests. Returns false when there is nothing
+ * left to send. */
+static bool start_batch(lg_thread *t, lg_conn *c, const bool preloading) {
+    uint64_t start;
+    int i;
+
+    c->wlen = c->wsent = 0;
+    c->nreqs = c->head = 0;
+    c->wnext = 0;
+    for (i = 0; i < cfg.depth; i++) {
+        request *r = &c->reqs[c->nreqs];
+        r->hits = 0;
+        if (preloading && t->preload_next >= t->preload_end)
+            break;
+        if (cfg.udp_port)
+            add_udp_header(c, r);
+        if (preloading) {
+            queue_set(t, c, r, t->preload_next++);
+        } else if (cfg.set_ratio > 0 && rng_double(t) < cfg.set_ratio) {
+            queue_set(t, c, r, next_key(t));
+        } else {
+            queue_get(t, c, r);
+        }
+        if (cfg.udp_port)
+            c->ends[c->nreqs] = c->wlen;
+        c->nreqs++;
+    }
+    start = now_ns();
+    for (i = 0; i < c->nreqs; i++)
+        c->reqs[i].start = start;
+    return c->nreqs > 0;
+}
+
+static void complete(lg_thread *t, request *r, const uint64_t now,
+                     const bool ok) {
+    uint64_t ns = now - r->start;
+    t->ops[r->op]++;
+    t->hist[r->op][hist_bucket(ns)]++;
+    if (ns > t->max_ns[r->op])
+        t->max_ns[r->op] = ns;
+    if (!ok)
+        t->errors++;
+    if (r->op == OP_GET) {
+        t->hits += r->hits;
+        t->misses += r->nkeys - r->hits;
+    }
+}
+
+/* Returns the number of bytes consumed. */
+static size_t parse_ascii(lg_thread *t, lg_conn *c, const uint64_t now) {
+    size_t pos = 0;
+
+    while (c->head < c->nreqs) {
+        char *line = c->rbuf + pos;
+        size_t avail = c->rlen - pos;
+        char *nl = memchr(line, '\n', avail);
+        request *r = &c->reqs[c->head];
+        size_t linelen;
+
+        if (nl == NULL)
+            break;
+        linelen = nl - line + 1;
+        if (linelen > 6 && memcmp(line, "VALUE ", 6) == 0) {
+            char tmp[KEY_MAX_LENGTH + 64];
+            unsigned long bytes = 0;
+            size_t n = linelen < sizeof(tmp) ? linelen : sizeof(tmp) - 1;
+            memcpy(tmp, line, n);
+            tmp[n] = '\0';
+            if (sscanf(tmp, "VALUE %*s %*u %lu", &bytes) != 1) {
+                fprintf(stderr, "Bad response: %s", tmp);
+                exit(EXIT_FAILURE);
+            }
+            if (avail < linelen + bytes + 2)
+                break;
+            r->hits++;
+            pos += linelen + bytes + 2;
+            continue;
+        }
+        pos += linelen;
+        if (r->op == OP_GET) {
+            complete(t, r, now, memcmp(line, "END\r\n", 5) == 0);
+        } else {
+            complete(t, r, now, memcmp(line, "STORED\r\n", 8) == 0);
+        }
+        c->head++;
+    }
+    return pos;
+}
+
+static size_t parse_binary(lg_thread *t, lg_conn *c, const uint64_t now) {
+    size_t pos = 0;
+
+    while (c->head < c->nreqs &&
+           c->rlen - pos >= sizeof(protocol_binary_response_header)) {
+        protocol_binary_response_header *rsp =
+            (protocol_binary_response_header *)(c->rbuf + pos);
+        uint32_t bodylen = ntohl(rsp->response.bodylen);
+        uint16_t status = ntohs(rsp->response.status);
+        request *r = &c->reqs[c->head];
+
+        if (c->rlen - pos < sizeof(*rsp) + bodylen)
+            break;
+        pos += sizeof(*rsp) + bodylen;
+        if (rsp->response.opaque != r->opaque) {
+            /* A quiet get hit for the current multiget. */
+            r->hits++;
+            continue;
+        }
+        if (r->op == OP_GET) {
+            if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS)
+                r->hits++;
+            complete(t, r, now, status == PROTOCOL_BINARY_RESPONSE_SUCCESS ||
+                     status == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+        } else {
+            complete(t, r, now, status == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        }
+        c->head++;
+    }
+    return pos;
+}
+
+/* One datagram per request. */
+static void udp_write(lg_conn *c) {
+    while (c->wnext < c->nreqs) {
+        size_t end = c->ends[c->wnext];
+        ssize_t res = send(c->fd, c->wbuf + c->wsent, end - c->wsent, 0);
+        if (res >= 0) {
+            c->wsent = end;
+            c->wnext++;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        } else if (errno != EINTR) {
+            perror("send");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void conn_write(lg_conn *c) {
+    if (cfg.udp_port) {
+        udp_write(c);
+        return;
+    }
+    while (c->wsent < c->wlen) {
+        ssize_t res = write(c->fd, c->wbuf + c->wsent, c->wlen - c->wsent);
+        if (res > 0) {
+            c->wsent += res;
+        } else if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        } else if (res == -1 && errno == EINTR) {
+            continue;
+        } else {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/* Strips the frame headers off the datagrams that answer the current
+ * request and parses what they carry as if it came over TCP. */
+static void udp_read(lg_thread *t, lg_conn *c) {
+    for (;;) {
+        unsigned char *buf;
+        ssize_t res;
+        size_t used;
+
+        ensure_space(&c->rbuf, &c->rsize, c->rlen + UDP_MAX_DATAGRAM);
+        buf = (unsigned char *)c->rbuf + c->rlen;
+        res = recv(c->fd, buf, UDP_MAX_DATAGRAM, 0);
+        if (res == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EINTR)
+                continue;
+            perror("recv");
+            exit(EXIT_FAILURE);
+        }
+        /* Late answers to requests that timed out, among others. */
+        if (res < 8 || c->head >= c->nreqs ||
+            (buf[0] << 8 | buf[1]) != c->reqs[c->head].udp_id)
+            continue;
+        memmove(buf, buf + 8, res - 8);
+        c->rlen += res - 8;
+        used = cfg.binary ? parse_binary(t, c, now_ns())
+                          : parse_ascii(t, c, now_ns());
+        memmove(c->rbuf, c->rbuf + used, c->rlen - used);
+        c->rlen -= used;
+    }
+}
+
+/* Gives up on the rest of a UDP batch. */
+static void udp_expire(lg_thread *t, lg_conn *c, const uint64_t now) {
+    while (c->head < c->nreqs)
+        complete(t, &c->reqs[c->head++], now, false);
+    c->rlen = 0;
+    c->wsent = c->wlen;
+    c->wnext = c->nreqs;
+}
+
+static void conn_read(lg_thread *t, lg_conn *c) {
+    if (cfg.udp_port) {
+        udp_read(t, c);
+        return;
+    }
+    for (;;) {
+        ssize_t res;
+        size_t used;
+
+        ensure_space(&c->rbuf, &c->rsize, c->rlen + 16384);
+        res = read(c->fd, c->rbuf + c->rlen, c->rsize - c->rlen);
+        if (res == 0) {
+            fprintf(stderr, "Server closed the connection\n");
+            exit(EXIT_FAILURE);
+        } else if (res == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            exit(EXIT_FAILURE);
+        }
+        c->rlen += res;
+        used = cfg.binary ? parse_binary(t, c, now_ns())
+                          : parse_ascii(t, c, now_ns());
+        memmove(c->rbuf, c->rbuf + used, c->rlen - used);
+        c->rlen -= used;
+    }
+}
+
+/* Runs batches on all connections until there is nothing more to send and
+ * every request has been answered. */
+static void run_batches(lg_thread *t, const bool preloading) {
+    struct pollfd *fds = lg_malloc(sizeof(struct pollfd) * cfg.conns);
+    bool *more = lg_malloc(sizeof(bool) * cfg.conns);
+    int i;
+
+    for (i = 0; i < cfg.conns; i++)
+        more[i] = true;
+
+    for (;;) {
+        uint64_t now = cfg.udp_port ? now_ns() : 0;
+        int active = 0;
+        for (i = 0; i < cfg.conns; i++) {
+            lg_conn *c = &t->conns[i];
+            if (cfg.udp_port && c->head < c->nreqs &&
+                now - c->reqs[c->head].start > UDP_TIMEOUT_NS)
+                udp_expire(t, c, now);
+            if (c->head == c->nreqs && more[i]) {
+                if ((preloading || !stop) && start_batch(t, c, preloading)) {
+                    conn_write(c);
+                } else {
+                    more[i] = false;
+                }
+            }
+            fds[i].fd = c->fd;
+            fds[i].events = 0;
+            fds[i].revents = 0;
+            if (c->head < c->nreqs) {
+                fds[i].events = POLLIN;
+                if (c->wsent < c->wlen)
+                    fds[i].events |= POLLOUT;
+                active++;
+            }
+        }
+        if (active == 0)
+            break;
+        if (poll(fds, cfg.conns, 100) == -1 && errno != EINTR) {
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < cfg.conns; i++) {
+            if (fds[i].revents & POLLOUT)
+                conn_write(&t->conns[i]);
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                conn_read(t, &t->conns[i]);
+        }
+    }
+    free(fds);
+    free(more);
+}
+
+static void *worker(void *arg) {
+    lg_thread *t = arg;
+    int i;
+
+    t->conns = calloc(cfg.conns, sizeof(lg_conn));
+    if (t->conns == NULL) {
+        fprintf(stderr, "Failed to allocate connections\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < cfg.conns; i++) {
+        lg_conn *c = &t->conns[i];
+        c->fd = connect_server(cfg.udp_port ? udp_addr : server_addr);
+        c->wsize = c->rsize = 16384;
+        c->wbuf = lg_malloc(c->wsize);
+        c->rbuf = lg_malloc(c->rsize);
+        c->reqs = lg_malloc(sizeof(request) * cfg.depth);
+        c->ends = lg_malloc(sizeof(size_t) * cfg.depth);
+        c->udp_id = t->id << 12;
+    }
+
+    if (cfg.preload) {
+        run_batches(t, true);
+        memset(t->ops, 0, sizeof(t->ops));
+        memset(t->hist, 0, sizeof(t->hist));
+        memset(t->max_ns, 0, sizeof(t->max_ns));
+        t->hits = t->misses = t->errors = 0;
+    }
+
+    pthread_mutex_lock(&start_lock);
+    threads_ready++;
+    pthread_cond_broadcast(&start_cond);
+    while (!started)
+        pthread_cond_wait(&start_cond, &start_lock);
+    pthread_mutex_unlock(&start_lock);
+
+    run_batches(t, false);
+
+    for (i = 0; i < cfg.conns; i++) {
+        close(t->conns[i].fd);
+        free(t->conns[i].wbuf);
+        free(t->conns[i].rbuf);
+        free(t->conns[i].reqs);
+        free(t->conns[i].ends);
+    }
+    free(t->conns);
+    return NULL;
+}
+
+static void report(lg_thread *threads, const double elapsed,
+                   const double cpu) {
+    static const struct {
+        const char *name;
+        double q;
+    } pcts[] = {
+        { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }, { "p999", 0.999 }
+    };
+    uint64_t hist[OP_MAX][HIST_BUCKETS];
+    uint64_t ops[OP_MAX] = { 0 }, max_ns[OP_MAX] = { 0 };
+    uint64_t hits = 0, misses = 0, errors = 0, total;
+    int i, op, b, p;
+
+    memset(hist, 0, sizeof(hist));
+    for (i = 0; i < cfg.threads; i++) {
+        lg_thread *t = &threads[i];
+        for (op = 0; op < OP_MAX; op++) {
+            ops[op] += t->ops[op];
+            if (t->max_ns[op] > max_ns[op])
+                max_ns[op] = t->max_ns[op];
+            for (b = 0; b < HIST_BUCKETS; b++)
+                hist[op][b] += t->hist[op][b];
+        }
+        hits += t->hits;
+        misses += t->misses;
+        errors += t->errors;
+    }
+    total = ops[OP_GET] + ops[OP_SET];
+
+    if (cfg.json) {
+        printf("{\"protocol\":\"%s\",\"transport\":\"%s\","
+               "\"threads\":%d,\"conns\":%d,"
+               "\"depth\":%d,\"multiget\":%d,\"keys\":%u,"
+               "\"distribution\":\"%s\",\"value_min\":%u,\"value_max\":%u,"
+               "\"set_ratio\":%.3f,\"elapsed\":%.3f,\"ops\":%llu,"
+               "\"ops_per_sec\":%.0f,\"hits\":%llu,\"misses\":%llu,"
+               "\"errors\":%llu",
+               cfg.binary ? "binary" : "ascii", cfg.udp_port ? "udp" : "tcp",
+               cfg.threads, cfg.conns,
+               cfg.depth, cfg.multiget, cfg.keys,
+               cfg.dist == DIST_ZIPF ? "zipf" : "uniform",
+               cfg.value_min, cfg.value_max, cfg.set_ratio, elapsed,
+               (unsigned long long)total, total / elapsed,
+               (unsigned long long)hits, (unsigned long long)misses,
+               (unsigned long long)errors);
+        if (cfg.server_cpu && total > 0)
+            printf(",\"server_cpu_us_per_op\":%.3f", cpu * 1e6 / total);
+        for (op = 0; op < OP_MAX; op++) {
+            printf(",\"%s\":{\"ops\":%llu", op_names[op],
+                   (unsigned long long)ops[op]);
+            for (p = 0; p < sizeof(pcts) / sizeof(pcts[0]); p++) {
+                printf(",\"%s_us\":%.3f", pcts[p].name,
+                       hist_quantile(hist[op], pcts[p].q) / 1000.0);
+            }
+            printf(",\"max_us\":%.3f}", max_ns[op] / 1000.0);
+        }
+        printf("}\n");
+        return;
+    }
+
+    printf("protocol %s\n", cfg.binary ? "binary" : "ascii");
+    printf("transport %s\n", cfg.udp_port ? "udp" : "tcp");
+    printf("threads %d\nconns %d\ndepth %d\nmultiget %d\n",
+           cfg.threads, cfg.conns, cfg.depth, cfg.multiget);
+    printf("elapsed %.3f\n", elapsed);
+    printf("ops %llu\n", (unsigned long long)total);
+    printf("ops_per_sec %.0f\n", total / elapsed);
+    printf("hits %llu\nmisses %llu\nerrors %llu\n",
+           (unsigned long long)hits, (unsigned long long)misses,
+           (unsigned long long)errors);
+    if (cfg.server_cpu && total > 0)
+        printf("server_cpu_us_per_op %.3f\n", cpu * 1e6 / total);
+    for (op = 0; op < OP_MAX; op++) {
+        printf("%s_ops %llu\n", op_names[op], (unsigned long long)ops[op]);
+        for (p = 0; p < sizeof(pcts) / sizeof(pcts[0]); p++) {
+            printf("%s_%s_us %.3f\n", op_names[op], pcts[p].name,
+                   hist_quantile(hist[op], pcts[p].q) / 1000.0);
+        }
+        printf("%s_max_us %.3f\n", op_names[op], max_ns[op] / 1000.0);
+    }
+}
+
+static void usage(void) {
+    printf("loadgen - load generator for memcached\n"
+           "-s <host>      server to connect to (default: 127.0.0.1)\n"
+           "-p <port>      TCP port (default: 11211)\n"
+           "-U <port>      send requests to this UDP port instead\n"
+           "-B <proto>     protocol: ascii (default) or binary\n"
+           "-t <num>       threads (default: 4)\n"
+           "-c <num>       connections per thread (default: 4)\n"
+           "-d <num>       requests in flight per connection (default: 1)\n"
+           "-m <num>       keys per get (default: 1)\n"
+           "-k <num>       number of distinct keys (default: 100000)\n"
+           "-K <prefix>    key prefix (default: key:)\n"
+           "-D <dist>      key distribution: uniform (default) or\n"
+           "               zipf[:theta] (default theta: 0.99)\n"
+           "-v <min[-max]> value size in bytes, uniform over the range\n"
+           "               (default: 32)\n"
+           "-r <ratio>     fraction of requests that are sets (default: 0.1)\n"
+           "-T <seconds>   duration of the run (default: 10)\n"
+           "-P             set every key once before the run\n"
+           "-S             report the server's CPU time per request\n"
+           "-J             print results as JSON\n"
+           "-h             print this help and exit\n");
+}
+
+int main(int argc, char **argv) {
+    struct addrinfo hints;
+    lg_thread *threads;
+    uint64_t start;
+    double elapsed, cpu = 0;
+    char *end;
+    int c, i, error;
+
+    while (-1 != (c = getopt(argc, argv, "s:p:U:B:t:c:d:m:k:K:D:v:r:T:PSJh"))) {
+        switch (c) {
+        case 's':
+            cfg.host = optarg;
+            break;
+        case 'p':
+            cfg.port = optarg;
+            break;
+        case 'U':
+            cfg.udp_port = optarg;
+            break;
+        case 'B':
+            if (strcmp(optarg, "binary") == 0) {
+                cfg.binary = true;
+            } else if (strcmp(optarg, "ascii") == 0) {
+                cfg.binary = false;
+            } else {
+                fprintf(stderr, "Unknown protocol: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 't':
+            cfg.threads = atoi(optarg);
+            break;
+        case 'c':
+            cfg.conns = atoi(optarg);
+            break;
+        case 'd':
+            cfg.depth = atoi(optarg);
+            break;
+        case 'm':
+            cfg.multiget = atoi(optarg);
+            break;
+        case 'k':
+            cfg.keys = strtoul(optarg, NULL, 10);
+            break;
+        case 'K':
+            cfg.prefix = optarg;
+            break;
+        case 'D':
+            if (strcmp(optarg, "uniform") == 0) {
+                cfg.dist = DIST_UNIFORM;
+            } else if (strncmp(optarg, "zipf", 4) == 0) {
+                cfg.dist = DIST_ZIPF;
+                if (optarg[4] == ':')
+                    cfg.zipf_theta = strtod(optarg + 5, NULL);
+            } else {
+                fprintf(stderr, "Unknown distribution: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'v':
+            cfg.value_min = cfg.value_max = strtoul(optarg, &end, 10);
+            if (*end == '-')
+                cfg.value_max = strtoul(end + 1, NULL, 10);
+            break;
+        case 'r':
+            cfg.set_ratio = strtod(optarg, NULL);
+            break;
+        case 'T':
+            cfg.duration = atoi(optarg);
+            break;
+        case 'P':
+            cfg.preload = true;
+            break;
+        case 'S':
+            cfg.server_cpu = true;
+            break;
+        case 'J':
+            cfg.json = true;
+            break;
+        case 'h':
+            usage();
+            return EXIT_SUCCESS;
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (cfg.threads < 1 || cfg.conns < 1 || cfg.depth < 1 ||
+        cfg.multiget < 1 || cfg.multiget > 255 || cfg.keys < 1 ||
+        cfg.duration < 1 || cfg.value_max < cfg.value_min ||
+        cfg.set_ratio < 0 || cfg.set_ratio > 1) {
+        fprintf(stderr, "Invalid arguments, see -h\n");
+        return EXIT_FAILURE;
+    }
+    if (cfg.dist == DIST_ZIPF &&
+        (cfg.zipf_theta <= 0 || cfg.zipf_theta >= 1)) {
+        fprintf(stderr, "The zipf theta must be between 0 and 1\n");
+        return EXIT_FAILURE;
+    }
+    if (cfg.udp_port && cfg.value_max > UDP_MAX_DATAGRAM - 1024) {
+        fprintf(stderr, "Sets over UDP must fit in one datagram\n");
+        return EXIT_FAILURE;
+    }
+    if (strlen(cfg.prefix) + 10 > KEY_MAX_LENGTH) {
+        fprintf(stderr, "Key prefix too long\n");
+        return EXIT_FAILURE;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    error = getaddrinfo(cfg.host, cfg.port, &hints, &server_addr);
+    if (error != 0) {
+        fprintf(stderr, "getaddrinfo(): %s\n", gai_strerror(error));
+        return EXIT_FAILURE;
+    }
+    if (cfg.udp_port) {
+        hints.ai_socktype = SOCK_DGRAM;
+        error = getaddrinfo(cfg.host, cfg.udp_port, &hints, &udp_addr);
+        if (error != 0) {
+            fprintf(stderr, "getaddrinfo(): %s\n", gai_strerror(error));
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (cfg.dist == DIST_ZIPF)
+        zipf_init();
+    value_buf = lg_malloc(cfg.value_max + 1);
+    memset(value_buf, 'x', cfg.value_max);
+
+    threads = calloc(cfg.threads, sizeof(lg_thread));
+    if (threads == NULL) {
+        fprintf(stderr, "Failed to allocate threads\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < cfg.threads; i++) {
+        lg_thread *t = &threads[i];
+        t->id = i;
+        t->rng = 0x9E3779B97F4A7C15ULL * (i + 1) ^ (uint64_t)time(NULL);
+        t->preload_next = (uint64_t)cfg.keys * i / cfg.threads;
+        t->preload_end = (uint64_t)cfg.keys * (i + 1) / cfg.threads;
+        if (pthread_create(&t->tid, NULL, worker, t) != 0) {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+    }
+
+    pthread_mutex_lock(&start_lock);
+    while (threads_ready < cfg.threads)
+        pthread_cond_wait(&start_cond, &start_lock);
+    if (cfg.server_cpu)
+        cpu = -server_cpu();
+    started = true;
+    start = now_ns();
+    pthread_cond_broadcast(&start_cond);
+    pthread_mutex_unlock(&start_lock);
+
+    sleep(cfg.duration);
+    stop = true;
+    for (i = 0; i < cfg.threads; i++)
+        pthread_join(threads[i].tid, NULL);
+    elapsed = (now_ns() - start) / 1e9;
+    if (cfg.server_cpu)
+        cpu += server_cpu();
+
+    report(threads, elapsed, cpu);
+
+    free(threads);
+    free(value_buf);
+    freeaddrinfo(server_addr);
+    if (udp_addr != NULL)
+        freeaddrinfo(udp_addr);
+    return EXIT_SUCCESS;
+}
@@ -14,6 +14,8 @@
  *      Brad Fitzpatrick <brad@danga.com>
  */
 #include "memcached.h"
+#include "base64.h"
+#include "proto_text.h"
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -71,6 +73,9 @@ enum try_read_result {
 
 static enum try_read_result try_read_network(conn *c);
 static enum try_read_result try_read_udp(conn *c);
+static bool udp_batch_init(conn *c);
+static void udp_batch_free(conn *c);
+static bool udp_batch_pending(conn *c);
 
 static void conn_set_state(conn *c, enum conn_states state);
 
@@ -85,7 +90,6 @@ static void conn_to_str(const conn *c, char *buf);
 static void settings_init(void);
 
 /* event handling, network IO */
-static void event_handler(const int fd, const short which, void *arg);
 static void conn_close(conn *c);
 static void conn_init(void);
 static bool update_event(conn *c, const int new_flags);
@@ -97,6 +101,9 @@ static int add_iov(conn *c, const void *buf, int len);
 static int add_msghdr(conn *c);
 static void write_bin_error(conn *c, protocol_binary_response_status err,
                             const char *errstr, int swallow);
+static void complete_mset(conn *c, const enum store_item_type ret);
+static void multi_set_free(conn *c);
+static void multi_read_next(conn *c);
 
 static void conn_free(conn *c);
 
@@ -180,6 +187,7 @@ static void stats_init(void) {
     stats.hash_power_level = stats.hash_bytes = stats.hash_is_expanding = 0;
     stats.expired_unfetched = stats.evicted_unfetched = 0;
     stats.slabs_moved = 0;
+    stats.automove_decisions = stats.automove_pages = 0;
     stats.accepting_conns = true; /* assuming we start in this state. */
     stats.slab_reassign_running = false;
     stats.lru_crawler_running = false;
@@ -203,7 +211,11 @@ static void stats_reset(void) {
     stats_prefix_clear();
     STATS_UNLOCK();
     threadlocal_stats_reset();
+    threadlocal_latency_reset();
     item_stats_reset();
+    mrc_reset();
+    hotkeys_reset();
+    lock_stats_reset();
 }
 
 static void settings_init(void) {
@@ -233,6 +245,20 @@ static void settings_init(void) {
     settings.lru_crawler = false;
     settings.lru_crawler_sleep = 100;
     settings.lru_crawler_tocrawl = 0;
+    settings.expiry_wheel = false;
+    settings.eviction_policy = EVICTION_LRU;
+    settings.gdsf_cost_flags = false;
+    settings.mrc = false;
+    settings.lock_stats = false;
+    settings.capture_file = NULL;
+    settings.capture_sample = 1;
+    settings.hotkey_sample = 100;
+    settings.hotcache = false;
+    settings.leases = false;
+    settings.lease_ttl = 10;
+    settings.lease_stale = false;
+    settings.zerocopy = 0;
+    settings.io_uring = false;
     settings.hashpower_init = 0;
     settings.slab_reassign = false;
     settings.slab_automove = 0;
@@ -288,6 +314,113 @@ static int add_msghdr(conn *c)
     return 0;
 }
 
+/*
+ * Responses to pipelined ASCII commands on TCP are not sent one at a time.
+ * While the next command is already in the read buffer, a response stays
+ * queued in the msghdr/iovec list and the next one is added behind it, so
+ * that a whole read's worth of commands is answered with one or two
+ * sendmsg() calls. The queue is sent once the read buffer runs dry, the
+ * event's request budget (-R) is spent, or it grows past RESP_QUEUE_BYTES
+ * or RESP_QUEUE_IOV.
+ */
+static void resp_queue_reset(conn *c) {
+    c->resp_cmds = 0;
+    c->resp_bytes = 0;
+    c->resp_msgused = 0;
+    c->resp_iovused = 0;
+    c->resp_msgbytes = 0;
+    c->resp_wbytes = 0;
+    c->resp_sending = false;
+}
+
+/*
+ * Starts the response of the current ASCII command behind the queued ones,
+ * dropping anything the command itself had added so far.
+ *
+ * Returns 0 on success, -1 on out-of-memory.
+ */
+static int conn_start_response(conn *c) {
+    struct msghdr *m;
+
+    c->write_and_go = conn_new_cmd;
+    if (c->resp_cmds == 0) {
+        c->msgcurr = 0;
+        c->msgused = 0;
+        c->iovused = 0;
+        return add_msghdr(c);
+    }
+
+    c->msgused = c->resp_msgused;
+    c->iovused = c->resp_iovused;
+    c->msgbytes = c->resp_msgbytes;
+    m = &c->msglist[c->msgused - 1];
+    m->msg_iovlen = &c->iov[c->iovused] - m->msg_iov;
+    return 0;
+}
+
+/*
+ * Holds a reference to an item in the response until it is sent.
+ *
+ * Returns 0 on success, -1 on out-of-memory.
+ */
+static int conn_hold_item(conn *c, item *it) {
+    if (c->ileft >= c->isize) {
+        item **new_list = realloc(c->ilist, sizeof(item *) * c->isize * 2);
+        if (new_list == NULL) {
+            STATS_LOCK();
+            stats.malloc_fails++;
+            STATS_UNLOCK();
+            return -1;
+        }
+        c->isize *= 2;
+        c->ilist = new_list;
+    }
+    c->icurr = c->ilist;
+    c->ilist[c->ileft++] = it;
+    return 0;
+}
+
+/*
+ * Called with a complete response about to be sent. Queues it instead if
+ * another command waits in the read buffer and we'll get to it in this
+ * event.
+ *
+ * Returns true if the response was queued.
+ */
+static bool conn_queue_response(conn *c, const int nreqs) {
+    char *wend = c->wbuf + c->resp_wbytes;
+    int bytes = 0;
+    int i;
+
+    if (c->resp_sending || c->protocol != ascii_prot ||
+        IS_UDP(c->transport) || c->write_and_free != NULL ||
+        c->write_and_go == conn_closing || nreqs <= 0 ||
+        c->rbytes == 0 || memchr(c->rcurr, '\n', c->rbytes) == NULL)
+        return false;
+
+    /* Response lines live in wbuf, so the next one goes after them. */
+    for (i = c->resp_iovused; i < c->iovused; i++) {
+        char *base = c->iov[i].iov_base;
+        bytes += c->iov[i].iov_len;
+        if (base >= c->wbuf && base < c->wbuf + c->wsize &&
+            base + c->iov[i].iov_len > wend)
+            wend = base + c->iov[i].iov_len;
+    }
+    if (c->resp_bytes + bytes > RESP_QUEUE_BYTES ||
+        c->iovused > RESP_QUEUE_IOV ||
+        c->wsize - (wend - c->wbuf) < RESP_QUEUE_WBUF_ROOM)
+        return false;
+
+    c->resp_cmds++;
+    c->resp_bytes += bytes;
+    c->resp_msgused = c->msgused;
+    c->resp_iovused = c->iovused;
+    c->resp_msgbytes = c->msgbytes;
+    c->resp_wbytes = wend - c->wbuf;
+    THR_STATS_INCR(c, responses_coalesced);
+    return true;
+}
+
 extern pthread_mutex_t conn_lock;
 
 /*
@@ -341,6 +474,170 @@ static const char *prot_text(enum protocol prot) {
     return rv;
 }
 
+/*
+ * Connection buffers.
+ *
+ * The buffers a connection needs to read, parse and answer requests (rbuf,
+ * wbuf and the item, suffix, iovec and msghdr lists) are about 13KB. Client
+ * connections only hold them while a request is in flight: they borrow a
+ * set from their thread's pool on reading, and give it back in
+ * conn_waiting once nothing is left unparsed, so idle connections cost
+ * little more than their conn struct. Listening and UDP connections keep
+ * theirs.
+ */
+struct conn_bufs {
+    char *rbuf;
+    char *wbuf;
+    item **ilist;
+    char **suffixlist;
+    struct iovec *iov;
+    struct msghdr *msglist;
+};
+
+static void conn_bufs_free(conn *c) {
+    free(c->rbuf);
+    free(c->wbuf);
+    free(c->ilist);
+    free(c->suffixlist);
+    free(c->iov);
+    free(c->msglist);
+    c->rbuf = c->wbuf = NULL;
+    c->ilist = NULL;
+    c->suffixlist = NULL;
+    c->iov = NULL;
+    c->msglist = NULL;
+}
+
+static bool conn_bufs_alloc(conn *c, const int read_buffer_size) {
+    c->rsize = read_buffer_size;
+    c->wsize = DATA_BUFFER_SIZE;
+    c->isize = ITEM_LIST_INITIAL;
+    c->suffixsize = SUFFIX_LIST_INITIAL;
+    c->iovsize = IOV_LIST_INITIAL;
+    c->msgsize = MSG_LIST_INITIAL;
+
+    c->rbuf = (char *)malloc((size_t)c->rsize);
+    c->wbuf = (char *)malloc((size_t)c->wsize);
+    c->ilist = (item **)malloc(sizeof(item *) * c->isize);
+    c->suffixlist = (char **)malloc(sizeof(char *) * c->suffixsize);
+    c->iov = (struct iovec *)malloc(sizeof(struct iovec) * c->iovsize);
+    c->msglist = (struct msghdr *)malloc(sizeof(struct msghdr) * c->msgsize);
+
+    if (c->rbuf == 0 || c->wbuf == 0 || c->ilist == 0 || c->iov == 0 ||
+            c->msglist == 0 || c->suffixlist == 0) {
+        conn_bufs_free(c);
+        STATS_LOCK();
+        stats.malloc_fails++;
+        STATS_UNLOCK();
+        return false;
+    }
+    return true;
+}
+
+static bool conn_bufs_pooled(const conn *c) {
+    return !IS_UDP(c->transport) && c->state != conn_listening;
+}
+
+static bool conn_bufs_borrow(conn *c) {
+    LIBEVENT_THREAD *me = c->thread;
+
+    if (c->rbuf != NULL)
+        return true;
+    if (me->bufs_pooled > 0) {
+        struct conn_bufs *b = &me->bufs_pool[--me->bufs_pooled];
+        c->rbuf = b->rbuf;
+        c->wbuf = b->wbuf;
+        c->ilist = b->ilist;
+        c->suffixlist = b->suffixlist;
+        c->iov = b->iov;
+        c->msglist = b->msglist;
+        c->rsize = c->wsize = DATA_BUFFER_SIZE;
+        c->isize = ITEM_LIST_INITIAL;
+        c->suffixsize = SUFFIX_LIST_INITIAL;
+        c->iovsize = IOV_LIST_INITIAL;
+        c->msgsize = MSG_LIST_INITIAL;
+        THR_STATS_ADD(c, conn_buffers_pooled, -1);
+    } else if (!conn_bufs_alloc(c, DATA_BUFFER_SIZE)) {
+        return false;
+    }
+    c->rcurr = c->rbuf;
+    c->wcurr = c->wbuf;
+    c->icurr = c->ilist;
+    c->suffixcurr = c->suffixlist;
+    THR_STATS_INCR(c, conn_buffers_borrowed);
+    return true;
+}
+
+/* Brings a buffer that has grown back to its size in the pool. */
+static bool conn_buf_restore(void **buf, int *size, const int initial,
+                             const size_t unit) {
+    void *newbuf;
+
+    if (*size == initial)
+        return true;
+    if ((newbuf = realloc(*buf, unit * initial)) == NULL)
+        return false;
+    *buf = newbuf;
+    *size = initial;
+    return true;
+}
+
+/* Only in between requests, what is left in the buffers is dropped. */
+static void conn_bufs_release(conn *c) {
+    LIBEVENT_THREAD *me = c->thread;
+    struct conn_bufs *b;
+
+    if (c->rbuf == NULL || !conn_bufs_pooled(c) || me == NULL)
+        return;
+    if (me->bufs_pool == NULL)
+        me->bufs_pool = calloc(CONN_BUFS_POOL_MAX, sizeof(struct conn_bufs));
+    if (me->bufs_pool != NULL && me->bufs_pooled < CONN_BUFS_POOL_MAX &&
+        conn_buf_restore((void **)&c->rbuf, &c->rsize, DATA_BUFFER_SIZE, 1) &&
+        conn_buf_restore((void **)&c->wbuf, &c->wsize, DATA_BUFFER_SIZE, 1) &&
+        conn_buf_restore((void **)&c->ilist, &c->isize, ITEM_LIST_INITIAL,
+                         sizeof(item *)) &&
+        conn_buf_restore((void **)&c->suffixlist, &c->suffixsize,
+                         SUFFIX_LIST_INITIAL, sizeof(char *)) &&
+        conn_buf_restore((void **)&c->iov, &c->iovsize, IOV_LIST_INITIAL,
+                         sizeof(struct iovec)) &&
+        conn_buf_restore((void **)&c->msglist, &c->msgsize,
+                         MSG_LIST_INITIAL, sizeof(struct msghdr))) {
+        b = &me->bufs_pool[me->bufs_pooled++];
+        b->rbuf = c->rbuf;
+        b->wbuf = c->wbuf;
+        b->ilist = c->ilist;
+        b->suffixlist = c->suffixlist;
+        b->iov = c->iov;
+        b->msglist = c->msglist;
+        THR_STATS_INCR(c, conn_buffers_pooled);
+        c->rbuf = c->wbuf = NULL;
+        c->ilist = NULL;
+        c->suffixlist = NULL;
+        c->iov = NULL;
+        c->msglist = NULL;
+    } else {
+        conn_bufs_free(c);
+    }
+    THR_STATS_ADD(c, conn_buffers_borrowed, -1);
+    c->rcurr = c->wcurr = NULL;
+    c->icurr = NULL;
+    c->suffixcurr = NULL;
+    c->rbytes = c->wbytes = 0;
+}
+
+/* What the connection has allocated right now, for "stats conns". */
+static size_t conn_bytes(const conn *c) {
+    size_t bytes = sizeof(conn) + c->hdrsize * UDP_HEADER_SIZE;
+
+    if (c->rbuf != NULL) {
+        bytes += c->rsize + c->wsize + sizeof(item *) * c->isize +
+            sizeof(char *) * c->suffixsize +
+            sizeof(struct iovec) * c->iovsize +
+            sizeof(struct msghdr) * c->msgsize;
+    }
+    return bytes;
+}
+
 conn *conn_new(const int sfd, enum conn_states init_state,
                 const int event_flags,
                 const int read_buffer_size, enum network_transport transport,
@@ -366,32 +663,8 @@ conn *conn_new(const int sfd, enum conn_states init_state,
         c->iov = 0;
         c->msglist = 0;
         c->hdrbuf = 0;
-
-        c->rsize = read_buffer_size;
-        c->wsize = DATA_BUFFER_SIZE;
-        c->isize = ITEM_LIST_INITIAL;
-        c->suffixsize = SUFFIX_LIST_INITIAL;
-        c->iovsize = IOV_LIST_INITIAL;
-        c->msgsize = MSG_LIST_INITIAL;
         c->hdrsize = 0;
 
-        c->rbuf = (char *)malloc((size_t)c->rsize);
-        c->wbuf = (char *)malloc((size_t)c->wsize);
-        c->ilist = (item **)malloc(sizeof(item *) * c->isize);
-        c->suffixlist = (char **)malloc(sizeof(char *) * c->suffixsize);
-        c->iov = (struct iovec *)malloc(sizeof(struct iovec) * c->iovsize);
-        c->msglist = (struct msghdr *)malloc(sizeof(struct msghdr) * c->msgsize);
-
-        if (c->rbuf == 0 || c->wbuf == 0 || c->ilist == 0 || c->iov == 0 ||
-                c->msglist == 0 || c->suffixlist == 0) {
-            conn_free(c);
-            STATS_LOCK();
-            stats.malloc_fails++;
-            STATS_UNLOCK();
-            fprintf(stderr, "Failed to allocate buffers for connection\n");
-            return NULL;
-        }
-
         STATS_LOCK();
         stats.conn_structs++;
         STATS_UNLOCK();
@@ -403,6 +676,20 @@ conn *conn_new(const int sfd, enum conn_states init_state,
     c->transport = transport;
     c->protocol = settings.binding_protocol;
 
+    /* The others borrow theirs when they have something to read. */
+    if (c->rbuf == NULL && (init_state == conn_listening || IS_UDP(transport))
+        && !conn_bufs_alloc(c, read_buffer_size)) {
+        conn_free(c);
+        fprintf(stderr, "Failed to allocate buffers for connection\n");
+        return NULL;
+    }
+
+    if (IS_UDP(transport) && c->udp_batch == NULL && !udp_batch_init(c)) {
+        conn_free(c);
+        fprintf(stderr, "Failed to allocate UDP read buffers\n");
+        return NULL;
+    }
+
     /* unix socket mode doesn't need this, so zeroed out.  but why
      * is this done for every command?  presumably for UDP
      * mode.  */
@@ -442,6 +729,7 @@ conn *conn_new(const int sfd, enum conn_states init_state,
 
     c->state = init_state;
     c->rlbytes = 0;
+    c->read_header = false;
     c->cmd = -1;
     c->rbytes = c->wbytes = 0;
     c->wcurr = c->wbuf;
@@ -454,6 +742,9 @@ conn *conn_new(const int sfd, enum conn_states init_state,
     c->iovused = 0;
     c->msgcurr = 0;
     c->msgused = 0;
+    resp_queue_reset(c);
+    zerocopy_conn_init(c);
+    c->uring = false;
     c->authenticated = false;
 
     c->write_and_go = init_state;
@@ -461,6 +752,10 @@ conn *conn_new(const int sfd, enum conn_states init_state,
     c->item = 0;
 
     c->noreply = false;
+    c->mset = false;
+    c->multi = NULL;
+    c->lat_cmd = LAT_NONE;
+    c->capture_id = 0;
 
     event_set(&c->event, sfd, event_flags, event_handler, (void *)c);
     event_base_set(base, &c->event);
@@ -489,10 +784,11 @@ static void conn_release_items(conn *c) {
         c->item = 0;
     }
 
+    /* Items of a get may have come from the thread's hot item cache. */
     while (c->ileft > 0) {
         item *it = *(c->icurr);
         assert((it->it_flags & ITEM_SLABBED) == 0);
-        item_remove(it);
+        hotcache_release(c->thread, it);
         c->icurr++;
         c->ileft--;
     }
@@ -512,6 +808,10 @@ static void conn_cleanup(conn *c) {
 
     conn_release_items(c);
 
+    if (c->multi) {
+        multi_set_free(c);
+    }
+
     if (c->write_and_free) {
         free(c->write_and_free);
         c->write_and_free = 0;
@@ -542,6 +842,7 @@ void conn_free(conn *c) {
             free(c->hdrbuf);
         if (c->msglist)
             free(c->msglist);
+        udp_batch_free(c);
         if (c->rbuf)
             free(c->rbuf);
         if (c->wbuf)
@@ -552,6 +853,8 @@ void conn_free(conn *c) {
             free(c->suffixlist);
         if (c->iov)
             free(c->iov);
+        zerocopy_conn_free(c);
+        uring_conn_free(c);
         free(c);
     }
 }
@@ -560,16 +863,26 @@ static void conn_close(conn *c) {
     assert(c != NULL);
 
     /* delete the event, the socket and the conn */
-    event_del(&c->event);
+    if (c->uring) {
+        /* Once the ring is done with it, see uring.c. */
+        if (!uring_conn_close(c))
+            return;
+    } else {
+        event_del(&c->event);
+    }
 
     if (settings.verbose > 1)
         fprintf(stderr, "<%d connection closed.\n", c->sfd);
 
+    /* Items the kernel may still send from stay held, see zerocopy.c. */
+    zerocopy_hold(c);
     conn_cleanup(c);
+    conn_bufs_release(c);
 
     MEMCACHED_CONN_RELEASE(c->sfd);
     conn_set_state(c, conn_closed);
-    close(c->sfd);
+    if (!zerocopy_conn_close(c))
+        close(c->sfd);
 
     pthread_mutex_lock(&conn_lock);
     allow_new_conns = true;
@@ -677,6 +990,12 @@ static void conn_set_state(conn *c, enum conn_states state) {
         if (state == conn_write || state == conn_mwrite) {
             MEMCACHED_PROCESS_COMMAND_END(c->sfd, c->wbuf, c->wbytes);
         }
+        /* The response is queued (or dropped for noreply). */
+        if (c->lat_cmd != LAT_NONE && (state == conn_write ||
+                state == conn_mwrite || state == conn_new_cmd)) {
+            latency_record(c->thread, c->lat_cmd, c->cmd_start);
+            c->lat_cmd = LAT_NONE;
+        }
         c->state = state;
     }
 }
@@ -826,6 +1145,8 @@ static void out_string(conn *c, const char *str) {
         if (settings.verbose > 1)
             fprintf(stderr, ">%d NOREPLY %s\n", c->sfd, str);
         c->noreply = false;
+        if (c->resp_cmds > 0)
+            conn_start_response(c);
         conn_set_state(c, conn_new_cmd);
         return;
     }
@@ -833,23 +1154,20 @@ static void out_string(conn *c, const char *str) {
     if (settings.verbose > 1)
         fprintf(stderr, ">%d %s\n", c->sfd, str);
 
-    /* Nuke a partial output... */
-    c->msgcurr = 0;
-    c->msgused = 0;
-    c->iovused = 0;
-    add_msghdr(c);
+    /* Nuke a partial output, but not the queued responses... */
+    conn_start_response(c);
 
     len = strlen(str);
-    if ((len + 2) > c->wsize) {
+    if ((len + 2) > c->wsize - c->resp_wbytes) {
         /* ought to be always enough. just fail for simplicity */
         str = "SERVER_ERROR output line too long";
         len = strlen(str);
     }
 
-    memcpy(c->wbuf, str, len);
-    memcpy(c->wbuf + len, "\r\n", 2);
+    c->wcurr = c->wbuf + c->resp_wbytes;
+    memcpy(c->wcurr, str, len);
+    memcpy(c->wcurr + len, "\r\n", 2);
     c->wbytes = len + 2;
-    c->wcurr = c->wbuf;
 
     conn_set_state(c, conn_write);
     c->write_and_go = conn_new_cmd;
@@ -886,9 +1204,7 @@ static void complete_nread_ascii(conn *c) {
     int comm = c->cmd;
     enum store_item_type ret;
 
-    pthread_mutex_lock(&c->thread->stats.mutex);
-    c->thread->stats.slab_stats[it->slabs_clsid].set_cmds++;
-    pthread_mutex_unlock(&c->thread->stats.mutex);
+    THR_STATS_INCR(c, slab_stats[it->slabs_clsid].set_cmds);
 
     if (strncmp(ITEM_data(it) + it->nbytes - 2, "\r\n", 2) != 0) {
         out_string(c, "CLIENT_ERROR bad data chunk");
@@ -925,27 +1241,32 @@ static void complete_nread_ascii(conn *c) {
       }
 #endif
 
-      switch (ret) {
-      case STORED:
-          out_string(c, "STORED");
-          break;
-      case EXISTS:
-          out_string(c, "EXISTS");
-          break;
-      case NOT_FOUND:
-          out_string(c, "NOT_FOUND");
-          break;
-      case NOT_STORED:
-          out_string(c, "NOT_STORED");
-          break;
-      default:
-          out_string(c, "SERVER_ERROR Unhandled storage type.");
+      if (c->mset) {
+          complete_mset(c, ret);
+      } else {
+          switch (ret) {
+          case STORED:
+              out_string(c, "STORED");
+              break;
+          case EXISTS:
+              out_string(c, "EXISTS");
+              break;
+          case NOT_FOUND:
+              out_string(c, "NOT_FOUND");
+              break;
+          case NOT_STORED:
+              out_string(c, "NOT_STORED");
+              break;
+          default:
+              out_string(c, "SERVER_ERROR Unhandled storage type.");
+          }
       }
 
     }
 
     item_remove(c->item);       /* release the c->item reference */
     c->item = 0;
+    c->mset = false;
 }
 
 /**
@@ -1050,6 +1371,9 @@ static void write_bin_error(conn *c, protocol_binary_response_status err,
         case PROTOCOL_BINARY_RESPONSE_AUTH_ERROR:
             errstr = "Auth failure.";
             break;
+        case PROTOCOL_BINARY_RESPONSE_HOT_MISS:
+            errstr = "Not found, lease held elsewhere.";
+            break;
         default:
             assert(false);
             errstr = "UNHANDLED ERROR";
@@ -1172,13 +1496,11 @@ static void complete_incr_bin(conn *c) {
                         "SERVER_ERROR Out of memory allocating new item");
             }
         } else {
-            pthread_mutex_lock(&c->thread->stats.mutex);
             if (c->cmd == PROTOCOL_BINARY_CMD_INCREMENT) {
-                c->thread->stats.incr_misses++;
+                THR_STATS_INCR(c, incr_misses);
             } else {
-                c->thread->stats.decr_misses++;
+                THR_STATS_INCR(c, decr_misses);
             }
-            pthread_mutex_unlock(&c->thread->stats.mutex);
 
             write_bin_error(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, NULL, 0);
         }
@@ -1196,9 +1518,7 @@ static void complete_update_bin(conn *c) {
 
     item *it = c->item;
 
-    pthread_mutex_lock(&c->thread->stats.mutex);
-    c->thread->stats.slab_stats[it->slabs_clsid].set_cmds++;
-    pthread_mutex_unlock(&c->thread->stats.mutex);
+    THR_STATS_INCR(c, slab_stats[it->slabs_clsid].set_cmds);
 
     /* We don't actually receive the trailing two characters in the bin
      * protocol, so we're going to just set them here */
@@ -1259,6 +1579,64 @@ static void complete_update_bin(conn *c) {
     c->item = 0;
 }
 
+/* Binary lget. A hit answers like get. A lease comes as KEY_ENOENT with the
+ * token in the CAS field, and a hot miss as HOT_MISS, with the flags and the
+ * stale value if there is one. */
+static void process_bin_lease_get(conn *c) {
+    protocol_binary_response_get* rsp = (protocol_binary_response_get*)c->wbuf;
+    protocol_binary_response_incr* lease = (protocol_binary_response_incr*)c->wbuf;
+    char* key = binary_get_key(c);
+    size_t nkey = c->binary_header.request.keylen;
+    enum lease_result res;
+    item *it;
+
+    it = item_lease_get(key, nkey, &res);
+    THR_STATS_INCR(c, get_cmds);
+    switch (res) {
+    case LEASE_HIT:
+    case LEASE_STALE:
+        if (res == LEASE_HIT) {
+            THR_STATS_INCR(c, slab_stats[it->slabs_clsid].get_hits);
+            item_update(it);
+            c->cas = ITEM_get_cas(it);
+        } else {
+            /* The placeholder's CAS is the token, which isn't ours. A zero
+             * CAS marks the value as stale. */
+            THR_STATS_INCR(c, get_misses);
+            THR_STATS_INCR(c, leases_stale);
+        }
+        add_bin_header(c, 0, sizeof(rsp->message.body), 0,
+                       sizeof(rsp->message.body) + it->nbytes - 2);
+        rsp->message.body.flags = htonl(strtoul(ITEM_suffix(it), NULL, 10));
+        add_iov(c, &rsp->message.body, sizeof(rsp->message.body));
+        add_iov(c, ITEM_data(it), it->nbytes - 2);
+        conn_set_state(c, conn_mwrite);
+        c->write_and_go = conn_new_cmd;
+        c->item = it;
+        break;
+    case LEASE_GRANTED:
+        /* Error responses carry no CAS, so the token goes in the body. */
+        THR_STATS_INCR(c, get_misses);
+        THR_STATS_INCR(c, leases_issued);
+        lease->message.body.value = htonll(ITEM_get_cas(it));
+        item_remove(it);
+        add_bin_header(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0, 0,
+                       sizeof(lease->message.body.value));
+        add_iov(c, &lease->message.body, sizeof(lease->message.body.value));
+        conn_set_state(c, conn_mwrite);
+        c->write_and_go = conn_new_cmd;
+        break;
+    case LEASE_HOT_MISS:
+        THR_STATS_INCR(c, get_misses);
+        THR_STATS_INCR(c, leases_hot_misses);
+        write_bin_error(c, PROTOCOL_BINARY_RESPONSE_HOT_MISS, NULL, 0);
+        break;
+    case LEASE_NOMEM:
+        write_bin_error(c, PROTOCOL_BINARY_RESPONSE_ENOMEM, NULL, 0);
+        break;
+    }
+}
+
 static void process_bin_get_or_touch(conn *c) {
     item *it;
 
@@ -1293,15 +1671,13 @@ static void process_bin_get_or_touch(conn *c) {
         uint32_t bodylen = sizeof(rsp->message.body) + (it->nbytes - 2);
 
         item_update(it);
-        pthread_mutex_lock(&c->thread->stats.mutex);
         if (should_touch) {
-            c->thread->stats.touch_cmds++;
-            c->thread->stats.slab_stats[it->slabs_clsid].touch_hits++;
+            THR_STATS_INCR(c, touch_cmds);
+            THR_STATS_INCR(c, slab_stats[it->slabs_clsid].touch_hits);
         } else {
-            c->thread->stats.get_cmds++;
-            c->thread->stats.slab_stats[it->slabs_clsid].get_hits++;
+            THR_STATS_INCR(c, get_cmds);
+            THR_STATS_INCR(c, slab_stats[it->slabs_clsid].get_hits);
         }
-        pthread_mutex_unlock(&c->thread->stats.mutex);
 
         if (should_touch) {
             MEMCACHED_COMMAND_TOUCH(c->sfd, ITEM_key(it), it->nkey,
@@ -1339,19 +1715,18 @@ static void process_bin_get_or_touch(conn *c) {
         /* Remember this command so we can garbage collect it later */
         c->item = it;
     } else {
-        pthread_mutex_lock(&c->thread->stats.mutex);
         if (should_touch) {
-            c->thread->stats.touch_cmds++;
-            c->thread->stats.touch_misses++;
+            THR_STATS_INCR(c, touch_cmds);
+            THR_STATS_INCR(c, touch_misses);
         } else {
-            c->thread->stats.get_cmds++;
-            c->thread->stats.get_misses++;
+            THR_STATS_INCR(c, get_cmds);
+            THR_STATS_INCR(c, get_misses);
         }
-        pthread_mutex_unlock(&c->thread->stats.mutex);
 
         if (should_touch) {
             MEMCACHED_COMMAND_TOUCH(c->sfd, key, nkey, -1, 0);
         } else {
+            item_ghost_miss(key, nkey);
             MEMCACHED_COMMAND_GET(c->sfd, key, nkey, -1, 0);
         }
 
@@ -1759,9 +2134,7 @@ static void process_bin_complete_sasl_auth(conn *c) {
     case SASL_OK:
         c->authenticated = true;
         write_bin_response(c, "Authenticated", 0, 0, strlen("Authenticated"));
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.auth_cmds++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_INCR(c, auth_cmds);
         break;
     case SASL_CONTINUE:
         add_bin_header(c, PROTOCOL_BINARY_RESPONSE_AUTH_CONTINUE, 0, 0, outlen);
@@ -1775,10 +2148,8 @@ static void process_bin_complete_sasl_auth(conn *c) {
         if (settings.verbose)
             fprintf(stderr, "Unknown sasl response:  %d\n", result);
         write_bin_error(c, PROTOCOL_BINARY_RESPONSE_AUTH_ERROR, NULL, 0);
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.auth_cmds++;
-        c->thread->stats.auth_errors++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_INCR(c, auth_cmds);
+        THR_STATS_INCR(c, auth_errors);
     }
 }
 
@@ -1820,9 +2191,25 @@ static void dispatch_bin_command(conn *c) {
 
     MEMCACHED_PROCESS_COMMAND_START(c->sfd, c->rcurr, c->rbytes);
     c->noreply = true;
-
-    /* binprot supports 16bit keys, but internals are still 8bit */
-    if (keylen > KEY_MAX_LENGTH) {
+    c->lat_cmd = LAT_NONE;
+    c->cmd_start = latency_now();
+
+    /* Commands such as NOOP or QUIT are answered right here, so they are
+     * logged now, header only; the rest once their key has been read. */
+    if (unlikely(settings.capture_file != NULL) && extlen + keylen == 0 &&
+        c->cmd != PROTOCOL_BINARY_CMD_SASL_LIST_MECHS) {
+        capture_binary(c, c->rcurr);
+    }
+
+    /* binprot supports 16bit keys, but internals are still 8bit. The
+     * multi-key commands carry a table of keys in the key field. */
+    if (c->cmd == PROTOCOL_BINARY_CMD_SET_MULTI ||
+        c->cmd == PROTOCOL_BINARY_CMD_DELETE_MULTI) {
+        if (keylen > MULTI_KEYS_MAX * (KEY_MAX_LENGTH + 5)) {
+            handle_binary_protocol_error(c);
+            return;
+        }
+    } else if (keylen > KEY_MAX_LENGTH) {
         handle_binary_protocol_error(c);
         return;
     }
@@ -1874,6 +2261,13 @@ static void dispatch_bin_command(conn *c) {
         c->noreply = false;
     }
 
+    if ((c->cmd == PROTOCOL_BINARY_CMD_LGET ||
+         c->cmd == PROTOCOL_BINARY_CMD_LSET) && !settings.leases) {
+        write_bin_error(c, PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND, NULL,
+                        bodylen);
+        return;
+    }
+
     switch (c->cmd) {
         case PROTOCOL_BINARY_CMD_VERSION:
             if (extlen == 0 && keylen == 0 && bodylen == 0) {
@@ -1898,8 +2292,10 @@ static void dispatch_bin_command(conn *c) {
             break;
         case PROTOCOL_BINARY_CMD_SET: /* FALLTHROUGH */
         case PROTOCOL_BINARY_CMD_ADD: /* FALLTHROUGH */
-        case PROTOCOL_BINARY_CMD_REPLACE:
+        case PROTOCOL_BINARY_CMD_REPLACE: /* FALLTHROUGH */
+        case PROTOCOL_BINARY_CMD_LSET:
             if (extlen == 8 && keylen != 0 && bodylen >= (keylen + 8)) {
+                c->lat_cmd = LAT_SET;
                 bin_read_key(c, bin_reading_set_header, 8);
             } else {
                 protocol_error = 1;
@@ -1908,8 +2304,10 @@ static void dispatch_bin_command(conn *c) {
         case PROTOCOL_BINARY_CMD_GETQ:  /* FALLTHROUGH */
         case PROTOCOL_BINARY_CMD_GET:   /* FALLTHROUGH */
         case PROTOCOL_BINARY_CMD_GETKQ: /* FALLTHROUGH */
-        case PROTOCOL_BINARY_CMD_GETK:
+        case PROTOCOL_BINARY_CMD_GETK:  /* FALLTHROUGH */
+        case PROTOCOL_BINARY_CMD_LGET:
             if (extlen == 0 && bodylen == keylen && keylen > 0) {
+                c->lat_cmd = LAT_GET;
                 bin_read_key(c, bin_reading_get_key, 0);
             } else {
                 protocol_error = 1;
@@ -1917,14 +2315,30 @@ static void dispatch_bin_command(conn *c) {
             break;
         case PROTOCOL_BINARY_CMD_DELETE:
             if (keylen > 0 && extlen == 0 && bodylen == keylen) {
+                c->lat_cmd = LAT_DELETE;
                 bin_read_key(c, bin_reading_del_header, extlen);
             } else {
                 protocol_error = 1;
             }
             break;
+        case PROTOCOL_BINARY_CMD_SET_MULTI:
+            if (extlen == 8 && keylen != 0 && bodylen >= (keylen + 8)) {
+                bin_read_key(c, bin_reading_multi_set_header, 8);
+            } else {
+                protocol_error = 1;
+            }
+            break;
+        case PROTOCOL_BINARY_CMD_DELETE_MULTI:
+            if (keylen > 0 && extlen == 0 && bodylen == keylen) {
+                bin_read_key(c, bin_reading_multi_del_keys, 0);
+            } else {
+                protocol_error = 1;
+            }
+            break;
         case PROTOCOL_BINARY_CMD_INCREMENT:
         case PROTOCOL_BINARY_CMD_DECREMENT:
             if (keylen > 0 && extlen == 20 && bodylen == (keylen + extlen)) {
+                c->lat_cmd = LAT_INCR;
                 bin_read_key(c, bin_reading_incr_header, 20);
             } else {
                 protocol_error = 1;
@@ -1933,6 +2347,7 @@ static void dispatch_bin_command(conn *c) {
         case PROTOCOL_BINARY_CMD_APPEND:
         case PROTOCOL_BINARY_CMD_PREPEND:
             if (keylen > 0 && extlen == 0) {
+                c->lat_cmd = LAT_SET;
                 bin_read_key(c, bin_reading_set_header, 0);
             } else {
                 protocol_error = 1;
@@ -1977,6 +2392,7 @@ static void dispatch_bin_command(conn *c) {
         case PROTOCOL_BINARY_CMD_GATK:
         case PROTOCOL_BINARY_CMD_GATKQ:
             if (extlen == 4 && keylen != 0) {
+                c->lat_cmd = LAT_TOUCH;
                 bin_read_key(c, bin_reading_touch_key, 4);
             } else {
                 protocol_error = 1;
@@ -2067,11 +2483,14 @@ static void process_bin_update(conn *c) {
         case PROTOCOL_BINARY_CMD_REPLACE:
             c->cmd = NREAD_REPLACE;
             break;
+        case PROTOCOL_BINARY_CMD_LSET:
+            c->cmd = NREAD_LSET;
+            break;
         default:
             assert(0);
     }
 
-    if (ITEM_get_cas(it) != 0) {
+    if (ITEM_get_cas(it) != 0 && c->cmd != NREAD_LSET) {
         c->cmd = NREAD_CAS;
     }
 
@@ -2156,13 +2575,24 @@ static void process_bin_flush(conn *c) {
     }
     item_flush_expired();
 
-    pthread_mutex_lock(&c->thread->stats.mutex);
-    c->thread->stats.flush_cmds++;
-    pthread_mutex_unlock(&c->thread->stats.mutex);
+    THR_STATS_INCR(c, flush_cmds);
 
     write_bin_response(c, NULL, 0, 0, 0);
 }
 
+/* Returns the item a delete applies to. A lease placeholder is unlinked
+ * instead, so that a value read before the delete can't be stored with its
+ * token. */
+static item *delete_lookup(const char *key, const size_t nkey) {
+    item *it = item_get_any(key, nkey);
+    if (it != NULL && (it->it_flags & ITEM_LEASE)) {
+        item_unlink(it);
+        item_remove(it);
+        it = NULL;
+    }
+    return it;
+}
+
 static void process_bin_delete(conn *c) {
     item *it;
 
@@ -2186,14 +2616,12 @@ static void process_bin_delete(conn *c) {
         stats_prefix_record_delete(key, nkey);
     }
 
-    it = item_get(key, nkey);
+    it = delete_lookup(key, nkey);
     if (it) {
         uint64_t cas = ntohll(req->message.header.request.cas);
         if (cas == 0 || cas == ITEM_get_cas(it)) {
             MEMCACHED_COMMAND_DELETE(c->sfd, ITEM_key(it), it->nkey);
-            pthread_mutex_lock(&c->thread->stats.mutex);
-            c->thread->stats.slab_stats[it->slabs_clsid].delete_hits++;
-            pthread_mutex_unlock(&c->thread->stats.mutex);
+            THR_STATS_INCR(c, slab_stats[it->slabs_clsid].delete_hits);
             item_unlink(it);
             write_bin_response(c, NULL, 0, 0, 0);
         } else {
@@ -2202,101 +2630,431 @@ static void process_bin_delete(conn *c) {
         item_remove(it);      /* release our reference */
     } else {
         write_bin_error(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, NULL, 0);
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.delete_misses++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_INCR(c, delete_misses);
     }
 }
 
-static void complete_nread_binary(conn *c) {
-    assert(c != NULL);
-    assert(c->cmd >= 0);
+/*
+ * Multi-key set and delete. set_multi allocates the items of all of its keys
+ * when the command is parsed, reads their values in one after the other,
+ * then stores them all at once with store_item_multi(), which takes each item
+ * lock stripe once. delete_multi deletes its keys the same way. Either
+ * answers once for all of its keys, with a bitmap of the keys that failed.
+ */
 
-    switch(c->substate) {
-    case bin_reading_set_header:
-        if (c->cmd == PROTOCOL_BINARY_CMD_APPEND ||
-                c->cmd == PROTOCOL_BINARY_CMD_PREPEND) {
-            process_bin_append_prepend(c);
-        } else {
-            process_bin_update(c);
+static void multi_set_free(conn *c) {
+    struct multi_set *m = c->multi;
+    int i;
+
+    for (i = 0; i < m->count; i++) {
+        if (m->items[i] != NULL) {
+            item_remove(m->items[i]);
         }
-        break;
-    case bin_read_set_value:
-        complete_update_bin(c);
-        break;
-    case bin_reading_get_key:
-    case bin_reading_touch_key:
-        process_bin_get_or_touch(c);
-        break;
-    case bin_reading_stat:
-        process_bin_stat(c);
-        break;
-    case bin_reading_del_header:
-        process_bin_delete(c);
-        break;
-    case bin_reading_incr_header:
-        complete_incr_bin(c);
-        break;
-    case bin_read_flush_exptime:
-        process_bin_flush(c);
-        break;
-    case bin_reading_sasl_auth:
-        process_bin_sasl_auth(c);
-        break;
-    case bin_reading_sasl_auth_data:
-        process_bin_complete_sasl_auth(c);
-        break;
-    default:
-        fprintf(stderr, "Not handling substate %d\n", c->substate);
-        assert(0);
     }
+    free(m);
+    c->multi = NULL;
 }
 
-static void reset_cmd_handler(conn *c) {
-    c->cmd = -1;
-    c->substate = bin_no_state;
-    if(c->item != NULL) {
-        item_remove(c->item);
-        c->item = NULL;
-    }
-    conn_shrink(c);
-    if (c->rbytes > 0) {
-        conn_set_state(c, conn_parse_cmd);
+/*
+ * Answers a multi-key command: ok when no key failed, otherwise fail with
+ * the bitmap, where bit i % 8 of byte i / 8 is set if the i-th key failed.
+ * The text protocol writes the bitmap in hex after the fail string, the
+ * binary protocol returns it as the body of a response with status fail_bin.
+ */
+static void write_multi_result(conn *c, const uint8_t *failed, const int n,
+                               const bool any_failed, const char *ok,
+                               const char *fail,
+                               protocol_binary_response_status fail_bin) {
+    int nbytes = (n + 7) / 8;
+    int i;
+
+    if (c->protocol == binary_prot) {
+        if (!any_failed) {
+            write_bin_response(c, NULL, 0, 0, 0);
+            return;
+        }
+        char *bitmap = c->wbuf + sizeof(protocol_binary_response_header);
+        memcpy(bitmap, failed, nbytes);
+        add_bin_header(c, fail_bin, 0, 0, nbytes);
+        add_iov(c, bitmap, nbytes);
+        conn_set_state(c, conn_mwrite);
+        c->write_and_go = conn_new_cmd;
+    } else if (!any_failed) {
+        out_string(c, ok);
     } else {
-        conn_set_state(c, conn_waiting);
+        char line[16 + MULTI_KEYS_MAX / 4];
+        int len = snprintf(line, sizeof(line), "%s ", fail);
+        for (i = 0; i < nbytes; i++) {
+            len += snprintf(line + len, sizeof(line) - len, "%02x", failed[i]);
+        }
+        out_string(c, line);
     }
 }
 
-static void complete_nread(conn *c) {
-    assert(c != NULL);
-    assert(c->protocol == ascii_prot
-           || c->protocol == binary_prot);
+static void complete_set_multi(conn *c) {
+    struct multi_set *m = c->multi;
+    enum store_item_type ret[MULTI_KEYS_MAX];
+    bool any_failed = false;
+    int i;
 
-    if (c->protocol == ascii_prot) {
-        complete_nread_ascii(c);
-    } else if (c->protocol == binary_prot) {
-        complete_nread_binary(c);
+    store_item_multi(m->items, ret, m->count, NREAD_SET, c);
+
+    for (i = 0; i < m->count; i++) {
+        if (m->items[i] != NULL) {
+            THR_STATS_INCR(c, slab_stats[m->items[i]->slabs_clsid].set_cmds);
+        }
+        if (ret[i] != STORED) {
+            m->failed[i / 8] |= 1 << (i % 8);
+            any_failed = true;
+        }
     }
+
+    write_multi_result(c, m->failed, m->count, any_failed, "STORED",
+                       "NOT_STORED", PROTOCOL_BINARY_RESPONSE_NOT_STORED);
+    multi_set_free(c);
 }
 
 /*
- * Stores an item in the cache according to the semantics of one of the set
- * commands. In threaded mode, this is protected by the cache lock.
- *
- * Returns the state of storage.
+ * Sets up the read of the next value of a set_multi into its item, or its
+ * swallowing if the item couldn't be allocated. Stores them all after the
+ * last one.
  */
-enum store_item_type do_store_item(item *it, int comm, conn *c, const uint32_t hv) {
-    char *key = ITEM_key(it);
-    item *old_it = do_item_get(key, it->nkey, hv);
-    enum store_item_type stored = NOT_STORED;
+static void multi_read_next(conn *c) {
+    struct multi_set *m = c->multi;
+    int i;
 
-    item *new_it = NULL;
-    int flags;
+    if (m->next == m->count) {
+        complete_set_multi(c);
+        return;
+    }
 
-    if (old_it != NULL && comm == NREAD_ADD) {
-        /* add only adds a nonexistent item, but promote to head of LRU */
-        do_item_update(old_it);
-    } else if (!old_it && (comm == NREAD_REPLACE
+    i = m->next++;
+    if (m->items[i] == NULL) {
+        c->sbytes = m->vlen[i];
+        conn_set_state(c, conn_swallow);
+    } else {
+        c->ritem = ITEM_data(m->items[i]);
+        c->rlbytes = m->vlen[i];
+        conn_set_state(c, conn_nread);
+    }
+}
+
+static void complete_nread_multi(conn *c) {
+    struct multi_set *m = c->multi;
+    item *it = m->items[m->next - 1];
+
+    if (c->protocol == binary_prot) {
+        /* As in complete_update_bin(), the "\r\n" isn't sent. */
+        memcpy(ITEM_data(it) + it->nbytes - 2, "\r\n", 2);
+    } else if (strncmp(ITEM_data(it) + it->nbytes - 2, "\r\n", 2) != 0) {
+        multi_set_free(c);
+        out_string(c, "CLIENT_ERROR bad data chunk");
+        return;
+    }
+    multi_read_next(c);
+}
+
+/*
+ * Starts a set_multi of count keys with the given value lengths. extra is
+ * the number of bytes that follow each value on the wire: 2 for the "\r\n"
+ * of the text protocol, 0 for binary.
+ */
+static void start_set_multi(conn *c, const char **keys, const size_t *nkeys,
+                            const int *vlens, const int count,
+                            const unsigned int flags, const rel_time_t exptime,
+                            const int extra) {
+    struct multi_set *m;
+    int i;
+
+    assert(count > 0 && count <= MULTI_KEYS_MAX);
+    c->lat_cmd = LAT_SET;
+
+    m = malloc(sizeof(*m));
+    if (m == NULL) {
+        STATS_LOCK();
+        stats.malloc_fails++;
+        STATS_UNLOCK();
+        /* The values that follow can't be told apart from commands. */
+        out_of_memory(c, "SERVER_ERROR out of memory storing object");
+        c->write_and_go = conn_closing;
+        return;
+    }
+    m->count = count;
+    m->next = 0;
+    memset(m->failed, 0, sizeof(m->failed));
+
+    for (i = 0; i < count; i++) {
+        item *it;
+
+        hotkey_sample(c, LAT_SET, keys[i], nkeys[i]);
+        if (settings.detail_enabled) {
+            stats_prefix_record_set(keys[i], nkeys[i]);
+        }
+
+        m->vlen[i] = vlens[i] + extra;
+        it = item_alloc((char *)keys[i], nkeys[i], flags, exptime,
+                        vlens[i] + 2);
+        m->items[i] = it;
+        if (it != NULL) {
+            ITEM_set_cas(it, 0);
+            continue;
+        }
+
+        /* As for set, a failed allocation leaves no stale value behind. */
+        it = item_get(keys[i], nkeys[i]);
+        if (it) {
+            item_unlink(it);
+            item_remove(it);
+        }
+    }
+
+    c->multi = m;
+    multi_read_next(c);
+}
+
+static void delete_multi(conn *c, const char **keys, const size_t *nkeys,
+                         const int count) {
+    unsigned int clsid[MULTI_KEYS_MAX];
+    uint8_t failed[MULTI_KEYS_MAX / 8];
+    bool any_failed = false;
+    int i;
+
+    assert(count > 0 && count <= MULTI_KEYS_MAX);
+    c->lat_cmd = LAT_DELETE;
+
+    for (i = 0; i < count; i++) {
+        hotkey_sample(c, LAT_DELETE, keys[i], nkeys[i]);
+        if (settings.detail_enabled) {
+            stats_prefix_record_delete(keys[i], nkeys[i]);
+        }
+    }
+
+    item_delete_multi(keys, nkeys, clsid, count);
+
+    memset(failed, 0, sizeof(failed));
+    for (i = 0; i < count; i++) {
+        if (clsid[i] != 0) {
+            MEMCACHED_COMMAND_DELETE(c->sfd, keys[i], nkeys[i]);
+            THR_STATS_INCR(c, slab_stats[clsid[i]].delete_hits);
+        } else {
+            THR_STATS_INCR(c, delete_misses);
+            failed[i / 8] |= 1 << (i % 8);
+            any_failed = true;
+        }
+    }
+
+    write_multi_result(c, failed, count, any_failed, "DELETED", "NOT_FOUND",
+                       PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+}
+
+/*
+ * Binary set_multi. The extras are the flags and expiration shared by all
+ * keys, the key field a table of (key length: 1 byte, value length: 4 bytes,
+ * key) entries, and the value the values of the keys one after the other.
+ */
+static void process_bin_set_multi(conn *c) {
+    protocol_binary_request_set* req = binary_get_request(c);
+    const char *keys[MULTI_KEYS_MAX];
+    size_t nkeys[MULTI_KEYS_MAX];
+    int vlens[MULTI_KEYS_MAX];
+    const char *p = binary_get_key(c);
+    const char *end = p + c->binary_header.request.keylen;
+    uint32_t vtotal = c->binary_header.request.bodylen -
+        (c->binary_header.request.keylen + c->binary_header.request.extlen);
+    uint64_t sum = 0;
+    uint32_t vlen;
+    int count = 0;
+
+    while (p < end && count < MULTI_KEYS_MAX && end - p > 5) {
+        nkeys[count] = (uint8_t)p[0];
+        memcpy(&vlen, p + 1, 4);
+        vlen = ntohl(vlen);
+        if (nkeys[count] == 0 || nkeys[count] > KEY_MAX_LENGTH ||
+            nkeys[count] > end - p - 5 ||
+            vlen > INT_MAX - 2) {
+            break;
+        }
+        keys[count] = p + 5;
+        vlens[count] = vlen;
+        sum += vlen;
+        p += 5 + nkeys[count++];
+    }
+
+    if (p != end || sum != vtotal) {
+        write_bin_error(c, PROTOCOL_BINARY_RESPONSE_EINVAL, NULL, vtotal);
+        return;
+    }
+
+    start_set_multi(c, keys, nkeys, vlens, count,
+                    ntohl(req->message.body.flags),
+                    realtime(ntohl(req->message.body.expiration)), 0);
+}
+
+/*
+ * Binary delete_multi. The key field is a table of (key length: 1 byte,
+ * key) entries.
+ */
+static void process_bin_delete_multi(conn *c) {
+    const char *keys[MULTI_KEYS_MAX];
+    size_t nkeys[MULTI_KEYS_MAX];
+    const char *p = binary_get_key(c);
+    const char *end = p + c->binary_header.request.keylen;
+    int count = 0;
+
+    while (p < end && count < MULTI_KEYS_MAX && end - p > 1) {
+        nkeys[count] = (uint8_t)p[0];
+        if (nkeys[count] == 0 || nkeys[count] > KEY_MAX_LENGTH ||
+            nkeys[count] > end - p - 1) {
+            break;
+        }
+        keys[count] = p + 1;
+        p += 1 + nkeys[count++];
+    }
+
+    if (p != end) {
+        write_bin_error(c, PROTOCOL_BINARY_RESPONSE_EINVAL, NULL, 0);
+        return;
+    }
+
+    delete_multi(c, keys, nkeys, count);
+}
+
+static void complete_nread_binary(conn *c) {
+    assert(c != NULL);
+    assert(c->cmd >= 0);
+
+    /* The whole request but the value is in the buffer now. Never log
+     * SASL exchanges. Requests of just a header were logged on dispatch. */
+    if (unlikely(settings.capture_file != NULL) &&
+        c->binary_header.request.extlen + c->binary_header.request.keylen != 0 &&
+        c->substate != bin_read_set_value &&
+        c->substate != bin_reading_sasl_auth &&
+        c->substate != bin_reading_sasl_auth_data) {
+        capture_binary(c, binary_get_request(c));
+    }
+
+    if (c->lat_cmd != LAT_NONE && c->substate != bin_read_set_value) {
+        hotkey_sample(c, c->lat_cmd, binary_get_key(c),
+                      c->binary_header.request.keylen);
+    }
+
+    switch(c->substate) {
+    case bin_reading_set_header:
+        if (c->cmd == PROTOCOL_BINARY_CMD_APPEND ||
+                c->cmd == PROTOCOL_BINARY_CMD_PREPEND) {
+            process_bin_append_prepend(c);
+        } else {
+            process_bin_update(c);
+        }
+        break;
+    case bin_read_set_value:
+        complete_update_bin(c);
+        break;
+    case bin_reading_get_key:
+    case bin_reading_touch_key:
+        if (c->cmd == PROTOCOL_BINARY_CMD_LGET) {
+            process_bin_lease_get(c);
+        } else {
+            process_bin_get_or_touch(c);
+        }
+        break;
+    case bin_reading_stat:
+        process_bin_stat(c);
+        break;
+    case bin_reading_del_header:
+        process_bin_delete(c);
+        break;
+    case bin_reading_multi_set_header:
+        process_bin_set_multi(c);
+        break;
+    case bin_reading_multi_del_keys:
+        process_bin_delete_multi(c);
+        break;
+    case bin_reading_incr_header:
+        complete_incr_bin(c);
+        break;
+    case bin_read_flush_exptime:
+        process_bin_flush(c);
+        break;
+    case bin_reading_sasl_auth:
+        process_bin_sasl_auth(c);
+        break;
+    case bin_reading_sasl_auth_data:
+        process_bin_complete_sasl_auth(c);
+        break;
+    default:
+        fprintf(stderr, "Not handling substate %d\n", c->substate);
+        assert(0);
+    }
+}
+
+static void reset_cmd_handler(conn *c) {
+    c->cmd = -1;
+    c->substate = bin_no_state;
+    if(c->item != NULL) {
+        item_remove(c->item);
+        c->item = NULL;
+    }
+    if (c->resp_cmds == 0)
+        conn_shrink(c);
+    if (c->rbytes > 0) {
+        conn_set_state(c, conn_parse_cmd);
+    } else if (c->resp_cmds > 0) {
+        conn_set_state(c, conn_mwrite);
+    } else {
+        conn_set_state(c, conn_waiting);
+    }
+}
+
+static void complete_nread(conn *c) {
+    assert(c != NULL);
+    assert(c->protocol == ascii_prot
+           || c->protocol == binary_prot);
+
+    if (c->multi != NULL) {
+        complete_nread_multi(c);
+    } else if (c->protocol == ascii_prot) {
+        complete_nread_ascii(c);
+    } else if (c->protocol == binary_prot) {
+        complete_nread_binary(c);
+    }
+}
+
+/*
+ * Stores an item in the cache according to the semantics of one of the set
+ * commands. In threaded mode, this is protected by the cache lock.
+ *
+ * Returns the state of storage.
+ */
+enum store_item_type do_store_item(item *it, int comm, conn *c, const uint32_t hv) {
+    char *key = ITEM_key(it);
+    item *old_it = do_item_get_any(key, it->nkey, hv);
+    item *lease = NULL;
+    enum store_item_type stored = NOT_STORED;
+
+    item *new_it = NULL;
+    int flags;
+
+    /* A lease placeholder counts as a missing item, but is replaced by
+     * whatever gets stored. */
+    if (old_it != NULL && (old_it->it_flags & ITEM_LEASE)) {
+        lease = old_it;
+        old_it = NULL;
+    }
+
+    if (comm == NREAD_LSET) {
+        /* lset only stores over the placeholder of the lease it names */
+        if (lease != NULL && ITEM_get_cas(it) == ITEM_get_cas(lease)) {
+            item_replace(lease, it, hv);
+            stored = STORED;
+            THR_STATS_INCR(c, leases_honored);
+        } else {
+            THR_STATS_INCR(c, leases_rejected);
+        }
+    } else if (old_it != NULL && comm == NREAD_ADD) {
+        /* add only adds a nonexistent item, but promote to head of LRU */
+        do_item_update(old_it);
+    } else if (!old_it && (comm == NREAD_REPLACE
         || comm == NREAD_APPEND || comm == NREAD_PREPEND))
     {
         /* replace only replaces an existing value; don't store */
@@ -2305,24 +3063,18 @@ enum store_item_type do_store_item(item *it, int comm, conn *c, const uint32_t h
         if(old_it == NULL) {
             // LRU expired
             stored = NOT_FOUND;
-            pthread_mutex_lock(&c->thread->stats.mutex);
-            c->thread->stats.cas_misses++;
-            pthread_mutex_unlock(&c->thread->stats.mutex);
+            THR_STATS_INCR(c, cas_misses);
         }
         else if (ITEM_get_cas(it) == ITEM_get_cas(old_it)) {
             // cas validates
             // it and old_it may belong to different classes.
             // I'm updating the stats for the one that's getting pushed out
-            pthread_mutex_lock(&c->thread->stats.mutex);
-            c->thread->stats.slab_stats[old_it->slabs_clsid].cas_hits++;
-            pthread_mutex_unlock(&c->thread->stats.mutex);
+            THR_STATS_INCR(c, slab_stats[old_it->slabs_clsid].cas_hits);
 
             item_replace(old_it, it, hv);
             stored = STORED;
         } else {
-            pthread_mutex_lock(&c->thread->stats.mutex);
-            c->thread->stats.slab_stats[old_it->slabs_clsid].cas_badval++;
-            pthread_mutex_unlock(&c->thread->stats.mutex);
+            THR_STATS_INCR(c, slab_stats[old_it->slabs_clsid].cas_badval);
 
             if(settings.verbose > 1) {
                 fprintf(stderr, "CAS:  failure: expected %llu, got %llu\n",
@@ -2381,6 +3133,8 @@ enum store_item_type do_store_item(item *it, int comm, conn *c, const uint32_t h
         if (stored == NOT_STORED) {
             if (old_it != NULL)
                 item_replace(old_it, it, hv);
+            else if (lease != NULL)
+                item_replace(lease, it, hv);
             else
                 do_item_link(it, hv);
 
@@ -2392,6 +3146,8 @@ enum store_item_type do_store_item(item *it, int comm, conn *c, const uint32_t h
 
     if (old_it != NULL)
         do_item_remove(old_it);         /* release our reference */
+    if (lease != NULL)
+        do_item_remove(lease);
     if (new_it != NULL)
         do_item_remove(new_it);
 
@@ -2402,78 +3158,6 @@ enum store_item_type do_store_item(item *it, int comm, conn *c, const uint32_t h
     return stored;
 }
 
-typedef struct token_s {
-    char *value;
-    size_t length;
-} token_t;
-
-#define COMMAND_TOKEN 0
-#define SUBCOMMAND_TOKEN 1
-#define KEY_TOKEN 1
-
-#define MAX_TOKENS 8
-
-/*
- * Tokenize the command string by replacing whitespace with '\0' and update
- * the token array tokens with pointer to start of each token and length.
- * Returns total number of tokens.  The last valid token is the terminal
- * token (value points to the first unprocessed character of the string and
- * length zero).
- *
- * Usage example:
- *
- *  while(tokenize_command(command, ncommand, tokens, max_tokens) > 0) {
- *      for(int ix = 0; tokens[ix].length != 0; ix++) {
- *          ...
- *      }
- *      ncommand = tokens[ix].value - command;
- *      command  = tokens[ix].value;
- *   }
- */
-static size_t tokenize_command(char *command, token_t *tokens, const size_t max_tokens) {
-    char *s, *e;
-    size_t ntokens = 0;
-    size_t len = strlen(command);
-    unsigned int i = 0;
-
-    assert(command != NULL && tokens != NULL && max_tokens > 1);
-
-    s = e = command;
-    for (i = 0; i < len; i++) {
-        if (*e == ' ') {
-            if (s != e) {
-                tokens[ntokens].value = s;
-                tokens[ntokens].length = e - s;
-                ntokens++;
-                *e = '\0';
-                if (ntokens == max_tokens - 1) {
-                    e++;
-                    s = e; /* so we don't add an extra token */
-                    break;
-                }
-            }
-            s = e + 1;
-        }
-        e++;
-    }
-
-    if (s != e) {
-        tokens[ntokens].value = s;
-        tokens[ntokens].length = e - s;
-        ntokens++;
-    }
-
-    /*
-     * If we scanned the whole string, the terminal value pointer is null,
-     * otherwise it is the first unprocessed character.
-     */
-    tokens[ntokens].value =  *e == '\0' ? NULL : e;
-    tokens[ntokens].length = 0;
-    ntokens++;
-
-    return ntokens;
-}
-
 /* set up a connection to write a buffer then free it, used for stats */
 static void write_and_free(conn *c, char *buf, int bytes) {
     if (buf) {
@@ -2583,6 +3267,10 @@ static void server_stats(ADD_STAT add_stats, conn *c) {
         APPEND_STAT("rejected_connections", "%llu", (unsigned long long)stats.rejected_conns);
     }
     APPEND_STAT("connection_structures", "%u", stats.conn_structs);
+    APPEND_STAT("conn_buffers_borrowed", "%llu",
+                (unsigned long long)thread_stats.conn_buffers_borrowed);
+    APPEND_STAT("conn_buffers_pooled", "%llu",
+                (unsigned long long)thread_stats.conn_buffers_pooled);
     APPEND_STAT("reserved_fds", "%u", stats.reserved_fds);
     APPEND_STAT("cmd_get", "%llu", (unsigned long long)thread_stats.get_cmds);
     APPEND_STAT("cmd_set", "%llu", (unsigned long long)slab_stats.set_cmds);
@@ -2605,17 +3293,61 @@ static void server_stats(ADD_STAT add_stats, conn *c) {
     APPEND_STAT("auth_errors", "%llu", (unsigned long long)thread_stats.auth_errors);
     APPEND_STAT("bytes_read", "%llu", (unsigned long long)thread_stats.bytes_read);
     APPEND_STAT("bytes_written", "%llu", (unsigned long long)thread_stats.bytes_written);
+    APPEND_STAT("value_bytes_copied", "%llu",
+                (unsigned long long)thread_stats.value_bytes_copied);
+    APPEND_STAT("value_bytes_direct", "%llu",
+                (unsigned long long)thread_stats.value_bytes_direct);
     APPEND_STAT("limit_maxbytes", "%llu", (unsigned long long)settings.maxbytes);
     APPEND_STAT("accepting_conns", "%u", stats.accepting_conns);
     APPEND_STAT("listen_disabled_num", "%llu", (unsigned long long)stats.listen_disabled_num);
     APPEND_STAT("threads", "%d", settings.num_threads);
     APPEND_STAT("conn_yields", "%llu", (unsigned long long)thread_stats.conn_yields);
+    APPEND_STAT("sendmsg_calls", "%llu",
+                (unsigned long long)thread_stats.sendmsg_calls);
+    APPEND_STAT("responses_coalesced", "%llu",
+                (unsigned long long)thread_stats.responses_coalesced);
+    APPEND_STAT("bin_multiget_keys", "%llu",
+                (unsigned long long)thread_stats.bin_multiget_keys);
+    if (settings.leases) {
+        APPEND_STAT("leases_issued", "%llu",
+                    (unsigned long long)thread_stats.leases_issued);
+        APPEND_STAT("leases_hot_misses", "%llu",
+                    (unsigned long long)thread_stats.leases_hot_misses);
+        APPEND_STAT("leases_stale", "%llu",
+                    (unsigned long long)thread_stats.leases_stale);
+        APPEND_STAT("leases_honored", "%llu",
+                    (unsigned long long)thread_stats.leases_honored);
+        APPEND_STAT("leases_rejected", "%llu",
+                    (unsigned long long)thread_stats.leases_rejected);
+    }
+    if (settings.hotcache) {
+        APPEND_STAT("hotcache_hits", "%llu",
+                    (unsigned long long)thread_stats.hotcache_hits);
+        APPEND_STAT("hotcache_fills", "%llu",
+                    (unsigned long long)thread_stats.hotcache_fills);
+    }
+    if (settings.zerocopy) {
+        APPEND_STAT("zerocopy_bytes", "%llu",
+                    (unsigned long long)thread_stats.zerocopy_bytes);
+        APPEND_STAT("zerocopy_fallbacks", "%llu",
+                    (unsigned long long)thread_stats.zerocopy_fallbacks);
+    }
+    if (settings.io_uring) {
+        APPEND_STAT("uring_enters", "%llu",
+                    (unsigned long long)thread_stats.uring_enters);
+        APPEND_STAT("uring_sqes", "%llu",
+                    (unsigned long long)thread_stats.uring_sqes);
+    }
     APPEND_STAT("hash_power_level", "%u", stats.hash_power_level);
     APPEND_STAT("hash_bytes", "%llu", (unsigned long long)stats.hash_bytes);
     APPEND_STAT("hash_is_expanding", "%u", stats.hash_is_expanding);
     if (settings.slab_reassign) {
         APPEND_STAT("slab_reassign_running", "%u", stats.slab_reassign_running);
         APPEND_STAT("slabs_moved", "%llu", stats.slabs_moved);
+        APPEND_STAT("automove_decisions", "%llu",
+                    (unsigned long long)stats.automove_decisions);
+        APPEND_STAT("automove_pages", "%llu",
+                    (unsigned long long)stats.automove_pages);
     }
     if (settings.lru_crawler) {
         APPEND_STAT("lru_crawler_running", "%u", stats.lru_crawler_running);
@@ -2623,6 +3355,8 @@ static void server_stats(ADD_STAT add_stats, conn *c) {
     APPEND_STAT("malloc_fails", "%llu",
                 (unsigned long long)stats.malloc_fails);
     STATS_UNLOCK();
+    if (settings.capture_file != NULL)
+        capture_stats(add_stats, c);
 }
 
 static void process_stat_settings(ADD_STAT add_stats, void *c) {
@@ -2659,6 +3393,22 @@ static void process_stat_settings(ADD_STAT add_stats, void *c) {
     APPEND_STAT("lru_crawler", "%s", settings.lru_crawler ? "yes" : "no");
     APPEND_STAT("lru_crawler_sleep", "%d", settings.lru_crawler_sleep);
     APPEND_STAT("lru_crawler_tocrawl", "%lu", (unsigned long)settings.lru_crawler_tocrawl);
+    APPEND_STAT("expiry_wheel", "%s", settings.expiry_wheel ? "yes" : "no");
+    APPEND_STAT("eviction_policy", "%s",
+                eviction_policy_name(settings.eviction_policy));
+    APPEND_STAT("gdsf_cost_flags", "%s", settings.gdsf_cost_flags ? "yes" : "no");
+    APPEND_STAT("mrc", "%s", settings.mrc ? "yes" : "no");
+    APPEND_STAT("lock_stats", "%s", settings.lock_stats ? "yes" : "no");
+    APPEND_STAT("capture_file", "%s",
+                settings.capture_file ? settings.capture_file : "NULL");
+    APPEND_STAT("capture_sample", "%d", settings.capture_sample);
+    APPEND_STAT("hotkey_sample", "%d", settings.hotkey_sample);
+    APPEND_STAT("hotcache", "%s", settings.hotcache ? "yes" : "no");
+    APPEND_STAT("leases", "%s", settings.leases ? "yes" : "no");
+    APPEND_STAT("lease_ttl", "%d", settings.lease_ttl);
+    APPEND_STAT("lease_stale", "%s", settings.lease_stale ? "yes" : "no");
+    APPEND_STAT("zerocopy", "%d", settings.zerocopy);
+    APPEND_STAT("io_uring", "%s", settings.io_uring ? "yes" : "no");
     APPEND_STAT("tail_repair_time", "%d", settings.tail_repair_time);
     APPEND_STAT("flush_enabled", "%s", settings.flush_enabled ? "yes" : "no");
     APPEND_STAT("hash_algorithm", "%s", settings.hash_algorithm);
@@ -2766,6 +3516,8 @@ static void process_stats_conns(ADD_STAT add_stats, void *c) {
                         state_text(conns[i]->state));
                 APPEND_NUM_STAT(i, "secs_since_last_cmd", "%d",
                         current_time - conns[i]->last_cmd_time);
+                APPEND_NUM_STAT(i, "resident_bytes", "%lu",
+                        (unsigned long)conn_bytes(conns[i]));
             }
         }
     }
@@ -2854,12 +3606,36 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
     char *key;
     size_t nkey;
     int i = 0;
+    /* Items and suffixes of queued responses come first. */
+    const int ibase = c->ileft;
+    const int sbase = c->suffixleft;
     item *it;
+    bool replica;
+    uint64_t samples;
     token_t *key_token = &tokens[KEY_TOKEN];
+    token_t *t;
     char *suffix;
+    /* Items of the keys in this set of tokens, looked up together. */
+    const char *keys[MAX_TOKENS];
+    size_t nkeys[MAX_TOKENS];
+    item *batch[MAX_TOKENS];
+    int nbatch, ibatch;
     assert(c != NULL);
+    c->lat_cmd = LAT_GET;
 
     do {
+        /* Unless the hot item cache may answer first. */
+        nbatch = ibatch = 0;
+        if (c->thread->hotcache == NULL) {
+            for (t = key_token; t->length != 0 &&
+                 t->length <= KEY_MAX_LENGTH; t++) {
+                keys[nbatch] = t->value;
+                nkeys[nbatch] = t->length;
+                nbatch++;
+            }
+            item_get_multi(keys, nkeys, batch, nbatch);
+        }
+
         while(key_token->length != 0) {
 
             key = key_token->value;
@@ -2868,17 +3644,31 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
             if(nkey > KEY_MAX_LENGTH) {
                 out_string(c, "CLIENT_ERROR bad command line format");
                 while (i-- > 0) {
-                    item_remove(*(c->ilist + i));
+                    hotcache_release(c->thread, *(c->ilist + ibase + i));
                 }
                 return;
             }
 
-            it = item_get(key, nkey);
+            samples = hotkey_sample(c, LAT_GET, key, nkey);
+            if (ibatch < nbatch) {
+                it = batch[ibatch++];
+                replica = false;
+            } else {
+                it = NULL;
+                if (c->thread->hotcache != NULL)
+                    it = hotcache_get(c, key, nkey);
+                replica = it != NULL;
+                if (!replica) {
+                    it = item_get(key, nkey);
+                    if (it != NULL && samples > 0)
+                        hotcache_add(c, it, samples);
+                }
+            }
             if (settings.detail_enabled) {
                 stats_prefix_record_get(key, nkey, NULL != it);
             }
             if (it) {
-                if (i >= c->isize) {
+                if (ibase + i >= c->isize) {
                     item **new_list = realloc(c->ilist, sizeof(item *) * c->isize * 2);
                     if (new_list) {
                         c->isize *= 2;
@@ -2887,7 +3677,7 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
                         STATS_LOCK();
                         stats.malloc_fails++;
                         STATS_UNLOCK();
-                        item_remove(it);
+                        hotcache_release(c->thread, it);
                         break;
                     }
                 }
@@ -2905,7 +3695,7 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
                   MEMCACHED_COMMAND_GET(c->sfd, ITEM_key(it), it->nkey,
                                         it->nbytes, ITEM_get_cas(it));
                   /* Goofy mid-flight realloc. */
-                  if (i >= c->suffixsize) {
+                  if (sbase + i >= c->suffixsize) {
                     char **new_suffix_list = realloc(c->suffixlist,
                                            sizeof(char *) * c->suffixsize * 2);
                     if (new_suffix_list) {
@@ -2915,7 +3705,7 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
                         STATS_LOCK();
                         stats.malloc_fails++;
                         STATS_UNLOCK();
-                        item_remove(it);
+                        hotcache_release(c->thread, it);
                         break;
                     }
                   }
@@ -2926,13 +3716,17 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
                       stats.malloc_fails++;
                       STATS_UNLOCK();
                       out_of_memory(c, "SERVER_ERROR out of memory making CAS suffix");
-                      item_remove(it);
+                      hotcache_release(c->thread, it);
                       while (i-- > 0) {
-                          item_remove(*(c->ilist + i));
+                          hotcache_release(c->thread, *(c->ilist + ibase + i));
+                      }
+                      for (; ibatch < nbatch; ibatch++) {
+                          if (batch[ibatch] != NULL)
+                              item_remove(batch[ibatch]);
                       }
                       return;
                   }
-                  *(c->suffixlist + i) = suffix;
+                  *(c->suffixlist + sbase + i) = suffix;
                   int suffix_len = snprintf(suffix, SUFFIX_SIZE,
                                             " %llu\r\n",
                                             (unsigned long long)ITEM_get_cas(it));
@@ -2942,7 +3736,7 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
                       add_iov(c, suffix, suffix_len) != 0 ||
                       add_iov(c, ITEM_data(it), it->nbytes) != 0)
                       {
-                          item_remove(it);
+                          hotcache_release(c->thread, it);
                           break;
                       }
                 }
@@ -2954,7 +3748,7 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
                       add_iov(c, ITEM_key(it), it->nkey) != 0 ||
                       add_iov(c, ITEM_suffix(it), it->nsuffix + it->nbytes) != 0)
                       {
-                          item_remove(it);
+                          hotcache_release(c->thread, it);
                           break;
                       }
                 }
@@ -2970,25 +3764,29 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
                 }
 
                 /* item_get() has incremented it->refcount for us */
-                pthread_mutex_lock(&c->thread->stats.mutex);
-                c->thread->stats.slab_stats[it->slabs_clsid].get_hits++;
-                c->thread->stats.get_cmds++;
-                pthread_mutex_unlock(&c->thread->stats.mutex);
-                item_update(it);
-                *(c->ilist + i) = it;
+                THR_STATS_INCR(c, slab_stats[it->slabs_clsid].get_hits);
+                THR_STATS_INCR(c, get_cmds);
+                if (!replica)
+                    item_update(it);
+                *(c->ilist + ibase + i) = it;
                 i++;
 
             } else {
-                pthread_mutex_lock(&c->thread->stats.mutex);
-                c->thread->stats.get_misses++;
-                c->thread->stats.get_cmds++;
-                pthread_mutex_unlock(&c->thread->stats.mutex);
+                THR_STATS_INCR(c, get_misses);
+                THR_STATS_INCR(c, get_cmds);
+                item_ghost_miss(key, nkey);
                 MEMCACHED_COMMAND_GET(c->sfd, key, nkey, -1, 0);
             }
 
             key_token++;
         }
 
+        /* Keys the loop broke off before were looked up all the same. */
+        for (; ibatch < nbatch; ibatch++) {
+            if (batch[ibatch] != NULL)
+                item_remove(batch[ibatch]);
+        }
+
         /*
          * If the command string hasn't been fully processed, get the next set
          * of tokens.
@@ -3001,10 +3799,10 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
     } while(key_token->value != NULL);
 
     c->icurr = c->ilist;
-    c->ileft = i;
+    c->ileft = ibase + i;
     if (return_cas) {
         c->suffixcurr = c->suffixlist;
-        c->suffixleft = i;
+        c->suffixleft = sbase + i;
     }
 
     if (settings.verbose > 1)
@@ -3025,6 +3823,71 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
     }
 }
 
+/* lget <key>: a get that hands out a lease on a miss. The reply is the value,
+ * "LEASE <token>" for the client that should regenerate it, and "HOT_MISS"
+ * or, with lease_stale, the old value as "STALE ..." for everyone else. */
+static void process_lease_get_command(conn *c, token_t *tokens, const size_t ntokens) {
+    char *key = tokens[KEY_TOKEN].value;
+    size_t nkey = tokens[KEY_TOKEN].length;
+    enum lease_result res;
+    char temp[32];
+    item *it;
+
+    assert(c != NULL);
+    c->lat_cmd = LAT_GET;
+
+    if (nkey > KEY_MAX_LENGTH) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+    hotkey_sample(c, LAT_GET, key, nkey);
+    it = item_lease_get(key, nkey, &res);
+    THR_STATS_INCR(c, get_cmds);
+    switch (res) {
+    case LEASE_HIT:
+        THR_STATS_INCR(c, slab_stats[it->slabs_clsid].get_hits);
+        item_update(it);
+        break;
+    case LEASE_STALE:
+        THR_STATS_INCR(c, get_misses);
+        THR_STATS_INCR(c, leases_stale);
+        break;
+    case LEASE_GRANTED:
+        THR_STATS_INCR(c, get_misses);
+        THR_STATS_INCR(c, leases_issued);
+        snprintf(temp, sizeof(temp), "LEASE %llu",
+                 (unsigned long long)ITEM_get_cas(it));
+        item_remove(it);
+        out_string(c, temp);
+        return;
+    case LEASE_HOT_MISS:
+        THR_STATS_INCR(c, get_misses);
+        THR_STATS_INCR(c, leases_hot_misses);
+        out_string(c, "HOT_MISS");
+        return;
+    case LEASE_NOMEM:
+        out_of_memory(c, "SERVER_ERROR out of memory storing lease");
+        return;
+    }
+
+    if (add_iov(c, res == LEASE_HIT ? "VALUE " : "STALE ", 6) != 0 ||
+        add_iov(c, ITEM_key(it), it->nkey) != 0 ||
+        add_iov(c, ITEM_suffix(it), it->nsuffix + it->nbytes) != 0 ||
+        add_iov(c, "END\r\n", 5) != 0 ||
+        (IS_UDP(c->transport) && build_udp_headers(c) != 0)) {
+        item_remove(it);
+        out_of_memory(c, "SERVER_ERROR out of memory writing get response");
+        return;
+    }
+    if (conn_hold_item(c, it) != 0) {
+        item_remove(it);
+        out_of_memory(c, "SERVER_ERROR out of memory writing get response");
+        return;
+    }
+    conn_set_state(c, conn_mwrite);
+    c->msgcurr = 0;
+}
+
 static void process_update_command(conn *c, token_t *tokens, const size_t ntokens, int comm, bool handle_cas) {
     char *key;
     size_t nkey;
@@ -3036,6 +3899,7 @@ static void process_update_command(conn *c, token_t *tokens, const size_t ntoken
     item *it;
 
     assert(c != NULL);
+    c->lat_cmd = LAT_SET;
 
     set_noreply_maybe(c, tokens, ntokens);
 
@@ -3046,6 +3910,7 @@ static void process_update_command(conn *c, token_t *tokens, const size_t ntoken
 
     key = tokens[KEY_TOKEN].value;
     nkey = tokens[KEY_TOKEN].length;
+    hotkey_sample(c, LAT_SET, key, nkey);
 
     if (! (safe_strtoul(tokens[2].value, (uint32_t *)&flags)
            && safe_strtol(tokens[3].value, &exptime_int)
@@ -3120,6 +3985,7 @@ static void process_touch_command(conn *c, token_t *tokens, const size_t ntokens
     item *it;
 
     assert(c != NULL);
+    c->lat_cmd = LAT_TOUCH;
 
     set_noreply_maybe(c, tokens, ntokens);
 
@@ -3130,6 +3996,7 @@ static void process_touch_command(conn *c, token_t *tokens, const size_t ntokens
 
     key = tokens[KEY_TOKEN].value;
     nkey = tokens[KEY_TOKEN].length;
+    hotkey_sample(c, LAT_TOUCH, key, nkey);
 
     if (!safe_strtol(tokens[2].value, &exptime_int)) {
         out_string(c, "CLIENT_ERROR invalid exptime argument");
@@ -3139,18 +4006,14 @@ static void process_touch_command(conn *c, token_t *tokens, const size_t ntokens
     it = item_touch(key, nkey, realtime(exptime_int));
     if (it) {
         item_update(it);
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.touch_cmds++;
-        c->thread->stats.slab_stats[it->slabs_clsid].touch_hits++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_INCR(c, touch_cmds);
+        THR_STATS_INCR(c, slab_stats[it->slabs_clsid].touch_hits);
 
         out_string(c, "TOUCHED");
         item_remove(it);
     } else {
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.touch_cmds++;
-        c->thread->stats.touch_misses++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_INCR(c, touch_cmds);
+        THR_STATS_INCR(c, touch_misses);
 
         out_string(c, "NOT_FOUND");
     }
@@ -3163,6 +4026,7 @@ static void process_arithmetic_command(conn *c, token_t *tokens, const size_t nt
     size_t nkey;
 
     assert(c != NULL);
+    c->lat_cmd = LAT_INCR;
 
     set_noreply_maybe(c, tokens, ntokens);
 
@@ -3173,6 +4037,7 @@ static void process_arithmetic_command(conn *c, token_t *tokens, const size_t nt
 
     key = tokens[KEY_TOKEN].value;
     nkey = tokens[KEY_TOKEN].length;
+    hotkey_sample(c, LAT_INCR, key, nkey);
 
     if (!safe_strtoull(tokens[2].value, &delta)) {
         out_string(c, "CLIENT_ERROR invalid numeric delta argument");
@@ -3190,13 +4055,11 @@ static void process_arithmetic_command(conn *c, token_t *tokens, const size_t nt
         out_of_memory(c, "SERVER_ERROR out of memory");
         break;
     case DELTA_ITEM_NOT_FOUND:
-        pthread_mutex_lock(&c->thread->stats.mutex);
         if (incr) {
-            c->thread->stats.incr_misses++;
+            THR_STATS_INCR(c, incr_misses);
         } else {
-            c->thread->stats.decr_misses++;
+            THR_STATS_INCR(c, decr_misses);
         }
-        pthread_mutex_unlock(&c->thread->stats.mutex);
 
         out_string(c, "NOT_FOUND");
         break;
@@ -3254,13 +4117,11 @@ enum delta_result_type do_add_delta(conn *c, const char *key, const size_t nkey,
         MEMCACHED_COMMAND_DECR(c->sfd, ITEM_key(it), it->nkey, value);
     }
 
-    pthread_mutex_lock(&c->thread->stats.mutex);
     if (incr) {
-        c->thread->stats.slab_stats[it->slabs_clsid].incr_hits++;
+        THR_STATS_INCR(c, slab_stats[it->slabs_clsid].incr_hits);
     } else {
-        c->thread->stats.slab_stats[it->slabs_clsid].decr_hits++;
+        THR_STATS_INCR(c, slab_stats[it->slabs_clsid].decr_hits);
     }
-    pthread_mutex_unlock(&c->thread->stats.mutex);
 
     snprintf(buf, INCR_MAX_STORAGE_LEN, "%llu", (unsigned long long)value);
     res = strlen(buf);
@@ -3315,6 +4176,7 @@ static void process_delete_command(conn *c, token_t *tokens, const size_t ntoken
     item *it;
 
     assert(c != NULL);
+    c->lat_cmd = LAT_DELETE;
 
     if (ntokens > 3) {
         bool hold_is_zero = strcmp(tokens[KEY_TOKEN+1].value, "0") == 0;
@@ -3337,30 +4199,649 @@ static void process_delete_command(conn *c, token_t *tokens, const size_t ntoken
         return;
     }
 
+    hotkey_sample(c, LAT_DELETE, key, nkey);
     if (settings.detail_enabled) {
         stats_prefix_record_delete(key, nkey);
     }
 
-    it = item_get(key, nkey);
+    it = delete_lookup(key, nkey);
     if (it) {
         MEMCACHED_COMMAND_DELETE(c->sfd, ITEM_key(it), it->nkey);
 
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.slab_stats[it->slabs_clsid].delete_hits++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_INCR(c, slab_stats[it->slabs_clsid].delete_hits);
 
         item_unlink(it);
         item_remove(it);      /* release our reference */
         out_string(c, "DELETED");
     } else {
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.delete_misses++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_INCR(c, delete_misses);
 
         out_string(c, "NOT_FOUND");
     }
 }
 
+/*
+ * Tokenizes the rest of a line that has more tokens than process_command()
+ * takes, into all[], which has room for max tokens. Returns the number of
+ * tokens as tokenize_command() does.
+ */
+static size_t tokenize_multi(token_t *tokens, const size_t ntokens,
+                             token_t *all, const size_t max) {
+    size_t n = ntokens - 1;
+
+    memcpy(all, tokens, ntokens * sizeof(token_t));
+    if (tokens[n].value == NULL) {
+        return ntokens;
+    }
+    return n + tokenize_command(tokens[n].value, all + n, max - n);
+}
+
+/* set_multi <flags> <exptime> <key> <bytes> [<key> <bytes> ...] [noreply] */
+static void process_set_multi_command(conn *c, token_t *tokens,
+                                      const size_t ntokens) {
+    token_t all[MAX_MULTI_TOKENS];
+    const char *keys[MULTI_KEYS_MAX];
+    size_t nkeys[MULTI_KEYS_MAX];
+    int vlens[MULTI_KEYS_MAX];
+    unsigned int flags;
+    int32_t exptime_int = 0;
+    time_t exptime;
+    size_t n;
+    int i, count;
+
+    assert(c != NULL);
+    c->lat_cmd = LAT_SET;
+
+    n = tokenize_multi(tokens, ntokens, all, MAX_MULTI_TOKENS);
+    set_noreply_maybe(c, all, n);
+
+    /* The command, the flags and the exptime come before the keys. */
+    count = (int)n - 4 - (c->noreply ? 1 : 0);
+    if (all[n - 1].value != NULL || count < 2 || count % 2 != 0 ||
+        !safe_strtoul(all[1].value, (uint32_t *)&flags) ||
+        !safe_strtol(all[2].value, &exptime_int)) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+    count /= 2;
+
+    for (i = 0; i < count; i++) {
+        token_t *key = &all[3 + 2 * i];
+        if (key->length > KEY_MAX_LENGTH ||
+            !safe_strtol(key[1].value, (int32_t *)&vlens[i]) ||
+            vlens[i] < 0 || vlens[i] > INT_MAX - 2) {
+            out_string(c, "CLIENT_ERROR bad command line format");
+            return;
+        }
+        keys[i] = key->value;
+        nkeys[i] = key->length;
+    }
+
+    /* As in process_update_command(). */
+    exptime = exptime_int;
+    if (exptime < 0)
+        exptime = REALTIME_MAXDELTA + 1;
+
+    start_set_multi(c, keys, nkeys, vlens, count, flags, realtime(exptime), 2);
+}
+
+/* delete_multi <key> [<key> ...] [noreply] */
+static void process_delete_multi_command(conn *c, token_t *tokens,
+                                         const size_t ntokens) {
+    token_t all[MAX_MULTI_TOKENS];
+    const char *keys[MULTI_KEYS_MAX];
+    size_t nkeys[MULTI_KEYS_MAX];
+    size_t n;
+    int i, count;
+
+    assert(c != NULL);
+    c->lat_cmd = LAT_DELETE;
+
+    n = tokenize_multi(tokens, ntokens, all, MAX_MULTI_TOKENS);
+    set_noreply_maybe(c, all, n);
+
+    count = (int)n - 2 - (c->noreply ? 1 : 0);
+    if (all[n - 1].value != NULL || count < 1 || count > MULTI_KEYS_MAX) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (all[1 + i].length > KEY_MAX_LENGTH) {
+            out_string(c, "CLIENT_ERROR bad command line format");
+            return;
+        }
+        keys[i] = all[1 + i].value;
+        nkeys[i] = all[1 + i].length;
+    }
+
+    delete_multi(c, keys, nkeys, count);
+}
+
+/*
+ * Meta commands: mg, ms, md, ma and mn.
+ *
+ * Each takes a key followed by single character flags, some with an argument
+ * ("T30"), and answers with a two letter status code followed by the return
+ * flags that were asked for, in the order they were given. This way a client
+ * can e.g. fetch an item's value, CAS and remaining TTL and push its TTL out
+ * in one round trip. See "Meta Commands" in doc/protocol.txt.
+ */
+
+#define META_LINE_MAX 512
+
+typedef struct {
+    meta_reply reply;
+    char mode;                  /* M */
+    bool has_ttl;               /* T */
+    bool has_cas;               /* C */
+    bool has_delta;             /* D */
+    int32_t ttl;
+    uint32_t client_flags;      /* F */
+    uint64_t cas;
+    uint64_t delta;
+} meta_flags;
+
+/* Parses the flags of a meta command, which may only use those in allowed.
+ * Returns the error to send back, or NULL. */
+static const char *meta_parse_flags(token_t *tokens, const size_t ntokens,
+                                    const char *allowed, meta_flags *mf) {
+    size_t nret = 0;
+    size_t i;
+
+    memset(mf, 0, sizeof(*mf));
+    /* The last token is the terminal one. */
+    for (i = 0; i + 1 < ntokens; i++) {
+        const char flag = tokens[i].value[0];
+        const char *arg = tokens[i].value + 1;
+
+        if (strchr(allowed, flag) == NULL)
+            return "CLIENT_ERROR invalid flag";
+        switch (flag) {
+        case 'b':
+            mf->reply.base64 = true;
+            break;
+        case 'q':
+            mf->reply.quiet = true;
+            break;
+        case 'C':
+            if (!safe_strtoull(arg, &mf->cas))
+                return "CLIENT_ERROR bad token in command line format";
+            mf->has_cas = true;
+            break;
+        case 'D':
+            if (!safe_strtoull(arg, &mf->delta))
+                return "CLIENT_ERROR invalid numeric delta argument";
+            mf->has_delta = true;
+            break;
+        case 'F':
+            if (!safe_strtoul(arg, &mf->client_flags))
+                return "CLIENT_ERROR bad token in command line format";
+            break;
+        case 'M':
+            if (tokens[i].length != 2)
+                return "CLIENT_ERROR invalid mode";
+            mf->mode = toupper((unsigned char)arg[0]);
+            break;
+        case 'T':
+            if (!safe_strtol(arg, &mf->ttl))
+                return "CLIENT_ERROR bad token in command line format";
+            mf->has_ttl = true;
+            break;
+        case 'O':
+            if (tokens[i].length - 1 > META_OPAQUE_MAX)
+                return "CLIENT_ERROR opaque token too long";
+            memset(mf->reply.opaque, 0, sizeof(mf->reply.opaque));
+            memcpy(mf->reply.opaque, arg, tokens[i].length - 1);
+            /* FALLTHROUGH */
+        default:
+            /* Everything else is returned. */
+            if (strchr(mf->reply.flags, flag) == NULL) {
+                if (nret == META_RET_MAX)
+                    return "CLIENT_ERROR too many flags";
+                mf->reply.flags[nret++] = flag;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Finds the key of a meta command, decoding it into buf if it was given in
+ * base64. Returns false if the key is too long or not valid base64. */
+static bool meta_key(const token_t *token, const meta_flags *mf, char *buf,
+                     char **key, size_t *nkey) {
+    if (mf->reply.base64) {
+        *key = buf;
+        *nkey = base64_decode(token->value, token->length,
+                              (unsigned char *)buf, KEY_MAX_LENGTH);
+        return *nkey > 0;
+    }
+    *key = token->value;
+    *nkey = token->length;
+    return *nkey <= KEY_MAX_LENGTH;
+}
+
+/* Writes a status code and the return flags of a meta command to buf. The
+ * flags describing an item are left out if it is NULL, and the CAS if cas
+ * is. Returns the length of the line. */
+static int meta_render(char *buf, const size_t size, const char *status,
+                       const meta_reply *r, const char *key, const size_t nkey,
+                       const item *it, const uint64_t *cas) {
+    const char *f;
+    int len = snprintf(buf, size, "%s", status);
+
+    for (f = r->flags; *f != '\0'; f++) {
+        char *p = buf + len;
+        size_t left = size - len;
+
+        switch (*f) {
+        case 'O':
+            len += snprintf(p, left, " O%s", r->opaque);
+            break;
+        case 'k':
+            if (r->base64) {
+                len += snprintf(p, left, " k");
+                len += base64_encode((const unsigned char *)key, nkey,
+                                     buf + len, size - len - 3);
+                len += snprintf(buf + len, size - len, " b");
+            } else {
+                len += snprintf(p, left, " k%.*s", (int)nkey, key);
+            }
+            break;
+        case 'c':
+            if (cas != NULL)
+                len += snprintf(p, left, " c%llu", (unsigned long long)*cas);
+            break;
+        case 'f':
+            if (it != NULL)
+                len += snprintf(p, left, " f%lu",
+                                strtoul(ITEM_suffix(it), NULL, 10));
+            break;
+        case 's':
+            if (it != NULL)
+                len += snprintf(p, left, " s%d", it->nbytes - 2);
+            break;
+        case 't':
+            if (it != NULL)
+                len += snprintf(p, left, " t%d", it->exptime == 0 ? -1 :
+                                (int)(it->exptime - current_time));
+            break;
+        case 'l':
+            if (it != NULL)
+                len += snprintf(p, left, " l%u", current_time - it->time);
+            break;
+        }
+    }
+    return len;
+}
+
+/* mg <key> <flags>*: a get that can touch the item and return its CAS, TTL,
+ * size and time since the last access along with, or instead of, the value. */
+static void process_mget_command(conn *c, token_t *tokens, const size_t ntokens) {
+    char keybuf[KEY_MAX_LENGTH];
+    char line[META_LINE_MAX];
+    const char *err;
+    meta_flags mf;
+    char *key;
+    size_t nkey;
+    uint64_t cas;
+    item *it;
+    char *hdr;
+    int hdrsize;
+    int len;
+
+    assert(c != NULL);
+    c->lat_cmd = LAT_GET;
+
+    err = meta_parse_flags(tokens + 2, ntokens - 2, "bcfklOqstTv", &mf);
+    if (err == NULL && !meta_key(&tokens[KEY_TOKEN], &mf, keybuf, &key, &nkey))
+        err = "CLIENT_ERROR bad command line format";
+    if (err != NULL) {
+        out_string(c, err);
+        return;
+    }
+
+    hotkey_sample(c, LAT_GET, key, nkey);
+    if (mf.has_ttl) {
+        it = item_touch(key, nkey, realtime(mf.ttl));
+        THR_STATS_INCR(c, touch_cmds);
+        if (it) {
+            THR_STATS_INCR(c, slab_stats[it->slabs_clsid].touch_hits);
+        } else {
+            THR_STATS_INCR(c, touch_misses);
+        }
+    } else {
+        it = item_get(key, nkey);
+    }
+    THR_STATS_INCR(c, get_cmds);
+    if (settings.detail_enabled) {
+        stats_prefix_record_get(key, nkey, NULL != it);
+    }
+
+    if (it == NULL) {
+        THR_STATS_INCR(c, get_misses);
+        item_ghost_miss(key, nkey);
+        MEMCACHED_COMMAND_GET(c->sfd, key, nkey, -1, 0);
+        meta_render(line, sizeof(line), "EN", &mf.reply, key, nkey, NULL, NULL);
+        if (mf.reply.quiet)
+            c->noreply = true;
+        out_string(c, line);
+        return;
+    }
+
+    THR_STATS_INCR(c, slab_stats[it->slabs_clsid].get_hits);
+    MEMCACHED_COMMAND_GET(c->sfd, ITEM_key(it), it->nkey,
+                          it->nbytes, ITEM_get_cas(it));
+    cas = ITEM_get_cas(it);
+
+    if (strchr(mf.reply.flags, 'v') == NULL) {
+        meta_render(line, sizeof(line), "HD", &mf.reply, key, nkey, it, &cas);
+        item_update(it);
+        item_remove(it);
+        out_string(c, line);
+        return;
+    }
+
+    /* Like the binary protocol, the header is sent from wbuf, after the
+     * lines of any queued responses. */
+    hdr = c->wbuf + c->resp_wbytes;
+    hdrsize = c->wsize - c->resp_wbytes;
+    len = snprintf(hdr, hdrsize, "VA %d", it->nbytes - 2);
+    len += meta_render(hdr + len, hdrsize - len, "", &mf.reply,
+                       key, nkey, it, &cas);
+    memcpy(hdr + len, "\r\n", 2);
+    item_update(it);
+
+    if (add_iov(c, hdr, len + 2) != 0 ||
+        add_iov(c, ITEM_data(it), it->nbytes) != 0 ||
+        (IS_UDP(c->transport) && build_udp_headers(c) != 0)) {
+        item_remove(it);
+        out_of_memory(c, "SERVER_ERROR out of memory writing get response");
+        return;
+    }
+    if (conn_hold_item(c, it) != 0) {
+        item_remove(it);
+        out_of_memory(c, "SERVER_ERROR out of memory writing get response");
+        return;
+    }
+    conn_set_state(c, conn_mwrite);
+    c->msgcurr = 0;
+}
+
+/* ms <key> <datalen> <flags>*: a set, add, replace, append or prepend
+ * depending on the mode, which is a cas if a CAS is given. The reply is sent
+ * by complete_mset() once the value is read. */
+static void process_mset_command(conn *c, token_t *tokens, const size_t ntokens) {
+    char keybuf[KEY_MAX_LENGTH];
+    const char *err;
+    meta_flags mf;
+    char *key;
+    size_t nkey;
+    int32_t vlen = -1;
+    time_t exptime;
+    int comm = NREAD_SET;
+    item *it;
+
+    assert(c != NULL);
+    c->lat_cmd = LAT_SET;
+
+    err = meta_parse_flags(tokens + 3, ntokens - 3, "bcCFkMOqT", &mf);
+    if (!safe_strtol(tokens[2].value, &vlen) || vlen < 0 ||
+        vlen > INT_MAX - 2) {
+        out_string(c, "CLIENT_ERROR bad data chunk");
+        return;
+    }
+    if (err == NULL && !meta_key(&tokens[KEY_TOKEN], &mf, keybuf, &key, &nkey))
+        err = "CLIENT_ERROR bad command line format";
+    if (err == NULL) {
+        switch (mf.mode) {
+        case 0:
+        case 'S':
+            comm = mf.has_cas ? NREAD_CAS : NREAD_SET;
+            break;
+        case 'R':
+            comm = mf.has_cas ? NREAD_CAS : NREAD_REPLACE;
+            break;
+        case 'E':
+            comm = NREAD_ADD;
+            if (mf.has_cas)
+                err = "CLIENT_ERROR bad command line format";
+            break;
+        case 'A':
+            comm = NREAD_APPEND;
+            break;
+        case 'P':
+            comm = NREAD_PREPEND;
+            break;
+        default:
+            err = "CLIENT_ERROR invalid mode";
+        }
+    }
+    if (err != NULL) {
+        out_string(c, err);
+        /* swallow the data line */
+        c->write_and_go = conn_swallow;
+        c->sbytes = vlen + 2;
+        return;
+    }
+
+    hotkey_sample(c, LAT_SET, key, nkey);
+    if (settings.detail_enabled) {
+        stats_prefix_record_set(key, nkey);
+    }
+
+    /* As with set, a negative TTL expires the item at once. */
+    exptime = mf.ttl < 0 ? REALTIME_MAXDELTA + 1 : mf.ttl;
+    it = item_alloc(key, nkey, mf.client_flags, realtime(exptime), vlen + 2);
+    if (it == 0) {
+        if (! item_size_ok(nkey, mf.client_flags, vlen + 2))
+            out_string(c, "SERVER_ERROR object too large for cache");
+        else
+            out_of_memory(c, "SERVER_ERROR out of memory storing object");
+        c->write_and_go = conn_swallow;
+        c->sbytes = vlen + 2;
+
+        if (comm == NREAD_SET) {
+            it = item_get(key, nkey);
+            if (it) {
+                item_unlink(it);
+                item_remove(it);
+            }
+        }
+        return;
+    }
+    ITEM_set_cas(it, mf.cas);
+
+    c->item = it;
+    c->ritem = ITEM_data(it);
+    c->rlbytes = it->nbytes;
+    c->cmd = comm;
+    c->mset = true;
+    c->mset_reply = mf.reply;
+    conn_set_state(c, conn_nread);
+}
+
+static void complete_mset(conn *c, const enum store_item_type ret) {
+    char line[META_LINE_MAX];
+    item *it = c->item;
+    const char *status;
+
+    switch (ret) {
+    case STORED:
+        status = "HD";
+        break;
+    case EXISTS:
+        status = "EX";
+        break;
+    case NOT_FOUND:
+        status = "NF";
+        break;
+    case NOT_STORED:
+        status = "NS";
+        break;
+    default:
+        out_string(c, "SERVER_ERROR Unhandled storage type.");
+        return;
+    }
+    meta_render(line, sizeof(line), status, &c->mset_reply, ITEM_key(it),
+                it->nkey, NULL, ret == STORED ? &c->cas : NULL);
+    if (ret == STORED && c->mset_reply.quiet)
+        c->noreply = true;
+    out_string(c, line);
+}
+
+/* md <key> <flags>*: a delete, which only goes ahead if the item's CAS matches
+ * when one is given. */
+static void process_mdelete_command(conn *c, token_t *tokens, const size_t ntokens) {
+    char keybuf[KEY_MAX_LENGTH];
+    char line[META_LINE_MAX];
+    const char *status;
+    const char *err;
+    meta_flags mf;
+    char *key;
+    size_t nkey;
+    item *it;
+
+    assert(c != NULL);
+    c->lat_cmd = LAT_DELETE;
+
+    err = meta_parse_flags(tokens + 2, ntokens - 2, "bCkOq", &mf);
+    if (err == NULL && !meta_key(&tokens[KEY_TOKEN], &mf, keybuf, &key, &nkey))
+        err = "CLIENT_ERROR bad command line format";
+    if (err != NULL) {
+        out_string(c, err);
+        return;
+    }
+
+    hotkey_sample(c, LAT_DELETE, key, nkey);
+    if (settings.detail_enabled) {
+        stats_prefix_record_delete(key, nkey);
+    }
+
+    it = delete_lookup(key, nkey);
+    if (it == NULL) {
+        THR_STATS_INCR(c, delete_misses);
+        status = "NF";
+    } else if (mf.has_cas && ITEM_get_cas(it) != mf.cas) {
+        item_remove(it);
+        status = "EX";
+    } else {
+        MEMCACHED_COMMAND_DELETE(c->sfd, ITEM_key(it), it->nkey);
+        THR_STATS_INCR(c, slab_stats[it->slabs_clsid].delete_hits);
+        item_unlink(it);
+        item_remove(it);
+        status = "HD";
+        if (mf.reply.quiet)
+            c->noreply = true;
+    }
+    meta_render(line, sizeof(line), status, &mf.reply, key, nkey, NULL, NULL);
+    out_string(c, line);
+}
+
+/* ma <key> <flags>*: incr or decr by the D flag, 1 by default, which only
+ * goes ahead if the item's CAS matches when one is given. */
+static void process_marithmetic_command(conn *c, token_t *tokens, const size_t ntokens) {
+    char temp[INCR_MAX_STORAGE_LEN];
+    char keybuf[KEY_MAX_LENGTH];
+    char line[META_LINE_MAX];
+    const char *err;
+    meta_flags mf;
+    char *key;
+    size_t nkey;
+    bool incr = true;
+    uint64_t cas;
+    int len;
+
+    assert(c != NULL);
+    c->lat_cmd = LAT_INCR;
+
+    err = meta_parse_flags(tokens + 2, ntokens - 2, "bcCDkMOqv", &mf);
+    if (err == NULL && !meta_key(&tokens[KEY_TOKEN], &mf, keybuf, &key, &nkey))
+        err = "CLIENT_ERROR bad command line format";
+    if (err == NULL) {
+        switch (mf.mode) {
+        case 0:
+        case 'I':
+        case '+':
+            break;
+        case 'D':
+        case '-':
+            incr = false;
+            break;
+        default:
+            err = "CLIENT_ERROR invalid mode";
+        }
+    }
+    if (err != NULL) {
+        out_string(c, err);
+        return;
+    }
+
+    hotkey_sample(c, LAT_INCR, key, nkey);
+    cas = mf.has_cas ? mf.cas : 0;
+    switch(add_delta(c, key, nkey, incr, mf.has_delta ? mf.delta : 1,
+                     temp, &cas)) {
+    case OK:
+        if (strchr(mf.reply.flags, 'v') != NULL) {
+            len = snprintf(line, sizeof(line), "VA %d", (int)strlen(temp));
+            len += meta_render(line + len, sizeof(line) - len, "", &mf.reply,
+                               key, nkey, NULL, &cas);
+            snprintf(line + len, sizeof(line) - len, "\r\n%s", temp);
+        } else {
+            meta_render(line, sizeof(line), "HD", &mf.reply, key, nkey,
+                        NULL, &cas);
+            if (mf.reply.quiet)
+                c->noreply = true;
+        }
+        out_string(c, line);
+        break;
+    case NON_NUMERIC:
+        out_string(c, "CLIENT_ERROR cannot increment or decrement non-numeric value");
+        break;
+    case EOM:
+        out_of_memory(c, "SERVER_ERROR out of memory");
+        break;
+    case DELTA_ITEM_NOT_FOUND:
+        if (incr) {
+            THR_STATS_INCR(c, incr_misses);
+        } else {
+            THR_STATS_INCR(c, decr_misses);
+        }
+        meta_render(line, sizeof(line), "NF", &mf.reply, key, nkey, NULL, NULL);
+        out_string(c, line);
+        break;
+    case DELTA_ITEM_CAS_MISMATCH:
+        meta_render(line, sizeof(line), "EX", &mf.reply, key, nkey, NULL, NULL);
+        out_string(c, line);
+        break;
+    }
+}
+
+static void process_meta_command(conn *c, char *command) {
+    token_t tokens[MAX_META_TOKENS];
+    size_t ntokens;
+    enum ascii_command cmd;
+
+    ntokens = tokenize_command(command, tokens, MAX_META_TOKENS);
+    cmd = ascii_command_lookup(tokens[COMMAND_TOKEN].value,
+                               tokens[COMMAND_TOKEN].length);
+    if (tokens[ntokens - 1].value != NULL) {
+        out_string(c, "CLIENT_ERROR too many flags");
+    } else if (ntokens == 2 && cmd == ASCII_CMD_MN) {
+        out_string(c, "MN");
+    } else if (ntokens >= 3 && cmd == ASCII_CMD_MG) {
+        process_mget_command(c, tokens, ntokens);
+    } else if (ntokens >= 4 && cmd == ASCII_CMD_MS) {
+        process_mset_command(c, tokens, ntokens);
+    } else if (ntokens >= 3 && cmd == ASCII_CMD_MD) {
+        process_mdelete_command(c, tokens, ntokens);
+    } else if (ntokens >= 3 && cmd == ASCII_CMD_MA) {
+        process_marithmetic_command(c, tokens, ntokens);
+    } else {
+        out_string(c, "ERROR");
+    }
+}
+
 static void process_verbosity_command(conn *c, token_t *tokens, const size_t ntokens) {
     unsigned int level;
 
@@ -3384,7 +4865,7 @@ static void process_slabs_automove_command(conn *c, token_t *tokens, const size_
     level = strtoul(tokens[2].value, NULL, 10);
     if (level == 0) {
         settings.slab_automove = 0;
-    } else if (level == 1 || level == 2) {
+    } else if (level >= 1 && level <= 3) {
         settings.slab_automove = level;
     } else {
         out_string(c, "ERROR");
@@ -3394,15 +4875,38 @@ static void process_slabs_automove_command(conn *c, token_t *tokens, const size_
     return;
 }
 
+static void process_eviction_policy_command(conn *c, token_t *tokens, const size_t ntokens) {
+    int policy;
+
+    assert(c != NULL);
+
+    set_noreply_maybe(c, tokens, ntokens);
+
+    policy = eviction_policy_id(tokens[1].value);
+    if (policy < 0) {
+        out_string(c, "ERROR");
+        return;
+    }
+    item_set_eviction_policy(policy);
+    out_string(c, "OK");
+    return;
+}
+
 static void process_command(conn *c, char *command) {
 
     token_t tokens[MAX_TOKENS];
     size_t ntokens;
+    enum ascii_command cmd;
     int comm;
 
     assert(c != NULL);
 
     MEMCACHED_PROCESS_COMMAND_START(c->sfd, c->rcurr, c->rbytes);
+    c->lat_cmd = LAT_NONE;
+    c->cmd_start = latency_now();
+
+    if (unlikely(settings.capture_file != NULL))
+        capture_ascii(c, command);
 
     if (settings.verbose > 1)
         fprintf(stderr, "<%d %s\n", c->sfd, command);
@@ -3412,66 +4916,90 @@ static void process_command(conn *c, char *command) {
      * directly into it, then continue in nread_complete().
      */
 
-    c->msgcurr = 0;
-    c->msgused = 0;
-    c->iovused = 0;
-    if (add_msghdr(c) != 0) {
+    if (conn_start_response(c) != 0) {
         out_of_memory(c, "SERVER_ERROR out of memory preparing response");
         return;
     }
 
+    /* Meta commands take more tokens than the others. */
+    if (command[0] == 'm' && command[1] != '\0' &&
+        (command[2] == ' ' || command[2] == '\0')) {
+        process_meta_command(c, command);
+        return;
+    }
+
     ntokens = tokenize_command(command, tokens, MAX_TOKENS);
+    cmd = ascii_command_lookup(tokens[COMMAND_TOKEN].value,
+                               tokens[COMMAND_TOKEN].length);
     if (ntokens >= 3 &&
-        ((strcmp(tokens[COMMAND_TOKEN].value, "get") == 0) ||
-         (strcmp(tokens[COMMAND_TOKEN].value, "bget") == 0))) {
+        (cmd == ASCII_CMD_GET || cmd == ASCII_CMD_BGET)) {
 
         process_get_command(c, tokens, ntokens, false);
 
     } else if ((ntokens == 6 || ntokens == 7) &&
-               ((strcmp(tokens[COMMAND_TOKEN].value, "add") == 0 && (comm = NREAD_ADD)) ||
-                (strcmp(tokens[COMMAND_TOKEN].value, "set") == 0 && (comm = NREAD_SET)) ||
-                (strcmp(tokens[COMMAND_TOKEN].value, "replace") == 0 && (comm = NREAD_REPLACE)) ||
-                (strcmp(tokens[COMMAND_TOKEN].value, "prepend") == 0 && (comm = NREAD_PREPEND)) ||
-                (strcmp(tokens[COMMAND_TOKEN].value, "append") == 0 && (comm = NREAD_APPEND)) )) {
+               ((cmd == ASCII_CMD_ADD && (comm = NREAD_ADD)) ||
+                (cmd == ASCII_CMD_SET && (comm = NREAD_SET)) ||
+                (cmd == ASCII_CMD_REPLACE && (comm = NREAD_REPLACE)) ||
+                (cmd == ASCII_CMD_PREPEND && (comm = NREAD_PREPEND)) ||
+                (cmd == ASCII_CMD_APPEND && (comm = NREAD_APPEND)) )) {
 
         process_update_command(c, tokens, ntokens, comm, false);
 
-    } else if ((ntokens == 7 || ntokens == 8) && (strcmp(tokens[COMMAND_TOKEN].value, "cas") == 0 && (comm = NREAD_CAS))) {
+    } else if ((ntokens == 7 || ntokens == 8) && (cmd == ASCII_CMD_CAS && (comm = NREAD_CAS))) {
+
+        process_update_command(c, tokens, ntokens, comm, true);
+
+    } else if ((cmd == ASCII_CMD_LGET || cmd == ASCII_CMD_LSET) &&
+               !settings.leases) {
+
+        out_string(c, "CLIENT_ERROR leases disabled");
+
+    } else if (ntokens == 3 && cmd == ASCII_CMD_LGET) {
+
+        process_lease_get_command(c, tokens, ntokens);
+
+    } else if ((ntokens == 7 || ntokens == 8) && (cmd == ASCII_CMD_LSET && (comm = NREAD_LSET))) {
 
         process_update_command(c, tokens, ntokens, comm, true);
 
-    } else if ((ntokens == 4 || ntokens == 5) && (strcmp(tokens[COMMAND_TOKEN].value, "incr") == 0)) {
+    } else if ((ntokens == 4 || ntokens == 5) && cmd == ASCII_CMD_INCR) {
 
         process_arithmetic_command(c, tokens, ntokens, 1);
 
-    } else if (ntokens >= 3 && (strcmp(tokens[COMMAND_TOKEN].value, "gets") == 0)) {
+    } else if (ntokens >= 3 && cmd == ASCII_CMD_GETS) {
 
         process_get_command(c, tokens, ntokens, true);
 
-    } else if ((ntokens == 4 || ntokens == 5) && (strcmp(tokens[COMMAND_TOKEN].value, "decr") == 0)) {
+    } else if ((ntokens == 4 || ntokens == 5) && cmd == ASCII_CMD_DECR) {
 
         process_arithmetic_command(c, tokens, ntokens, 0);
 
-    } else if (ntokens >= 3 && ntokens <= 5 && (strcmp(tokens[COMMAND_TOKEN].value, "delete") == 0)) {
+    } else if (ntokens >= 3 && ntokens <= 5 && cmd == ASCII_CMD_DELETE) {
 
         process_delete_command(c, tokens, ntokens);
 
-    } else if ((ntokens == 4 || ntokens == 5) && (strcmp(tokens[COMMAND_TOKEN].value, "touch") == 0)) {
+    } else if (ntokens >= 6 && cmd == ASCII_CMD_SET_MULTI) {
+
+        process_set_multi_command(c, tokens, ntokens);
+
+    } else if (ntokens >= 3 && cmd == ASCII_CMD_DELETE_MULTI) {
+
+        process_delete_multi_command(c, tokens, ntokens);
+
+    } else if ((ntokens == 4 || ntokens == 5) && cmd == ASCII_CMD_TOUCH) {
 
         process_touch_command(c, tokens, ntokens);
 
-    } else if (ntokens >= 2 && (strcmp(tokens[COMMAND_TOKEN].value, "stats") == 0)) {
+    } else if (ntokens >= 2 && cmd == ASCII_CMD_STATS) {
 
         process_stat(c, tokens, ntokens);
 
-    } else if (ntokens >= 2 && ntokens <= 4 && (strcmp(tokens[COMMAND_TOKEN].value, "flush_all") == 0)) {
+    } else if (ntokens >= 2 && ntokens <= 4 && cmd == ASCII_CMD_FLUSH_ALL) {
         time_t exptime = 0;
 
         set_noreply_maybe(c, tokens, ntokens);
 
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.flush_cmds++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_INCR(c, flush_cmds);
 
         if (!settings.flush_enabled) {
             // flush_all is not allowed but we log it on stats
@@ -3506,15 +5034,21 @@ static void process_command(conn *c, char *command) {
         out_string(c, "OK");
         return;
 
-    } else if (ntokens == 2 && (strcmp(tokens[COMMAND_TOKEN].value, "version") == 0)) {
+    } else if (ntokens == 2 && cmd == ASCII_CMD_VERSION) {
 
         out_string(c, "VERSION " VERSION);
 
-    } else if (ntokens == 2 && (strcmp(tokens[COMMAND_TOKEN].value, "quit") == 0)) {
+    } else if (ntokens == 2 && cmd == ASCII_CMD_QUIT) {
 
-        conn_set_state(c, conn_closing);
+        if (c->resp_cmds > 0) {
+            /* Answer the commands before it first. */
+            c->write_and_go = conn_closing;
+            conn_set_state(c, conn_mwrite);
+        } else {
+            conn_set_state(c, conn_closing);
+        }
 
-    } else if (ntokens == 2 && (strcmp(tokens[COMMAND_TOKEN].value, "shutdown") == 0)) {
+    } else if (ntokens == 2 && cmd == ASCII_CMD_SHUTDOWN) {
 
         if (settings.shutdown_command) {
             conn_set_state(c, conn_closing);
@@ -3523,7 +5057,7 @@ static void process_command(conn *c, char *command) {
             out_string(c, "ERROR: shutdown not enabled");
         }
 
-    } else if (ntokens > 1 && strcmp(tokens[COMMAND_TOKEN].value, "slabs") == 0) {
+    } else if (ntokens > 1 && cmd == ASCII_CMD_SLABS) {
         if (ntokens == 5 && strcmp(tokens[COMMAND_TOKEN + 1].value, "reassign") == 0) {
             int src, dst, rv;
 
@@ -3565,7 +5099,7 @@ static void process_command(conn *c, char *command) {
         } else {
             out_string(c, "ERROR");
         }
-    } else if (ntokens > 1 && strcmp(tokens[COMMAND_TOKEN].value, "lru_crawler") == 0) {
+    } else if (ntokens > 1 && cmd == ASCII_CMD_LRU_CRAWLER) {
         if (ntokens == 4 && strcmp(tokens[COMMAND_TOKEN + 1].value, "crawl") == 0) {
             int rv;
             if (settings.lru_crawler == false) {
@@ -3628,14 +5162,226 @@ static void process_command(conn *c, char *command) {
         } else {
             out_string(c, "ERROR");
         }
-    } else if ((ntokens == 3 || ntokens == 4) && (strcmp(tokens[COMMAND_TOKEN].value, "verbosity") == 0)) {
+    } else if ((ntokens == 3 || ntokens == 4) && cmd == ASCII_CMD_VERBOSITY) {
         process_verbosity_command(c, tokens, ntokens);
+    } else if ((ntokens == 3 || ntokens == 4) && cmd == ASCII_CMD_EVICTION_POLICY) {
+        process_eviction_policy_command(c, tokens, ntokens);
     } else {
         out_string(c, "ERROR");
     }
     return;
 }
 
+/*
+ * Clients send a binary multiget as a run of GETQ/GETKQ packets closed by a
+ * NOOP. When such a run is in the read buffer it is answered here in one
+ * pass rather than one trip through the state machine per key: the keys of
+ * up to BIN_GET_BATCH packets are looked up by item_get_multi(), and the hits
+ * and the NOOP all go into one msghdr list. Their headers live in wbuf, which
+ * bounds the hits of one pass; the rest of a longer run is left for the next.
+ * They are packed there back to back, so they are only written with memcpy().
+ */
+#define BIN_GET_BATCH 16
+/* A get response's header and flags, as sent */
+#define BIN_GET_RSP_LEN (sizeof(protocol_binary_response_header) + 4)
+
+struct bin_get {
+    const char *key;
+    uint16_t nkey;
+    uint8_t opcode;
+    uint32_t opaque;
+};
+
+/*
+ * Returns the length of the complete packet with one of the opcodes a run is
+ * made of at p, or 0 if there isn't one.
+ */
+static size_t bin_get_packet(const char *p, const size_t avail,
+                             const bool noop, struct bin_get *g) {
+    protocol_binary_request_header req;
+    size_t nkey;
+
+    if (avail < sizeof(req))
+        return 0;
+    /* The packets of a run needn't be aligned. */
+    memcpy(&req, p, sizeof(req));
+    if (req.request.magic != PROTOCOL_BINARY_REQ || req.request.extlen != 0)
+        return 0;
+    nkey = ntohs(req.request.keylen);
+    if (noop) {
+        if (req.request.opcode != PROTOCOL_BINARY_CMD_NOOP || nkey != 0 ||
+            req.request.bodylen != 0)
+            return 0;
+    } else if ((req.request.opcode != PROTOCOL_BINARY_CMD_GETQ &&
+                req.request.opcode != PROTOCOL_BINARY_CMD_GETKQ) ||
+               nkey == 0 || nkey > KEY_MAX_LENGTH ||
+               ntohl(req.request.bodylen) != nkey ||
+               avail < sizeof(req) + nkey) {
+        return 0;
+    }
+    g->key = p + sizeof(req);
+    g->nkey = nkey;
+    g->opcode = req.request.opcode;
+    g->opaque = req.request.opaque;
+    return sizeof(req) + nkey;
+}
+
+static void bin_get_header(char *dst, const struct bin_get *g,
+                           const uint16_t keylen, const uint8_t extlen,
+                           const uint32_t bodylen, const uint64_t cas) {
+    protocol_binary_response_header h;
+
+    memset(&h, 0, sizeof(h));
+    h.response.magic = (uint8_t)PROTOCOL_BINARY_RES;
+    h.response.opcode = g->opcode;
+    h.response.keylen = (uint16_t)htons(keylen);
+    h.response.extlen = extlen;
+    h.response.datatype = (uint8_t)PROTOCOL_BINARY_RAW_BYTES;
+    h.response.bodylen = htonl(bodylen);
+    h.response.opaque = g->opaque;
+    h.response.cas = htonll(cas);
+    memcpy(dst, h.bytes, sizeof(h.bytes));
+}
+
+/*
+ * Adds the response to a hit behind the ones before it, taking over the
+ * item reference.
+ *
+ * Returns 0 on success, -1 on out-of-memory with nothing added.
+ */
+static int bin_get_add_hit(conn *c, char *rsp, const struct bin_get *g,
+                           item *it) {
+    const uint16_t keylen = g->opcode == PROTOCOL_BINARY_CMD_GETKQ ? g->nkey : 0;
+    const uint8_t extlen = BIN_GET_RSP_LEN - sizeof(protocol_binary_response_header);
+    const int msgused = c->msgused;
+    const int iovused = c->iovused;
+    const int msgbytes = c->msgbytes;
+    uint32_t flags;
+    struct msghdr *m;
+
+    if (conn_hold_item(c, it) != 0)
+        return -1;
+
+    /* the length has two unnecessary bytes ("\r\n") */
+    bin_get_header(rsp, g, keylen, extlen,
+                   extlen + keylen + it->nbytes - 2, ITEM_get_cas(it));
+    flags = htonl(strtoul(ITEM_suffix(it), NULL, 10));
+    memcpy(rsp + sizeof(protocol_binary_response_header), &flags, extlen);
+    if (add_iov(c, rsp, BIN_GET_RSP_LEN) == 0 &&
+        (keylen == 0 || add_iov(c, ITEM_key(it), keylen) == 0) &&
+        add_iov(c, ITEM_data(it), it->nbytes - 2) == 0)
+        return 0;
+
+    c->ileft--;
+    c->msgused = msgused;
+    c->iovused = iovused;
+    c->msgbytes = msgbytes;
+    m = &c->msglist[c->msgused - 1];
+    m->msg_iovlen = &c->iov[c->iovused] - m->msg_iov;
+    return -1;
+}
+
+/*
+ * Returns true if a run of quiet gets at rcurr was (at least partly)
+ * answered, false to leave the packet there to the usual path.
+ */
+static bool process_bin_get_batch(conn *c) {
+    struct bin_get batch[BIN_GET_BATCH];
+    const char *keys[BIN_GET_BATCH];
+    size_t nkeys[BIN_GET_BATCH];
+    item *its[BIN_GET_BATCH];
+    char *rsp = c->wbuf;
+    /* Keep room for the NOOP's header. */
+    const int maxhits = c->wsize / BIN_GET_RSP_LEN - 1;
+    int hits = 0, answered = 0, n, i;
+    size_t len, off;
+    bool full = false;
+
+    if (IS_UDP(c->transport) || settings.verbose > 1 ||
+        settings.capture_file != NULL || (settings.sasl && !authenticated(c)) ||
+        bin_get_packet(c->rcurr, c->rbytes, false, &batch[0]) == 0)
+        return false;
+
+    c->msgcurr = 0;
+    c->msgused = 0;
+    c->iovused = 0;
+    if (add_msghdr(c) != 0)
+        return false;
+    c->lat_cmd = LAT_GET;
+    c->cmd_start = latency_now();
+
+    do {
+        /* Each packet may hit, so take no more than wbuf has room for. */
+        for (n = 0, off = 0; n < BIN_GET_BATCH && hits + n < maxhits; n++) {
+            len = bin_get_packet(c->rcurr + off, c->rbytes - off, false,
+                                 &batch[n]);
+            if (len == 0)
+                break;
+            off += len;
+            keys[n] = batch[n].key;
+            nkeys[n] = batch[n].nkey;
+        }
+        item_get_multi(keys, nkeys, its, n);
+
+        for (i = 0; i < n; i++) {
+            struct bin_get *g = &batch[i];
+            item *it = its[i];
+
+            if (it != NULL) {
+                if (bin_get_add_hit(c, rsp + hits * BIN_GET_RSP_LEN, g, it) != 0) {
+                    for (; i < n; i++) {
+                        if (its[i] != NULL)
+                            item_remove(its[i]);
+                    }
+                    full = true;
+                    break;
+                }
+                item_update(it);
+                THR_STATS_INCR(c, get_cmds);
+                THR_STATS_INCR(c, slab_stats[it->slabs_clsid].get_hits);
+                MEMCACHED_COMMAND_GET(c->sfd, ITEM_key(it), it->nkey,
+                                      it->nbytes, ITEM_get_cas(it));
+                hits++;
+            } else {
+                THR_STATS_INCR(c, get_cmds);
+                THR_STATS_INCR(c, get_misses);
+                item_ghost_miss(g->key, g->nkey);
+                MEMCACHED_COMMAND_GET(c->sfd, g->key, g->nkey, -1, 0);
+            }
+            hotkey_sample(c, LAT_GET, g->key, g->nkey);
+            if (settings.detail_enabled) {
+                stats_prefix_record_get(g->key, g->nkey, NULL != it);
+            }
+
+            len = sizeof(protocol_binary_request_header) + g->nkey;
+            c->rcurr += len;
+            c->rbytes -= len;
+            answered++;
+        }
+    } while (n > 0 && !full);
+
+    if (answered == 0) {
+        c->lat_cmd = LAT_NONE;
+        return false;
+    }
+
+    /* The NOOP closing the run goes out with it. */
+    if (!full && (len = bin_get_packet(c->rcurr, c->rbytes, true,
+                                       &batch[0])) > 0) {
+        char *noop = rsp + hits * BIN_GET_RSP_LEN;
+        if (add_iov(c, noop, sizeof(protocol_binary_response_header)) == 0) {
+            bin_get_header(noop, &batch[0], 0, 0, 0, 0);
+            c->rcurr += len;
+            c->rbytes -= len;
+        }
+    }
+
+    THR_STATS_ADD(c, bin_multiget_keys, answered);
+    c->write_and_go = conn_new_cmd;
+    conn_set_state(c, c->iovused > 0 ? conn_mwrite : conn_new_cmd);
+    return true;
+}
+
 /*
  * if we have a complete line in the buffer, process it.
  */
@@ -3645,7 +5391,7 @@ static int try_read_command(conn *c) {
     assert(c->rbytes > 0);
 
     if (c->protocol == negotiating_prot || c->transport == udp_transport)  {
-        if ((unsigned char)c->rbuf[0] == (unsigned char)PROTOCOL_BINARY_REQ) {
+        if ((unsigned char)c->rcurr[0] == (unsigned char)PROTOCOL_BINARY_REQ) {
             c->protocol = binary_prot;
         } else {
             c->protocol = ascii_prot;
@@ -3662,6 +5408,8 @@ static int try_read_command(conn *c) {
         if (c->rbytes < sizeof(c->binary_header)) {
             /* need more data! */
             return 0;
+        } else if (process_bin_get_batch(c)) {
+            return 1;
         } else {
 #ifdef NEED_ALIGN
             if (((long)(c->rcurr)) % 8 != 0) {
@@ -3734,7 +5482,8 @@ static int try_read_command(conn *c) {
             if (c->rbytes > 1024) {
                 /*
                  * We didn't have a '\n' in the first k. This _has_ to be a
-                 * large multiget, if not we should just nuke the connection.
+                 * large multiget or multi-key set or delete, if not we
+                 * should just nuke the connection.
                  */
                 char *ptr = c->rcurr;
                 while (*ptr == ' ') { /* ignore leading whitespaces */
@@ -3742,7 +5491,9 @@ static int try_read_command(conn *c) {
                 }
 
                 if (ptr - c->rcurr > 100 ||
-                    (strncmp(ptr, "get ", 4) && strncmp(ptr, "gets ", 5))) {
+                    (strncmp(ptr, "get ", 4) && strncmp(ptr, "gets ", 5) &&
+                     strncmp(ptr, "set_multi ", 10) &&
+                     strncmp(ptr, "delete_multi ", 13))) {
 
                     conn_set_state(c, conn_closing);
                     return 1;
@@ -3771,6 +5522,174 @@ static int try_read_command(conn *c) {
     return 1;
 }
 
+#ifdef UDP_MMSG
+/*
+ * A UDP conn reads up to UDP_BATCH datagrams with one recvmmsg(), each into
+ * a read buffer of its own, the conn's rbuf being one of them. For each
+ * datagram c->rbuf is switched to its buffer, with rcurr past the frame
+ * header, so nothing is moved. The datagrams after it are processed before
+ * the socket is polled again.
+ */
+#define UDP_BATCH 16
+#define UDP_SEND_BATCH 64       /* datagrams of a response per sendmmsg() */
+
+struct udp_batch {
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+    struct sockaddr_in6 addrs[UDP_BATCH];
+    char *bufs[UDP_BATCH];
+    int sizes[UDP_BATCH];
+    int cur;                    /* the datagram c->rbuf belongs to */
+    int next;                   /* the next one to process */
+    int count;                  /* how many the last recvmmsg() got */
+    struct mmsghdr out[UDP_SEND_BATCH];
+};
+
+static bool udp_batch_init(conn *c) {
+    struct udp_batch *b = calloc(1, sizeof(struct udp_batch));
+    int i;
+
+    if (b == NULL) {
+        STATS_LOCK();
+        stats.malloc_fails++;
+        STATS_UNLOCK();
+        return false;
+    }
+    b->bufs[0] = c->rbuf;
+    b->sizes[0] = c->rsize;
+    for (i = 1; i < UDP_BATCH; i++) {
+        b->sizes[i] = c->rsize;
+        if ((b->bufs[i] = malloc(c->rsize)) == NULL) {
+            while (--i > 0)
+                free(b->bufs[i]);
+            free(b);
+            STATS_LOCK();
+            stats.malloc_fails++;
+            STATS_UNLOCK();
+            return false;
+        }
+    }
+    c->udp_batch = b;
+    return true;
+}
+
+static void udp_batch_free(conn *c) {
+    struct udp_batch *b = c->udp_batch;
+    int i;
+
+    if (b == NULL)
+        return;
+    b->bufs[b->cur] = c->rbuf;
+    for (i = 0; i < UDP_BATCH; i++)
+        free(b->bufs[i]);
+    free(b);
+    c->udp_batch = NULL;
+    c->rbuf = NULL;
+}
+
+static bool udp_batch_pending(conn *c) {
+    return c->udp_batch != NULL && c->udp_batch->next < c->udp_batch->count;
+}
+
+/*
+ * Sends the datagrams of a UDP response that are left in one call.
+ * Returns how many went out, or -1 with errno set.
+ */
+static int udp_sendmmsg(conn *c) {
+    struct mmsghdr *out = c->udp_batch->out;
+    int n = c->msgused - c->msgcurr;
+    int i, res;
+
+    if (n > UDP_SEND_BATCH)
+        n = UDP_SEND_BATCH;
+    for (i = 0; i < n; i++) {
+        out[i].msg_hdr = c->msglist[c->msgcurr + i];
+        out[i].msg_len = 0;
+    }
+    res = sendmmsg(c->sfd, out, n, 0);
+    for (i = 0; i < res; i++)
+        THR_STATS_ADD(c, bytes_written, out[i].msg_len);
+    if (res > 0) {
+        /* transmit() moves past the last one sent next time. */
+        c->msgcurr += res - 1;
+        c->msglist[c->msgcurr].msg_iovlen = 0;
+    }
+    return res;
+}
+
+/*
+ * read a UDP request.
+ */
+static enum try_read_result try_read_udp(conn *c) {
+    struct udp_batch *b = c->udp_batch;
+    unsigned char *buf;
+    int i, res;
+
+    assert(c != NULL);
+
+    /* A binary request may have made it larger. */
+    b->bufs[b->cur] = c->rbuf;
+    b->sizes[b->cur] = c->rsize;
+
+    for (;;) {
+        if (b->next == b->count) {
+            b->next = b->count = 0;
+            for (i = 0; i < UDP_BATCH; i++) {
+                b->iovs[i].iov_base = b->bufs[i];
+                b->iovs[i].iov_len = b->sizes[i];
+                b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+                b->msgs[i].msg_hdr.msg_iovlen = 1;
+                b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+                b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+            }
+            res = recvmmsg(c->sfd, b->msgs, UDP_BATCH, 0, NULL);
+            if (res <= 0)
+                return READ_NO_DATA_RECEIVED;
+            b->count = res;
+        }
+
+        i = b->next++;
+        res = b->msgs[i].msg_len;
+        if (res <= 8)
+            continue;
+        b->cur = i;
+        c->rbuf = b->bufs[i];
+        c->rsize = b->sizes[i];
+        memcpy(&c->request_addr, &b->addrs[i], b->msgs[i].msg_hdr.msg_namelen);
+        c->request_addr_size = b->msgs[i].msg_hdr.msg_namelen;
+
+        buf = (unsigned char *)c->rbuf;
+        THR_STATS_ADD(c, bytes_read, res);
+
+        /* Beginning of UDP packet is the request ID; save it. */
+        c->request_id = buf[0] * 256 + buf[1];
+
+        /* If this is a multi-packet request, drop it. */
+        if (buf[4] != 0 || buf[5] != 1) {
+            out_string(c, "SERVER_ERROR multi-packet request not supported");
+            return READ_NO_DATA_RECEIVED;
+        }
+
+        /* Don't care about any of the rest of the header. */
+        c->rbytes = res - 8;
+        c->rcurr = c->rbuf + 8;
+        return READ_DATA_RECEIVED;
+    }
+}
+
+#else
+
+static bool udp_batch_init(conn *c) {
+    return true;
+}
+
+static void udp_batch_free(conn *c) {
+}
+
+static bool udp_batch_pending(conn *c) {
+    return false;
+}
+
 /*
  * read a UDP request.
  */
@@ -3785,9 +5704,7 @@ static enum try_read_result try_read_udp(conn *c) {
                    &c->request_addr_size);
     if (res > 8) {
         unsigned char *buf = (unsigned char *)c->rbuf;
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.bytes_read += res;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_ADD(c, bytes_read, res);
 
         /* Beginning of UDP packet is the request ID; save it. */
         c->request_id = buf[0] * 256 + buf[1];
@@ -3809,6 +5726,8 @@ static enum try_read_result try_read_udp(conn *c) {
     return READ_NO_DATA_RECEIVED;
 }
 
+#endif
+
 /*
  * read from network as much as we can, handle buffer overflow and connection
  * close.
@@ -3827,14 +5746,30 @@ static enum try_read_result try_read_network(conn *c) {
     int num_allocs = 0;
     assert(c != NULL);
 
-    if (c->rcurr != c->rbuf) {
-        if (c->rbytes != 0) /* otherwise there's nothing to copy */
-            memmove(c->rbuf, c->rcurr, c->rbytes);
+    /* After a large value, read no more than the next command's header, so
+     * that if it is another large value it can go straight into its item
+     * instead of through rbuf. */
+    bool header_only = c->read_header && c->rbytes == 0 && !c->uring;
+    c->read_header = false;
+
+    /* What is left unparsed is only moved to the front when less than half
+     * of rbuf is free behind it, not on every read. */
+    if (c->rbytes == 0) {
+        c->rcurr = c->rbuf;
+    } else if (c->rcurr != c->rbuf &&
+               c->rsize - (c->rcurr - c->rbuf) - c->rbytes < c->rsize / 2) {
+        memmove(c->rbuf, c->rcurr, c->rbytes);
         c->rcurr = c->rbuf;
     }
 
     while (1) {
-        if (c->rbytes >= c->rsize) {
+        int avail = c->rsize - (c->rcurr - c->rbuf) - c->rbytes;
+        if (avail == 0 && c->rcurr != c->rbuf) {
+            memmove(c->rbuf, c->rcurr, c->rbytes);
+            c->rcurr = c->rbuf;
+            avail = c->rsize - c->rbytes;
+        }
+        if (avail == 0) {
             if (num_allocs == 4) {
                 return gotdata;
             }
@@ -3854,17 +5789,20 @@ static enum try_read_result try_read_network(conn *c) {
             }
             c->rcurr = c->rbuf = new_rbuf;
             c->rsize *= 2;
+            avail = c->rsize - c->rbytes;
         }
 
-        int avail = c->rsize - c->rbytes;
-        res = read(c->sfd, c->rbuf + c->rbytes, avail);
+        if (header_only && avail > HEADER_READ_SIZE)
+            avail = HEADER_READ_SIZE;
+        if (c->uring)
+            res = uring_read(c, c->rcurr + c->rbytes, avail);
+        else
+            res = read(c->sfd, c->rcurr + c->rbytes, avail);
         if (res > 0) {
-            pthread_mutex_lock(&c->thread->stats.mutex);
-            c->thread->stats.bytes_read += res;
-            pthread_mutex_unlock(&c->thread->stats.mutex);
+            THR_STATS_ADD(c, bytes_read, res);
             gotdata = READ_DATA_RECEIVED;
             c->rbytes += res;
-            if (res == avail) {
+            if (res == avail && !header_only) {
                 continue;
             } else {
                 break;
@@ -3886,6 +5824,9 @@ static enum try_read_result try_read_network(conn *c) {
 static bool update_event(conn *c, const int new_flags) {
     assert(c != NULL);
 
+    if (c->uring)
+        return uring_update_event(c, new_flags);
+
     struct event_base *base = c->event.ev_base;
     if (c->ev_flags == new_flags)
         return true;
@@ -3952,12 +5893,31 @@ static enum transmit_result transmit(conn *c) {
     if (c->msgcurr < c->msgused) {
         ssize_t res;
         struct msghdr *m = &c->msglist[c->msgcurr];
-
-        res = sendmsg(c->sfd, m, 0);
+        int flags = 0, hidden = 0;
+
+        /* Large values go on their own, see zerocopy.c. */
+        if (c->zerocopy && c->state == conn_mwrite)
+            flags = zerocopy_prepare(c, m, &hidden);
+        if (c->uring) {
+            /* EAGAIN until the ring has sent it, see uring.c. */
+            res = uring_sendmsg(c, m);
+#ifdef UDP_MMSG
+        } else if (IS_UDP(c->transport) && c->msgused - c->msgcurr > 1) {
+            /* The rest of a multi-packet response in one call. */
+            res = udp_sendmmsg(c);
+            THR_STATS_INCR(c, sendmsg_calls);
+            if (res > 0)
+                return TRANSMIT_INCOMPLETE;
+#endif
+        } else {
+            res = sendmsg(c->sfd, m, flags);
+            THR_STATS_INCR(c, sendmsg_calls);
+        }
+        if (flags != 0)
+            res = zerocopy_sent(c, m, res);
+        m->msg_iovlen += hidden;
         if (res > 0) {
-            pthread_mutex_lock(&c->thread->stats.mutex);
-            c->thread->stats.bytes_written += res;
-            pthread_mutex_unlock(&c->thread->stats.mutex);
+            THR_STATS_ADD(c, bytes_written, res);
 
             /* We've written some of the data. Remove the completed
                iovec entries from the list of pending writes. */
@@ -4074,6 +6034,13 @@ static void drive_machine(conn *c) {
             break;
 
         case conn_waiting:
+            /* Datagrams from the last recvmmsg() aren't polled for. */
+            if (udp_batch_pending(c)) {
+                conn_set_state(c, conn_read);
+                break;
+            }
+            if (c->rbytes == 0)
+                conn_bufs_release(c);
             if (!update_event(c, EV_READ | EV_PERSIST)) {
                 if (settings.verbose > 0)
                     fprintf(stderr, "Couldn't update event\n");
@@ -4086,6 +6053,12 @@ static void drive_machine(conn *c) {
             break;
 
         case conn_read:
+            if (!conn_bufs_borrow(c)) {
+                if (settings.verbose > 0)
+                    fprintf(stderr, "Couldn't allocate buffers\n");
+                conn_set_state(c, conn_closing);
+                break;
+            }
             res = IS_UDP(c->transport) ? try_read_udp(c) : try_read_network(c);
 
             switch (res) {
@@ -4106,8 +6079,12 @@ static void drive_machine(conn *c) {
 
         case conn_parse_cmd :
             if (try_read_command(c) == 0) {
-                /* wee need more data! */
-                conn_set_state(c, conn_waiting);
+                /* wee need more data! Send what's queued meanwhile. */
+                if (c->resp_cmds > 0) {
+                    conn_set_state(c, conn_mwrite);
+                } else {
+                    conn_set_state(c, conn_waiting);
+                }
             }
 
             break;
@@ -4120,10 +6097,8 @@ static void drive_machine(conn *c) {
             if (nreqs >= 0) {
                 reset_cmd_handler(c);
             } else {
-                pthread_mutex_lock(&c->thread->stats.mutex);
-                c->thread->stats.conn_yields++;
-                pthread_mutex_unlock(&c->thread->stats.mutex);
-                if (c->rbytes > 0) {
+                THR_STATS_INCR(c, conn_yields);
+                if (c->rbytes > 0 || udp_batch_pending(c)) {
                     /* We have already read in data into the input buffer,
                        so libevent will most likely not signal read events
                        on the socket (unless more data is available. As a
@@ -4156,11 +6131,16 @@ static void drive_machine(conn *c) {
                 break;
             }
 
+            /* Likely followed by more like it, see try_read_network(). */
+            if (c->rlbytes >= DIRECT_READ_MIN)
+                c->read_header = true;
+
             /* first check if we have leftovers in the conn_read buffer */
             if (c->rbytes > 0) {
                 int tocopy = c->rbytes > c->rlbytes ? c->rlbytes : c->rbytes;
                 if (c->ritem != c->rcurr) {
                     memmove(c->ritem, c->rcurr, tocopy);
+                    THR_STATS_ADD(c, value_bytes_copied, tocopy);
                 }
                 c->ritem += tocopy;
                 c->rlbytes -= tocopy;
@@ -4172,13 +6152,19 @@ static void drive_machine(conn *c) {
             }
 
             /*  now try reading from the socket */
-            res = read(c->sfd, c->ritem, c->rlbytes);
+            if (c->uring)
+                res = uring_read(c, c->ritem, c->rlbytes);
+            else
+                res = read(c->sfd, c->ritem, c->rlbytes);
             if (res > 0) {
-                pthread_mutex_lock(&c->thread->stats.mutex);
-                c->thread->stats.bytes_read += res;
-                pthread_mutex_unlock(&c->thread->stats.mutex);
+                THR_STATS_ADD(c, bytes_read, res);
                 if (c->rcurr == c->ritem) {
                     c->rcurr += res;
+                } else if (c->uring) {
+                    /* From the ring's buffers, see uring.c. */
+                    THR_STATS_ADD(c, value_bytes_copied, res);
+                } else {
+                    THR_STATS_ADD(c, value_bytes_direct, res);
                 }
                 c->ritem += res;
                 c->rlbytes -= res;
@@ -4213,7 +6199,11 @@ static void drive_machine(conn *c) {
         case conn_swallow:
             /* we are reading sbytes and throwing them away */
             if (c->sbytes == 0) {
-                conn_set_state(c, conn_new_cmd);
+                if (c->multi != NULL) {
+                    multi_read_next(c);
+                } else {
+                    conn_set_state(c, conn_new_cmd);
+                }
                 break;
             }
 
@@ -4227,11 +6217,12 @@ static void drive_machine(conn *c) {
             }
 
             /*  now try reading from the socket */
-            res = read(c->sfd, c->rbuf, c->rsize > c->sbytes ? c->sbytes : c->rsize);
+            if (c->uring)
+                res = uring_read(c, c->rbuf, c->rsize > c->sbytes ? c->sbytes : c->rsize);
+            else
+                res = read(c->sfd, c->rbuf, c->rsize > c->sbytes ? c->sbytes : c->rsize);
             if (res > 0) {
-                pthread_mutex_lock(&c->thread->stats.mutex);
-                c->thread->stats.bytes_read += res;
-                pthread_mutex_unlock(&c->thread->stats.mutex);
+                THR_STATS_ADD(c, bytes_read, res);
                 c->sbytes -= res;
                 break;
             }
@@ -4261,7 +6252,8 @@ static void drive_machine(conn *c) {
              * assemble it into a msgbuf list (this will be a single-entry
              * list for TCP or a two-entry list for UDP).
              */
-            if (c->iovused == 0 || (IS_UDP(c->transport) && c->iovused == 1)) {
+            if (c->iovused == c->resp_iovused ||
+                (IS_UDP(c->transport) && c->iovused == 1)) {
                 if (add_iov(c, c->wcurr, c->wbytes) != 0) {
                     if (settings.verbose > 0)
                         fprintf(stderr, "Couldn't build response\n");
@@ -4273,6 +6265,12 @@ static void drive_machine(conn *c) {
             /* fall through... */
 
         case conn_mwrite:
+          if (conn_queue_response(c, nreqs)) {
+              conn_set_state(c, c->state == conn_write ?
+                             c->write_and_go : conn_new_cmd);
+              break;
+          }
+          c->resp_sending = true;
           if (IS_UDP(c->transport) && c->msgcurr == 0 && build_udp_headers(c) != 0) {
             if (settings.verbose > 0)
               fprintf(stderr, "Failed to build UDP headers\n");
@@ -4282,9 +6280,12 @@ static void drive_machine(conn *c) {
             switch (transmit(c)) {
             case TRANSMIT_COMPLETE:
                 if (c->state == conn_mwrite) {
+                    zerocopy_hold(c);
                     conn_release_items(c);
+                    resp_queue_reset(c);
                     /* XXX:  I don't know why this wasn't the general case */
-                    if(c->protocol == binary_prot) {
+                    if(c->protocol == binary_prot ||
+                       c->write_and_go == conn_closing) {
                         conn_set_state(c, c->write_and_go);
                     } else {
                         conn_set_state(c, conn_new_cmd);
@@ -4294,6 +6295,10 @@ static void drive_machine(conn *c) {
                         free(c->write_and_free);
                         c->write_and_free = 0;
                     }
+                    /* Queued get responses hold items too. */
+                    if (c->resp_cmds > 0)
+                        conn_release_items(c);
+                    resp_queue_reset(c);
                     conn_set_state(c, c->write_and_go);
                 } else {
                     if (settings.verbose > 0)
@@ -4350,6 +6355,10 @@ void event_handler(const int fd, const short which, void *arg) {
         return;
     }
 
+    /* Completions of zero-copy sends keep the socket readable. */
+    if (c->zc_next != c->zc_done)
+        zerocopy_reap(c);
+
     drive_machine(c);
 
     /* wait for next event */
@@ -4408,6 +6417,41 @@ static void maximize_sndbuf(const int sfd) {
         fprintf(stderr, "<%d send buffer was %d, now %d\n", sfd, old_size, last_good);
 }
 
+/*
+ * Another socket on the UDP port of sfd, for the next worker thread. Bound
+ * with SO_REUSEPORT, the kernel spreads datagrams over the sockets by
+ * sender, and a datagram wakes up just the thread it was queued for. Falls
+ * back to a duplicate of sfd, which all threads then wait on.
+ */
+static int udp_thread_socket(int sfd, struct addrinfo *ai) {
+#ifdef SO_REUSEPORT
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    int flags = 1;
+    int fd;
+
+    /* The port sfd got, if it was asked for any. */
+    if (getsockname(sfd, (struct sockaddr *)&addr, &len) == 0 &&
+        (fd = new_socket(ai)) != -1) {
+#ifdef IPV6_V6ONLY
+        if (ai->ai_family == AF_INET6)
+            setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&flags,
+                       sizeof(flags));
+#endif
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags,
+                   sizeof(flags));
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags,
+                       sizeof(flags)) == 0 &&
+            bind(fd, (struct sockaddr *)&addr, len) == 0) {
+            maximize_sndbuf(fd);
+            return fd;
+        }
+        close(fd);
+    }
+#endif
+    return dup(sfd);
+}
+
 /**
  * Create a socket and bind it to a specific port number
  * @param interface the interface to bind to
@@ -4475,6 +6519,12 @@ static int server_socket(const char *interface,
         setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
         if (IS_UDP(transport)) {
             maximize_sndbuf(sfd);
+#ifdef SO_REUSEPORT
+            /* So that udp_thread_socket() can bind more to the port. */
+            if (settings.num_threads_per_udp > 1)
+                setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags,
+                           sizeof(flags));
+#endif
         } else {
             error = setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
             if (error != 0)
@@ -4540,7 +6590,7 @@ static int server_socket(const char *interface,
                  * among threads, so this is guaranteed to assign one
                  * FD to each thread.
                  */
-                int per_thread_fd = c ? dup(sfd) : sfd;
+                int per_thread_fd = c ? udp_thread_socket(sfd, next) : sfd;
                 dispatch_conn_new(per_thread_fd, conn_read,
                                   EV_READ | EV_PERSIST,
                                   UDP_READ_BUFFER_SIZE, transport);
@@ -4810,6 +6860,33 @@ static void usage(void) {
            "                default is 100.\n"
            "              - lru_crawler_tocrawl: Max items to crawl per slab per run\n"
            "                default is 0 (unlimited)\n"
+           "              - expiry_wheel: Index items with a TTL by expiration time\n"
+           "                and free them from a background thread as they expire\n"
+           "              - eviction_policy: How to pick items to evict when a slab\n"
+           "                class is full. options: lru (default), gdsf\n"
+           "              - gdsf_cost_flags: Use the top byte of client flags as a\n"
+           "                cost hint for the gdsf eviction policy\n"
+           "              - mrc: Sample keys to estimate the hit ratio at other\n"
+           "                memory sizes (see \"stats mrc\")\n"
+           "              - lock_stats: Time acquisitions of the cache, slabs,\n"
+           "                stats and item locks (see \"stats locks\")\n"
+           "              - capture: Log commands to this file, for the replay\n"
+           "                tool\n"
+           "              - capture_sample: Capture one connection in this many\n"
+           "                default is 1 (all of them)\n"
+           "              - hotkey_sample: Track one keyed command in this many\n"
+           "                for \"stats hotkeys\" (default: 100, 0 disables)\n"
+           "              - hotcache: Let each thread serve gets for the hottest\n"
+           "                keys from its own reference to the item\n"
+           "              - leases: Enable lget and lset\n"
+           "              - lease_ttl: Seconds a lease from lget is held\n"
+           "                (default: 10)\n"
+           "              - lease_stale: While a lease is held, answer lget\n"
+           "                with the expired value it replaced\n"
+           "              - zerocopy: Send values of at least this many bytes\n"
+           "                with MSG_ZEROCOPY (default: 16384 if no size)\n"
+           "              - io_uring: Run worker connections on io_uring\n"
+           "                instead of libevent, if the kernel allows\n"
            );
     return;
 }
@@ -5052,7 +7129,21 @@ int main (int argc, char **argv) {
         HASH_ALGORITHM,
         LRU_CRAWLER,
         LRU_CRAWLER_SLEEP,
-        LRU_CRAWLER_TOCRAWL
+        LRU_CRAWLER_TOCRAWL,
+        EXPIRY_WHEEL,
+        EVICTION_POLICY,
+        GDSF_COST_FLAGS,
+        MRC,
+        LOCK_STATS,
+        CAPTURE,
+        CAPTURE_SAMPLE,
+        HOTKEY_SAMPLE,
+        HOTCACHE,
+        LEASES,
+        LEASE_TTL,
+        LEASE_STALE,
+        ZEROCOPY,
+        IO_URING
     };
     char *const subopts_tokens[] = {
         [MAXCONNS_FAST] = "maxconns_fast",
@@ -5064,6 +7155,20 @@ int main (int argc, char **argv) {
         [LRU_CRAWLER] = "lru_crawler",
         [LRU_CRAWLER_SLEEP] = "lru_crawler_sleep",
         [LRU_CRAWLER_TOCRAWL] = "lru_crawler_tocrawl",
+        [EXPIRY_WHEEL] = "expiry_wheel",
+        [EVICTION_POLICY] = "eviction_policy",
+        [GDSF_COST_FLAGS] = "gdsf_cost_flags",
+        [MRC] = "mrc",
+        [LOCK_STATS] = "lock_stats",
+        [CAPTURE] = "capture",
+        [CAPTURE_SAMPLE] = "capture_sample",
+        [HOTKEY_SAMPLE] = "hotkey_sample",
+        [HOTCACHE] = "hotcache",
+        [LEASES] = "leases",
+        [LEASE_TTL] = "lease_ttl",
+        [LEASE_STALE] = "lease_stale",
+        [ZEROCOPY] = "zerocopy",
+        [IO_URING] = "io_uring",
         NULL
     };
 
@@ -5334,8 +7439,8 @@ int main (int argc, char **argv) {
                     break;
                 }
                 settings.slab_automove = atoi(subopts_value);
-                if (settings.slab_automove < 0 || settings.slab_automove > 2) {
-                    fprintf(stderr, "slab_automove must be between 0 and 2\n");
+                if (settings.slab_automove < 0 || settings.slab_automove > 3) {
+                    fprintf(stderr, "slab_automove must be between 0 and 3\n");
                     return 1;
                 }
                 break;
@@ -5384,6 +7489,93 @@ int main (int argc, char **argv) {
                 }
                 settings.lru_crawler_tocrawl = tocrawl;
                 break;
+            case EXPIRY_WHEEL:
+                settings.expiry_wheel = true;
+                break;
+            case EVICTION_POLICY:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing eviction_policy argument\n");
+                    return 1;
+                }
+                if ((settings.eviction_policy = eviction_policy_id(subopts_value)) < 0) {
+                    fprintf(stderr, "Unknown eviction_policy option (lru, gdsf)\n");
+                    return 1;
+                }
+                break;
+            case GDSF_COST_FLAGS:
+                settings.gdsf_cost_flags = true;
+                break;
+            case MRC:
+                settings.mrc = true;
+                break;
+            case LOCK_STATS:
+                settings.lock_stats = true;
+                break;
+            case CAPTURE:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing capture file name\n");
+                    return 1;
+                }
+                settings.capture_file = strdup(subopts_value);
+                break;
+            case CAPTURE_SAMPLE:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing numeric argument for capture_sample\n");
+                    return 1;
+                }
+                settings.capture_sample = atoi(subopts_value);
+                if (settings.capture_sample < 1) {
+                    fprintf(stderr, "capture_sample must be at least 1\n");
+                    return 1;
+                }
+                break;
+            case HOTKEY_SAMPLE:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing numeric argument for hotkey_sample\n");
+                    return 1;
+                }
+                settings.hotkey_sample = atoi(subopts_value);
+                if (settings.hotkey_sample < 0) {
+                    fprintf(stderr, "hotkey_sample must not be negative\n");
+                    return 1;
+                }
+                break;
+            case HOTCACHE:
+                settings.hotcache = true;
+                break;
+            case LEASES:
+                settings.leases = true;
+                break;
+            case LEASE_TTL:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing numeric argument for lease_ttl\n");
+                    return 1;
+                }
+                settings.lease_ttl = atoi(subopts_value);
+                if (settings.lease_ttl < 1) {
+                    fprintf(stderr, "lease_ttl must be at least 1\n");
+                    return 1;
+                }
+                break;
+            case LEASE_STALE:
+                settings.lease_stale = true;
+                break;
+            case ZEROCOPY:
+#ifdef HAVE_ZEROCOPY
+                settings.zerocopy = subopts_value ? atoi(subopts_value) : 16384;
+                if (settings.zerocopy < 1) {
+                    fprintf(stderr, "zerocopy must be at least 1 byte\n");
+                    return 1;
+                }
+#else
+                fprintf(stderr, "This platform has no MSG_ZEROCOPY\n");
+                return 1;
+#endif
+                break;
+            case IO_URING:
+                /* Falls back to libevent if it can't be set up. */
+                settings.io_uring = true;
+                break;
             default:
                 printf("Illegal suboption \"%s\"\n", subopts_value);
                 return 1;
@@ -5423,6 +7615,16 @@ int main (int argc, char **argv) {
         }
     }
 
+    if (settings.leases && !settings.use_cas) {
+        fprintf(stderr, "Lease tokens are CAS values, leases can't be used with -C\n");
+        exit(EX_USAGE);
+    }
+
+    if (settings.hotcache && settings.hotkey_sample == 0) {
+        fprintf(stderr, "hotcache finds hot keys by sampling, it needs a hotkey_sample above 0\n");
+        exit(EX_USAGE);
+    }
+
     if (tcp_specified && !udp_specified) {
         settings.udpport = settings.port;
     } else if (udp_specified && !tcp_specified) {
@@ -5547,6 +7749,19 @@ int main (int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
 
+    if (settings.expiry_wheel &&
+        start_expiry_wheel_thread() == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (settings.mrc && mrc_init() != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (settings.capture_file != NULL && capture_init() != 0) {
+        exit(EXIT_FAILURE);
+    }
+
     /* Run regardless of initializing it later */
     init_lru_crawler();
 
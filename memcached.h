@@ -23,6 +23,16 @@
 
 #include "sasl_defs.h"
 
+/* MSG_ZEROCOPY sends, see zerocopy.c */
+#if defined(HAVE_LINUX_ERRQUEUE_H) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#define HAVE_ZEROCOPY 1
+#endif
+
+/* UDP datagrams read and sent in batches, see try_read_udp() */
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+#define UDP_MMSG 1
+#endif
+
 /** Maximum length of a key. */
 #define KEY_MAX_LENGTH 250
 
@@ -38,6 +48,16 @@
  * Plus a few for spaces, \r\n, \0 */
 #define SUFFIX_SIZE 24
 
+/** Longest opaque token echoed back by the meta commands. */
+#define META_OPAQUE_MAX 32
+/** Most return flags a meta command can ask for. */
+#define META_RET_MAX 8
+
+/** Most keys a set_multi or delete_multi command can carry. */
+#define MULTI_KEYS_MAX 128
+/** Tokens of the longest set_multi line, see process_set_multi_command(). */
+#define MAX_MULTI_TOKENS (2 * MULTI_KEYS_MAX + 5)
+
 /** Initial size of list of items being returned by "get". */
 #define ITEM_LIST_INITIAL 200
 
@@ -50,12 +70,28 @@
 /** Initial number of sendmsg() argument structures to allocate. */
 #define MSG_LIST_INITIAL 10
 
+/** Values at least this large are mostly read straight into their items:
+ * the read after one is kept to HEADER_READ_SIZE, see try_read_network(). */
+#define DIRECT_READ_MIN 16384
+#define HEADER_READ_SIZE 512
+
+/** Most idle connection buffer sets a worker thread keeps, see
+ * conn_bufs_borrow(). */
+#define CONN_BUFS_POOL_MAX 256
+
 /** High water marks for buffer shrinking */
 #define READ_BUFFER_HIGHWAT 8192
 #define ITEM_LIST_HIGHWAT 400
 #define IOV_LIST_HIGHWAT 600
 #define MSG_LIST_HIGHWAT 100
 
+/** Responses to pipelined ASCII commands are held back and sent together
+ * until this many bytes or iovecs are queued. */
+#define RESP_QUEUE_BYTES (64 * 1024)
+#define RESP_QUEUE_IOV 256
+/** Room kept in wbuf for the response line of the next queued command. */
+#define RESP_QUEUE_WBUF_ROOM 1024
+
 /* Binary protocol stuff */
 #define MIN_BIN_PKT_LENGTH 16
 #define BIN_PKT_HDR_WORDS (MIN_BIN_PKT_LENGTH/sizeof(uint32_t))
@@ -174,6 +210,8 @@ enum bin_substates {
     bin_reading_sasl_auth,
     bin_reading_sasl_auth_data,
     bin_reading_touch_key,
+    bin_reading_multi_set_header,
+    bin_reading_multi_del_keys,
 };
 
 enum protocol {
@@ -193,6 +231,12 @@ enum item_lock_types {
     ITEM_LOCK_GLOBAL
 };
 
+enum eviction_policy_type {
+    EVICTION_LRU = 0,
+    EVICTION_GDSF,
+    EVICTION_POLICY_COUNT
+};
+
 #define IS_UDP(x) (x == udp_transport)
 
 #define NREAD_ADD 1
@@ -201,11 +245,17 @@ enum item_lock_types {
 #define NREAD_APPEND 4
 #define NREAD_PREPEND 5
 #define NREAD_CAS 6
+#define NREAD_LSET 7
 
 enum store_item_type {
     NOT_STORED=0, STORED, EXISTS, NOT_FOUND
 };
 
+/** Outcomes of lget, see do_item_lease_get(). */
+enum lease_result {
+    LEASE_HIT, LEASE_GRANTED, LEASE_HOT_MISS, LEASE_STALE, LEASE_NOMEM
+};
+
 enum delta_result_type {
     OK, NON_NUMERIC, EOM, DELTA_ITEM_NOT_FOUND, DELTA_ITEM_CAS_MISMATCH
 };
@@ -225,11 +275,38 @@ struct slab_stats {
     uint64_t  decr_hits;
 };
 
+/** Commands whose service time is recorded, see "stats latency". */
+enum latency_cmd {
+    LAT_NONE = 0, LAT_GET, LAT_SET, LAT_DELETE, LAT_INCR, LAT_TOUCH, LAT_MAX
+};
+
+/* Log-bucketed histogram of nanoseconds: each power of two is split into
+ * LATENCY_SUB_BUCKETS linear buckets, so a bucket is at most 12.5% wide.
+ * The last bucket collects everything from about an hour up. */
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS (40 * LATENCY_SUB_BUCKETS)
+
 /**
- * Stats stored per-thread.
+ * Latency histograms stored per-thread. Only the owning thread writes them,
+ * so they are updated and read without a lock.
+ */
+struct latency_stats {
+    uint64_t buckets[LAT_MAX][LATENCY_BUCKETS];
+};
+
+#if defined(__GNUC__)
+#define CACHE_LINE_ALIGNED __attribute__((aligned(64)))
+#else
+#define CACHE_LINE_ALIGNED
+#endif
+
+/**
+ * Stats stored per-thread. Only the worker thread owning them writes them,
+ * through THR_STATS_ADD(); threadlocal_stats_aggregate() reads them from any
+ * thread. Both sides use relaxed atomic accesses, so no lock is taken.
  */
 struct thread_stats {
-    pthread_mutex_t   mutex;
     uint64_t          get_cmds;
     uint64_t          get_misses;
     uint64_t          touch_cmds;
@@ -240,12 +317,41 @@ struct thread_stats {
     uint64_t          cas_misses;
     uint64_t          bytes_read;
     uint64_t          bytes_written;
+    uint64_t          value_bytes_copied;
+    uint64_t          value_bytes_direct;
     uint64_t          flush_cmds;
     uint64_t          conn_yields; /* # of yields for connections (-R option)*/
+    uint64_t          sendmsg_calls;
+    uint64_t          responses_coalesced;
+    uint64_t          bin_multiget_keys;
+    uint64_t          zerocopy_bytes;
+    uint64_t          zerocopy_fallbacks;
+    uint64_t          uring_enters;
+    uint64_t          uring_sqes;
     uint64_t          auth_cmds;
     uint64_t          auth_errors;
+    uint64_t          hotcache_hits;
+    uint64_t          hotcache_fills;
+    uint64_t          leases_issued;
+    uint64_t          leases_hot_misses;
+    uint64_t          leases_stale;
+    uint64_t          leases_honored;
+    uint64_t          leases_rejected;
+    uint64_t          conn_buffers_borrowed; /* gauges, not reset */
+    uint64_t          conn_buffers_pooled;
     struct slab_stats slab_stats[MAX_NUMBER_OF_SLAB_CLASSES];
-};
+} CACHE_LINE_ALIGNED;
+
+#ifdef __ATOMIC_RELAXED
+#define THR_STATS_READ(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define THR_STATS_ADD(c, field, n)                                          \
+    __atomic_store_n(&(c)->thread->stats.field,                             \
+                     (c)->thread->stats.field + (n), __ATOMIC_RELAXED)
+#else
+#define THR_STATS_READ(field) (*(volatile uint64_t *)&(field))
+#define THR_STATS_ADD(c, field, n) ((c)->thread->stats.field += (n))
+#endif
+#define THR_STATS_INCR(c, field) THR_STATS_ADD(c, field, 1)
 
 /**
  * Global stats.
@@ -280,6 +386,8 @@ struct stats {
     uint64_t      evicted_unfetched; /* items evicted but never touched */
     bool          slab_reassign_running; /* slab reassign in progress */
     uint64_t      slabs_moved;       /* times slabs were moved around */
+    uint64_t      automove_decisions; /* automove=3 decisions made */
+    uint64_t      automove_pages; /* pages requested by automove=3 */
     bool          lru_crawler_running; /* crawl in progress */
 };
 
@@ -324,6 +432,20 @@ struct settings {
     char *hash_algorithm;     /* Hash algorithm in use */
     int lru_crawler_sleep;  /* Microsecond sleep between items */
     uint32_t lru_crawler_tocrawl; /* Number of items to crawl per run */
+    bool expiry_wheel;      /* Whether the expiry wheel thread is enabled */
+    int eviction_policy;    /* enum eviction_policy_type */
+    bool gdsf_cost_flags;   /* Take a cost hint from the top byte of flags */
+    bool mrc;               /* Whether miss ratio curve sampling is enabled */
+    bool lock_stats;        /* Whether lock acquisitions are timed */
+    char *capture_file;     /* Where to log sampled commands, or NULL */
+    int capture_sample;     /* Capture one connection in this many */
+    int hotkey_sample;      /* Track one keyed command in this many, or 0 */
+    bool hotcache;          /* Whether threads keep replicas of hot items */
+    bool leases;            /* Whether lget and lset are enabled */
+    int lease_ttl;          /* Seconds a lease placeholder lives */
+    bool lease_stale;       /* Serve expired values while a lease is out */
+    int zerocopy;           /* Send values this large with MSG_ZEROCOPY, or 0 */
+    bool io_uring;          /* Whether workers run connections on io_uring */
 };
 
 extern struct stats stats;
@@ -338,6 +460,13 @@ extern struct settings settings;
 
 #define ITEM_FETCHED 8
 
+/* A lease placeholder, see do_item_lease_get(). With ITEM_STALE it holds the
+ * expired value it replaced. */
+#define ITEM_LEASE 16
+#define ITEM_STALE 32
+/* Has an entry in the expiry wheel, see item_wheel_insert(). */
+#define ITEM_WHEEL 64
+
 /**
  * Structure for storing items within memcached.
  */
@@ -353,6 +482,9 @@ typedef struct _stritem {
     uint8_t         it_flags;   /* ITEM_* above */
     uint8_t         slabs_clsid;/* which slab class we're in */
     uint8_t         nkey;       /* key length, w/terminating null and padding */
+    uint8_t         cost;       /* eviction cost hint */
+    uint8_t         hits;       /* saturating access count */
+    uint32_t        priority;   /* eviction priority, see items.c */
     /* this odd type prevents type-punning issues when we do
      * the little shuffle to save space when not using CAS. */
     union {
@@ -387,9 +519,21 @@ typedef struct {
     int notify_receive_fd;      /* receiving end of notify pipe */
     int notify_send_fd;         /* sending end of notify pipe */
     struct thread_stats stats;  /* Stats generated by this thread */
+    struct thread_stats stats_base; /* stats as of the last "stats reset" */
+    struct latency_stats latency; /* Command latencies seen by this thread */
+    struct latency_stats latency_base; /* latencies as of the last "stats reset" */
     struct conn_queue *new_conn_queue; /* queue of new connections to handle */
     cache_t *suffix_cache;      /* suffix cache */
     uint8_t item_lock_type;     /* use fine-grained or global item lock */
+    struct capture_thread *capture; /* commands not yet written to the capture file */
+    struct hotkey_sketch *hotkeys; /* most frequent keys, see "stats hotkeys" */
+    int hotkey_countdown;       /* keyed commands until the next sample */
+    struct hotcache *hotcache;  /* this thread's replicas of hot items */
+    struct uring *uring;        /* io_uring for its connections, or NULL */
+    struct conn_bufs *bufs_pool; /* idle connection buffers */
+    int bufs_pooled;
+    struct zerocopy_orphan *zc_orphans; /* closed, still sending items */
+    struct event zc_timer;      /* reaps zc_orphans, see zerocopy.c */
 } LIBEVENT_THREAD;
 
 typedef struct {
@@ -397,6 +541,29 @@ typedef struct {
     struct event_base *base;    /* libevent handle this thread uses */
 } LIBEVENT_DISPATCHER_THREAD;
 
+/**
+ * What a meta command returns besides its status code.
+ */
+typedef struct {
+    char flags[META_RET_MAX + 1];       /* return flags, in the order given */
+    char opaque[META_OPAQUE_MAX + 1];
+    bool base64;                        /* key was given in base64 */
+    bool quiet;                         /* hide the common case reply */
+} meta_reply;
+
+/**
+ * A set_multi in progress. Its items are all allocated when the command is
+ * parsed, then their values are read one after the other, and they are
+ * stored together once the last one is in. See process_set_multi_command().
+ */
+struct multi_set {
+    int      count;                     /* keys in the command */
+    int      next;                      /* next value to read */
+    int      vlen[MULTI_KEYS_MAX];      /* to swallow values left unallocated */
+    item    *items[MULTI_KEYS_MAX];     /* NULL where the allocation failed */
+    uint8_t  failed[MULTI_KEYS_MAX / 8];
+};
+
 /**
  * The structure representing a connection into memcached.
  */
@@ -427,6 +594,7 @@ struct conn {
 
     char   *ritem;  /** when we read in an item's value, it goes here */
     int    rlbytes;
+    bool   read_header; /** keep the next read to a command header */
 
     /* data for the nread state */
 
@@ -462,6 +630,43 @@ struct conn {
     char   **suffixcurr;
     int    suffixleft;
 
+    /* responses of earlier pipelined commands waiting to be sent along */
+    int    resp_cmds;     /* number of commands they answer */
+    int    resp_bytes;
+    int    resp_msgused;  /* msglist[], iov[] and wbuf use where they end */
+    int    resp_iovused;
+    int    resp_msgbytes;
+    int    resp_wbytes;
+    bool   resp_sending;  /* transmit() has started on them */
+
+    /* zero-copy sends, see zerocopy.c */
+    bool   zerocopy;      /* SO_ZEROCOPY is set on the socket */
+    bool   zc_used;       /* the response being sent used it */
+    uint32_t zc_next;     /* number of the next zero-copy send */
+    uint32_t zc_done;     /* sends before this one have completed */
+    struct zerocopy_hold *zc_held; /* items lent to the kernel */
+    int    zc_nheld;
+    int    zc_size;
+
+    /* io_uring worker loop, see uring.c */
+    bool   uring;         /* reads and sends go through the thread's ring */
+    bool   uring_recv;    /* a multishot recv is armed */
+    bool   uring_sending; /* a sendmsg is in flight */
+    bool   uring_sent;    /* ... and has completed with uring_res */
+    bool   uring_wake;    /* a wake-up is queued */
+    bool   uring_cancel;  /* cancelling the recv */
+    bool   uring_eof;     /* the recv ended for good, with uring_err */
+    bool   uring_closing; /* waiting for the ring before closing */
+    int    uring_err;
+    int    uring_res;
+    int    uring_ops;     /* operations the ring has for this conn */
+    char   *uring_buf;    /* received data not read yet */
+    int    uring_buf_len;
+    char   *uring_spill;  /* ... and what was left of earlier buffers */
+    int    uring_spill_off;
+    int    uring_spill_len;
+    int    uring_spill_size;
+
     enum protocol protocol;   /* which protocol this connection speaks */
     enum network_transport transport; /* what transport is used by this connection */
 
@@ -471,8 +676,12 @@ struct conn {
     socklen_t request_addr_size;
     unsigned char *hdrbuf; /* udp packet headers */
     int    hdrsize;   /* number of headers' worth of space is allocated */
+    struct udp_batch *udp_batch; /* datagrams read together, see memcached.c */
 
     bool   noreply;   /* True if the reply should not be sent. */
+    bool   mset;      /* True while the value of an ms command is read. */
+    meta_reply mset_reply;
+    struct multi_set *multi; /* set_multi whose values are being read */
     /* current stats command */
     struct {
         char *buffer;
@@ -485,6 +694,9 @@ struct conn {
     protocol_binary_request_header binary_header;
     uint64_t cas; /* the cas to return */
     short cmd; /* current command being processed */
+    enum latency_cmd lat_cmd; /* histogram to record the command in */
+    uint64_t cmd_start;       /* when the command was parsed, in ns */
+    uint32_t capture_id;      /* connection number in the capture file */
     int opaque;
     int keylen;
     conn   *next;     /* Used for generating a list of conn structures */
@@ -522,20 +734,14 @@ enum delta_result_type do_add_delta(conn *c, const char *key,
                                     uint64_t *cas, const uint32_t hv);
 enum store_item_type do_store_item(item *item, int comm, conn* c, const uint32_t hv);
 conn *conn_new(const int sfd, const enum conn_states init_state, const int event_flags, const int read_buffer_size, enum network_transport transport, struct event_base *base);
+void event_handler(const int fd, const short which, void *arg);
 extern int daemonize(int nochdir, int noclose);
 
-static inline int mutex_lock(pthread_mutex_t *mutex)
-{
-    while (pthread_mutex_trylock(mutex));
-    return 0;
-}
-
-#define mutex_unlock(x) pthread_mutex_unlock(x)
-
 #include "stats.h"
 #include "slabs.h"
 #include "assoc.h"
 #include "items.h"
+#include "mrc.h"
 #include "trace.h"
 #include "hash.h"
 #include "util.h"
@@ -564,6 +770,13 @@ item *item_alloc(char *key, size_t nkey, int flags, rel_time_t exptime, int nbyt
 char *item_cachedump(const unsigned int slabs_clsid, const unsigned int limit, unsigned int *bytes);
 void  item_flush_expired(void);
 item *item_get(const char *key, const size_t nkey);
+item *item_get_any(const char *key, const size_t nkey);
+void item_get_multi(const char **keys, const size_t *nkeys, item **its,
+                    const int n);
+void item_delete_multi(const char **keys, const size_t *nkeys,
+                       unsigned int *clsid, const int n);
+item *item_lease_get(const char *key, const size_t nkey,
+                     enum lease_result *res);
 item *item_touch(const char *key, const size_t nkey, uint32_t exptime);
 int   item_link(item *it);
 void  item_remove(item *it);
@@ -578,6 +791,7 @@ void item_lock_global(void);
 void item_unlock_global(void);
 void item_lock(uint32_t hv);
 void *item_trylock(uint32_t hv);
+void *item_lock_ptr(uint32_t hv);
 void item_trylock_unlock(void *arg);
 void item_unlock(uint32_t hv);
 void switch_item_lock_type(enum item_lock_types type);
@@ -588,12 +802,57 @@ void STATS_UNLOCK(void);
 void threadlocal_stats_reset(void);
 void threadlocal_stats_aggregate(struct thread_stats *stats);
 void slab_stats_aggregate(struct thread_stats *stats, struct slab_stats *out);
+uint64_t latency_now(void);
+void latency_record(LIBEVENT_THREAD *me, const enum latency_cmd cmd,
+                    const uint64_t start);
+void threadlocal_latency_stats(ADD_STAT add_stats, void *c);
+void threadlocal_latency_reset(void);
+
+/* capture.c: with -o capture, log commands from sampled connections */
+int capture_init(void);
+void capture_ascii(conn *c, const char *command);
+void capture_binary(conn *c, const void *request);
+void capture_stats(ADD_STAT add_stats, void *c);
+
+/* hotkeys.c: sampled top-K of the keys each thread sees */
+uint64_t hotkey_record(LIBEVENT_THREAD *me, const enum latency_cmd cmd,
+                       const char *key, const size_t nkey);
+void hotkeys_stats(ADD_STAT add_stats, void *c);
+void hotkeys_reset(void);
+
+/* hotcache.c: with -o hotcache, per-thread references to hot items */
+#define HOTCACHE_PROMOTE 32     /* sampled gets that make an item hot */
+void hotcache_thread_init(LIBEVENT_THREAD *me);
+item *hotcache_get(conn *c, const char *key, const size_t nkey);
+void hotcache_add(conn *c, item *it, const uint64_t samples);
+void hotcache_release(LIBEVENT_THREAD *me, item *it);
+
+/* zerocopy.c: with -o zerocopy, MSG_ZEROCOPY sends of large values */
+void zerocopy_conn_init(conn *c);
+int zerocopy_prepare(conn *c, struct msghdr *m, int *hidden);
+ssize_t zerocopy_sent(conn *c, struct msghdr *m, const ssize_t res);
+void zerocopy_hold(conn *c);
+void zerocopy_reap(conn *c);
+bool zerocopy_conn_close(conn *c);
+void zerocopy_conn_free(conn *c);
+
+/* uring.c: with -o io_uring, worker connections run on io_uring */
+bool uring_thread_init(LIBEVENT_THREAD *me);
+void uring_thread_free(LIBEVENT_THREAD *me);
+bool uring_conn_add(conn *c);
+ssize_t uring_read(conn *c, void *buf, size_t count);
+ssize_t uring_sendmsg(conn *c, struct msghdr *m);
+bool uring_update_event(conn *c, const int new_flags);
+bool uring_conn_close(conn *c);
+void uring_conn_free(conn *c);
 
 /* Stat processing functions */
 void append_stat(const char *name, ADD_STAT add_stats, conn *c,
                  const char *fmt, ...);
 
 enum store_item_type store_item(item *item, int comm, conn *c);
+void store_item_multi(item **its, enum store_item_type *ret, const int n,
+                      int comm, conn *c);
 
 #if HAVE_DROP_PRIVILEGES
 extern void drop_privileges(void);
@@ -604,7 +863,53 @@ extern void drop_privileges(void);
 /* If supported, give compiler hints for branch prediction. */
 #if !defined(__GNUC__) || (__GNUC__ == 2 && __GNUC_MINOR__ < 96)
 #define __builtin_expect(x, expected_value) (x)
+#define __builtin_prefetch(addr) ((void)(addr))
 #endif
 
 #define likely(x)       __builtin_expect((x),1)
 #define unlikely(x)     __builtin_expect((x),0)
+
+/* With -o lock_stats, acquisitions of the locks registered through
+ * lock_stats_register() are timed; see "stats locks". Others are untouched. */
+int mutex_lock_stats(pthread_mutex_t *mutex, const bool spin);
+void lock_stats_acquired(pthread_mutex_t *mutex);
+void lock_stats_release(pthread_mutex_t *mutex);
+void lock_stats_register(pthread_mutex_t *mutex, const char *name);
+void lock_stats(ADD_STAT add_stats, void *c);
+void lock_stats_reset(void);
+void mutex_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+
+static inline int mutex_lock(pthread_mutex_t *mutex)
+{
+    if (unlikely(settings.lock_stats))
+        return mutex_lock_stats(mutex, true);
+    while (pthread_mutex_trylock(mutex));
+    return 0;
+}
+
+/* Same as mutex_lock(), but sleeps instead of spinning while contended. */
+static inline int mutex_lock_blocking(pthread_mutex_t *mutex)
+{
+    if (unlikely(settings.lock_stats))
+        return mutex_lock_stats(mutex, false);
+    return pthread_mutex_lock(mutex);
+}
+
+static inline int mutex_unlock(pthread_mutex_t *mutex)
+{
+    if (unlikely(settings.lock_stats))
+        lock_stats_release(mutex);
+    return pthread_mutex_unlock(mutex);
+}
+
+/* Called for every keyed command; about one in hotkey_sample is recorded.
+ * Returns how many samples of the key the thread has certainly seen, or 0
+ * if this command wasn't sampled. */
+static inline uint64_t hotkey_sample(conn *c, const enum latency_cmd cmd,
+                                     const char *key, const size_t nkey)
+{
+    if (settings.hotkey_sample > 0 &&
+        unlikely(--c->thread->hotkey_countdown <= 0))
+        return hotkey_record(c->thread, cmd, key, nkey);
+    return 0;
+}
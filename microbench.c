@@ -0,0 +1,888 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * In-process microbenchmarks for the hash functions, the hash table, the
+ * slab allocator and item allocation. Like testapp, this links the server
+ * sources directly; memcached.c and thread.c are replaced by the small set
+ * of globals and locking functions below, so there is no network or event
+ * loop in the way.
+ *
+ * Results are printed as "name value" lines. Values are nanoseconds per
+ * operation unless the name says otherwise; multithreaded results are the
+ * mean over threads, so perfect scaling keeps them flat.
+ *
+ * Run it with "make bench".
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "memcached.h"
+#include "hash.h"
+#include "proto_text.h"
+
+/* Globals normally provided by memcached.c */
+struct stats stats;
+struct settings settings;
+time_t process_started;
+volatile rel_time_t current_time;
+struct slab_rebalance slab_rebal;
+volatile int slab_rebalance_signal;
+
+/* Locks normally provided by thread.c. Benchmarks lock a stripe around
+ * item operations, as worker threads do. All hash table access here is made
+ * under cache_lock, so the expansion thread never needs the other threads to
+ * switch to the global item lock and switch_item_lock_type() can be a no-op.
+ */
+#define hashsize(n) ((unsigned long int)1<<(n))
+#define hashmask(n) (hashsize(n)-1)
+
+#define BENCH_LOCK_POWER 10
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t item_global_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t item_locks[1 << BENCH_LOCK_POWER];
+
+void STATS_LOCK(void) {
+    pthread_mutex_lock(&stats_lock);
+}
+
+void STATS_UNLOCK(void) {
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void item_lock_global(void) {
+    pthread_mutex_lock(&item_global_lock);
+}
+
+void item_unlock_global(void) {
+    pthread_mutex_unlock(&item_global_lock);
+}
+
+static void bench_item_lock(const uint32_t hv) {
+    pthread_mutex_lock(&item_locks[hv & hashmask(BENCH_LOCK_POWER)]);
+}
+
+static void bench_item_unlock(const uint32_t hv) {
+    pthread_mutex_unlock(&item_locks[hv & hashmask(BENCH_LOCK_POWER)]);
+}
+
+void *item_trylock(uint32_t hv) {
+    pthread_mutex_t *lock = &item_locks[hv & hashmask(BENCH_LOCK_POWER)];
+    if (pthread_mutex_trylock(lock) == 0)
+        return lock;
+    return NULL;
+}
+
+void *item_lock_ptr(uint32_t hv) {
+    return &item_locks[hv & hashmask(BENCH_LOCK_POWER)];
+}
+
+void item_trylock_unlock(void *lock) {
+    pthread_mutex_unlock((pthread_mutex_t *)lock);
+}
+
+void switch_item_lock_type(enum item_lock_types type) {
+}
+
+unsigned short refcount_incr(unsigned short *refcount) {
+#ifdef HAVE_GCC_ATOMICS
+    return __sync_add_and_fetch(refcount, 1);
+#else
+    unsigned short res;
+    pthread_mutex_lock(&item_global_lock);
+    res = ++(*refcount);
+    pthread_mutex_unlock(&item_global_lock);
+    return res;
+#endif
+}
+
+unsigned short refcount_decr(unsigned short *refcount) {
+#ifdef HAVE_GCC_ATOMICS
+    return __sync_sub_and_fetch(refcount, 1);
+#else
+    unsigned short res;
+    pthread_mutex_lock(&item_global_lock);
+    res = --(*refcount);
+    pthread_mutex_unlock(&item_global_lock);
+    return res;
+#endif
+}
+
+/* Stats plumbing the benchmarks never report through. */
+void item_stats(ADD_STAT add_stats, void *c) {
+}
+
+void item_stats_totals(ADD_STAT add_stats, void *c) {
+}
+
+void item_stats_sizes(ADD_STAT add_stats, void *c) {
+}
+
+void threadlocal_stats_aggregate(struct thread_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+}
+
+void slab_stats_aggregate(struct thread_stats *stats, struct slab_stats *out) {
+    memset(out, 0, sizeof(*out));
+}
+
+void threadlocal_latency_stats(ADD_STAT add_stats, void *c) {
+}
+
+void hotkeys_stats(ADD_STAT add_stats, void *c) {
+}
+
+void append_stat(const char *name, ADD_STAT add_stats, conn *c,
+                 const char *fmt, ...) {
+}
+
+/* settings.lock_stats stays off, so these are never reached. */
+int mutex_lock_stats(pthread_mutex_t *mutex, const bool spin) {
+    return pthread_mutex_lock(mutex);
+}
+
+void lock_stats_acquired(pthread_mutex_t *mutex) {
+}
+
+void lock_stats_release(pthread_mutex_t *mutex) {
+}
+
+void lock_stats_register(pthread_mutex_t *mutex, const char *name) {
+}
+
+void lock_stats(ADD_STAT add_stats, void *c) {
+}
+
+void lock_stats_reset(void) {
+}
+
+void mutex_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+    pthread_cond_wait(cond, mutex);
+}
+
+/* Benchmark harness */
+
+static int nthreads = 4;
+static size_t mem_limit = 64 * 1024 * 1024;
+static unsigned int assoc_max_items = 1 << 18;
+
+static uint64_t now_ns(void) {
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+    {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return (uint64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+    }
+}
+
+static void report(const char *name, const double value) {
+    printf("%s %.2f\n", name, value);
+    fflush(stdout);
+}
+
+typedef struct {
+    pthread_t tid;
+    int id;
+    void *arg;
+    uint64_t ops;
+    uint64_t ns;
+} bench_thread;
+
+typedef void (*bench_func)(bench_thread *t);
+
+static bench_func running_func;
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
+static bool start_flag;
+
+static void *bench_thread_main(void *arg) {
+    bench_thread *t = arg;
+    pthread_mutex_lock(&start_lock);
+    while (!start_flag)
+        pthread_cond_wait(&start_cond, &start_lock);
+    pthread_mutex_unlock(&start_lock);
+    running_func(t);
+    return NULL;
+}
+
+/* Runs func on n threads at once and returns the mean ns/op. Each thread
+ * sets its own ops and ns. */
+static double run_threads(const int n, bench_func func, void *arg) {
+    bench_thread *threads = calloc(n, sizeof(bench_thread));
+    double total = 0;
+    int i;
+
+    if (threads == NULL) {
+        fprintf(stderr, "Failed to allocate benchmark threads\n");
+        exit(EXIT_FAILURE);
+    }
+    running_func = func;
+    start_flag = false;
+    for (i = 0; i < n; i++) {
+        threads[i].id = i;
+        threads[i].arg = arg;
+        if (pthread_create(&threads[i].tid, NULL, bench_thread_main,
+                           &threads[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_mutex_lock(&start_lock);
+    start_flag = true;
+    pthread_cond_broadcast(&start_cond);
+    pthread_mutex_unlock(&start_lock);
+
+    for (i = 0; i < n; i++) {
+        pthread_join(threads[i].tid, NULL);
+        total += (double)threads[i].ns / (threads[i].ops ? threads[i].ops : 1);
+    }
+    free(threads);
+    return total / n;
+}
+
+/* Multithreaded runs use one thread, then all of them. */
+static int next_thread_count(const int n) {
+    return n < nthreads ? nthreads : nthreads + 1;
+}
+
+/* Hash throughput by key length */
+
+#define HASH_ITERATIONS 2000000
+
+static void bench_hash_run(bench_thread *t) {
+    size_t len = *(size_t *)t->arg;
+    char key[KEY_MAX_LENGTH];
+    volatile uint32_t sink = 0;
+    uint64_t start;
+    int i;
+
+    memset(key, 'k', sizeof(key));
+    start = now_ns();
+    for (i = 0; i < HASH_ITERATIONS; i++) {
+        key[0] = (char)i;
+        sink += hash(key, len);
+    }
+    t->ns = now_ns() - start;
+    t->ops = HASH_ITERATIONS;
+}
+
+static void bench_hash(void) {
+    static const struct {
+        const char *name;
+        enum hashfunc_type type;
+    } funcs[] = {
+        { "jenkins", JENKINS_HASH },
+        { "murmur3", MURMUR3_HASH },
+    };
+    static size_t lengths[] = { 8, 16, 32, 64, 128, 250 };
+    char name[128];
+    int f, l;
+
+    for (f = 0; f < sizeof(funcs) / sizeof(funcs[0]); f++) {
+        hash_init(funcs[f].type);
+        for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+            double ns = run_threads(1, bench_hash_run, &lengths[l]);
+            snprintf(name, sizeof(name), "hash_%s_len%lu", funcs[f].name,
+                     (unsigned long)lengths[l]);
+            report(name, ns);
+            snprintf(name, sizeof(name), "hash_%s_len%lu_mb_per_sec",
+                     funcs[f].name, (unsigned long)lengths[l]);
+            report(name, lengths[l] * 1000.0 / ns);
+        }
+    }
+    hash_init(JENKINS_HASH);
+}
+
+/* Hash table insert and lookup as it grows. Items are plain malloc()ed
+ * headers with a key, which is all assoc.c looks at. */
+
+#define ASSOC_BATCH 64
+
+static item **assoc_items;
+static uint32_t *assoc_hvs;
+
+static item *make_key_item(const char *prefix, const unsigned int n) {
+    char key[KEY_MAX_LENGTH];
+    int nkey = snprintf(key, sizeof(key), "%s%u", prefix, n);
+    item *it = calloc(1, sizeof(item) + nkey + 1);
+    if (it == NULL) {
+        fprintf(stderr, "Failed to allocate bench item\n");
+        exit(EXIT_FAILURE);
+    }
+    it->nkey = nkey;
+    memcpy(ITEM_key(it), key, nkey + 1);
+    return it;
+}
+
+static bool assoc_expanding(void) {
+    bool expanding;
+    STATS_LOCK();
+    expanding = stats.hash_is_expanding;
+    STATS_UNLOCK();
+    return expanding;
+}
+
+static void wait_for_expansion(void) {
+    /* The expansion thread may not have picked up the signal yet. */
+    usleep(10000);
+    while (assoc_expanding())
+        usleep(1000);
+}
+
+/* assoc.c grows one power at a time and only checks the fill level on
+ * insert, so a bulk insert can leave it behind. Re-insert the last key until
+ * it catches up. */
+static void settle_table(const unsigned int nitems) {
+    item *it = assoc_items[nitems - 1];
+    uint32_t hv = assoc_hvs[nitems - 1];
+
+    wait_for_expansion();
+    while (nitems > hashsize(hashpower) * 3 / 2) {
+        mutex_lock(&cache_lock);
+        assoc_delete(ITEM_key(it), it->nkey, hv);
+        assoc_insert(it, hv);
+        mutex_unlock(&cache_lock);
+        wait_for_expansion();
+    }
+}
+
+static uint64_t assoc_insert_range(const unsigned int from,
+                                   const unsigned int to) {
+    uint64_t start = now_ns();
+    unsigned int i;
+    for (i = from; i < to; i++) {
+        if ((i - from) % ASSOC_BATCH == 0) {
+            if (i != from)
+                mutex_unlock(&cache_lock);
+            mutex_lock(&cache_lock);
+        }
+        assoc_insert(assoc_items[i], assoc_hvs[i]);
+    }
+    if (to > from)
+        mutex_unlock(&cache_lock);
+    return now_ns() - start;
+}
+
+/* Looks up n random existing keys; returns elapsed ns. */
+static uint64_t assoc_find_random(const unsigned int nitems,
+                                  const unsigned int n, uint64_t *rng) {
+    uint64_t start = now_ns();
+    unsigned int i;
+    for (i = 0; i < n; i++) {
+        unsigned int k;
+        if (i % ASSOC_BATCH == 0) {
+            if (i != 0)
+                mutex_unlock(&cache_lock);
+            mutex_lock(&cache_lock);
+        }
+        *rng = *rng * 6364136223846793005ULL + 1442695040888963407ULL;
+        k = (unsigned int)(*rng >> 33) % nitems;
+        if (assoc_find(ITEM_key(assoc_items[k]), assoc_items[k]->nkey,
+                       assoc_hvs[k]) != assoc_items[k]) {
+            fprintf(stderr, "assoc_find lost an item\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (n > 0)
+        mutex_unlock(&cache_lock);
+    return now_ns() - start;
+}
+
+static void bench_assoc(void) {
+    char name[128];
+    uint64_t rng = 42;
+    unsigned int i, nitems = 0, target, total;
+    uint64_t ns, ops;
+
+    /* Room to push past the last size, for the expansion run. */
+    total = assoc_max_items * 2;
+    assoc_items = malloc(sizeof(item *) * total);
+    assoc_hvs = malloc(sizeof(uint32_t) * total);
+    if (assoc_items == NULL || assoc_hvs == NULL) {
+        fprintf(stderr, "Failed to allocate bench items\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < total; i++) {
+        assoc_items[i] = make_key_item("assoc:", i);
+        assoc_hvs[i] = hash(ITEM_key(assoc_items[i]), assoc_items[i]->nkey);
+    }
+
+    /* Fill each table size to a load factor of one. */
+    for (target = 4096; target <= assoc_max_items; target *= 4) {
+        ns = assoc_insert_range(nitems, target);
+        snprintf(name, sizeof(name), "assoc_insert_items%u", target);
+        report(name, (double)ns / (target - nitems));
+        nitems = target;
+        settle_table(nitems);
+
+        snprintf(name, sizeof(name), "assoc_find_items%u_hashpower%u",
+                 nitems, hashpower);
+        report(name, (double)assoc_find_random(nitems, 1000000, &rng)
+               / 1000000);
+    }
+
+    /* Push past the next threshold and look up while the table moves. */
+    target = hashsize(hashpower) * 3 / 2 + 1;
+    if (target > total)
+        target = total;
+    assoc_insert_range(nitems, target);
+    nitems = target;
+    for (i = 0; i < 1000 && !assoc_expanding(); i++)
+        usleep(1000);
+    ns = ops = 0;
+    while (assoc_expanding()) {
+        ns += assoc_find_random(nitems, 10000, &rng);
+        ops += 10000;
+    }
+    snprintf(name, sizeof(name), "assoc_find_expanding_items%u", nitems);
+    report(name, ops ? (double)ns / ops : 0);
+    wait_for_expansion();
+
+    mutex_lock(&cache_lock);
+    for (i = 0; i < nitems; i++)
+        assoc_delete(ITEM_key(assoc_items[i]), assoc_items[i]->nkey,
+                     assoc_hvs[i]);
+    mutex_unlock(&cache_lock);
+    for (i = 0; i < total; i++)
+        free(assoc_items[i]);
+    free(assoc_items);
+    free(assoc_hvs);
+}
+
+/* Slab allocator */
+
+#define SLABS_BATCH 256
+#define SLABS_ROUNDS 2000
+
+typedef struct {
+    size_t size;
+    bool free_only;     /* report the free half instead of alloc */
+} slabs_arg;
+
+static void bench_slabs_run(bench_thread *t) {
+    slabs_arg *arg = t->arg;
+    unsigned int id = slabs_clsid(arg->size);
+    void *ptrs[SLABS_BATCH];
+    uint64_t alloc_ns = 0, free_ns = 0, start;
+    int r, i;
+
+    for (r = 0; r < SLABS_ROUNDS; r++) {
+        start = now_ns();
+        for (i = 0; i < SLABS_BATCH; i++) {
+            ptrs[i] = slabs_alloc(arg->size, id);
+            if (ptrs[i] == NULL) {
+                fprintf(stderr, "slabs_alloc failed, raise -m\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        alloc_ns += now_ns() - start;
+        start = now_ns();
+        for (i = 0; i < SLABS_BATCH; i++)
+            slabs_free(ptrs[i], arg->size, id);
+        free_ns += now_ns() - start;
+    }
+    t->ns = arg->free_only ? free_ns : alloc_ns;
+    t->ops = SLABS_ROUNDS * SLABS_BATCH;
+}
+
+static void bench_slabs(void) {
+    static size_t sizes[] = { 96, 1024, 8192 };
+    char name[128];
+    slabs_arg arg;
+    int s, n;
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        arg.size = sizes[s];
+        for (n = 1; n <= nthreads; n = next_thread_count(n)) {
+            arg.free_only = false;
+            snprintf(name, sizeof(name), "slabs_alloc_size%lu_threads%d",
+                     (unsigned long)sizes[s], n);
+            report(name, run_threads(n, bench_slabs_run, &arg));
+            arg.free_only = true;
+            snprintf(name, sizeof(name), "slabs_free_size%lu_threads%d",
+                     (unsigned long)sizes[s], n);
+            report(name, run_threads(n, bench_slabs_run, &arg));
+        }
+    }
+}
+
+/* Item allocation once memory is full, so that each one evicts. */
+
+#define ITEM_VALUE_SIZE 100
+#define ITEM_ITERATIONS 500000
+
+static unsigned int item_key_base;
+
+static uint64_t total_evictions(void) {
+    uint64_t evicted[MAX_NUMBER_OF_SLAB_CLASSES];
+    uint64_t total = 0;
+    int i;
+    memset(evicted, 0, sizeof(evicted));
+    item_stats_evictions(evicted);
+    for (i = 0; i < MAX_NUMBER_OF_SLAB_CLASSES; i++)
+        total += evicted[i];
+    return total;
+}
+
+/* Allocates and links one item, like a set would. */
+static bool item_cycle(const int thread, const unsigned int n) {
+    char key[KEY_MAX_LENGTH];
+    int nkey = snprintf(key, sizeof(key), "item:%d:%u", thread, n);
+    uint32_t hv = hash(key, nkey);
+    item *it;
+
+    bench_item_lock(hv);
+    it = do_item_alloc(key, nkey, 0, 0, ITEM_VALUE_SIZE + 2, hv);
+    if (it != NULL) {
+        do_item_link(it, hv);
+        do_item_remove(it);
+    }
+    bench_item_unlock(hv);
+    return it != NULL;
+}
+
+static void bench_items_run(bench_thread *t) {
+    unsigned int base = item_key_base, i;
+    uint64_t start = now_ns();
+    for (i = 0; i < ITEM_ITERATIONS; i++)
+        item_cycle(t->id, base + i);
+    t->ns = now_ns() - start;
+    t->ops = ITEM_ITERATIONS;
+}
+
+static void bench_items(void) {
+    char name[128];
+    unsigned int i;
+    int n;
+
+    /* Fill memory until evictions start. */
+    for (i = 0; total_evictions() == 0; i++) {
+        if (!item_cycle(0, i)) {
+            fprintf(stderr, "Out of memory without evicting\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    item_key_base = i;
+
+    for (n = 1; n <= nthreads; n = next_thread_count(n)) {
+        uint64_t before = total_evictions();
+        snprintf(name, sizeof(name), "item_alloc_evicting_threads%d", n);
+        report(name, run_threads(n, bench_items_run, NULL));
+        snprintf(name, sizeof(name), "item_alloc_evicting_threads%d_evictions", n);
+        report(name, (double)(total_evictions() - before));
+        item_key_base += ITEM_ITERATIONS;
+    }
+}
+
+/* Multiget lookups by key count, ns per multiget: one key after another, as
+ * item_get() does them, and a batch at a time with the buckets and items
+ * prefetched first, as item_get_multi() in thread.c does. Keys are picked at
+ * random from a table filling the slab memory, so that most lookups miss
+ * the CPU caches. */
+
+#define MULTIGET_KEYS_MAX 100
+#define MULTIGET_BATCH 16
+#define MULTIGET_LOOKUPS 2000000
+
+static char **mget_keys;
+static size_t *mget_nkeys;
+static unsigned int mget_first, mget_items;
+
+static void multiget_serial(const char **keys, const size_t *nkeys,
+                            item **its, const int n) {
+    uint32_t hv;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        hv = hash(keys[i], nkeys[i]);
+        bench_item_lock(hv);
+        its[i] = do_item_get(keys[i], nkeys[i], hv);
+        bench_item_unlock(hv);
+    }
+}
+
+static void multiget_batched(const char **keys, const size_t *nkeys,
+                             item **its, const int n) {
+    uint32_t hv[MULTIGET_BATCH];
+    int base, i, m;
+
+    for (base = 0; base < n; base += m) {
+        m = n - base < MULTIGET_BATCH ? n - base : MULTIGET_BATCH;
+        for (i = 0; i < m; i++) {
+            hv[i] = hash(keys[base + i], nkeys[base + i]);
+            assoc_prefetch_bucket(hv[i]);
+            __builtin_prefetch(&item_locks[hv[i] & hashmask(BENCH_LOCK_POWER)]);
+        }
+        for (i = 0; i < m; i++)
+            assoc_prefetch_head(hv[i]);
+        for (i = 0; i < m; i++) {
+            bench_item_lock(hv[i]);
+            its[base + i] = do_item_get(keys[base + i], nkeys[base + i], hv[i]);
+            bench_item_unlock(hv[i]);
+        }
+    }
+}
+
+typedef struct {
+    int nkeys;
+    bool batched;
+} multiget_arg;
+
+static void bench_multiget_run(bench_thread *t) {
+    multiget_arg *arg = t->arg;
+    const char *keys[MULTIGET_KEYS_MAX];
+    size_t nkeys[MULTIGET_KEYS_MAX];
+    item *its[MULTIGET_KEYS_MAX];
+    uint64_t rng = 42 + t->id, ns = 0, start;
+    int r, i, rounds = MULTIGET_LOOKUPS / arg->nkeys;
+
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < arg->nkeys; i++) {
+            unsigned int k;
+            rng = rng * 6364136223846793005ULL + 1442695040888963407ULL;
+            k = mget_first + (unsigned int)(rng >> 33) % (mget_items - mget_first);
+            keys[i] = mget_keys[k];
+            nkeys[i] = mget_nkeys[k];
+        }
+        start = now_ns();
+        if (arg->batched)
+            multiget_batched(keys, nkeys, its, arg->nkeys);
+        else
+            multiget_serial(keys, nkeys, its, arg->nkeys);
+        ns += now_ns() - start;
+        for (i = 0; i < arg->nkeys; i++) {
+            if (its[i] == NULL) {
+                fprintf(stderr, "multiget lost an item\n");
+                exit(EXIT_FAILURE);
+            }
+            do_item_remove(its[i]);
+        }
+    }
+    t->ns = ns;
+    t->ops = rounds;
+}
+
+static void bench_multiget(void) {
+    static const int counts[] = { 1, 4, 16, 50, 100 };
+    const unsigned int max = mem_limit / (sizeof(item) + ITEM_VALUE_SIZE);
+    char key[KEY_MAX_LENGTH];
+    char name[128];
+    multiget_arg arg;
+    unsigned int i;
+    int c, nkey;
+
+    /* Fill memory. Evictions take the oldest keys, whether ours or those of
+     * an earlier benchmark. */
+    mget_keys = malloc(sizeof(char *) * max);
+    mget_nkeys = malloc(sizeof(size_t) * max);
+    if (mget_keys == NULL || mget_nkeys == NULL) {
+        fprintf(stderr, "Failed to allocate bench keys\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < max; i++) {
+        uint32_t hv;
+        item *it;
+
+        nkey = snprintf(key, sizeof(key), "mget:%u", i);
+        hv = hash(key, nkey);
+        bench_item_lock(hv);
+        it = do_item_alloc(key, nkey, 0, 0, ITEM_VALUE_SIZE + 2, hv);
+        if (it != NULL) {
+            do_item_link(it, hv);
+            do_item_remove(it);
+        }
+        bench_item_unlock(hv);
+        if (it == NULL) {
+            fprintf(stderr, "Failed to allocate bench item\n");
+            exit(EXIT_FAILURE);
+        }
+        if ((mget_keys[i] = strdup(key)) == NULL) {
+            fprintf(stderr, "Failed to allocate bench keys\n");
+            exit(EXIT_FAILURE);
+        }
+        mget_nkeys[i] = nkey;
+    }
+    mget_items = max;
+    wait_for_expansion();
+    for (mget_first = 0; mget_first < mget_items; mget_first++) {
+        item *it = do_item_get(mget_keys[mget_first], mget_nkeys[mget_first],
+                               hash(mget_keys[mget_first],
+                                    mget_nkeys[mget_first]));
+        if (it != NULL) {
+            do_item_remove(it);
+            break;
+        }
+    }
+    report("multiget_items", mget_items - mget_first);
+
+    for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        arg.nkeys = counts[c];
+        arg.batched = false;
+        snprintf(name, sizeof(name), "multiget_keys%d_serial", counts[c]);
+        report(name, run_threads(1, bench_multiget_run, &arg));
+        arg.batched = true;
+        snprintf(name, sizeof(name), "multiget_keys%d_batched", counts[c]);
+        report(name, run_threads(1, bench_multiget_run, &arg));
+    }
+}
+
+/* ASCII command parsing: tokenizing a line and looking up its command, as
+ * process_command() does before running it. */
+
+#define PARSE_ITERATIONS 2000000
+
+static const char *parse_lines[] = {
+    "get foo:12345678",
+    "gets foo:12345678",
+    "get foo:1 foo:2 foo:3 foo:4 foo:5 foo:6 foo:7 foo:8",
+    "set foo:12345678 0 0 100",
+    "add foo:12345678 0 0 100",
+    "replace foo:12345678 0 0 100",
+    "append foo:12345678 0 0 100",
+    "prepend foo:12345678 0 0 100",
+    "cas foo:12345678 0 0 100 1234567",
+    "incr foo:12345678 1",
+    "decr foo:12345678 1",
+    "delete foo:12345678",
+    "touch foo:12345678 100",
+    "mg foo:12345678 v c t",
+    "ms foo:12345678 100 T0 F0",
+    "stats",
+    "version",
+};
+
+static void bench_parse_run(bench_thread *t) {
+    const char *line = t->arg;
+    size_t len = strlen(line) + 1;
+    token_t tokens[MAX_TOKENS];
+    char buf[256];
+    volatile int sink = 0;
+    uint64_t start;
+    int i;
+
+    start = now_ns();
+    for (i = 0; i < PARSE_ITERATIONS; i++) {
+        /* Tokenizing writes to the line, so start from a fresh copy. */
+        memcpy(buf, line, len);
+        tokenize_command(buf, tokens, MAX_TOKENS);
+        sink += ascii_command_lookup(tokens[COMMAND_TOKEN].value,
+                                     tokens[COMMAND_TOKEN].length);
+    }
+    t->ns = now_ns() - start;
+    t->ops = PARSE_ITERATIONS;
+}
+
+static void bench_parse(void) {
+    char name[128];
+    int i, n;
+
+    for (i = 0; i < sizeof(parse_lines) / sizeof(parse_lines[0]); i++) {
+        const char *verb = parse_lines[i];
+        const char *end = strchr(verb, ' ');
+        int nkeys = 0;
+
+        if (end == NULL)
+            end = verb + strlen(verb);
+        if (strncmp(verb, "get ", 4) == 0) {
+            const char *p;
+            for (p = verb; *p != '\0'; p++)
+                nkeys += *p == ' ';
+        }
+        n = snprintf(name, sizeof(name), "parse_%.*s", (int)(end - verb), verb);
+        if (nkeys > 1)
+            snprintf(name + n, sizeof(name) - n, "_%dkeys", nkeys);
+        report(name, run_threads(1, bench_parse_run, (void *)parse_lines[i]));
+    }
+}
+
+static void settings_init(void) {
+    settings.use_cas = true;
+    settings.maxbytes = mem_limit;
+    settings.evict_to_free = 1;
+    settings.factor = 1.25;
+    settings.chunk_size = 48;
+    settings.item_size_max = 1024 * 1024;
+    settings.eviction_policy = EVICTION_LRU;
+    settings.tail_repair_time = TAIL_REPAIR_TIME_DEFAULT;
+    settings.num_threads = nthreads;
+}
+
+static void usage(void) {
+    printf("microbench - in-process benchmarks for memcached internals\n"
+           "-t <num>     threads for the multithreaded runs (default: 4)\n"
+           "-m <num>     slab memory in megabytes (default: 64)\n"
+           "-n <num>     largest hash table fill (default: 262144)\n"
+           "-b <list>    benchmarks to run, comma separated, from\n"
+           "             hash,assoc,slabs,items,multiget,parse\n"
+           "             (default: all)\n"
+           "-h           print this help and exit\n");
+}
+
+int main(int argc, char **argv) {
+    const char *which = "hash,assoc,slabs,items,multiget,parse";
+    int c, i;
+
+    while (-1 != (c = getopt(argc, argv, "t:m:n:b:h"))) {
+        switch (c) {
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'm':
+            mem_limit = (size_t)atoi(optarg) * 1024 * 1024;
+            break;
+        case 'n':
+            assoc_max_items = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            which = optarg;
+            break;
+        case 'h':
+            usage();
+            return EXIT_SUCCESS;
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (nthreads < 1 || mem_limit == 0 || assoc_max_items < 4096) {
+        fprintf(stderr, "Invalid arguments, see -h\n");
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < (1 << BENCH_LOCK_POWER); i++)
+        pthread_mutex_init(&item_locks[i], NULL);
+    settings_init();
+    process_started = time(0) - 2;
+    current_time = 2;
+    hash_init(JENKINS_HASH);
+    assoc_init(12);
+    slabs_init(settings.maxbytes, settings.factor, false);
+    if (start_assoc_maintenance_thread() == -1) {
+        fprintf(stderr, "Failed to start the hash table expansion thread\n");
+        return EXIT_FAILURE;
+    }
+
+    if (strstr(which, "hash"))
+        bench_hash();
+    if (strstr(which, "assoc"))
+        bench_assoc();
+    if (strstr(which, "slabs"))
+        bench_slabs();
+    if (strstr(which, "items"))
+        bench_items();
+    if (strstr(which, "multiget"))
+        bench_multiget();
+    if (strstr(which, "parse"))
+        bench_parse();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,317 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Miss-ratio curve estimation, using SHARDS sampling (Waldspurger et al.,
+ * "Efficient MRC Construction with SHARDS", FAST '15).
+ *
+ * A key is sampled when its hash is below mrc_threshold, so the same keys are
+ * always picked and the hot path only pays for one compare. For sampled keys
+ * we measure the LRU reuse distance in bytes: the total size of the distinct
+ * sampled keys referenced since the key was last referenced, scaled up by the
+ * sampling rate. A histogram of those distances gives the hit ratio an LRU
+ * cache of any size would have had for the same gets.
+ *
+ * At most MRC_MAX_KEYS keys are tracked (fixed-size SHARDS). When a new key
+ * would go over, the key with the largest hash is dropped and the threshold
+ * is lowered to that hash, so memory use is bounded whatever the key space.
+ *
+ * The estimate models one LRU over the whole cache; it does not know about
+ * slab classes, so treat it as a guide to sizing rather than a prediction.
+ */
+#include "memcached.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#define MRC_MAX_KEYS 8192
+#define MRC_INDEX_SIZE (MRC_MAX_KEYS * 2)  /* must be a power of two */
+#define MRC_INDEX_MASK (MRC_INDEX_SIZE - 1)
+#define MRC_STAMPS (MRC_MAX_KEYS * 4)      /* clock span between compactions */
+#define MRC_BUCKETS_PER_X 32               /* buckets per multiple of -m */
+#define MRC_BUCKETS (MRC_BUCKETS_PER_X * 8)
+#define MRC_INITIAL_RATE 100               /* start sampling 1 key in 100 */
+
+typedef struct {
+    uint32_t hv;
+    uint32_t stamp;     /* logical time of the last reference */
+    uint32_t size;      /* total item size, 0 until known */
+    uint32_t heap_pos;  /* position in key_heap */
+} mrc_key;
+
+volatile uint32_t mrc_threshold = 0;
+
+static pthread_mutex_t mrc_lock = PTHREAD_MUTEX_INITIALIZER;
+static mrc_key *keys;         /* MRC_MAX_KEYS + 1 while dropping one */
+static uint32_t nkeys = 0;
+static int32_t *key_index;    /* open addressing on hv, -1 is empty */
+static uint32_t *key_heap;    /* keys[] positions, max-heap on hv */
+static uint64_t *tree;        /* Fenwick tree of sizes by stamp, 1-based */
+static uint32_t clock_now = 0;
+
+static uint64_t histogram[MRC_BUCKETS];
+static uint64_t overflow;     /* reuse distance past the last bucket */
+static uint64_t cold;         /* first reference to a key */
+static uint64_t references;
+
+static void tree_add(uint32_t stamp, const int64_t delta) {
+    for (; stamp <= MRC_STAMPS; stamp += stamp & -stamp)
+        tree[stamp] += delta;
+}
+
+static uint64_t tree_sum(uint32_t stamp) {
+    uint64_t sum = 0;
+    for (; stamp > 0; stamp -= stamp & -stamp)
+        sum += tree[stamp];
+    return sum;
+}
+
+/* Sampled hashes are all small, so mix them before picking a slot. */
+static inline uint32_t index_slot(const uint32_t hv) {
+    return (hv * 2654435761U) & MRC_INDEX_MASK;
+}
+
+static int32_t index_find(const uint32_t hv) {
+    uint32_t i;
+    for (i = index_slot(hv); key_index[i] != -1; i = (i + 1) & MRC_INDEX_MASK) {
+        if (keys[key_index[i]].hv == hv)
+            return (int32_t)i;
+    }
+    return -1;
+}
+
+static void index_insert(const uint32_t hv, const int32_t pos) {
+    uint32_t i = index_slot(hv);
+    while (key_index[i] != -1)
+        i = (i + 1) & MRC_INDEX_MASK;
+    key_index[i] = pos;
+}
+
+/* Linear probing delete; shift back later entries so lookups never stop at
+ * the hole early. */
+static void index_delete(uint32_t i) {
+    uint32_t j = i, k;
+    for (;;) {
+        j = (j + 1) & MRC_INDEX_MASK;
+        if (key_index[j] == -1)
+            break;
+        k = index_slot(keys[key_index[j]].hv);
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        key_index[i] = key_index[j];
+        i = j;
+    }
+    key_index[i] = -1;
+}
+
+static void heap_swap(const uint32_t a, const uint32_t b) {
+    uint32_t tmp = key_heap[a];
+    key_heap[a] = key_heap[b];
+    key_heap[b] = tmp;
+    keys[key_heap[a]].heap_pos = a;
+    keys[key_heap[b]].heap_pos = b;
+}
+
+static void heap_up(uint32_t i) {
+    while (i > 0 && keys[key_heap[(i - 1) / 2]].hv < keys[key_heap[i]].hv) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void heap_down(uint32_t i) {
+    for (;;) {
+        uint32_t largest = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < nkeys && keys[key_heap[l]].hv > keys[key_heap[largest]].hv)
+            largest = l;
+        if (r < nkeys && keys[key_heap[r]].hv > keys[key_heap[largest]].hv)
+            largest = r;
+        if (largest == i)
+            break;
+        heap_swap(i, largest);
+        i = largest;
+    }
+}
+
+static int stamp_cmp(const void *a, const void *b) {
+    uint32_t sa = keys[*(const uint32_t *)a].stamp;
+    uint32_t sb = keys[*(const uint32_t *)b].stamp;
+    return (sa > sb) - (sa < sb);
+}
+
+/* The clock ran out of stamps; renumber the keys 1..nkeys in the same order
+ * and rebuild the tree. Happens at most every 3 * MRC_MAX_KEYS references. */
+static void compact_stamps(void) {
+    uint32_t *order = key_heap + MRC_MAX_KEYS + 1; /* scratch space */
+    uint32_t i;
+    for (i = 0; i < nkeys; i++)
+        order[i] = i;
+    qsort(order, nkeys, sizeof(uint32_t), stamp_cmp);
+    memset(tree, 0, sizeof(uint64_t) * (MRC_STAMPS + 1));
+    for (i = 0; i < nkeys; i++) {
+        keys[order[i]].stamp = i + 1;
+        tree_add(i + 1, keys[order[i]].size);
+    }
+    clock_now = nkeys;
+}
+
+/* Moves a key to the most recent position, optionally with a new size. */
+static void key_touch(const uint32_t pos, const uint32_t size) {
+    mrc_key *k;
+    if (clock_now == MRC_STAMPS)
+        compact_stamps();
+    k = &keys[pos];
+    if (k->stamp != 0)
+        tree_add(k->stamp, -(int64_t)k->size);
+    if (size != 0)
+        k->size = size;
+    k->stamp = ++clock_now;
+    tree_add(k->stamp, k->size);
+}
+
+static void key_remove(const uint32_t pos) {
+    mrc_key *k = &keys[pos];
+    uint32_t hpos = k->heap_pos;
+    int32_t slot;
+
+    tree_add(k->stamp, -(int64_t)k->size);
+    index_delete(index_find(k->hv));
+
+    /* Take it out of the heap. */
+    nkeys--;
+    if (hpos != nkeys) {
+        heap_swap(hpos, nkeys);
+        heap_down(hpos);
+        heap_up(hpos);
+    }
+
+    /* Fill the hole in keys[] with the last key. */
+    if (pos != nkeys) {
+        keys[pos] = keys[nkeys];
+        slot = index_find(keys[pos].hv);
+        key_index[slot] = pos;
+        key_heap[keys[pos].heap_pos] = pos;
+    }
+}
+
+static void key_insert(const uint32_t hv, const uint32_t size) {
+    uint32_t pos = nkeys++;
+    keys[pos].hv = hv;
+    keys[pos].stamp = 0;
+    keys[pos].size = 0;
+    keys[pos].heap_pos = pos;
+    key_heap[pos] = pos;
+    heap_up(pos);
+    index_insert(hv, pos);
+    key_touch(pos, size);
+
+    if (nkeys > MRC_MAX_KEYS) {
+        /* Drop the largest hash and stop sampling anything above it. */
+        uint32_t top = key_heap[0];
+        mrc_threshold = keys[top].hv;
+        key_remove(top);
+    }
+}
+
+void mrc_record_get(const uint32_t hv, const item *it) {
+    uint32_t size = it ? ITEM_ntotal(it) : 0;
+    int32_t slot;
+
+    pthread_mutex_lock(&mrc_lock);
+    /* The threshold may have dropped since the caller checked. */
+    if (hv >= mrc_threshold) {
+        pthread_mutex_unlock(&mrc_lock);
+        return;
+    }
+    references++;
+    slot = index_find(hv);
+    if (slot == -1) {
+        cold++;
+        key_insert(hv, size);
+    } else {
+        uint32_t pos = key_index[slot];
+        uint64_t bucket_width = settings.maxbytes / MRC_BUCKETS_PER_X;
+        double distance = (double)(tree_sum(clock_now) - tree_sum(keys[pos].stamp));
+        uint64_t bucket;
+
+        distance = distance * 4294967296.0 / mrc_threshold;
+        bucket = (uint64_t)(distance / (bucket_width ? bucket_width : 1));
+        if (bucket < MRC_BUCKETS) {
+            histogram[bucket]++;
+        } else {
+            overflow++;
+        }
+        key_touch(pos, size);
+    }
+    pthread_mutex_unlock(&mrc_lock);
+}
+
+void mrc_record_set(const uint32_t hv, const item *it) {
+    int32_t slot;
+
+    pthread_mutex_lock(&mrc_lock);
+    if (hv >= mrc_threshold) {
+        pthread_mutex_unlock(&mrc_lock);
+        return;
+    }
+    slot = index_find(hv);
+    if (slot == -1) {
+        key_insert(hv, ITEM_ntotal(it));
+    } else {
+        key_touch(key_index[slot], ITEM_ntotal(it));
+    }
+    pthread_mutex_unlock(&mrc_lock);
+}
+
+void mrc_reset(void) {
+    pthread_mutex_lock(&mrc_lock);
+    memset(histogram, 0, sizeof(histogram));
+    overflow = cold = references = 0;
+    pthread_mutex_unlock(&mrc_lock);
+}
+
+void mrc_stats(ADD_STAT add_stats, void *c) {
+    static const struct {
+        const char *name;
+        int buckets;
+    } sizes[] = {
+        { "hit_ratio_0.5x", MRC_BUCKETS_PER_X / 2 },
+        { "hit_ratio_1x", MRC_BUCKETS_PER_X },
+        { "hit_ratio_2x", MRC_BUCKETS_PER_X * 2 },
+        { "hit_ratio_4x", MRC_BUCKETS_PER_X * 4 },
+    };
+    uint64_t hits = 0;
+    int i, b = 0;
+
+    pthread_mutex_lock(&mrc_lock);
+    APPEND_STAT("sample_rate", "%.6f", mrc_threshold / 4294967296.0);
+    APPEND_STAT("tracked_keys", "%u", nkeys);
+    APPEND_STAT("references", "%llu", (unsigned long long)references);
+    APPEND_STAT("cold_misses", "%llu", (unsigned long long)cold);
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        for (; b < sizes[i].buckets; b++)
+            hits += histogram[b];
+        APPEND_STAT(sizes[i].name, "%.4f",
+                    references ? (double)hits / references : 0.0);
+    }
+    pthread_mutex_unlock(&mrc_lock);
+
+    add_stats(NULL, 0, NULL, 0, c);
+}
+
+int mrc_init(void) {
+    int i;
+    keys = calloc(MRC_MAX_KEYS + 1, sizeof(mrc_key));
+    key_index = malloc(sizeof(int32_t) * MRC_INDEX_SIZE);
+    /* The heap is followed by scratch space for compact_stamps() */
+    key_heap = calloc((MRC_MAX_KEYS + 1) * 2, sizeof(uint32_t));
+    tree = calloc(MRC_STAMPS + 1, sizeof(uint64_t));
+    if (keys == NULL || key_index == NULL || key_heap == NULL || tree == NULL) {
+        fprintf(stderr, "Failed to allocate miss ratio curve tracking\n");
+        return -1;
+    }
+    for (i = 0; i < MRC_INDEX_SIZE; i++)
+        key_index[i] = -1;
+    mrc_threshold = UINT32_MAX / MRC_INITIAL_RATE;
+    return 0;
+}
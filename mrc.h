@@ -0,0 +1,14 @@
+/* miss-ratio curve estimation */
+#ifndef MRC_H
+#define MRC_H
+
+/* Keys whose hash is below this are sampled. Zero while disabled. */
+extern volatile uint32_t mrc_threshold;
+
+int mrc_init(void);
+void mrc_reset(void);
+void mrc_record_get(const uint32_t hv, const item *it);
+void mrc_record_set(const uint32_t hv, const item *it);
+void mrc_stats(ADD_STAT add_stats, void *c);
+
+#endif
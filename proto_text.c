@@ -0,0 +1,132 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include <assert.h>
+#include <string.h>
+
+#include "proto_text.h"
+
+/*
+ * Spaces are found with memchr(), which libc implements with vector
+ * instructions where the CPU has them. The line has already been cut at its
+ * "\r\n" by try_read_command().
+ */
+size_t tokenize_command(char *command, token_t *tokens, const size_t max_tokens) {
+    char *s, *e;
+    char *end;
+    size_t ntokens = 0;
+
+    assert(command != NULL && tokens != NULL && max_tokens > 1);
+
+    s = command;
+    end = command + strlen(command);
+    while (s < end) {
+        e = memchr(s, ' ', end - s);
+        if (e == NULL)
+            e = end;
+        if (e != s) {
+            tokens[ntokens].value = s;
+            tokens[ntokens].length = e - s;
+            ntokens++;
+            *e = '\0';
+            if (ntokens == max_tokens - 1) {
+                s = e + 1; /* so we don't add an extra token */
+                break;
+            }
+        }
+        s = e + 1;
+    }
+
+    /*
+     * If we scanned the whole string, the terminal value pointer is null,
+     * otherwise it is the first unprocessed character.
+     */
+    tokens[ntokens].value = s < end ? s : NULL;
+    tokens[ntokens].length = 0;
+    ntokens++;
+
+    return ntokens;
+}
+
+/*
+ * Commands are told apart by length and then by their first bytes, so that
+ * a command costs one memcmp() whatever its place in the list.
+ */
+#define MATCH(name, cmd) \
+    if (memcmp(verb, name, len) == 0) \
+        return cmd
+
+enum ascii_command ascii_command_lookup(const char *verb, const size_t len) {
+    switch (len) {
+    case 2:
+        if (verb[0] != 'm')
+            break;
+        switch (verb[1]) {
+        case 'g': return ASCII_CMD_MG;
+        case 's': return ASCII_CMD_MS;
+        case 'd': return ASCII_CMD_MD;
+        case 'a': return ASCII_CMD_MA;
+        case 'n': return ASCII_CMD_MN;
+        }
+        break;
+    case 3:
+        switch (verb[0]) {
+        case 'g': MATCH("get", ASCII_CMD_GET); break;
+        case 's': MATCH("set", ASCII_CMD_SET); break;
+        case 'a': MATCH("add", ASCII_CMD_ADD); break;
+        case 'c': MATCH("cas", ASCII_CMD_CAS); break;
+        }
+        break;
+    case 4:
+        switch (verb[0]) {
+        case 'g': MATCH("gets", ASCII_CMD_GETS); break;
+        case 'b': MATCH("bget", ASCII_CMD_BGET); break;
+        case 'i': MATCH("incr", ASCII_CMD_INCR); break;
+        case 'd': MATCH("decr", ASCII_CMD_DECR); break;
+        case 'q': MATCH("quit", ASCII_CMD_QUIT); break;
+        case 'l':
+            MATCH("lget", ASCII_CMD_LGET);
+            MATCH("lset", ASCII_CMD_LSET);
+            break;
+        }
+        break;
+    case 5:
+        switch (verb[0]) {
+        case 's':
+            MATCH("stats", ASCII_CMD_STATS);
+            MATCH("slabs", ASCII_CMD_SLABS);
+            break;
+        case 't': MATCH("touch", ASCII_CMD_TOUCH); break;
+        }
+        break;
+    case 6:
+        switch (verb[0]) {
+        case 'd': MATCH("delete", ASCII_CMD_DELETE); break;
+        case 'a': MATCH("append", ASCII_CMD_APPEND); break;
+        }
+        break;
+    case 7:
+        switch (verb[0]) {
+        case 'r': MATCH("replace", ASCII_CMD_REPLACE); break;
+        case 'p': MATCH("prepend", ASCII_CMD_PREPEND); break;
+        case 'v': MATCH("version", ASCII_CMD_VERSION); break;
+        }
+        break;
+    case 8:
+        MATCH("shutdown", ASCII_CMD_SHUTDOWN);
+        break;
+    case 9:
+        MATCH("flush_all", ASCII_CMD_FLUSH_ALL);
+        MATCH("verbosity", ASCII_CMD_VERBOSITY);
+        MATCH("set_multi", ASCII_CMD_SET_MULTI);
+        break;
+    case 11:
+        MATCH("lru_crawler", ASCII_CMD_LRU_CRAWLER);
+        break;
+    case 12:
+        MATCH("delete_multi", ASCII_CMD_DELETE_MULTI);
+        break;
+    case 15:
+        MATCH("eviction_policy", ASCII_CMD_EVICTION_POLICY);
+        break;
+    }
+    return ASCII_CMD_UNKNOWN;
+}
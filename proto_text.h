@@ -0,0 +1,83 @@
+#ifndef PROTO_TEXT_H
+#define PROTO_TEXT_H
+
+#include <stddef.h>
+
+/*
+ * Parsing of ASCII protocol command lines: splitting them into tokens and
+ * telling which command the first token names.
+ */
+
+typedef struct token_s {
+    char *value;
+    size_t length;
+} token_t;
+
+#define COMMAND_TOKEN 0
+#define SUBCOMMAND_TOKEN 1
+#define KEY_TOKEN 1
+
+#define MAX_TOKENS 8
+#define MAX_META_TOKENS 24
+
+enum ascii_command {
+    ASCII_CMD_UNKNOWN = 0,
+    ASCII_CMD_GET,
+    ASCII_CMD_BGET,
+    ASCII_CMD_GETS,
+    ASCII_CMD_SET,
+    ASCII_CMD_ADD,
+    ASCII_CMD_REPLACE,
+    ASCII_CMD_APPEND,
+    ASCII_CMD_PREPEND,
+    ASCII_CMD_CAS,
+    ASCII_CMD_LGET,
+    ASCII_CMD_LSET,
+    ASCII_CMD_INCR,
+    ASCII_CMD_DECR,
+    ASCII_CMD_DELETE,
+    ASCII_CMD_SET_MULTI,
+    ASCII_CMD_DELETE_MULTI,
+    ASCII_CMD_TOUCH,
+    ASCII_CMD_MG,
+    ASCII_CMD_MS,
+    ASCII_CMD_MD,
+    ASCII_CMD_MA,
+    ASCII_CMD_MN,
+    ASCII_CMD_STATS,
+    ASCII_CMD_FLUSH_ALL,
+    ASCII_CMD_VERSION,
+    ASCII_CMD_QUIT,
+    ASCII_CMD_SHUTDOWN,
+    ASCII_CMD_SLABS,
+    ASCII_CMD_LRU_CRAWLER,
+    ASCII_CMD_VERBOSITY,
+    ASCII_CMD_EVICTION_POLICY
+};
+
+/*
+ * Tokenize the command string by replacing whitespace with '\0' and update
+ * the token array tokens with pointer to start of each token and length.
+ * Returns total number of tokens.  The last valid token is the terminal
+ * token (value points to the first unprocessed character of the string and
+ * length zero).
+ *
+ * Usage example:
+ *
+ *  while(tokenize_command(command, ncommand, tokens, max_tokens) > 0) {
+ *      for(int ix = 0; tokens[ix].length != 0; ix++) {
+ *          ...
+ *      }
+ *      ncommand = tokens[ix].value - command;
+ *      command  = tokens[ix].value;
+ *   }
+ */
+size_t tokenize_command(char *command, token_t *tokens, const size_t max_tokens);
+
+/*
+ * Returns the command named by the first token of a command line, or
+ * ASCII_CMD_UNKNOWN.
+ */
+enum ascii_command ascii_command_lookup(const char *verb, const size_t len);
+
+#endif    /* PROTO_TEXT_H */
@@ -67,6 +67,7 @@ extern "C"
         PROTOCOL_BINARY_RESPONSE_EINVAL = 0x04,
         PROTOCOL_BINARY_RESPONSE_NOT_STORED = 0x05,
         PROTOCOL_BINARY_RESPONSE_DELTA_BADVAL = 0x06,
+        PROTOCOL_BINARY_RESPONSE_HOT_MISS = 0x0a,
         PROTOCOL_BINARY_RESPONSE_AUTH_ERROR = 0x20,
         PROTOCOL_BINARY_RESPONSE_AUTH_CONTINUE = 0x21,
         PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND = 0x81,
@@ -111,6 +112,14 @@ extern "C"
         PROTOCOL_BINARY_CMD_GATK = 0x23,
         PROTOCOL_BINARY_CMD_GATKQ = 0x24,
 
+        /* Leases, see "lget" and "lset" in doc/protocol.txt */
+        PROTOCOL_BINARY_CMD_LGET = 0x25,
+        PROTOCOL_BINARY_CMD_LSET = 0x26,
+
+        /* See "set_multi" and "delete_multi" in doc/protocol.txt */
+        PROTOCOL_BINARY_CMD_SET_MULTI = 0x27,
+        PROTOCOL_BINARY_CMD_DELETE_MULTI = 0x28,
+
         PROTOCOL_BINARY_CMD_SASL_LIST_MECHS = 0x20,
         PROTOCOL_BINARY_CMD_SASL_AUTH = 0x21,
         PROTOCOL_BINARY_CMD_SASL_STEP = 0x22,
@@ -0,0 +1,874 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Replays a command capture (see -o capture) against a server.
+ *
+ * Every captured connection gets its own connection to the server, and each
+ * command is sent at its original offset from the start of the capture,
+ * divided by the speed factor (-S). With -S 0 commands are sent as fast as
+ * the server answers, keeping up to -d of them in flight per connection.
+ *
+ * Storage commands are sent with filler values of the captured length.
+ * Quiet binary commands are sent as their loud versions, so that every
+ * request has exactly one response to time. ASCII commands other than
+ * get, gets, set, add, replace, append, prepend, cas, delete, incr, decr and
+ * touch (and the binary equivalents) are skipped, so a captured flush_all or
+ * stats will not disturb the run.
+ *
+ * Results are printed in the same format as loadgen: "name value" lines, or
+ * a JSON object with -J.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "protocol_binary.h"
+#include "capture.h"
+
+/* Latency histograms, the same layout as loadgen and "stats latency". */
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (40 * HIST_SUB_BUCKETS)
+
+#define MAX_TOKENS 8
+
+enum op_type { OP_GET = 0, OP_SET, OP_OTHER, OP_MAX };
+static const char *op_names[OP_MAX] = { "get", "set", "other" };
+
+/* What to expect back for a command. */
+enum response_type {
+    RESP_NONE = 0,      /* noreply */
+    RESP_VALUES,        /* ASCII VALUE lines until END */
+    RESP_LINE,          /* one ASCII line */
+    RESP_BINARY         /* one binary response */
+};
+
+typedef struct {
+    uint64_t time;
+    uint32_t conn;
+    uint8_t protocol;
+    uint8_t op;
+    uint8_t response;
+    uint8_t opcode;     /* binary opcode to send, quiet ones made loud */
+    uint16_t nkeys;
+    const char *data;
+    uint32_t len;
+    uint32_t vlen;      /* value bytes to send after the command */
+    uint32_t index;     /* position in the file, to keep the sort stable */
+} replay_cmd;
+
+typedef struct {
+    uint8_t op;
+    uint8_t response;
+    uint16_t nkeys;
+    uint16_t hits;
+    uint64_t start;
+} pending;
+
+typedef struct {
+    int fd;
+    uint32_t remaining;     /* commands not sent yet */
+    char *wbuf;
+    size_t wsize, wlen, wsent;
+    char *rbuf;
+    size_t rsize, rlen;
+    pending *pend;
+    size_t psize, phead, ptail;
+} replay_conn;
+
+static struct {
+    const char *host;
+    const char *port;
+    const char *file;
+    double speed;
+    int depth;
+    bool json;
+} cfg = {
+    .host = "127.0.0.1",
+    .port = "11211",
+    .file = NULL,
+    .speed = 1.0,
+    .depth = 16,
+    .json = false,
+};
+
+static struct addrinfo *server_addr;
+static char *value_buf;
+
+static uint64_t ops[OP_MAX], hist[OP_MAX][HIST_BUCKETS], max_ns[OP_MAX];
+static uint64_t hits, misses, errors, replayed, skipped, max_lag;
+
+static uint64_t now_ns(void) {
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+    {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return (uint64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+    }
+}
+
+static int hist_bucket(const uint64_t ns) {
+    int msb = 0, idx;
+    uint64_t v = ns;
+    if (ns < HIST_SUB_BUCKETS)
+        return (int)ns;
+    while (v >>= 1)
+        msb++;
+    idx = (msb - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS +
+          (int)((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+static uint64_t hist_bucket_floor(const int idx) {
+    int power = idx / HIST_SUB_BUCKETS;
+    if (power == 0)
+        return idx;
+    return (uint64_t)(HIST_SUB_BUCKETS + idx % HIST_SUB_BUCKETS)
+        << (power - 1);
+}
+
+static uint64_t hist_quantile(const uint64_t *h, const double q) {
+    uint64_t count = 0, seen = 0, rank;
+    int b;
+    for (b = 0; b < HIST_BUCKETS; b++)
+        count += h[b];
+    if (count == 0)
+        return 0;
+    rank = (uint64_t)(count * q);
+    if (rank >= count)
+        rank = count - 1;
+    for (b = 0; seen + h[b] <= rank; b++)
+        seen += h[b];
+    return hist_bucket_floor(b + 1) - 1;
+}
+
+static void *replay_malloc(size_t size) {
+    void *ptr = malloc(size);
+    if (ptr == NULL) {
+        fprintf(stderr, "Failed to allocate %lu bytes\n",
+                (unsigned long)size);
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+static void ensure_space(char **buf, size_t *size, const size_t need) {
+    if (need <= *size)
+        return;
+    while (*size < need)
+        *size *= 2;
+    *buf = realloc(*buf, *size);
+    if (*buf == NULL) {
+        fprintf(stderr, "Failed to grow buffer to %lu bytes\n",
+                (unsigned long)*size);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Splits a copy of an ASCII command line on spaces. */
+static int tokenize(char *line, char **tokens) {
+    int n = 0;
+    char *tok, *save = NULL;
+    for (tok = strtok_r(line, " ", &save); tok != NULL && n < MAX_TOKENS;
+         tok = strtok_r(NULL, " ", &save)) {
+        tokens[n++] = tok;
+    }
+    return n;
+}
+
+/* Works out how to replay an ASCII command. Returns false to skip it. */
+static bool classify_ascii(replay_cmd *cmd) {
+    char line[2048];
+    char *tokens[MAX_TOKENS];
+    int ntokens;
+    size_t len = cmd->len < sizeof(line) - 1 ? cmd->len : sizeof(line) - 1;
+    bool noreply;
+
+    memcpy(line, cmd->data, len);
+    line[len] = '\0';
+    ntokens = tokenize(line, tokens);
+    if (ntokens < 2)
+        return false;
+    noreply = strcmp(tokens[ntokens - 1], "noreply") == 0;
+
+    if (strcmp(tokens[0], "get") == 0 || strcmp(tokens[0], "gets") == 0) {
+        const char *p;
+        cmd->op = OP_GET;
+        cmd->response = RESP_VALUES;
+        /* Count keys in the whole line, which may have been cut above. */
+        cmd->nkeys = 0;
+        for (p = cmd->data; p < cmd->data + cmd->len; p++) {
+            if (*p == ' ' && p + 1 < cmd->data + cmd->len && p[1] != ' ')
+                cmd->nkeys++;
+        }
+        return true;
+    }
+    if (strcmp(tokens[0], "set") == 0 || strcmp(tokens[0], "add") == 0 ||
+        strcmp(tokens[0], "replace") == 0 ||
+        strcmp(tokens[0], "append") == 0 ||
+        strcmp(tokens[0], "prepend") == 0 || strcmp(tokens[0], "cas") == 0) {
+        if (ntokens < 5)
+            return false;
+        cmd->op = OP_SET;
+        cmd->response = noreply ? RESP_NONE : RESP_LINE;
+        cmd->vlen = strtoul(tokens[4], NULL, 10);
+        return true;
+    }
+    if (strcmp(tokens[0], "delete") == 0 || strcmp(tokens[0], "incr") == 0 ||
+        strcmp(tokens[0], "decr") == 0 || strcmp(tokens[0], "touch") == 0) {
+        cmd->op = OP_OTHER;
+        cmd->response = noreply ? RESP_NONE : RESP_LINE;
+        return true;
+    }
+    return false;
+}
+
+static bool classify_binary(replay_cmd *cmd) {
+    protocol_binary_request_header req;
+    uint32_t bodylen;
+    uint16_t keylen;
+
+    if (cmd->len < sizeof(req))
+        return false;
+    memcpy(&req, cmd->data, sizeof(req));
+    keylen = ntohs(req.request.keylen);
+    bodylen = ntohl(req.request.bodylen);
+    if (bodylen < req.request.extlen + keylen)
+        return false;
+    cmd->vlen = bodylen - req.request.extlen - keylen;
+    cmd->response = RESP_BINARY;
+    cmd->nkeys = 1;
+
+    switch (req.request.opcode) {
+    case PROTOCOL_BINARY_CMD_GETQ:
+        cmd->opcode = PROTOCOL_BINARY_CMD_GET;
+        cmd->op = OP_GET;
+        return true;
+    case PROTOCOL_BINARY_CMD_GETKQ:
+        cmd->opcode = PROTOCOL_BINARY_CMD_GETK;
+        cmd->op = OP_GET;
+        return true;
+    case PROTOCOL_BINARY_CMD_GET:
+    case PROTOCOL_BINARY_CMD_GETK:
+        cmd->opcode = req.request.opcode;
+        cmd->op = OP_GET;
+        return true;
+    case PROTOCOL_BINARY_CMD_SETQ:
+        cmd->opcode = PROTOCOL_BINARY_CMD_SET;
+        break;
+    case PROTOCOL_BINARY_CMD_ADDQ:
+        cmd->opcode = PROTOCOL_BINARY_CMD_ADD;
+        break;
+    case PROTOCOL_BINARY_CMD_REPLACEQ:
+        cmd->opcode = PROTOCOL_BINARY_CMD_REPLACE;
+        break;
+    case PROTOCOL_BINARY_CMD_APPENDQ:
+        cmd->opcode = PROTOCOL_BINARY_CMD_APPEND;
+        break;
+    case PROTOCOL_BINARY_CMD_PREPENDQ:
+        cmd->opcode = PROTOCOL_BINARY_CMD_PREPEND;
+        break;
+    case PROTOCOL_BINARY_CMD_SET:
+    case PROTOCOL_BINARY_CMD_ADD:
+    case PROTOCOL_BINARY_CMD_REPLACE:
+    case PROTOCOL_BINARY_CMD_APPEND:
+    case PROTOCOL_BINARY_CMD_PREPEND:
+        cmd->opcode = req.request.opcode;
+        break;
+    case PROTOCOL_BINARY_CMD_DELETEQ:
+        cmd->opcode = PROTOCOL_BINARY_CMD_DELETE;
+        cmd->op = OP_OTHER;
+        return true;
+    case PROTOCOL_BINARY_CMD_INCREMENTQ:
+        cmd->opcode = PROTOCOL_BINARY_CMD_INCREMENT;
+        cmd->op = OP_OTHER;
+        return true;
+    case PROTOCOL_BINARY_CMD_DECREMENTQ:
+        cmd->opcode = PROTOCOL_BINARY_CMD_DECREMENT;
+        cmd->op = OP_OTHER;
+        return true;
+    case PROTOCOL_BINARY_CMD_DELETE:
+    case PROTOCOL_BINARY_CMD_INCREMENT:
+    case PROTOCOL_BINARY_CMD_DECREMENT:
+    case PROTOCOL_BINARY_CMD_TOUCH:
+        cmd->opcode = req.request.opcode;
+        cmd->op = OP_OTHER;
+        return true;
+    default:
+        return false;
+    }
+    cmd->op = OP_SET;
+    return true;
+}
+
+static int cmd_order(const void *a, const void *b) {
+    const replay_cmd *x = a, *y = b;
+    if (x->time != y->time)
+        return x->time < y->time ? -1 : 1;
+    return x->index < y->index ? -1 : (x->index > y->index);
+}
+
+/* Reads the capture; returns the commands to replay, sorted by time. */
+static replay_cmd *load_capture(const char *path, size_t *ncmds,
+                                uint32_t *nconns, char **file_data) {
+    capture_file_header header;
+    capture_record rec;
+    struct stat st;
+    replay_cmd *cmds;
+    size_t pos, n = 0, nalloc = 1024;
+    uint32_t max_vlen = 0;
+    char *data;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    data = replay_malloc(st.st_size + 1);
+    for (pos = 0; pos < (size_t)st.st_size; ) {
+        ssize_t res = read(fd, data + pos, st.st_size - pos);
+        if (res <= 0) {
+            fprintf(stderr, "Failed to read %s\n", path);
+            exit(EXIT_FAILURE);
+        }
+        pos += res;
+    }
+    close(fd);
+
+    if ((size_t)st.st_size < sizeof(header)) {
+        fprintf(stderr, "%s is not a capture file\n", path);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CAPTURE_VERSION) {
+        fprintf(stderr, "%s is not a capture file\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (header.byteorder != CAPTURE_BYTEORDER) {
+        fprintf(stderr, "%s was written on a machine of another byte order\n",
+                path);
+        exit(EXIT_FAILURE);
+    }
+
+    cmds = replay_malloc(sizeof(replay_cmd) * nalloc);
+    *nconns = 0;
+    for (pos = sizeof(header); pos + sizeof(rec) <= (size_t)st.st_size; ) {
+        replay_cmd *cmd;
+        bool ok;
+
+        memcpy(&rec, data + pos, sizeof(rec));
+        if (pos + sizeof(rec) + rec.len > (size_t)st.st_size)
+            break;      /* cut short while being written */
+        if (n == nalloc) {
+            nalloc *= 2;
+            cmds = realloc(cmds, sizeof(replay_cmd) * nalloc);
+            if (cmds == NULL) {
+                fprintf(stderr, "Failed to allocate commands\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        cmd = &cmds[n];
+        memset(cmd, 0, sizeof(*cmd));
+        cmd->time = rec.time;
+        cmd->conn = rec.conn;
+        cmd->protocol = rec.protocol;
+        cmd->data = data + pos + sizeof(rec);
+        cmd->len = rec.len;
+        cmd->index = n;
+        pos += sizeof(rec) + rec.len;
+
+        if (rec.protocol == CAPTURE_ASCII) {
+            ok = classify_ascii(cmd);
+        } else if (rec.protocol == CAPTURE_BINARY) {
+            ok = classify_binary(cmd);
+        } else {
+            ok = false;
+        }
+        if (!ok || rec.conn == 0) {
+            skipped++;
+            continue;
+        }
+        if (cmd->vlen > max_vlen)
+            max_vlen = cmd->vlen;
+        if (rec.conn > *nconns)
+            *nconns = rec.conn;
+        n++;
+    }
+
+    qsort(cmds, n, sizeof(replay_cmd), cmd_order);
+    value_buf = replay_malloc(max_vlen + 1);
+    memset(value_buf, 'x', max_vlen);
+    *ncmds = n;
+    *file_data = data;
+    return cmds;
+}
+
+static int connect_server(void) {
+    int fd, flag = 1;
+
+    fd = socket(server_addr->ai_family, server_addr->ai_socktype,
+                server_addr->ai_protocol);
+    if (fd == -1) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    if (connect(fd, server_addr->ai_addr, server_addr->ai_addrlen) == -1) {
+        perror("connect");
+        exit(EXIT_FAILURE);
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+static void append(replay_conn *c, const void *data, const size_t len) {
+    ensure_space(&c->wbuf, &c->wsize, c->wlen + len);
+    memcpy(c->wbuf + c->wlen, data, len);
+    c->wlen += len;
+}
+
+static size_t pending_count(const replay_conn *c) {
+    return c->ptail - c->phead;
+}
+
+static void send_cmd(replay_conn *c, const replay_cmd *cmd,
+                     const uint64_t now) {
+    if (c->fd == -1) {
+        c->fd = connect_server();
+        c->wsize = c->rsize = 16384;
+        c->wbuf = replay_malloc(c->wsize);
+        c->rbuf = replay_malloc(c->rsize);
+        c->psize = 64;
+        c->pend = replay_malloc(sizeof(pending) * c->psize);
+    }
+
+    if (cmd->protocol == CAPTURE_ASCII) {
+        append(c, cmd->data, cmd->len);
+        append(c, "\r\n", 2);
+        if (cmd->op == OP_SET) {
+            append(c, value_buf, cmd->vlen);
+            append(c, "\r\n", 2);
+        }
+    } else {
+        protocol_binary_request_header req;
+        memcpy(&req, cmd->data, sizeof(req));
+        req.request.opcode = cmd->opcode;
+        append(c, &req, sizeof(req));
+        append(c, cmd->data + sizeof(req), cmd->len - sizeof(req));
+        append(c, value_buf, cmd->vlen);
+    }
+
+    replayed++;
+    c->remaining--;
+    if (cmd->response == RESP_NONE) {
+        ops[cmd->op]++;
+        return;
+    }
+    if (c->ptail == c->psize) {
+        if (c->phead > 0) {
+            memmove(c->pend, c->pend + c->phead,
+                    sizeof(pending) * pending_count(c));
+            c->ptail -= c->phead;
+            c->phead = 0;
+        } else {
+            c->psize *= 2;
+            c->pend = realloc(c->pend, sizeof(pending) * c->psize);
+            if (c->pend == NULL) {
+                fprintf(stderr, "Failed to grow pending commands\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    c->pend[c->ptail].op = cmd->op;
+    c->pend[c->ptail].response = cmd->response;
+    c->pend[c->ptail].nkeys = cmd->nkeys;
+    c->pend[c->ptail].hits = 0;
+    c->pend[c->ptail].start = now;
+    c->ptail++;
+}
+
+static void complete(replay_conn *c, const uint64_t now, const bool ok) {
+    pending *p = &c->pend[c->phead++];
+    uint64_t ns = now - p->start;
+    ops[p->op]++;
+    hist[p->op][hist_bucket(ns)]++;
+    if (ns > max_ns[p->op])
+        max_ns[p->op] = ns;
+    if (!ok)
+        errors++;
+    if (p->op == OP_GET) {
+        hits += p->hits;
+        misses += p->nkeys > p->hits ? p->nkeys - p->hits : 0;
+    }
+}
+
+static bool is_error_line(const char *line) {
+    return strncmp(line, "ERROR", 5) == 0 ||
+           strncmp(line, "CLIENT_ERROR", 12) == 0 ||
+           strncmp(line, "SERVER_ERROR", 12) == 0;
+}
+
+/* Returns the number of bytes consumed. */
+static size_t parse_responses(replay_conn *c, const uint64_t now) {
+    size_t pos = 0;
+
+    while (pending_count(c) > 0) {
+        pending *p = &c->pend[c->phead];
+        char *start = c->rbuf + pos;
+        size_t avail = c->rlen - pos;
+
+        if (p->response == RESP_BINARY) {
+            protocol_binary_response_header rsp;
+            uint32_t bodylen;
+            uint16_t status;
+
+            if (avail < sizeof(rsp))
+                break;
+            memcpy(&rsp, start, sizeof(rsp));
+            bodylen = ntohl(rsp.response.bodylen);
+            if (avail < sizeof(rsp) + bodylen)
+                break;
+            pos += sizeof(rsp) + bodylen;
+            status = ntohs(rsp.response.status);
+            if (p->op == OP_GET && status == PROTOCOL_BINARY_RESPONSE_SUCCESS)
+                p->hits++;
+            complete(c, now, status == PROTOCOL_BINARY_RESPONSE_SUCCESS ||
+                     status == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT ||
+                     status == PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS ||
+                     status == PROTOCOL_BINARY_RESPONSE_NOT_STORED);
+        } else {
+            char *nl = memchr(start, '\n', avail);
+            size_t linelen;
+
+            if (nl == NULL)
+                break;
+            linelen = nl - start + 1;
+            if (p->response == RESP_VALUES && linelen > 6 &&
+                memcmp(start, "VALUE ", 6) == 0) {
+                char tmp[512];
+                unsigned long bytes = 0;
+                size_t n = linelen < sizeof(tmp) ? linelen : sizeof(tmp) - 1;
+                memcpy(tmp, start, n);
+                tmp[n] = '\0';
+                if (sscanf(tmp, "VALUE %*s %*u %lu", &bytes) != 1) {
+                    fprintf(stderr, "Bad response: %s", tmp);
+                    exit(EXIT_FAILURE);
+                }
+                if (avail < linelen + bytes + 2)
+                    break;
+                p->hits++;
+                pos += linelen + bytes + 2;
+                continue;
+            }
+            pos += linelen;
+            complete(c, now, !is_error_line(start));
+        }
+    }
+    return pos;
+}
+
+static void conn_write(replay_conn *c) {
+    while (c->wsent < c->wlen) {
+        ssize_t res = write(c->fd, c->wbuf + c->wsent, c->wlen - c->wsent);
+        if (res > 0) {
+            c->wsent += res;
+        } else if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        } else if (res == -1 && errno == EINTR) {
+            continue;
+        } else {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+    }
+    c->wlen = c->wsent = 0;
+}
+
+static void conn_read(replay_conn *c) {
+    for (;;) {
+        ssize_t res;
+        size_t used;
+
+        ensure_space(&c->rbuf, &c->rsize, c->rlen + 16384);
+        res = read(c->fd, c->rbuf + c->rlen, c->rsize - c->rlen);
+        if (res == 0) {
+            fprintf(stderr, "Server closed the connection\n");
+            exit(EXIT_FAILURE);
+        } else if (res == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            exit(EXIT_FAILURE);
+        }
+        c->rlen += res;
+        used = parse_responses(c, now_ns());
+        memmove(c->rbuf, c->rbuf + used, c->rlen - used);
+        c->rlen -= used;
+    }
+}
+
+static void conn_close(replay_conn *c) {
+    close(c->fd);
+    c->fd = -1;
+    free(c->wbuf);
+    free(c->rbuf);
+    free(c->pend);
+    c->wbuf = c->rbuf = NULL;
+    c->pend = NULL;
+}
+
+static void report(const double elapsed, const double captured,
+                   const uint32_t nconns, const uint64_t unanswered) {
+    static const struct {
+        const char *name;
+        double q;
+    } pcts[] = {
+        { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }, { "p999", 0.999 }
+    };
+    double hit_ratio = hits + misses ? (double)hits / (hits + misses) : 0;
+    int op, p;
+
+    if (cfg.json) {
+        printf("{\"conns\":%u,\"replayed\":%llu,\"skipped\":%llu,"
+               "\"speed\":%.3f,\"captured_secs\":%.3f,\"elapsed\":%.3f,"
+               "\"max_lag_ms\":%.3f,\"ops_per_sec\":%.0f,\"hits\":%llu,"
+               "\"misses\":%llu,\"hit_ratio\":%.4f,\"errors\":%llu,"
+               "\"unanswered\":%llu",
+               nconns, (unsigned long long)replayed,
+               (unsigned long long)skipped, cfg.speed, captured, elapsed,
+               max_lag / 1e6, replayed / elapsed, (unsigned long long)hits,
+               (unsigned long long)misses, hit_ratio,
+               (unsigned long long)errors, (unsigned long long)unanswered);
+        for (op = 0; op < OP_MAX; op++) {
+            printf(",\"%s\":{\"ops\":%llu", op_names[op],
+                   (unsigned long long)ops[op]);
+            for (p = 0; p < sizeof(pcts) / sizeof(pcts[0]); p++) {
+                printf(",\"%s_us\":%.3f", pcts[p].name,
+                       hist_quantile(hist[op], pcts[p].q) / 1000.0);
+            }
+            printf(",\"max_us\":%.3f}", max_ns[op] / 1000.0);
+        }
+        printf("}\n");
+        return;
+    }
+
+    printf("conns %u\n", nconns);
+    printf("replayed %llu\nskipped %llu\n", (unsigned long long)replayed,
+           (unsigned long long)skipped);
+    printf("speed %.3f\ncaptured_secs %.3f\nelapsed %.3f\n", cfg.speed,
+           captured, elapsed);
+    printf("max_lag_ms %.3f\n", max_lag / 1e6);
+    printf("ops_per_sec %.0f\n", replayed / elapsed);
+    printf("hits %llu\nmisses %llu\nhit_ratio %.4f\n",
+           (unsigned long long)hits, (unsigned long long)misses, hit_ratio);
+    printf("errors %llu\nunanswered %llu\n", (unsigned long long)errors,
+           (unsigned long long)unanswered);
+    for (op = 0; op < OP_MAX; op++) {
+        printf("%s_ops %llu\n", op_names[op], (unsigned long long)ops[op]);
+        for (p = 0; p < sizeof(pcts) / sizeof(pcts[0]); p++) {
+            printf("%s_%s_us %.3f\n", op_names[op], pcts[p].name,
+                   hist_quantile(hist[op], pcts[p].q) / 1000.0);
+        }
+        printf("%s_max_us %.3f\n", op_names[op], max_ns[op] / 1000.0);
+    }
+}
+
+static void usage(void) {
+    printf("replay - replay a memcached command capture\n"
+           "-f <file>    capture file written with -o capture\n"
+           "-s <host>    server to connect to (default: 127.0.0.1)\n"
+           "-p <port>    TCP port (default: 11211)\n"
+           "-S <speed>   speed relative to the capture (default: 1.0);\n"
+           "             0 sends as fast as the server answers\n"
+           "-d <num>     with -S 0, commands in flight per connection\n"
+           "             (default: 16)\n"
+           "-J           print results as JSON\n"
+           "-h           print this help and exit\n");
+}
+
+int main(int argc, char **argv) {
+    struct addrinfo hints;
+    replay_cmd *cmds;
+    replay_conn *conns;
+    struct pollfd *fds;
+    int *fd_conn;
+    size_t ncmds, next = 0;
+    uint32_t nconns, i;
+    uint64_t start, now, last_progress, unanswered = 0, outstanding;
+    double captured;
+    char *file_data;
+    int c, error;
+
+    while (-1 != (c = getopt(argc, argv, "f:s:p:S:d:Jh"))) {
+        switch (c) {
+        case 'f':
+            cfg.file = optarg;
+            break;
+        case 's':
+            cfg.host = optarg;
+            break;
+        case 'p':
+            cfg.port = optarg;
+            break;
+        case 'S':
+            cfg.speed = strtod(optarg, NULL);
+            break;
+        case 'd':
+            cfg.depth = atoi(optarg);
+            break;
+        case 'J':
+            cfg.json = true;
+            break;
+        case 'h':
+            usage();
+            return EXIT_SUCCESS;
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (cfg.file == NULL || cfg.speed < 0 || cfg.depth < 1) {
+        fprintf(stderr, "Invalid arguments, see -h\n");
+        return EXIT_FAILURE;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    error = getaddrinfo(cfg.host, cfg.port, &hints, &server_addr);
+    if (error != 0) {
+        fprintf(stderr, "getaddrinfo(): %s\n", gai_strerror(error));
+        return EXIT_FAILURE;
+    }
+
+    cmds = load_capture(cfg.file, &ncmds, &nconns, &file_data);
+    captured = ncmds ? (cmds[ncmds - 1].time - cmds[0].time) / 1e9 : 0;
+
+    /* Connection ids are dense, from 1. */
+    conns = calloc(nconns + 1, sizeof(replay_conn));
+    fds = calloc(nconns + 1, sizeof(struct pollfd));
+    fd_conn = calloc(nconns + 1, sizeof(int));
+    if (conns == NULL || fds == NULL || fd_conn == NULL) {
+        fprintf(stderr, "Failed to allocate connections\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i <= nconns; i++)
+        conns[i].fd = -1;
+    for (next = 0; next < ncmds; next++)
+        conns[cmds[next].conn].remaining++;
+
+    start = last_progress = now_ns();
+    next = 0;
+    for (;;) {
+        int nfds = 0, timeout = 100;
+
+        now = now_ns();
+        outstanding = 0;
+
+        /* Send everything that is due. */
+        while (next < ncmds) {
+            replay_cmd *cmd = &cmds[next];
+            replay_conn *rc = &conns[cmd->conn];
+            uint64_t due = 0;
+
+            if (cfg.speed > 0) {
+                due = (uint64_t)((cmd->time - cmds[0].time) / cfg.speed);
+                if (start + due > now) {
+                    uint64_t wait = (start + due - now) / 1000000;
+                    timeout = wait < 100 ? (int)wait : 100;
+                    break;
+                }
+                if (now - start - due > max_lag)
+                    max_lag = now - start - due;
+            } else if (rc->fd != -1 && pending_count(rc) >= cfg.depth) {
+                break;
+            }
+            send_cmd(rc, cmd, now);
+            last_progress = now;
+            next++;
+        }
+
+        for (i = 1; i <= nconns; i++) {
+            replay_conn *rc = &conns[i];
+            if (rc->fd == -1)
+                continue;
+            if (rc->wlen > rc->wsent)
+                conn_write(rc);
+            if (rc->remaining == 0 && pending_count(rc) == 0 &&
+                rc->wlen == 0) {
+                conn_close(rc);
+                continue;
+            }
+            outstanding += pending_count(rc);
+            fds[nfds].fd = rc->fd;
+            fds[nfds].events = POLLIN;
+            if (rc->wlen > rc->wsent)
+                fds[nfds].events |= POLLOUT;
+            fds[nfds].revents = 0;
+            fd_conn[nfds] = i;
+            nfds++;
+        }
+
+        if (next == ncmds && outstanding == 0)
+            break;
+        if (next == ncmds && now - last_progress > 5000000000ULL) {
+            unanswered = outstanding;
+            break;
+        }
+
+        if (poll(fds, nfds, timeout) == -1 && errno != EINTR) {
+            perror("poll");
+            return EXIT_FAILURE;
+        }
+        for (c = 0; c < nfds; c++) {
+            replay_conn *rc = &conns[fd_conn[c]];
+            if (fds[c].revents & POLLOUT)
+                conn_write(rc);
+            if (fds[c].revents & (POLLIN | POLLHUP | POLLERR)) {
+                conn_read(rc);
+                last_progress = now_ns();
+            }
+        }
+    }
+
+    report((now_ns() - start) / 1e9, captured, nconns, unanswered);
+
+    for (i = 1; i <= nconns; i++) {
+        if (conns[i].fd != -1)
+            conn_close(&conns[i]);
+    }
+    free(conns);
+    free(fds);
+    free(fd_conn);
+    free(cmds);
+    free(file_data);
+    free(value_buf);
+    freeaddrinfo(server_addr);
+    return EXIT_SUCCESS;
+}
@@ -97,6 +97,7 @@ void slabs_init(const size_t limit, const double factor, const bool prealloc) {
     unsigned int size = sizeof(item) + settings.chunk_size;
 
     mem_limit = limit;
+    lock_stats_register(&slabs_lock, "slabs_lock");
 
     if (prealloc) {
         /* Allocate everything in a big chunk with malloc */
@@ -301,6 +302,16 @@ bool get_stats(const char *stat_type, int nkey, ADD_STAT add_stats, void *c) {
             slabs_stats(add_stats, c);
         } else if (nz_strcmp(nkey, stat_type, "sizes") == 0) {
             item_stats_sizes(add_stats, c);
+        } else if (nz_strcmp(nkey, stat_type, "eviction") == 0) {
+            item_stats_eviction(add_stats, c);
+        } else if (nz_strcmp(nkey, stat_type, "mrc") == 0) {
+            mrc_stats(add_stats, c);
+        } else if (nz_strcmp(nkey, stat_type, "latency") == 0) {
+            threadlocal_latency_stats(add_stats, c);
+        } else if (nz_strcmp(nkey, stat_type, "locks") == 0) {
+            lock_stats(add_stats, c);
+        } else if (nz_strcmp(nkey, stat_type, "hotkeys") == 0) {
+            hotkeys_stats(add_stats, c);
         } else {
             ret = false;
         }
@@ -400,27 +411,27 @@ static void *memory_allocate(size_t size) {
 void *slabs_alloc(size_t size, unsigned int id) {
     void *ret;
 
-    pthread_mutex_lock(&slabs_lock);
+    mutex_lock_blocking(&slabs_lock);
     ret = do_slabs_alloc(size, id);
-    pthread_mutex_unlock(&slabs_lock);
+    mutex_unlock(&slabs_lock);
     return ret;
 }
 
 void slabs_free(void *ptr, size_t size, unsigned int id) {
-    pthread_mutex_lock(&slabs_lock);
+    mutex_lock_blocking(&slabs_lock);
     do_slabs_free(ptr, size, id);
-    pthread_mutex_unlock(&slabs_lock);
+    mutex_unlock(&slabs_lock);
 }
 
 void slabs_stats(ADD_STAT add_stats, void *c) {
-    pthread_mutex_lock(&slabs_lock);
+    mutex_lock_blocking(&slabs_lock);
     do_slabs_stats(add_stats, c);
-    pthread_mutex_unlock(&slabs_lock);
+    mutex_unlock(&slabs_lock);
 }
 
 void slabs_adjust_mem_requested(unsigned int id, size_t old, size_t ntotal)
 {
-    pthread_mutex_lock(&slabs_lock);
+    mutex_lock_blocking(&slabs_lock);
     slabclass_t *p;
     if (id < POWER_SMALLEST || id > power_largest) {
         fprintf(stderr, "Internal error! Invalid slab class\n");
@@ -429,7 +440,7 @@ void slabs_adjust_mem_requested(unsigned int id, size_t old, size_t ntotal)
 
     p = &slabclass[id];
     p->requested = p->requested - old + ntotal;
-    pthread_mutex_unlock(&slabs_lock);
+    mutex_unlock(&slabs_lock);
 }
 
 static pthread_cond_t maintenance_cond = PTHREAD_COND_INITIALIZER;
@@ -444,8 +455,8 @@ static int slab_rebalance_start(void) {
     slabclass_t *s_cls;
     int no_go = 0;
 
-    pthread_mutex_lock(&cache_lock);
-    pthread_mutex_lock(&slabs_lock);
+    mutex_lock_blocking(&cache_lock);
+    mutex_lock_blocking(&slabs_lock);
 
     if (slab_rebal.s_clsid < POWER_SMALLEST ||
         slab_rebal.s_clsid > power_largest  ||
@@ -464,8 +475,8 @@ static int slab_rebalance_start(void) {
         no_go = -3;
 
     if (no_go != 0) {
-        pthread_mutex_unlock(&slabs_lock);
-        pthread_mutex_unlock(&cache_lock);
+        mutex_unlock(&slabs_lock);
+        mutex_unlock(&cache_lock);
         return no_go; /* Should use a wrapper function... */
     }
 
@@ -484,8 +495,8 @@ static int slab_rebalance_start(void) {
         fprintf(stderr, "Started a slab rebalance\n");
     }
 
-    pthread_mutex_unlock(&slabs_lock);
-    pthread_mutex_unlock(&cache_lock);
+    mutex_unlock(&slabs_lock);
+    mutex_unlock(&cache_lock);
 
     STATS_LOCK();
     stats.slab_reassign_running = true;
@@ -510,8 +521,8 @@ static int slab_rebalance_move(void) {
     int refcount = 0;
     enum move_status status = MOVE_PASS;
 
-    pthread_mutex_lock(&cache_lock);
-    pthread_mutex_lock(&slabs_lock);
+    mutex_lock_blocking(&cache_lock);
+    mutex_lock_blocking(&slabs_lock);
 
     s_cls = &slabclass[slab_rebal.s_clsid];
 
@@ -590,8 +601,8 @@ static int slab_rebalance_move(void) {
         }
     }
 
-    pthread_mutex_unlock(&slabs_lock);
-    pthread_mutex_unlock(&cache_lock);
+    mutex_unlock(&slabs_lock);
+    mutex_unlock(&cache_lock);
 
     return was_busy;
 }
@@ -600,8 +611,8 @@ static void slab_rebalance_finish(void) {
     slabclass_t *s_cls;
     slabclass_t *d_cls;
 
-    pthread_mutex_lock(&cache_lock);
-    pthread_mutex_lock(&slabs_lock);
+    mutex_lock_blocking(&cache_lock);
+    mutex_lock_blocking(&slabs_lock);
 
     s_cls = &slabclass[slab_rebal.s_clsid];
     d_cls   = &slabclass[slab_rebal.d_clsid];
@@ -612,6 +623,7 @@ static void slab_rebalance_finish(void) {
     s_cls->slabs--;
     s_cls->killing = 0;
 
+    do_item_wheel_purge(slab_rebal.slab_start, slab_rebal.slab_end);
     memset(slab_rebal.slab_start, 0, (size_t)settings.item_size_max);
 
     d_cls->slab_list[d_cls->slabs++] = slab_rebal.slab_start;
@@ -627,8 +639,8 @@ static void slab_rebalance_finish(void) {
 
     slab_rebalance_signal = 0;
 
-    pthread_mutex_unlock(&slabs_lock);
-    pthread_mutex_unlock(&cache_lock);
+    mutex_unlock(&slabs_lock);
+    mutex_unlock(&cache_lock);
 
     STATS_LOCK();
     stats.slab_reassign_running = false;
@@ -643,15 +655,24 @@ static void slab_rebalance_finish(void) {
 /* Return 1 means a decision was reached.
  * Move to its own thread (created/destroyed as needed) once automover is more
  * complex.
+ *
+ * Classes are ranked by ghost hits (get misses on keys the class recently
+ * evicted) whenever any were seen since the last run, and by evictions
+ * otherwise. Evictions nobody asks for again don't cost hits, so a class
+ * that only has those is as good a source as one that doesn't evict.
  */
 static int slab_automove_decision(int *src, int *dst) {
     static uint64_t evicted_old[POWER_LARGEST];
+    static uint64_t ghost_old[POWER_LARGEST];
     static unsigned int slab_zeroes[POWER_LARGEST];
     static unsigned int slab_winner = 0;
     static unsigned int slab_wins   = 0;
     uint64_t evicted_new[POWER_LARGEST];
+    uint64_t ghost_new[POWER_LARGEST];
     uint64_t evicted_diff = 0;
-    uint64_t evicted_max  = 0;
+    uint64_t ghost_total  = 0;
+    uint64_t lost = 0;
+    uint64_t lost_max = 0;
     unsigned int highest_slab = 0;
     unsigned int total_pages[POWER_LARGEST];
     int i;
@@ -667,27 +688,34 @@ static int slab_automove_decision(int *src, int *dst) {
     }
 
     item_stats_evictions(evicted_new);
-    pthread_mutex_lock(&cache_lock);
+    item_stats_ghost_hits(ghost_new);
+    mutex_lock_blocking(&cache_lock);
     for (i = POWER_SMALLEST; i < power_largest; i++) {
         total_pages[i] = slabclass[i].slabs;
     }
-    pthread_mutex_unlock(&cache_lock);
+    mutex_unlock(&cache_lock);
+
+    for (i = POWER_SMALLEST; i < power_largest; i++) {
+        ghost_total += ghost_new[i] - ghost_old[i];
+    }
 
-    /* Find a candidate source; something with zero evicts 3+ times */
+    /* Find a candidate source; something that lost nothing 3+ times */
     for (i = POWER_SMALLEST; i < power_largest; i++) {
         evicted_diff = evicted_new[i] - evicted_old[i];
-        if (evicted_diff == 0 && total_pages[i] > 2) {
+        lost = ghost_total ? ghost_new[i] - ghost_old[i] : evicted_diff;
+        if (lost == 0 && total_pages[i] > 2) {
             slab_zeroes[i]++;
             if (source == 0 && slab_zeroes[i] >= 3)
                 source = i;
         } else {
             slab_zeroes[i] = 0;
-            if (evicted_diff > evicted_max) {
-                evicted_max = evicted_diff;
+            if (lost > lost_max) {
+                lost_max = lost;
                 highest_slab = i;
             }
         }
         evicted_old[i] = evicted_new[i];
+        ghost_old[i] = ghost_new[i];
     }
 
     /* Pick a valid destination */
@@ -708,12 +736,112 @@ static int slab_automove_decision(int *src, int *dst) {
     return 0;
 }
 
+/* Automove mode 3 compares the age of each class's LRU tail instead of
+ * waiting for eviction counts to settle. A class that evicts while its tail
+ * is young is short on memory; a class whose tail is much older holds memory
+ * nobody asked for in a while. Pages are taken from the oldest class and
+ * given to the youngest, several at once, sized to bring the two tail ages
+ * together.
+ *
+ * Hit rates keep it from robbing a class whose pages serve more hits than
+ * the destination's would.
+ */
+#define AUTOMOVE_AGE_WINDOW 2    /* seconds between decisions */
+#define AUTOMOVE_AGE_RATIO 2     /* source tail must be this many times older */
+#define AUTOMOVE_AGE_MIN_DIFF 3  /* ... and at least this many seconds older */
+#define AUTOMOVE_AGE_MAX_PAGES 8 /* max pages moved per decision */
+
+static int slab_automove_age_decision(int *src, int *dst, int *pages) {
+    static uint64_t evicted_old[POWER_LARGEST];
+    static uint64_t hits_old[POWER_LARGEST];
+    static rel_time_t next_run;
+    uint64_t evicted_new[POWER_LARGEST];
+    uint64_t hits_new[POWER_LARGEST];
+    uint64_t hits_diff[POWER_LARGEST];
+    uint64_t evicted_diff;
+    rel_time_t ages[POWER_LARGEST];
+    unsigned int total_pages[POWER_LARGEST];
+    struct thread_stats thread_stats;
+    int i;
+    int source = 0;
+    int dest = 0;
+    double move;
+
+    if (current_time >= next_run) {
+        next_run = current_time + AUTOMOVE_AGE_WINDOW;
+    } else {
+        return 0;
+    }
+
+    threadlocal_stats_aggregate(&thread_stats);
+    item_stats_evictions(evicted_new);
+    item_stats_tail_ages(ages);
+    mutex_lock_blocking(&cache_lock);
+    for (i = POWER_SMALLEST; i < power_largest; i++) {
+        total_pages[i] = slabclass[i].slabs;
+    }
+    mutex_unlock(&cache_lock);
+
+    /* Destination: the youngest tail among classes that evicted this
+     * window. */
+    for (i = POWER_SMALLEST; i < power_largest; i++) {
+        hits_new[i] = thread_stats.slab_stats[i].get_hits;
+        hits_diff[i] = hits_new[i] - hits_old[i];
+        evicted_diff = evicted_new[i] - evicted_old[i];
+        hits_old[i] = hits_new[i];
+        evicted_old[i] = evicted_new[i];
+        if (evicted_diff == 0 || total_pages[i] == 0)
+            continue;
+        if (dest == 0 || ages[i] < ages[dest] ||
+            (ages[i] == ages[dest] && hits_diff[i] > hits_diff[dest])) {
+            dest = i;
+        }
+    }
+    if (dest == 0)
+        return 0;
+
+    /* Source: the oldest tail that can spare a page and whose pages are not
+     * worth more hits than the destination's. */
+    for (i = POWER_SMALLEST; i < power_largest; i++) {
+        if (i == dest || total_pages[i] <= 2)
+            continue;
+        if (hits_diff[i] * total_pages[dest] > hits_diff[dest] * total_pages[i])
+            continue;
+        if (source == 0 || ages[i] > ages[source])
+            source = i;
+    }
+    if (source == 0 ||
+        ages[source] < ages[dest] * AUTOMOVE_AGE_RATIO ||
+        ages[source] - ages[dest] < AUTOMOVE_AGE_MIN_DIFF)
+        return 0;
+
+    /* With a steady insert rate the tail age scales with the number of
+     * pages, so solve age_s * (P_s - k) / P_s == age_d * (P_d + k) / P_d. */
+    move = (double)(ages[source] - ages[dest]) /
+        ((double)ages[source] / total_pages[source] +
+         (double)ages[dest] / total_pages[dest]);
+    *pages = move < 1 ? 1 : (int)move;
+    if (*pages > AUTOMOVE_AGE_MAX_PAGES)
+        *pages = AUTOMOVE_AGE_MAX_PAGES;
+    if (*pages > total_pages[source] - 2)
+        *pages = total_pages[source] - 2;
+
+    if (settings.verbose > 1) {
+        fprintf(stderr, "Automove: moving %d pages from %d (age %u) to %d (age %u)\n",
+                *pages, source, ages[source], dest, ages[dest]);
+    }
+    *src = source;
+    *dst = dest;
+    return 1;
+}
+
 /* Slab rebalancer thread.
  * Does not use spinlocks since it is not timing sensitive. Burn less CPU and
  * go to sleep if locks are contended
  */
 static void *slab_maintenance_thread(void *arg) {
     int src, dest;
+    int pages = 0;
 
     while (do_run_slab_thread) {
         if (settings.slab_automove == 1) {
@@ -722,6 +850,32 @@ static void *slab_maintenance_thread(void *arg) {
                 slabs_reassign(src, dest);
             }
             sleep(1);
+        } else if (settings.slab_automove == 3) {
+            if (pages == 0 &&
+                slab_automove_age_decision(&src, &dest, &pages) == 1) {
+                STATS_LOCK();
+                stats.automove_decisions++;
+                STATS_UNLOCK();
+            }
+            if (pages > 0) {
+                switch (slabs_reassign(src, dest)) {
+                case REASSIGN_OK:
+                    pages--;
+                    STATS_LOCK();
+                    stats.automove_pages++;
+                    STATS_UNLOCK();
+                    break;
+                case REASSIGN_RUNNING:
+                    /* Previous page still moving; try again shortly */
+                    break;
+                default:
+                    pages = 0;
+                    break;
+                }
+                usleep(10000);
+            } else {
+                sleep(1);
+            }
         } else {
             /* Don't wake as often if we're not enabled.
              * This is lazier than setting up a condition right now. */
@@ -874,7 +1028,7 @@ void stop_slab_maintenance_thread(void) {
     do_run_slab_thread = 0;
     do_run_slab_rebalance_thread = 0;
     pthread_cond_signal(&maintenance_cond);
-    pthread_mutex_unlock(&cache_lock);
+    mutex_unlock(&cache_lock);
 
     /* Wait for the maintenance thread to stop */
     pthread_join(maintenance_tid, NULL);
@@ -0,0 +1,103 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 12;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+use constant CMD_GETQ  => 0x09;
+use constant CMD_NOOP  => 0x0A;
+use constant CMD_GETK  => 0x0C;
+use constant CMD_GETKQ => 0x0D;
+
+my $server = new_memcached();
+my $sock = $server->sock;
+my $bin = $server->new_sock;
+
+sub request {
+    my ($cmd, $key, $opaque) = @_;
+    return pack("CCnCCnNNNN", 0x80, $cmd, length($key), 0, 0, 0,
+                length($key), $opaque, 0, 0) . $key;
+}
+
+sub response {
+    my $hdr = '';
+    while (length($hdr) < 24) {
+        sysread($bin, my $buf, 24 - length($hdr)) or return;
+        $hdr .= $buf;
+    }
+    my ($magic, $cmd, $keylen, $extlen, undef, $status, $bodylen,
+        $opaque) = unpack("CCnCCnNN", $hdr);
+    my $body = '';
+    while (length($body) < $bodylen) {
+        sysread($bin, my $buf, $bodylen - length($body)) or return;
+        $body .= $buf;
+    }
+    my $flags = $extlen ? unpack("N", substr($body, 0, $extlen, '')) : 0;
+    my $key = substr($body, 0, $keylen, '');
+    return { cmd => $cmd, status => $status, opaque => $opaque,
+             flags => $flags, key => $key, value => $body };
+}
+
+for my $i (1..200) {
+    print $sock "set key$i $i 0 " . length("val$i") . "\r\nval$i\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored key$i") if $i == 200;
+}
+
+# One write: 150 hits with a miss after every tenth, then a NOOP.
+{
+    my $before = mem_stats($sock);
+    my ($req, @want) = ('');
+    my $opaque = 0;
+    for my $i (1..150) {
+        my $cmd = $i % 2 ? CMD_GETKQ : CMD_GETQ;
+        $req .= request($cmd, "key$i", $opaque);
+        push @want, [$cmd, $opaque++, $i];
+        $req .= request(CMD_GETKQ, "nokey$i", $opaque++) if $i % 10 == 0;
+    }
+    $req .= request(CMD_NOOP, '', 0xffff);
+    print $bin $req;
+
+    my $ok = 0;
+    my $r;
+    while (($r = response()) && $r->{cmd} != CMD_NOOP) {
+        my $w = shift @want or last;
+        my ($cmd, $opaque, $i) = @$w;
+        $ok++ if $r->{cmd} == $cmd && $r->{opaque} == $opaque &&
+            $r->{status} == 0 && $r->{flags} == $i &&
+            $r->{key} eq ($cmd == CMD_GETKQ ? "key$i" : '') &&
+            $r->{value} eq "val$i";
+    }
+    is($ok, 150, "hits answered in order, misses skipped");
+    is($r->{cmd}, CMD_NOOP, "closed by the noop");
+    is($r->{opaque}, 0xffff, "noop opaque");
+
+    my $after = mem_stats($sock);
+    is($after->{bin_multiget_keys} - $before->{bin_multiget_keys}, 165,
+       "all keys taken by the fast path");
+    is($after->{get_hits} - $before->{get_hits}, 150, "get_hits");
+    is($after->{get_misses} - $before->{get_misses}, 15, "get_misses");
+    my $calls = $after->{sendmsg_calls} - $before->{sendmsg_calls};
+    ok($calls < 10, "$calls sendmsg() calls for 150 hits");
+}
+
+# A run cut mid-packet, and closed by a GETK rather than a NOOP.
+{
+    my $req = request(CMD_GETQ, "key1", 1) . request(CMD_GETKQ, "key2", 2) .
+        request(CMD_GETK, "key3", 3);
+    print $bin substr($req, 0, 30);
+    $bin->flush;
+    select(undef, undef, undef, 0.1);
+    print $bin substr($req, 30);
+
+    my @got = map { response() } (1..3);
+    is(join(',', map { $_->{opaque} } @got), "1,2,3", "answered in order");
+    is($got[1]->{key}, "key2", "getkq key");
+    is($got[2]->{key} . $got[2]->{value}, "key3val3", "getk answered");
+
+    print $bin request(CMD_GETQ, "nokey", 4) . request(CMD_NOOP, '', 5);
+    my $r = response();
+    is($r->{opaque}, 5, "miss only: just the noop");
+}
@@ -0,0 +1,107 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 21;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $file = "/tmp/memcachedcapture$$";
+my $server = new_memcached("-o capture=$file");
+my $sock = $server->sock;
+
+sub bin_request {
+    my ($sock, $opcode, $key, $extras, $value) = @_;
+    my $body = $extras . $key . $value;
+    print $sock pack("CCnCCnNNNN", 0x80, $opcode, length($key),
+                     length($extras), 0, 0, length($body), 0, 0, 0) . $body;
+    my $header;
+    read($sock, $header, 24);
+    my ($magic, $op, $keylen, $extlen, $type, $status, $bodylen) =
+        unpack("CCnCCnN", $header);
+    my $rest = '';
+    read($sock, $rest, $bodylen) if $bodylen;
+    return $status;
+}
+
+{
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{capture_file}, $file, "capturing to $file");
+    is($settings->{capture_sample}, 1, "every connection sampled");
+}
+
+print $sock "set foo 0 0 6\r\nfooval\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored foo");
+mem_get_is($sock, "foo", "fooval");
+mem_get_is($sock, "missing", undef);
+print $sock "delete foo\r\n";
+is(scalar <$sock>, "DELETED\r\n", "deleted foo");
+print $sock "flush_all\r\n";
+is(scalar <$sock>, "OK\r\n", "flushed");
+
+my $bin = $server->new_sock;
+is(bin_request($bin, 0x01, "binkey", pack("NN", 0, 0), "binval"), 0,
+   "binary set");
+is(bin_request($bin, 0x00, "binkey", '', ''), 0, "binary get hit");
+is(bin_request($bin, 0x0a, '', '', ''), 0, "binary noop");
+
+mem_get_is($sock, "foo", undef);
+is(bin_request($bin, 0x00, "nokey", '', ''), 1, "binary get miss");
+
+# Buffers are written out once a second, busy or not.
+sleep(2.1);
+
+{
+    my $stats = mem_stats($sock);
+    is($stats->{capture_conns}, 2, "two connections captured");
+    ok($stats->{capture_records} >= 9, "commands written out");
+    is($stats->{capture_dropped}, 0, "nothing dropped");
+}
+
+{
+    open(my $fh, '<', $file) or die "Can't open $file: $!";
+    my ($magic, $rec, $cmd);
+    read($fh, $magic, 8);
+    is($magic, "MCCAPTUR", "capture file header");
+
+    # Requests without a body are captured too.
+    my $noop = 0;
+    seek($fh, 24, 0);
+    while (read($fh, $rec, 24) == 24) {
+        my (undef, undef, undef, $len, $protocol) = unpack("LLLLC", $rec);
+        read($fh, $cmd, $len);
+        $noop++ if $protocol == 2 && $len == 24 && ord(substr($cmd, 1, 1)) == 0x0a;
+    }
+    close($fh);
+    is($noop, 1, "binary noop captured");
+}
+
+# Replay against the same server: foo is set, read, deleted and read again,
+# binkey is set and read, and missing and nokey never exist.
+{
+    my $port = $server->port;
+    my %res = map { /^(\S+) (\S+)$/ ? ($1, $2) : () }
+        `./replay -f $file -p $port -S 0`;
+    is($res{errors}, 0, "replay saw no errors");
+    ok($res{hits} >= 2 && $res{misses} >= 3,
+       "replay hit ratio: $res{hits} hits, $res{misses} misses");
+}
+
+# What is still buffered when the server exits is written out.
+{
+    unlink($file);
+    my $server = new_memcached("-o capture=$file");
+    my $sock = $server->sock;
+    mem_get_is($sock, "lastkey", undef);
+    kill 2, $server->{pid};
+    waitpid($server->{pid}, 0);
+
+    open(my $fh, '<', $file) or die "Can't open $file: $!";
+    local $/;
+    my $data = <$fh>;
+    close($fh);
+    ok(index($data, "get lastkey") >= 0, "last command written on exit");
+}
+
+unlink($file);
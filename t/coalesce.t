@@ -0,0 +1,71 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 17;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached();
+my $sock = $server->sock;
+
+# Fifty sets in one write.
+{
+    my $req = '';
+    $req .= "set key$_ 0 0 " . length("val$_") . "\r\nval$_\r\n" for (1..50);
+    print $sock $req;
+    my $stored = 0;
+    for (1..50) {
+        $stored++ if scalar <$sock> eq "STORED\r\n";
+    }
+    is($stored, 50, "pipelined sets all stored");
+}
+
+# Fifty gets in one write, answered in order with few sendmsg() calls.
+{
+    my $before = mem_stats($sock);
+    print $sock join('', map { "get key$_\r\n" } (1..50));
+    my $ok = 0;
+    for (1..50) {
+        my $resp = '';
+        $resp .= scalar <$sock> for (1..3);
+        $ok++ if $resp eq "VALUE key$_ 0 " . length("val$_") .
+            "\r\nval$_\r\nEND\r\n";
+    }
+    is($ok, 50, "pipelined gets answered in order");
+    my $after = mem_stats($sock);
+    my $calls = $after->{sendmsg_calls} - $before->{sendmsg_calls};
+    ok($calls < 10, "$calls sendmsg() calls for 50 gets");
+    ok($after->{responses_coalesced} - $before->{responses_coalesced} >= 40,
+       "responses coalesced");
+}
+
+# Different kinds of response queued behind each other.
+print $sock "gets key1\r\nget missing\r\ndelete key2\r\nmg key3 v\r\n" .
+    "incr key4 1\r\nbogus\r\nset key5 0 0 1 noreply\r\nx\r\n" .
+    "mn\r\nget key5\r\nversion\r\n";
+like(scalar <$sock>, qr/^VALUE key1 0 4 \d+\r\n/, "gets header");
+is(scalar <$sock>, "val1\r\n", "gets value");
+is(scalar <$sock>, "END\r\n", "gets end");
+is(scalar <$sock>, "END\r\n", "get miss");
+is(scalar <$sock>, "DELETED\r\n", "delete");
+is(scalar <$sock> . scalar <$sock>, "VA 4\r\nval3\r\n", "mg value");
+is(scalar <$sock>, "CLIENT_ERROR cannot increment or decrement non-numeric value\r\n",
+   "incr error");
+is(scalar <$sock> . scalar <$sock>, "ERROR\r\nMN\r\n", "unknown command, mn");
+is(scalar <$sock> . scalar <$sock> . scalar <$sock>,
+   "VALUE key5 0 1\r\nx\r\nEND\r\n", "noreply set kept its place");
+like(scalar <$sock>, qr/^VERSION /, "version");
+
+# A value that is too large is swallowed before the next command.
+print $sock "set big 0 0 2000000\r\n" . ("x" x 2000000) . "\r\nget key1\r\n";
+is(scalar <$sock>, "SERVER_ERROR object too large for cache\r\n",
+   "too large value refused");
+is(scalar <$sock> . scalar <$sock> . scalar <$sock>,
+   "VALUE key1 0 4\r\nval1\r\nEND\r\n", "command after it answered");
+
+# Commands before a quit are still answered.
+print $sock "get key1\r\nquit\r\n";
+is(join('', <$sock>), "VALUE key1 0 4\r\nval1\r\nEND\r\n",
+   "answered before quit");
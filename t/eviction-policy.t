@@ -0,0 +1,82 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 39;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $value = "B" x 100;
+my $hot_flags = 0xFF000000;
+
+# A few items with the highest cost hint are stored first, so they sit at
+# the LRU tail while a stream of cheap items pushes the class into eviction.
+sub fill {
+    my $sock = shift;
+    for (1 .. 10) {
+        print $sock "set hot$_ $hot_flags 0 100\r\n$value\r\n";
+        is(scalar <$sock>, "STORED\r\n", "stored hot$_");
+    }
+    for (1 .. 40000) {
+        print $sock "set cold$_ 0 0 100 noreply\r\n$value\r\n";
+    }
+    # Make sure everything was processed.
+    print $sock "set done 0 0 1\r\nx\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored done");
+}
+
+sub hot_left {
+    my $sock = shift;
+    my $left = 0;
+    for (1 .. 10) {
+        print $sock "get hot$_\r\n";
+        my $line = <$sock>;
+        if ($line =~ /^VALUE/) {
+            $left++;
+            $line = <$sock>;
+            $line = <$sock>;
+        }
+    }
+    return $left;
+}
+
+{
+    my $server = new_memcached('-m 3 -o eviction_policy=gdsf,gdsf_cost_flags');
+    my $sock = $server->sock;
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{eviction_policy}, "gdsf", "gdsf policy enabled");
+    is($settings->{gdsf_cost_flags}, "yes", "cost hint from flags enabled");
+
+    fill($sock);
+    my $stats = mem_stats($sock);
+    ok($stats->{evictions} > 0, "cheap items were evicted");
+    is(hot_left($sock), 10, "gdsf kept all costly items");
+
+    my $ev = mem_stats($sock, "eviction");
+    is($ev->{eviction_policy}, "gdsf", "eviction stats show gdsf");
+    is($ev->{"gdsf:evicted"}, $stats->{evictions}, "evictions credited to gdsf");
+    ok($ev->{"gdsf:spared"} > 0, "gdsf spared items");
+    is($ev->{"gdsf:get_hits"}, 10, "hits credited to gdsf");
+    is($ev->{"lru:evicted"}, 0, "nothing evicted by lru");
+
+    print $sock "eviction_policy lru\r\n";
+    is(scalar <$sock>, "OK\r\n", "switched to lru");
+    print $sock "eviction_policy bogus\r\n";
+    is(scalar <$sock>, "ERROR\r\n", "unknown policy refused");
+    mem_get_is($sock, "nope", undef);
+    $ev = mem_stats($sock, "eviction");
+    is($ev->{eviction_policy}, "lru", "eviction stats show lru");
+    is($ev->{"lru:get_misses"}, 1, "miss credited to lru");
+    is($ev->{"gdsf:get_hits"}, 10, "gdsf hits kept");
+}
+
+{
+    # Same load under plain LRU loses the costly items.
+    my $server = new_memcached('-m 3');
+    my $sock = $server->sock;
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{eviction_policy}, "lru", "lru policy by default");
+    fill($sock);
+    is(hot_left($sock), 0, "lru evicted the costly items");
+}
@@ -0,0 +1,107 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 195;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached('-m 32 -o expiry_wheel');
+{
+    my $stats = mem_stats($server->sock, ' settings');
+    is($stats->{expiry_wheel}, "yes");
+}
+
+my $sock = $server->sock;
+
+# Same layout as the LRU crawler test: immortal, long and short expiring
+# items, so the expired ones sit in the middle of the LRU.
+for (1 .. 30) {
+    print $sock "set ifoo$_ 0 0 2\r\nok\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored key");
+}
+for (1 .. 30) {
+    print $sock "set lfoo$_ 0 3600 2\r\nok\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored key");
+}
+for (1 .. 30) {
+    print $sock "set sfoo$_ 0 1 2\r\nok\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored key");
+}
+
+{
+    my $stats = mem_stats($sock);
+    is($stats->{expiry_wheel_entries}, 60, "60 items indexed by the wheel");
+}
+
+# Nothing fetches the short items; the wheel alone has to free them.
+for (1 .. 10) {
+    my $items = mem_stats($sock, "items");
+    last if $items->{"items:1:wheel_reclaimed"} == 30;
+    sleep 1;
+}
+
+{
+    my $slabs = mem_stats($sock, "slabs");
+    is($slabs->{"1:used_chunks"}, 60, "slab1 now has 60 used chunks");
+    my $items = mem_stats($sock, "items");
+    is($items->{"items:1:wheel_reclaimed"}, 30, "slab1 has 30 wheel reclaims");
+    my $stats = mem_stats($sock);
+    is($stats->{wheel_reclaimed}, 30, "30 wheel reclaims in total");
+}
+
+# A crawl afterwards has nothing left to find.
+print $sock "lru_crawler enable\r\n";
+is(scalar <$sock>, "OK\r\n", "enabled lru crawler");
+print $sock "lru_crawler crawl 1\r\n";
+is(scalar <$sock>, "OK\r\n", "kicked lru crawler");
+while (1) {
+    my $stats = mem_stats($sock);
+    last unless $stats->{lru_crawler_running};
+    sleep 1;
+}
+
+{
+    my $items = mem_stats($sock, "items");
+    is($items->{"items:1:crawler_reclaimed"}, 0, "crawler found nothing");
+}
+
+for (1 .. 30) {
+    mem_get_is($sock, "ifoo$_", "ok");
+    mem_get_is($sock, "lfoo$_", "ok");
+    mem_get_is($sock, "sfoo$_", undef);
+}
+
+# Touching an item moves it to its new slot in the wheel.
+print $sock "set tfoo 0 1 2\r\nok\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored key");
+print $sock "touch tfoo 3600\r\n";
+is(scalar <$sock>, "TOUCHED\r\n", "touched key");
+sleep 3;
+mem_get_is($sock, "tfoo", "ok");
+
+# Touching it again, even with a new TTL, doesn't add entries.
+{
+    my $before = mem_stats($sock)->{expiry_wheel_entries};
+    for (1 .. 10) {
+        print $sock "touch tfoo " . (3600 + $_) . "\r\n";
+        <$sock>;
+    }
+    my $stats = mem_stats($sock);
+    is($stats->{expiry_wheel_entries}, $before, "no entries added by touches");
+}
+
+# A shorter TTL still has the item reclaimed in time.
+print $sock "touch tfoo 1\r\n";
+is(scalar <$sock>, "TOUCHED\r\n", "touched key");
+for (1 .. 10) {
+    my $items = mem_stats($sock, "items");
+    last if $items->{"items:1:wheel_reclaimed"} == 31;
+    sleep 1;
+}
+{
+    my $items = mem_stats($sock, "items");
+    is($items->{"items:1:wheel_reclaimed"}, 31, "shortened item reclaimed");
+}
+mem_get_is($sock, "tfoo", undef);
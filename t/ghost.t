@@ -0,0 +1,62 @@
+#!/usr/bin/perl
+# Test the 'stats items' ghost_hits counters.
+
+use strict;
+use warnings;
+use Test::More tests => 8;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached("-m 3");
+my $sock = $server->sock;
+my $value = "B"x66560;
+
+for my $key (0 .. 59) {
+    print $sock "set key$key 0 0 66560 noreply\r\n$value\r\n";
+}
+
+my $stats = mem_stats($sock, "items");
+isnt($stats->{"items:31:evicted"}, 0, "class 31 evicted");
+is($stats->{"items:31:ghost_hits"}, 0, "no ghost hits yet");
+
+# Misses on keys that were never stored don't count.
+my $found = 0;
+for my $key (0 .. 19) {
+    print $sock "get nokey$key\r\n";
+    $found++ if scalar <$sock> ne "END\r\n";
+}
+is($found, 0, "unknown keys missed");
+$stats = mem_stats($sock, "items");
+is($stats->{"items:31:ghost_hits"}, 0, "unknown keys are not ghost hits");
+
+# The first keys were evicted; asking for them again would have hit.
+my $misses = 0;
+for my $key (0 .. 9) {
+    print $sock "get key$key\r\n";
+    my $line = <$sock>;
+    if ($line eq "END\r\n") {
+        $misses++;
+    } else {
+        <$sock>; <$sock>;
+    }
+}
+ok($misses > 0, "evicted keys missed");
+$stats = mem_stats($sock, "items");
+my $ghost_hits = $stats->{"items:31:ghost_hits"};
+ok($ghost_hits > 0 && $ghost_hits <= $misses,
+   "evicted keys counted as ghost hits ($ghost_hits of $misses)");
+
+# Each eviction is counted once.
+for my $key (0 .. 9) {
+    print $sock "get key$key\r\n";
+    my $line = <$sock>;
+    if ($line ne "END\r\n") {
+        <$sock>; <$sock>;
+    }
+}
+$stats = mem_stats($sock, "items");
+is($stats->{"items:31:ghost_hits"}, $ghost_hits, "ghost hits counted once");
+
+print $sock "stats reset\r\n";
+is(scalar <$sock>, "RESET\r\n", "stats reset");
@@ -0,0 +1,66 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 16;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached("-o hotcache,hotkey_sample=1");
+my $sock = $server->sock;
+
+{
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{hotcache}, "yes", "hot item cache enabled");
+}
+
+print $sock "set hot 0 0 3\r\nval\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored hot");
+
+sub get_many {
+    my ($key, $count) = @_;
+    my $value;
+    for (1 .. $count) {
+        print $sock "get $key\r\n";
+        my $line = <$sock>;
+        if ($line =~ /^VALUE/) {
+            $value = <$sock>;
+            $value =~ s/\r\n$//;
+            $line = <$sock>;
+        } else {
+            $value = undef;
+        }
+    }
+    return $value;
+}
+
+# Every get is sampled, so the key turns hot on the 32nd.
+is(get_many("hot", 100), "val", "hot key read");
+{
+    my $stats = mem_stats($sock);
+    is($stats->{hotcache_fills}, 1, "hot item cached");
+    is($stats->{hotcache_hits}, 68, "later gets served from the cache");
+    is($stats->{get_hits}, 100, "cache hits count as get hits");
+}
+
+mem_get_is({ sock => $sock, flags => 0 }, "hot", "val");
+print $sock "gets hot\r\n";
+like(scalar <$sock>, qr/^VALUE hot 0 3 \d+\r\n/, "gets from the cache");
+is(scalar <$sock>, "val\r\n", "gets value");
+is(scalar <$sock>, "END\r\n", "gets end");
+
+print $sock "set hot 0 0 6\r\nnewval\r\n";
+is(scalar <$sock>, "STORED\r\n", "replaced hot");
+is(get_many("hot", 1), "newval", "replaced item not served from the cache");
+
+print $sock "delete hot\r\n";
+is(scalar <$sock>, "DELETED\r\n", "deleted hot");
+is(get_many("hot", 1), undef, "deleted item not served from the cache");
+
+print $sock "set hot 0 0 3\r\nval\r\n";
+scalar <$sock>;
+get_many("hot", 10);
+print $sock "flush_all\r\n";
+is(scalar <$sock>, "OK\r\n", "flushed");
+is(get_many("hot", 1), undef, "flushed item not served from the cache");
@@ -0,0 +1,71 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 14;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached("-o hotkey_sample=1");
+my $sock = $server->sock;
+
+{
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{hotkey_sample}, 1, "every command sampled");
+}
+
+print $sock "set hot 0 0 3\r\nhot\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored hot");
+for my $i (1 .. 10) {
+    print $sock "set cold$i 0 0 1 noreply\r\nx\r\n";
+}
+
+for (1 .. 200) {
+    print $sock "get hot\r\n";
+    scalar <$sock>;
+    scalar <$sock>;
+    scalar <$sock>;
+}
+for (1 .. 50) {
+    print $sock "incr counter 1\r\n";
+    scalar <$sock>;
+}
+# Keys the ASCII protocol can't send come through escaped.
+{
+    my $bin = $server->new_sock;
+    print $bin pack("CCnCCnNNNN", 0x80, 0x00, 3, 0, 0, 0, 3, 0, 0, 0) . "a b";
+    my $header;
+    read($bin, $header, 24);
+    my ($bodylen) = unpack("x8N", $header);
+    my $body;
+    read($bin, $body, $bodylen) if $bodylen;
+}
+
+{
+    my $stats = mem_stats($sock, ' hotkeys');
+    is($stats->{sample}, 1, "sample rate reported");
+    is($stats->{'hotkey_1:key'}, "hot", "hottest key");
+    is($stats->{'hotkey_1:cmd'}, "get", "hot key is read");
+    ok($stats->{'hotkey_1:rate'} > 0, "hot key has a rate");
+    is($stats->{'hotkey_1:error'}, "0.0", "no overestimate yet");
+    is($stats->{'hotkey_2:key'}, "counter", "second key");
+    is($stats->{'hotkey_2:cmd'}, "incr", "second key is incremented");
+    my @escaped = grep { /:key$/ && $stats->{$_} eq 'a\\x20b' } keys %$stats;
+    is(scalar @escaped, 1, "binary key escaped");
+}
+
+print $sock "stats reset\r\n";
+is(scalar <$sock>, "RESET\r\n", "stats reset");
+{
+    my $stats = mem_stats($sock, ' hotkeys');
+    ok(!exists $stats->{'hotkey_1:key'}, "reset cleared the keys");
+}
+
+{
+    my $off = new_memcached("-o hotkey_sample=0");
+    my $osock = $off->sock;
+    mem_get_is($osock, "foo", undef);
+    my $stats = mem_stats($osock, ' hotkeys');
+    ok(!exists $stats->{'hotkey_1:key'}, "nothing tracked when disabled");
+}
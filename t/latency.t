@@ -0,0 +1,57 @@
+#!/usr/bin/perl
+# Test the 'stats latency' histograms.
+
+use strict;
+use warnings;
+use Test::More tests => 21;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached();
+my $sock = $server->sock;
+
+my $stats = mem_stats($sock, "latency");
+for my $cmd (qw(get set delete incr touch)) {
+    is($stats->{"$cmd:count"}, 0, "no $cmd timed yet");
+}
+
+for my $n (1 .. 100) {
+    my $len = length($n);
+    print $sock "set foo$n 0 0 $len\r\n$n\r\n";
+    <$sock>;
+    mem_get_is($sock, "foo$n", $n) if $n == 1;
+    if ($n > 1) {
+        print $sock "get foo$n\r\n";
+        <$sock>; <$sock>; <$sock>;
+    }
+}
+print $sock "get missing\r\n";
+is(scalar <$sock>, "END\r\n", "miss");
+print $sock "incr foo1 1\r\n";
+is(scalar <$sock>, "2\r\n", "incr");
+print $sock "decr foo1 1 noreply\r\n";
+print $sock "touch foo1 10\r\n";
+is(scalar <$sock>, "TOUCHED\r\n", "touch");
+print $sock "delete foo1\r\n";
+is(scalar <$sock>, "DELETED\r\n", "delete");
+
+$stats = mem_stats($sock, "latency");
+is($stats->{"get:count"}, 101, "gets timed");
+is($stats->{"set:count"}, 100, "sets timed");
+is($stats->{"incr:count"}, 2, "incr and noreply decr timed");
+is($stats->{"touch:count"}, 1, "touch timed");
+is($stats->{"delete:count"}, 1, "delete timed");
+
+my @pcts = map { $stats->{"get:$_"} } qw(p50 p90 p99 p999);
+ok($pcts[0] > 0, "get p50 is set ($pcts[0] usec)");
+ok($pcts[0] <= $pcts[1] && $pcts[1] <= $pcts[2] && $pcts[2] <= $pcts[3],
+   "get percentiles are ordered");
+like($stats->{"set:p99"}, qr/^\d+\.\d{3}$/, "reported in microseconds");
+
+# stats reset clears the histograms
+print $sock "stats reset\r\n";
+is(scalar <$sock>, "RESET\r\n", "stats reset");
+$stats = mem_stats($sock, "latency");
+is($stats->{"get:count"}, 0, "gets cleared");
+is($stats->{"get:p99"}, "0.000", "percentiles cleared");
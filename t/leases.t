@@ -0,0 +1,121 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 35;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached("-o leases,lease_ttl=2");
+my $sock = $server->sock;
+my $other = $server->new_sock;
+
+sub lget {
+    my ($s, $key) = @_;
+    print $s "lget $key\r\n";
+    return scalar <$s>;
+}
+
+# The first miss gets a lease, later ones a hot miss.
+my $lease = lget($sock, "foo");
+like($lease, qr/^LEASE \d+\r\n/, "first miss gets a lease");
+my ($token) = $lease =~ /^LEASE (\d+)/;
+is(lget($other, "foo"), "HOT_MISS\r\n", "second miss is hot");
+mem_get_is($sock, "foo", undef, "placeholder is not visible to get");
+
+# A wrong token doesn't store, the right one does.
+my $bad = $token + 1000;
+print $sock "lset foo 0 0 3 $bad\r\nbad\r\n";
+is(scalar <$sock>, "NOT_STORED\r\n", "lset with a wrong token");
+print $sock "lset foo 5 0 3 $token\r\nbar\r\n";
+is(scalar <$sock>, "STORED\r\n", "lset with the lease token");
+print $sock "lset foo 5 0 3 $token\r\nbaz\r\n";
+is(scalar <$sock>, "NOT_STORED\r\n", "token is used up");
+mem_get_is({ sock => $sock, flags => 5 }, "foo", "bar");
+is(lget($other, "foo"), "VALUE foo 5 3\r\n", "lget hit");
+is(scalar <$other>, "bar\r\n", "lget value");
+is(scalar <$other>, "END\r\n", "lget end");
+
+# A delete revokes the lease.
+($token) = lget($sock, "del") =~ /^LEASE (\d+)/;
+ok($token, "lease on del");
+print $sock "delete del\r\n";
+is(scalar <$sock>, "NOT_FOUND\r\n", "delete of a placeholder");
+print $sock "lset del 0 0 1 $token\r\nx\r\n";
+is(scalar <$sock>, "NOT_STORED\r\n", "deleted lease can't be used");
+
+# A plain set replaces the placeholder.
+($token) = lget($sock, "plain") =~ /^LEASE (\d+)/;
+print $sock "add plain 0 0 1\r\np\r\n";
+is(scalar <$sock>, "STORED\r\n", "add over a placeholder");
+print $sock "lset plain 0 0 1 $token\r\nx\r\n";
+is(scalar <$sock>, "NOT_STORED\r\n", "lease gone after a set");
+mem_get_is($sock, "plain", "p");
+
+# Leases expire.
+like(lget($sock, "short"), qr/^LEASE/, "lease on short");
+sleep(3.1);
+like(lget($other, "short"), qr/^LEASE/, "expired lease is handed out again");
+
+# Binary lget answers a miss with the token as the value.
+{
+    my $bin = $server->new_sock;
+    print $bin pack("CCnCCnNNNN", 0x80, 0x25, 3, 0, 0, 0, 3, 0, 0, 0) . "bin";
+    my $header;
+    read($bin, $header, 24);
+    my ($status, $bodylen) = unpack("x6nN", $header);
+    my $body;
+    read($bin, $body, $bodylen) if $bodylen;
+    is($status, 1, "binary lget miss");
+    my ($hi, $lo) = unpack("NN", $body);
+    ok($bodylen == 8 && $hi * 2 ** 32 + $lo > 0, "binary lease token");
+
+    print $bin pack("CCnCCnNNNN", 0x80, 0x25, 3, 0, 0, 0, 3, 0, 0, 0) . "bin";
+    read($bin, $header, 24);
+    ($status, $bodylen) = unpack("x6nN", $header);
+    read($bin, $body, $bodylen) if $bodylen;
+    is($status, 0x0a, "binary hot miss");
+
+    my $extras = pack("NN", 7, 0);
+    print $bin pack("CCnCCnNNNN", 0x80, 0x26, 3, 8, 0, 0, 8 + 3 + 2,
+                    0, $hi, $lo) . $extras . "bin" . "ok";
+    read($bin, $header, 24);
+    ($status, $bodylen) = unpack("x6nN", $header);
+    read($bin, $body, $bodylen) if $bodylen;
+    is($status, 0, "binary lset with the token");
+    mem_get_is({ sock => $sock, flags => 7 }, "bin", "ok");
+}
+
+{
+    my $stats = mem_stats($sock);
+    is($stats->{leases_issued}, 6, "leases issued");
+    is($stats->{leases_hot_misses}, 2, "hot misses");
+    is($stats->{leases_honored}, 2, "leases honored");
+    is($stats->{leases_rejected}, 4, "leases rejected");
+}
+
+# With lease_stale, an expired value is served while it's regenerated.
+{
+    my $stale = new_memcached("-o leases,lease_stale");
+    my $s1 = $stale->sock;
+    my $s2 = $stale->new_sock;
+    print $s1 "set old 0 1 3\r\nold\r\n";
+    is(scalar <$s1>, "STORED\r\n", "stored old");
+    sleep(2.1);
+    like(lget($s1, "old"), qr/^LEASE/, "expired item hands out a lease");
+    is(lget($s2, "old"), "STALE old 0 3\r\n", "others get the stale value");
+    is(scalar <$s2>, "old\r\n", "stale value");
+    is(scalar <$s2>, "END\r\n", "stale end");
+}
+
+# Without -o leases there are no leases, nor stats for them.
+{
+    my $plain = new_memcached();
+    my $s = $plain->sock;
+    is(lget($s, "foo"), "CLIENT_ERROR leases disabled\r\n", "lget disabled");
+    print $s "lset foo 0 0 3 1\r\n";
+    is(scalar <$s>, "CLIENT_ERROR leases disabled\r\n", "lset disabled");
+    my $stats = mem_stats($s);
+    ok(!exists $stats->{leases_issued}, "no lease stats");
+}
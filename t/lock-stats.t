@@ -0,0 +1,40 @@
+#!/usr/bin/perl
+# Test the 'stats locks' counters.
+
+use strict;
+use warnings;
+use Test::More tests => 14;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached();
+my $sock = $server->sock;
+my $stats = mem_stats($sock, "locks");
+is(scalar(keys %$stats), 0, "no lock stats unless enabled");
+
+$server = new_memcached("-o lock_stats");
+$sock = $server->sock;
+$stats = mem_stats($sock, "settings");
+is($stats->{lock_stats}, "yes", "lock_stats enabled");
+
+for my $n (1 .. 200) {
+    print $sock "set foo$n 0 0 3\r\nbar\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored foo$n") if $n == 1;
+    <$sock> if $n != 1;
+}
+mem_get_is($sock, "foo1", "bar");
+
+$stats = mem_stats($sock, "locks");
+for my $lock (qw(cache_lock slabs_lock stats_lock item_locks)) {
+    ok($stats->{"$lock:acquired"} > 0, "$lock was taken");
+}
+ok($stats->{"item_locks:acquired"} >= 201, "item lock taken per command");
+ok($stats->{"item_locks:stripes"} > 0, "stripe count reported");
+ok(exists $stats->{"cache_lock:hold_us"}, "hold time reported");
+ok(exists $stats->{"cache_lock:wait_us"}, "wait time reported");
+
+print $sock "stats reset\r\n";
+is(scalar <$sock>, "RESET\r\n", "stats reset");
+$stats = mem_stats($sock, "locks");
+ok($stats->{"item_locks:acquired"} < 201, "item lock counters cleared");
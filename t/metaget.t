@@ -0,0 +1,117 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 37;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+use MIME::Base64;
+
+my $server = new_memcached();
+my $sock = $server->sock;
+
+sub reply {
+    my $line = <$sock>;
+    $line =~ s/\r\n$//;
+    return $line;
+}
+
+# mn just answers, which ends a pipeline of quiet commands.
+print $sock "mn\r\n";
+is(reply(), "MN", "mn");
+
+# ms, then mg returning the value and metadata.
+print $sock "ms foo 3 T0 F5 c\r\nbar\r\n";
+my ($cas) = reply() =~ /^HD c(\d+)$/;
+ok($cas, "ms returned the CAS");
+
+print $sock "mg foo v f s t c k\r\n";
+is(reply(), "VA 3 f5 s3 t-1 c$cas kfoo", "mg header");
+is(reply(), "bar", "mg value");
+
+print $sock "mg foo s\r\n";
+is(reply(), "HD s3", "mg without v");
+
+print $sock "mg missing v\r\n";
+is(reply(), "EN", "mg miss");
+
+# Opaque tokens and the key come back on misses too.
+print $sock "mg missing v Oabc k\r\n";
+is(reply(), "EN Oabc kmissing", "mg miss with opaque");
+
+# Touch on read.
+print $sock "mg foo T100 t\r\n";
+my ($ttl) = reply() =~ /^HD t(\d+)$/;
+ok($ttl > 90 && $ttl <= 100, "mg touched the item");
+print $sock "mg foo l\r\n";
+like(reply(), qr/^HD l\d+$/, "last access");
+
+# Quiet mode: misses and plain successes are hidden.
+print $sock "mg missing v q\r\nmg foo s q\r\nmn\r\n";
+is(reply(), "HD s3", "quiet mg hit");
+is(reply(), "MN", "quiet mg miss hidden");
+
+print $sock "ms foo 3 q\r\nbaz\r\nmn\r\n";
+is(reply(), "MN", "quiet ms hidden");
+mem_get_is($sock, "foo", "baz");
+
+# Modes
+print $sock "ms foo 3 ME\r\nnew\r\n";
+is(reply(), "NS", "ms add of an existing key");
+print $sock "ms nokey 3 MR\r\nnew\r\n";
+is(reply(), "NS", "ms replace of a missing key");
+print $sock "ms foo 2 MA\r\n!!\r\n";
+is(reply(), "HD", "ms append");
+print $sock "ms foo 2 MP\r\n<<\r\n";
+is(reply(), "HD", "ms prepend");
+mem_get_is($sock, "foo", "<<baz!!");
+print $sock "ms foo 3 MX\r\nnew\r\n";
+is(reply(), "CLIENT_ERROR invalid mode", "ms bad mode");
+mem_get_is($sock, "foo", "<<baz!!");
+
+# Compare and swap
+print $sock "mg foo c\r\n";
+($cas) = reply() =~ /^HD c(\d+)$/;
+print $sock "ms foo 3 C" . ($cas + 1) . "\r\nbad\r\n";
+is(reply(), "EX", "ms with a stale CAS");
+print $sock "ms foo 4 C$cas c\r\ngood\r\n";
+like(reply(), qr/^HD c(\d+)$/, "ms with the right CAS");
+
+# md
+print $sock "md foo C1 q\r\n";
+is(reply(), "EX", "md with a stale CAS");
+print $sock "md foo q\r\nmd foo\r\n";
+is(reply(), "NF", "quiet md hidden, then not found");
+mem_get_is($sock, "foo", undef);
+
+# ma
+print $sock "ma num\r\n";
+is(reply(), "NF", "ma miss");
+print $sock "set num 0 0 1\r\n5\r\n";
+is(reply(), "STORED", "stored num");
+print $sock "ma num v\r\n";
+is(reply(), "VA 1", "ma incr header");
+is(reply(), "6", "ma incr value");
+print $sock "ma num MD D4 v c\r\n";
+($cas) = (reply() =~ /^VA 1 c(\d+)$/);
+is(reply(), "2", "ma decr by 4");
+print $sock "ma num C" . ($cas + 1) . "\r\n";
+is(reply(), "EX", "ma with a stale CAS");
+print $sock "ma num C$cas D10 q\r\nmn\r\n";
+is(reply(), "MN", "quiet ma hidden");
+mem_get_is($sock, "num", "12");
+
+# Base64 keys may hold any bytes.
+{
+    my $key = "bin\x00key \r\n";
+    my $b64 = encode_base64($key, '');
+    print $sock "ms $b64 2 b\r\nhi\r\n";
+    is(reply(), "HD", "ms with a base64 key");
+    print $sock "mg $b64 b v k\r\n";
+    is(reply(), "VA 2 k$b64 b", "mg returns the key in base64");
+    is(reply(), "hi", "mg base64 value");
+}
+
+print $sock "mg foo x\r\n";
+is(reply(), "CLIENT_ERROR invalid flag", "unknown flag");
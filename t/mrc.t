@@ -0,0 +1,58 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 14;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached('-m 16 -o mrc');
+my $sock = $server->sock;
+
+{
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{mrc}, "yes", "mrc sampling enabled");
+    my $mrc = mem_stats($sock, "mrc");
+    is($mrc->{references}, 0, "no references yet");
+    ok($mrc->{sample_rate} > 0, "sampling some keys");
+}
+
+# A working set of ~22MB read back in order: every get's reuse distance is
+# the whole working set, so it misses at 8MB and 16MB and hits at 32MB and
+# up. Anything within an order of magnitude of that is a pass.
+my $value = "M" x 1000;
+my $keys = 20000;
+for my $k (1 .. $keys) {
+    print $sock "set mrc_key_$k 0 0 1000 noreply\r\n$value\r\n";
+}
+for my $pass (1 .. 2) {
+    for (my $k = 1; $k <= $keys; $k += 100) {
+        print $sock "get " . join(" ", map { "mrc_key_$_" } $k .. $k + 99) . "\r\n";
+        while (my $line = <$sock>) {
+            last if $line =~ /^END/;
+        }
+    }
+}
+
+{
+    my $mrc = mem_stats($sock, "mrc");
+    ok($mrc->{tracked_keys} > 0, "tracking sampled keys");
+    ok($mrc->{tracked_keys} <= 8192, "tracked keys are bounded");
+    ok($mrc->{references} > 0, "sampled references");
+    is($mrc->{cold_misses}, 0, "sets filled every sampled key first");
+    ok($mrc->{"hit_ratio_0.5x"} < 0.1, "misses at half the memory");
+    ok($mrc->{hit_ratio_1x} < 0.1, "misses at current memory");
+    ok($mrc->{hit_ratio_2x} > 0.9, "hits at twice the memory");
+    ok($mrc->{hit_ratio_4x} > 0.9, "hits at four times the memory");
+
+    my $stats = mem_stats($sock);
+    ok($stats->{get_misses} > 0, "the real cache missed too");
+}
+
+print $sock "stats reset\r\n";
+is(scalar <$sock>, "RESET\r\n", "stats reset");
+{
+    my $mrc = mem_stats($sock, "mrc");
+    is($mrc->{references}, 0, "references reset");
+}
@@ -0,0 +1,147 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 29;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+use constant CMD_NOOP         => 0x0A;
+use constant CMD_SET_MULTI    => 0x27;
+use constant CMD_DELETE_MULTI => 0x28;
+
+my $server = new_memcached();
+my $sock = $server->sock;
+
+# Text protocol.
+print $sock "set_multi 5 0 ma 3 mb 4 mc 0\r\nfoo\r\nbarr\r\n\r\n";
+is(scalar <$sock>, "STORED\r\n", "set_multi of three keys");
+mem_get_is({ sock => $sock, flags => 5 }, "ma", "foo");
+mem_get_is({ sock => $sock, flags => 5 }, "mb", "barr");
+mem_get_is({ sock => $sock, flags => 5 }, "mc", "");
+
+print $sock "set_multi 0 0 ma 1 mb 1 noreply\r\n1\r\n2\r\n";
+mem_get_is($sock, "mb", "2", "set_multi noreply");
+
+{
+    my $big = "x" x (1024 * 1024 + 1);
+    print $sock "set_multi 0 0 ma 3 mb " . length($big) . " mc 3\r\n" .
+        "aaa\r\n$big\r\nccc\r\n";
+    is(scalar <$sock>, "NOT_STORED 02\r\n", "the key too large failed");
+    mem_get_is($sock, "ma", "aaa", "the keys before it are stored");
+    mem_get_is($sock, "mc", "ccc", "and the keys after it");
+    mem_get_is($sock, "mb", undef, "the old value is gone");
+}
+
+print $sock "set_multi 0 0 ma 3 mb 3\r\nabc\r\nabcde";
+is(scalar <$sock>, "CLIENT_ERROR bad data chunk\r\n", "bad data chunk");
+mem_get_is($sock, "ma", "aaa", "nothing stored after a bad chunk");
+
+print $sock "set_multi 0 0 ma 1 mb\r\n";
+is(scalar <$sock>, "CLIENT_ERROR bad command line format\r\n",
+   "a key without a length");
+
+{
+    my $line = join(' ', map { "k$_ 1" } (1..129));
+    print $sock "set_multi 0 0 $line\r\n";
+    is(scalar <$sock>, "CLIENT_ERROR bad command line format\r\n",
+       "too many keys");
+}
+
+# A line of 100 long keys, far over the 1k a line usually gets.
+{
+    my @keys = map { sprintf("key%s%03d", "-" x 40, $_) } (1..100);
+    print $sock "set_multi 0 0 " . join(' ', map { "$_ 3" } @keys) . "\r\n" .
+        join('', map { substr($_, -3) . "\r\n" } @keys);
+    is(scalar <$sock>, "STORED\r\n", "set_multi of 100 keys");
+    print $sock "get @keys\r\n";
+    my $ok = 0;
+    while ((my $line = <$sock>) =~ /^VALUE (\S+) 0 3/) {
+        $ok++ if scalar <$sock> eq substr($1, -3) . "\r\n";
+    }
+    is($ok, 100, "all 100 keys stored");
+
+    my $before = mem_stats($sock);
+    print $sock "delete_multi " . join(' ', @keys[0..49], "nokey") . "\r\n";
+    is(scalar <$sock>, "NOT_FOUND " . ("00" x 6) . "04\r\n",
+       "delete_multi misses one key");
+    my $after = mem_stats($sock);
+    is($after->{delete_hits} - $before->{delete_hits}, 50, "delete_hits");
+    is($after->{delete_misses} - $before->{delete_misses}, 1,
+       "delete_misses");
+
+    print $sock "delete_multi " . join(' ', @keys[50..99]) . "\r\n";
+    is(scalar <$sock>, "DELETED\r\n", "delete_multi of the rest");
+}
+
+# Binary protocol.
+my $bin = $server->new_sock;
+
+sub request {
+    my ($cmd, $ext, $key, $val) = @_;
+    return pack("CCnCCnNNNN", 0x80, $cmd, length($key), length($ext), 0, 0,
+                length($ext) + length($key) + length($val), 0, 0, 0) .
+        $ext . $key . $val;
+}
+
+sub response {
+    my $hdr = '';
+    while (length($hdr) < 24) {
+        sysread($bin, my $buf, 24 - length($hdr)) or return;
+        $hdr .= $buf;
+    }
+    my (undef, $cmd, undef, undef, undef, $status, $bodylen) =
+        unpack("CCnCCnN", $hdr);
+    my $body = '';
+    while (length($body) < $bodylen) {
+        sysread($bin, my $buf, $bodylen - length($body)) or return;
+        $body .= $buf;
+    }
+    return { cmd => $cmd, status => $status, body => $body };
+}
+
+{
+    my %kv = (ba => "one", bb => "x" x 100000, bc => "three");
+    my @keys = sort keys %kv;
+    my $table = join('', map { pack("CN", length($_), length($kv{$_})) . $_ }
+                     @keys);
+    my $req = request(CMD_SET_MULTI, pack("NN", 7, 0), $table,
+                      join('', map { $kv{$_} } @keys));
+    print $bin $req;
+    my $r = response();
+    is($r->{status}, 0, "binary set_multi");
+    print $sock "get bb\r\n";
+    is(scalar <$sock>, "VALUE bb 7 100000\r\n", "large value stored");
+    ok(scalar <$sock> eq "$kv{bb}\r\n" && <$sock> eq "END\r\n",
+       "large value read back");
+
+    $table = join('', map { pack("C", length($_)) . $_ } ("ba", "nokey", "bc"));
+    print $bin request(CMD_DELETE_MULTI, '', $table, '');
+    $r = response();
+    is($r->{status} . ":" . unpack("H*", $r->{body}), "1:02",
+       "binary delete_multi misses one key");
+
+    # An entry running past the table is refused, and the values skipped.
+    print $bin request(CMD_SET_MULTI, pack("NN", 0, 0),
+                       pack("CN", 10, 3) . "short", "abc") .
+        request(CMD_NOOP, '', '', '');
+    $r = response();
+    is($r->{status}, 4, "bad table refused");
+    $r = response();
+    is($r->{cmd}, CMD_NOOP, "the connection goes on");
+
+    # Keys in the table are limited to 250 bytes, as any other key.
+    my $long = "k" x 255;
+    print $bin request(CMD_SET_MULTI, pack("NN", 0, 0),
+                       pack("CN", length($long), 3) . $long, "abc");
+    $r = response();
+    is($r->{status}, 4, "set_multi of a 255 byte key refused");
+    print $bin request(CMD_DELETE_MULTI, '', pack("C", 251) . ("k" x 251), '');
+    $r = response();
+    is($r->{status}, 4, "delete_multi of a 251 byte key refused");
+    print $bin request(CMD_NOOP, '', '', '');
+    $r = response();
+    is($r->{cmd}, CMD_NOOP, "the server is still up");
+    mem_get_is($sock, "k" x 250, undef, "nothing stored");
+}
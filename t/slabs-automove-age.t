@@ -0,0 +1,80 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 11;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# Simulates a workload shift against the eviction-count automover (mode 1)
+# and the tail-age automover (mode 3), with identical traffic on both.
+my %servers = (
+    1 => new_memcached('-m 8 -o slab_reassign,slab_automove=1'),
+    3 => new_memcached('-m 8 -o slab_reassign,slab_automove=3'),
+);
+
+{
+    my $stats = mem_stats($servers{3}->sock, ' settings');
+    is($stats->{slab_automove}, 3, "automove mode 3 enabled");
+}
+
+my $bigdata = 'x' x 70000;   # slab 31
+my $smalldata = 'y' x 20000; # slab 25
+
+# Before the shift: a little small data, then big data takes the rest.
+for my $mode (1, 3) {
+    my $sock = $servers{$mode}->sock;
+    for (1 .. 20) {
+        print $sock "set sfoo$_ 0 0 20000 noreply\r\n", $smalldata, "\r\n";
+    }
+    for (1 .. 150) {
+        print $sock "set bfoo$_ 0 0 70000 noreply\r\n", $bigdata, "\r\n";
+    }
+    my $items = mem_stats($sock, "items");
+    isnt($items->{"items:31:evicted"}, 0, "mode $mode: big class is full");
+}
+
+my %before;
+for my $mode (1, 3) {
+    $before{$mode} = mem_stats($servers{$mode}->sock, "slabs");
+}
+
+# After the shift: only small items are written and read back.
+my $key = 100;
+my $end = time() + 10;
+while (time() < $end) {
+    for my $mode (1, 3) {
+        my $sock = $servers{$mode}->sock;
+        for my $k ($key .. $key + 9) {
+            print $sock "set sfoo$k 0 0 20000 noreply\r\n", $smalldata, "\r\n";
+        }
+        for my $k ($key .. $key + 9) {
+            print $sock "get sfoo$k\r\n";
+            while (my $line = <$sock>) {
+                last if $line =~ /^END/;
+            }
+        }
+    }
+    $key += 10;
+    sleep 0.1;
+}
+
+my %after;
+my %stats;
+for my $mode (1, 3) {
+    $after{$mode} = mem_stats($servers{$mode}->sock, "slabs");
+    $stats{$mode} = mem_stats($servers{$mode}->sock);
+}
+
+is($stats{1}->{slabs_moved}, 0, "mode 1 has not moved a page yet");
+is($stats{1}->{automove_decisions}, 0, "mode 1 makes no age decisions");
+ok($stats{3}->{automove_decisions} >= 1, "mode 3 made a decision");
+ok($stats{3}->{automove_pages} >= 2, "mode 3 moved several pages");
+ok($stats{3}->{slabs_moved} >= 2, "pages were actually moved");
+ok($after{3}->{"25:total_pages"} >= $before{3}->{"25:total_pages"} + 2,
+   "small class grew");
+ok($after{3}->{"31:total_pages"} < $before{3}->{"31:total_pages"},
+   "big class shrank");
+ok($after{3}->{"25:total_pages"} > $after{1}->{"25:total_pages"},
+   "mode 3 converged faster than mode 1");
@@ -1,7 +1,7 @@
 #!/usr/bin/perl
 
 use strict;
-use Test::More tests => 10;
+use Test::More tests => 12;
 use FindBin qw($Bin);
 use lib "$Bin/lib";
 use MemcachedTest;
@@ -63,3 +63,29 @@ $stats =~ m/STAT \d+:addr udp:0.0.0.0:(\d+)/;
 is($1, $server->udpport, "udp port number is correct");
 $stats =~ m/STAT \d+:addr tcp:0.0.0.0:(\d+)/;
 is($1, $server->port, "tcp port number is correct");
+
+# Connections hold their buffers only while a request is in flight.
+{
+    my @idle = map { $server->new_sock } (1..5);
+    for my $s (@idle) {
+        print $s "version\r\n";
+        my $line = <$s>;
+    }
+    select(undef, undef, undef, 0.2);
+    my $conns = mem_stats($stats_sock, "conns");
+    my ($busy, $max_idle, $nidle) = (0, 0, 0);
+    for my $key (keys %$conns) {
+        my ($fd) = $key =~ /^(\d+):state$/ or next;
+        next unless $conns->{"$fd:addr"} =~ /^tcp:/;
+        my $bytes = $conns->{"$fd:resident_bytes"};
+        if ($conns->{$key} eq "conn_nread") {
+            $busy = $bytes;
+        } elsif ($conns->{$key} eq "conn_read") {
+            $nidle++;
+            $max_idle = $bytes if $bytes > $max_idle;
+        }
+    }
+    ok($nidle >= 5 && $max_idle < 4096,
+       "$nidle idle connections hold at most $max_idle bytes");
+    ok($busy > $max_idle + 8192, "one reading a value holds $busy bytes");
+}
@@ -1,7 +1,7 @@
 #!/usr/bin/perl
 
 use strict;
-use Test::More tests => 97;
+use Test::More tests => 99;
 use FindBin qw($Bin);
 use lib "$Bin/lib";
 use MemcachedTest;
@@ -69,7 +69,7 @@ my $sock = $server->sock;
 my $stats = mem_stats($sock);
 
 # Test number of keys
-is(scalar(keys(%$stats)), 51, "51 stats values");
+is(scalar(keys(%$stats)), 58, "58 stats values");
 
 # Test initial state
 foreach my $key (qw(curr_items total_items bytes cmd_get cmd_set get_hits evictions get_misses
@@ -206,3 +206,14 @@ is(scalar <$sock>, "OK\r\n", "flushed");
 
 my $stats = mem_stats($sock);
 is($stats->{cmd_flush}, 1, "after one flush cmd_flush is 1");
+
+# A large value is mostly read straight into its item.
+{
+    my $big = "x" x 200000;
+    print $sock "set big 0 0 200000\r\n$big\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored large value");
+    my $stats = mem_stats($sock);
+    ok($stats->{value_bytes_direct} > $stats->{value_bytes_copied},
+       "$stats->{value_bytes_direct} bytes read into the item, " .
+       "$stats->{value_bytes_copied} copied");
+}
@@ -1,7 +1,7 @@
 #!/usr/bin/perl
 
 use strict;
-use Test::More tests => 48;
+use Test::More tests => 50;
 use FindBin qw($Bin);
 use lib "$Bin/lib";
 use MemcachedTest;
@@ -60,6 +60,35 @@ for my $prot (::IS_ASCII,::IS_BINARY) {
     udp_delete_test($prot,45,"aval$prot");
 }
 
+# Datagrams that are all waiting when the server reads, answered in order.
+{
+    my $n = 40;
+    my $big = "x" x 10000;
+    print $sock "set big 0 0 10000\r\n$big\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored big");
+    for my $id (1..$n) {
+        send($usock, pack("nnnn", 1000 + $id, 0, 1, 0) .
+             ($id % 10 ? "get foo\r\n" : "get big\r\n"), 0);
+    }
+    my (%resp, $res);
+    while (1) {
+        my $rin = '';
+        vec($rin, fileno($usock), 1) = 1;
+        last unless select(my $rout = $rin, undef, undef, 1.5);
+        $usock->recv($res, 1500, 0);
+        my ($id, $seq) = unpack("nn", $res);
+        $resp{$id}{$seq} = substr($res, 8);
+    }
+    my $ok = 0;
+    for my $id (1..$n) {
+        my $parts = $resp{1000 + $id} or next;
+        my $msg = join('', map { $parts->{$_} } sort { $a <=> $b } keys %$parts);
+        $ok++ if $msg eq ($id % 10 ? "VALUE foo 0 6\r\nfooval\r\nEND\r\n" :
+                          "VALUE big 0 10000\r\n$big\r\nEND\r\n");
+    }
+    is($ok, $n, "$n requests sent at once answered");
+}
+
 sub udp_set_test {
     my ($protocol, $req_id, $key, $value, $flags, $exp) = @_;
     my $req = "";
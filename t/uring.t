@@ -0,0 +1,123 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use POSIX ();
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached("-o io_uring");
+my $sock = $server->sock;
+if (mem_stats($sock, ' settings')->{io_uring} ne 'yes') {
+    plan skip_all => 'io_uring not available';
+    exit 0;
+}
+plan tests => 15;
+
+print $sock "set foo 0 0 3\r\nbar\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored foo");
+mem_get_is($sock, "foo", "bar");
+
+# Pipelined commands arrive in one receive buffer.
+{
+    my $req = '';
+    $req .= "set key$_ 0 0 " . length("val$_") . "\r\nval$_\r\n" for (1..50);
+    $req .= "get key$_\r\n" for (1..50);
+    print $sock $req;
+    my $ok = 0;
+    for (1..50) {
+        $ok++ if scalar <$sock> eq "STORED\r\n";
+    }
+    for (1..50) {
+        my $resp = '';
+        $resp .= scalar <$sock> for (1..3);
+        $ok++ if $resp eq "VALUE key$_ 0 " . length("val$_") .
+            "\r\nval$_\r\nEND\r\n";
+    }
+    is($ok, 100, "pipelined sets and gets");
+}
+
+# Values larger than a receive buffer, sent and received.
+my $big = join('', map { chr(65 + $_ % 26) } (0..299999));
+print $sock "set big 0 0 300000\r\n$big\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored large value");
+mem_get_is($sock, "big", $big);
+
+# Commands that come in while responses are still being sent.
+{
+    my $pid = fork();
+    if ($pid == 0) {
+        for (1..20) {
+            print $sock "get big\r\nset k$_ 0 0 100000\r\n" . ($_ % 10) x 100000 .
+                "\r\n";
+        }
+        # Without running the destructor, which would stop the server.
+        POSIX::_exit(0);
+    }
+    my $ok = 0;
+    for (1..20) {
+        my ($val, $line);
+        $ok++ if scalar <$sock> eq "VALUE big 0 300000\r\n";
+        read($sock, $val, 300002);
+        $ok++ if $val eq "$big\r\n";
+        $ok++ if scalar <$sock> eq "END\r\n";
+        $ok++ if scalar <$sock> eq "STORED\r\n";
+    }
+    waitpid($pid, 0);
+    is($ok, 80, "requests and responses interleaved");
+    mem_get_is($sock, "k20", "0" x 100000);
+}
+
+# A value that is too large is swallowed.
+print $sock "set huge 0 0 2000000\r\n" . ("x" x 2000000) . "\r\nget foo\r\n";
+is(scalar <$sock>, "SERVER_ERROR object too large for cache\r\n",
+   "too large value refused");
+is(scalar <$sock> . scalar <$sock> . scalar <$sock>,
+   "VALUE foo 0 3\r\nbar\r\nEND\r\n", "command after it answered");
+
+{
+    my $bin = $server->new_sock;
+    print $bin pack("CCnCCnNNNN", 0x80, 0x00, 3, 0, 0, 0, 3, 0, 0, 0) . "foo";
+    my ($header, $body);
+    read($bin, $header, 24);
+    my ($status, $bodylen) = (unpack("CCnCCnN", $header))[5, 6];
+    read($bin, $body, $bodylen);
+    ok($status == 0 && substr($body, 4) eq "bar", "binary get");
+}
+
+# Connections closed by either side go away.
+{
+    my @socks = map { $server->new_sock } (1..10);
+    print $_ "get foo\r\n" for (@socks);
+    my $ok = 0;
+    for my $s (@socks) {
+        my $resp = '';
+        $resp .= scalar <$s> for (1..3);
+        $ok++ if $resp eq "VALUE foo 0 3\r\nbar\r\nEND\r\n";
+    }
+    is($ok, 10, "ten more connections answered");
+    # Other connections of this test may still be on their way out.
+    my $open = mem_stats($sock)->{curr_connections};
+    my $first = $socks[0];
+    print $first "quit\r\n";
+    is(scalar <$first>, undef, "quit closes the connection");
+    close($_) for (@socks);
+    my $after;
+    for (1..50) {
+        $after = mem_stats($sock)->{curr_connections};
+        last if $after <= $open - 10;
+        select(undef, undef, undef, 0.1);
+    }
+    ok($after <= $open - 10, "closed connections are gone");
+}
+
+{
+    my $stats = mem_stats($sock);
+    ok($stats->{uring_enters} > 0 && $stats->{uring_sqes} > 0,
+       "$stats->{uring_sqes} operations in $stats->{uring_enters} " .
+       "io_uring_enter() calls");
+    # Every response went out through the ring.
+    is($stats->{sendmsg_calls}, 0, "no sendmsg() calls");
+}
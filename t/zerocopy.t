@@ -0,0 +1,138 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = eval { new_memcached("-o zerocopy=16384") };
+if (!$server) {
+    plan skip_all => 'MSG_ZEROCOPY not supported';
+    exit 0;
+}
+plan tests => 17;
+my $sock = $server->sock;
+
+{
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{zerocopy}, 16384, "zerocopy threshold");
+}
+
+my $big = join('', map { chr(65 + $_ % 26) } (0..199999));
+print $sock "set big 0 0 200000\r\n$big\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored large value");
+print $sock "set small 0 0 5\r\nsmall\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored small value");
+
+mem_get_is($sock, "big", $big);
+mem_get_is($sock, "small", "small");
+
+print $sock "gets big\r\n";
+like(scalar <$sock>, qr/^VALUE big 0 200000 \d+\r\n/, "gets header");
+{
+    my $val;
+    read($sock, $val, 200007);
+    is($val, "$big\r\nEND\r\n", "gets value");
+}
+
+# Several large responses queued behind each other.
+print $sock "get big\r\nget small\r\nmg big v\r\nget big\r\n";
+{
+    my $expect = "VALUE big 0 200000\r\n$big\r\nEND\r\n" .
+        "VALUE small 0 5\r\nsmall\r\nEND\r\n" .
+        "VA 200000\r\n$big\r\n" .
+        "VALUE big 0 200000\r\n$big\r\nEND\r\n";
+    my $val;
+    read($sock, $val, length($expect));
+    ok($val eq $expect, "pipelined large values");
+}
+
+{
+    my $bin = $server->new_sock;
+    print $bin pack("CCnCCnNNNN", 0x80, 0x00, 3, 0, 0, 0, 3, 0, 0, 0) . "big";
+    my ($header, $body);
+    read($bin, $header, 24);
+    my ($status, $bodylen) = (unpack("CCnCCnN", $header))[5, 6];
+    read($bin, $body, $bodylen);
+    ok($status == 0 && substr($body, 4) eq $big, "binary get");
+}
+
+# Closed right after a large response: the value still comes out whole,
+# followed by the end of the stream.
+{
+    my $c = $server->new_sock;
+    print $c "get big\r\nquit\r\n";
+    my ($val, $buf) = ('');
+    while (sysread($c, $buf, 65536)) {
+        $val .= $buf;
+    }
+    ok($val eq "VALUE big 0 200000\r\n$big\r\nEND\r\n", "value sent before quit");
+    print $sock "set big 0 0 200000\r\n" . reverse($big) . "\r\n";
+    is(scalar <$sock>, "STORED\r\n", "replaced after the close");
+    print $sock "set big 0 0 200000\r\n$big\r\n";
+    <$sock>;
+}
+
+# Replaced while the kernel may still hold the old one.
+my $big2 = reverse $big;
+print $sock "set big 0 0 200000\r\n$big2\r\n";
+is(scalar <$sock>, "STORED\r\n", "replaced large value");
+mem_get_is($sock, "big", $big2);
+
+{
+    my $stats = mem_stats($sock);
+    ok($stats->{zerocopy_bytes} > 0,
+       "$stats->{zerocopy_bytes} bytes sent with MSG_ZEROCOPY, " .
+       "$stats->{zerocopy_fallbacks} copied");
+}
+
+# With a tiny threshold the response lines, built in buffers that the next
+# command reuses, must still be copied: only values go out zero-copy.
+{
+    my $tiny = new_memcached("-o zerocopy=1");
+    my $t = $tiny->sock;
+    my %kv = map { ("k$_" => ("v$_" x (1 + $_ * 37))) } (0..19);
+    my $stored = 0;
+    foreach my $k (sort keys %kv) {
+        print $t "set $k 0 0 " . length($kv{$k}) . "\r\n$kv{$k}\r\n";
+        $stored++ if scalar <$t> eq "STORED\r\n";
+    }
+    is($stored, 20, "stored values with zerocopy=1");
+
+    my ($req, $expect) = ('', '');
+    for (1..10) {
+        foreach my $k (sort keys %kv) {
+            $req .= "mg $k v\r\nget $k\r\n";
+            $expect .= "VA " . length($kv{$k}) . "\r\n$kv{$k}\r\n" .
+                "VALUE $k 0 " . length($kv{$k}) . "\r\n$kv{$k}\r\nEND\r\n";
+        }
+    }
+    print $t $req;
+    my $val;
+    read($t, $val, length($expect));
+    ok($val eq $expect, "pipelined mg and get with zerocopy=1");
+
+    # Batched binary GETQs, whose headers are packed into wbuf.
+    my $bin = $tiny->new_sock;
+    ($req, $expect) = ('', '');
+    for (1..10) {
+        foreach my $k (sort keys %kv) {
+            $req .= pack("CCnCCnNNNN", 0x80, 0x09, length($k), 0, 0, 0,
+                         length($k), 0, 0, 0) . $k;
+            $expect .= $kv{$k};
+        }
+    }
+    $req .= pack("CCnCCnNNNN", 0x80, 0x0a, 0, 0, 0, 0, 0, 0, 0, 0);
+    print $bin $req;
+    my ($got, $header, $body) = ('');
+    for (;;) {
+        read($bin, $header, 24) == 24 or last;
+        my ($cmd, $bodylen) = (unpack("CCnCCnN", $header))[1, 6];
+        last if $cmd == 0x0a;
+        read($bin, $body, $bodylen);
+        $got .= substr($body, 4);
+    }
+    ok($got eq $expect, "pipelined binary getq with zerocopy=1");
+}
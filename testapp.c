@@ -1626,7 +1626,7 @@ static enum test_return test_binary_stat(void) {
 }
 
 static enum test_return test_binary_illegal(void) {
-    uint8_t cmd = 0x25;
+    uint8_t cmd = 0x29;
     while (cmd != 0x00) {
         union {
             protocol_binary_request_no_extras request;
@@ -1666,6 +1666,8 @@ static void *binary_hickup_recv_verification_thread(void *arg) {
 static enum test_return test_binary_pipeline_hickup_chunk(void *buffer, size_t buffersize) {
     off_t offset = 0;
     char *key[256];
+    char table[5 + 256];
+    uint32_t vlen;
     uint64_t value = 0xfeedfacedeadbeef;
 
     while (hickup_thread_running &&
@@ -1685,6 +1687,7 @@ static enum test_return test_binary_pipeline_hickup_chunk(void *buffer, size_t b
         case PROTOCOL_BINARY_CMD_REPLACEQ:
         case PROTOCOL_BINARY_CMD_SET:
         case PROTOCOL_BINARY_CMD_SETQ:
+        case PROTOCOL_BINARY_CMD_LSET:
             len = storage_command(command.bytes, sizeof(command.bytes), cmd,
                                   key, keylen , &value, sizeof(value),
                                   0, 0);
@@ -1710,6 +1713,21 @@ static enum test_return test_binary_pipeline_hickup_chunk(void *buffer, size_t b
             len = raw_command(command.bytes, sizeof(command.bytes), cmd,
                              key, keylen, NULL, 0);
             break;
+        case PROTOCOL_BINARY_CMD_SET_MULTI:
+            table[0] = keylen;
+            vlen = htonl(sizeof(value));
+            memcpy(table + 1, &vlen, sizeof(vlen));
+            memcpy(table + 5, key, keylen);
+            len = storage_command(command.bytes, sizeof(command.bytes), cmd,
+                                  table, keylen + 5, &value, sizeof(value),
+                                  0, 0);
+            break;
+        case PROTOCOL_BINARY_CMD_DELETE_MULTI:
+            table[0] = keylen;
+            memcpy(table + 1, key, keylen);
+            len = raw_command(command.bytes, sizeof(command.bytes), cmd,
+                              table, keylen + 1, NULL, 0);
+            break;
         case PROTOCOL_BINARY_CMD_DECREMENT:
         case PROTOCOL_BINARY_CMD_DECREMENTQ:
         case PROTOCOL_BINARY_CMD_INCREMENT:
@@ -1726,6 +1744,7 @@ static enum test_return test_binary_pipeline_hickup_chunk(void *buffer, size_t b
         case PROTOCOL_BINARY_CMD_GETK:
         case PROTOCOL_BINARY_CMD_GETKQ:
         case PROTOCOL_BINARY_CMD_GETQ:
+        case PROTOCOL_BINARY_CMD_LGET:
             len = raw_command(command.bytes, sizeof(command.bytes), cmd,
                              key, keylen, NULL, 0);
             break;
@@ -10,6 +10,7 @@
 #include <errno.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
 
 #ifdef __sun
 #include <atomic.h>
@@ -49,6 +50,10 @@ pthread_mutex_t atomics_mutex = PTHREAD_MUTEX_INITIALIZER;
 /* Lock for global stats */
 static pthread_mutex_t stats_lock;
 
+/* Guards the per-thread stats_base and latency_base snapshots taken by
+ * "stats reset" */
+static pthread_mutex_t stats_base_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* Free list of CQ_ITEM structs */
 static CQ_ITEM *cqi_freelist;
 static pthread_mutex_t cqi_freelist_lock;
@@ -140,11 +145,18 @@ void item_lock(uint32_t hv) {
 void *item_trylock(uint32_t hv) {
     pthread_mutex_t *lock = &item_locks[hv & hashmask(item_lock_hashpower)];
     if (pthread_mutex_trylock(lock) == 0) {
+        if (unlikely(settings.lock_stats))
+            lock_stats_acquired(lock);
         return lock;
     }
     return NULL;
 }
 
+/* The lock item_trylock() would take for hv, without taking it. */
+void *item_lock_ptr(uint32_t hv) {
+    return &item_locks[hv & hashmask(item_lock_hashpower)];
+}
+
 void item_trylock_unlock(void *lock) {
     mutex_unlock((pthread_mutex_t *) lock);
 }
@@ -351,17 +363,38 @@ static void setup_thread(LIBEVENT_THREAD *me) {
     }
     cq_init(me->new_conn_queue);
 
-    if (pthread_mutex_init(&me->stats.mutex, NULL) != 0) {
-        perror("Failed to initialize mutex");
-        exit(EXIT_FAILURE);
-    }
-
     me->suffix_cache = cache_create("suffix", SUFFIX_SIZE, sizeof(char*),
                                     NULL, NULL);
     if (me->suffix_cache == NULL) {
         fprintf(stderr, "Failed to create suffix cache\n");
         exit(EXIT_FAILURE);
     }
+
+    if (settings.hotcache)
+        hotcache_thread_init(me);
+}
+
+/*
+ * Gives every worker a ring, or none of them: connections are handed out
+ * round robin, so a mix would make the transport depend on the thread.
+ */
+static void setup_urings(int nthreads) {
+    int i;
+
+    for (i = 0; i < nthreads; i++) {
+        if (!uring_thread_init(&threads[i]))
+            break;
+    }
+    if (i < nthreads) {
+        fprintf(stderr, "Can't set up io_uring (%s), using libevent\n",
+                strerror(errno));
+        while (i-- > 0)
+            uring_thread_free(&threads[i]);
+        settings.io_uring = false;
+        return;
+    }
+    /* One more fd for each ring */
+    stats.reserved_fds += nthreads;
 }
 
 /*
@@ -421,6 +454,12 @@ static void thread_libevent_process(int fd, short which, void *arg) {
             }
         } else {
             c->thread = me;
+            if (me->uring && !IS_UDP(item->transport) &&
+                item->init_state == conn_new_cmd && !uring_conn_add(c)) {
+                if (settings.verbose > 0)
+                    fprintf(stderr, "Can't add fd %d to io_uring\n",
+                            item->sfd);
+            }
         }
         cqi_free(item);
     }
@@ -507,6 +546,125 @@ item *item_get(const char *key, const size_t nkey) {
     item_lock(hv);
     it = do_item_get(key, nkey, hv);
     item_unlock(hv);
+    if (hv < mrc_threshold)
+        mrc_record_get(hv, it);
+    return it;
+}
+
+/*
+ * Looks up n keys as item_get() would, a batch at a time. All keys of a batch
+ * are hashed, and their buckets, lock stripes and first chained items
+ * prefetched, before any lock is taken, so that the cache misses of the
+ * lookups overlap rather than follow each other. its[i] gets the item of
+ * keys[i], or NULL.
+ */
+#define ITEM_GET_BATCH 16
+
+void item_get_multi(const char **keys, const size_t *nkeys, item **its,
+                    const int n) {
+    uint32_t hv[ITEM_GET_BATCH];
+    uint8_t *lock_type = pthread_getspecific(item_lock_type_key);
+    const bool prefetch = *lock_type == ITEM_LOCK_GRANULAR;
+    int base, i, m;
+
+    for (base = 0; base < n; base += m) {
+        m = n - base < ITEM_GET_BATCH ? n - base : ITEM_GET_BATCH;
+        for (i = 0; i < m; i++) {
+            hv[i] = hash(keys[base + i], nkeys[base + i]);
+            if (prefetch) {
+                assoc_prefetch_bucket(hv[i]);
+                __builtin_prefetch(&item_locks[hv[i] &
+                                               hashmask(item_lock_hashpower)]);
+            }
+        }
+        if (prefetch) {
+            for (i = 0; i < m; i++)
+                assoc_prefetch_head(hv[i]);
+        }
+        for (i = 0; i < m; i++) {
+            item_lock(hv[i]);
+            its[base + i] = do_item_get(keys[base + i], nkeys[base + i], hv[i]);
+            item_unlock(hv[i]);
+            if (hv[i] < mrc_threshold)
+                mrc_record_get(hv[i], its[base + i]);
+        }
+    }
+}
+
+/*
+ * Sorts the m indexes in order[] by the lock stripe of their hv[], keeping
+ * their order within a stripe, so that a batch can take each stripe's lock
+ * once. m is at most MULTI_KEYS_MAX, so an insertion sort will do.
+ */
+static void order_by_stripe(uint32_t *hv, uint8_t *order, const int m) {
+    const uint32_t mask = hashmask(item_lock_hashpower);
+    int i, j;
+
+    for (i = 1; i < m; i++) {
+        uint8_t o = order[i];
+        for (j = i; j > 0 && (hv[order[j - 1]] & mask) > (hv[o] & mask); j--)
+            order[j] = order[j - 1];
+        order[j] = o;
+    }
+}
+
+/*
+ * Deletes n keys as delete would, taking each lock stripe once for all of
+ * the keys that hash to it. clsid[i] gets the slab class of the item deleted
+ * for keys[i], or 0 if there was none. Lease placeholders are removed but
+ * count as misses.
+ */
+void item_delete_multi(const char **keys, const size_t *nkeys,
+                       unsigned int *clsid, const int n) {
+    uint32_t hv[MULTI_KEYS_MAX];
+    uint8_t order[MULTI_KEYS_MAX];
+    const uint32_t mask = hashmask(item_lock_hashpower);
+    int i, k;
+
+    assert(n <= MULTI_KEYS_MAX);
+    for (i = 0; i < n; i++) {
+        hv[i] = hash(keys[i], nkeys[i]);
+        order[i] = i;
+    }
+    order_by_stripe(hv, order, n);
+
+    for (i = 0; i < n; ) {
+        uint32_t stripe = hv[order[i]] & mask;
+        item_lock(hv[order[i]]);
+        for (; i < n && (hv[k = order[i]] & mask) == stripe; i++) {
+            item *it = do_item_get_any(keys[k], nkeys[k], hv[k]);
+            clsid[k] = 0;
+            if (it != NULL) {
+                if ((it->it_flags & ITEM_LEASE) == 0)
+                    clsid[k] = it->slabs_clsid;
+                do_item_unlink(it, hv[k]);
+                do_item_remove(it);
+            }
+        }
+        item_unlock(hv[order[i - 1]]);
+    }
+}
+
+item *item_get_any(const char *key, const size_t nkey) {
+    item *it;
+    uint32_t hv;
+    hv = hash(key, nkey);
+    item_lock(hv);
+    it = do_item_get_any(key, nkey, hv);
+    item_unlock(hv);
+    return it;
+}
+
+item *item_lease_get(const char *key, const size_t nkey,
+                     enum lease_result *res) {
+    item *it;
+    uint32_t hv;
+    hv = hash(key, nkey);
+    item_lock(hv);
+    it = do_item_lease_get(key, nkey, hv, res);
+    item_unlock(hv);
+    if (hv < mrc_threshold && (*res == LEASE_HIT || *res == LEASE_GRANTED))
+        mrc_record_get(hv, *res == LEASE_HIT ? it : NULL);
     return it;
 }
 
@@ -517,6 +675,8 @@ item *item_touch(const char *key, size_t nkey, uint32_t exptime) {
     item_lock(hv);
     it = do_item_touch(key, nkey, exptime, hv);
     item_unlock(hv);
+    if (hv < mrc_threshold)
+        mrc_record_get(hv, it);
     return it;
 }
 
@@ -607,9 +767,48 @@ enum store_item_type store_item(item *item, int comm, conn* c) {
     item_lock(hv);
     ret = do_store_item(item, comm, c, hv);
     item_unlock(hv);
+    if (hv < mrc_threshold && ret == STORED)
+        mrc_record_set(hv, item);
     return ret;
 }
 
+/*
+ * Stores n items as store_item() would, with each lock stripe taken once for
+ * all of the items that hash to it. ret[i] gets the outcome for its[i]. NULL
+ * items are skipped and left NOT_STORED.
+ */
+void store_item_multi(item **its, enum store_item_type *ret, const int n,
+                      int comm, conn *c) {
+    uint32_t hv[MULTI_KEYS_MAX];
+    uint8_t order[MULTI_KEYS_MAX];
+    const uint32_t mask = hashmask(item_lock_hashpower);
+    int i, k, first, m = 0;
+
+    assert(n <= MULTI_KEYS_MAX);
+    for (i = 0; i < n; i++) {
+        ret[i] = NOT_STORED;
+        if (its[i] != NULL) {
+            hv[i] = hash(ITEM_key(its[i]), its[i]->nkey);
+            order[m++] = i;
+        }
+    }
+    order_by_stripe(hv, order, m);
+
+    for (i = 0; i < m; ) {
+        uint32_t stripe = hv[order[i]] & mask;
+        first = i;
+        item_lock(hv[order[i]]);
+        for (; i < m && (hv[k = order[i]] & mask) == stripe; i++)
+            ret[k] = do_store_item(its[k], comm, c, hv[k]);
+        item_unlock(hv[order[first]]);
+        for (; first < i; first++) {
+            k = order[first];
+            if (hv[k] < mrc_threshold && ret[k] == STORED)
+                mrc_record_set(hv[k], its[k]);
+        }
+    }
+}
+
 /*
  * Flushes expired items after a flush_all call
  */
@@ -658,94 +857,90 @@ void  item_stats_sizes(ADD_STAT add_stats, void *c) {
 /******************************* GLOBAL STATS ******************************/
 
 void STATS_LOCK() {
-    pthread_mutex_lock(&stats_lock);
+    mutex_lock_blocking(&stats_lock);
 }
 
 void STATS_UNLOCK() {
-    pthread_mutex_unlock(&stats_lock);
+    mutex_unlock(&stats_lock);
 }
 
+/* Adds cur - base to out. out may be base itself, which then becomes a
+ * snapshot of cur. */
+static void thread_stats_fold(struct thread_stats *out,
+                              const struct thread_stats *cur,
+                              const struct thread_stats *base) {
+    int sid;
+
+#define FOLD(field) out->field += THR_STATS_READ(cur->field) - base->field
+    FOLD(get_cmds);
+    FOLD(get_misses);
+    FOLD(touch_cmds);
+    FOLD(touch_misses);
+    FOLD(delete_misses);
+    FOLD(decr_misses);
+    FOLD(incr_misses);
+    FOLD(cas_misses);
+    FOLD(bytes_read);
+    FOLD(bytes_written);
+    FOLD(value_bytes_copied);
+    FOLD(value_bytes_direct);
+    FOLD(flush_cmds);
+    FOLD(conn_yields);
+    FOLD(sendmsg_calls);
+    FOLD(responses_coalesced);
+    FOLD(bin_multiget_keys);
+    FOLD(zerocopy_bytes);
+    FOLD(zerocopy_fallbacks);
+    FOLD(uring_enters);
+    FOLD(uring_sqes);
+    FOLD(auth_cmds);
+    FOLD(auth_errors);
+    FOLD(hotcache_hits);
+    FOLD(hotcache_fills);
+    FOLD(leases_issued);
+    FOLD(leases_hot_misses);
+    FOLD(leases_stale);
+    FOLD(leases_honored);
+    FOLD(leases_rejected);
+    /* Gauges; the baseline doesn't apply to them. */
+    out->conn_buffers_borrowed += THR_STATS_READ(cur->conn_buffers_borrowed);
+    out->conn_buffers_pooled += THR_STATS_READ(cur->conn_buffers_pooled);
+
+    for (sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
+        FOLD(slab_stats[sid].set_cmds);
+        FOLD(slab_stats[sid].get_hits);
+        FOLD(slab_stats[sid].touch_hits);
+        FOLD(slab_stats[sid].delete_hits);
+        FOLD(slab_stats[sid].decr_hits);
+        FOLD(slab_stats[sid].incr_hits);
+        FOLD(slab_stats[sid].cas_hits);
+        FOLD(slab_stats[sid].cas_badval);
+    }
+#undef FOLD
+}
+
+/* The worker threads keep counting; resetting just moves the baseline that
+ * threadlocal_stats_aggregate() subtracts. */
 void threadlocal_stats_reset(void) {
-    int ii, sid;
+    int ii;
+    pthread_mutex_lock(&stats_base_lock);
     for (ii = 0; ii < settings.num_threads; ++ii) {
-        pthread_mutex_lock(&threads[ii].stats.mutex);
-
-        threads[ii].stats.get_cmds = 0;
-        threads[ii].stats.get_misses = 0;
-        threads[ii].stats.touch_cmds = 0;
-        threads[ii].stats.touch_misses = 0;
-        threads[ii].stats.delete_misses = 0;
-        threads[ii].stats.incr_misses = 0;
-        threads[ii].stats.decr_misses = 0;
-        threads[ii].stats.cas_misses = 0;
-        threads[ii].stats.bytes_read = 0;
-        threads[ii].stats.bytes_written = 0;
-        threads[ii].stats.flush_cmds = 0;
-        threads[ii].stats.conn_yields = 0;
-        threads[ii].stats.auth_cmds = 0;
-        threads[ii].stats.auth_errors = 0;
-
-        for(sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
-            threads[ii].stats.slab_stats[sid].set_cmds = 0;
-            threads[ii].stats.slab_stats[sid].get_hits = 0;
-            threads[ii].stats.slab_stats[sid].touch_hits = 0;
-            threads[ii].stats.slab_stats[sid].delete_hits = 0;
-            threads[ii].stats.slab_stats[sid].incr_hits = 0;
-            threads[ii].stats.slab_stats[sid].decr_hits = 0;
-            threads[ii].stats.slab_stats[sid].cas_hits = 0;
-            threads[ii].stats.slab_stats[sid].cas_badval = 0;
-        }
-
-        pthread_mutex_unlock(&threads[ii].stats.mutex);
+        thread_stats_fold(&threads[ii].stats_base, &threads[ii].stats,
+                          &threads[ii].stats_base);
     }
+    pthread_mutex_unlock(&stats_base_lock);
 }
 
 void threadlocal_stats_aggregate(struct thread_stats *stats) {
-    int ii, sid;
+    int ii;
 
-    /* The struct has a mutex, but we can safely set the whole thing
-     * to zero since it is unused when aggregating. */
     memset(stats, 0, sizeof(*stats));
 
+    pthread_mutex_lock(&stats_base_lock);
     for (ii = 0; ii < settings.num_threads; ++ii) {
-        pthread_mutex_lock(&threads[ii].stats.mutex);
-
-        stats->get_cmds += threads[ii].stats.get_cmds;
-        stats->get_misses += threads[ii].stats.get_misses;
-        stats->touch_cmds += threads[ii].stats.touch_cmds;
-        stats->touch_misses += threads[ii].stats.touch_misses;
-        stats->delete_misses += threads[ii].stats.delete_misses;
-        stats->decr_misses += threads[ii].stats.decr_misses;
-        stats->incr_misses += threads[ii].stats.incr_misses;
-        stats->cas_misses += threads[ii].stats.cas_misses;
-        stats->bytes_read += threads[ii].stats.bytes_read;
-        stats->bytes_written += threads[ii].stats.bytes_written;
-        stats->flush_cmds += threads[ii].stats.flush_cmds;
-        stats->conn_yields += threads[ii].stats.conn_yields;
-        stats->auth_cmds += threads[ii].stats.auth_cmds;
-        stats->auth_errors += threads[ii].stats.auth_errors;
-
-        for (sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
-            stats->slab_stats[sid].set_cmds +=
-                threads[ii].stats.slab_stats[sid].set_cmds;
-            stats->slab_stats[sid].get_hits +=
-                threads[ii].stats.slab_stats[sid].get_hits;
-            stats->slab_stats[sid].touch_hits +=
-                threads[ii].stats.slab_stats[sid].touch_hits;
-            stats->slab_stats[sid].delete_hits +=
-                threads[ii].stats.slab_stats[sid].delete_hits;
-            stats->slab_stats[sid].decr_hits +=
-                threads[ii].stats.slab_stats[sid].decr_hits;
-            stats->slab_stats[sid].incr_hits +=
-                threads[ii].stats.slab_stats[sid].incr_hits;
-            stats->slab_stats[sid].cas_hits +=
-                threads[ii].stats.slab_stats[sid].cas_hits;
-            stats->slab_stats[sid].cas_badval +=
-                threads[ii].stats.slab_stats[sid].cas_badval;
-        }
-
-        pthread_mutex_unlock(&threads[ii].stats.mutex);
+        thread_stats_fold(stats, &threads[ii].stats, &threads[ii].stats_base);
     }
+    pthread_mutex_unlock(&stats_base_lock);
 }
 
 void slab_stats_aggregate(struct thread_stats *stats, struct slab_stats *out) {
@@ -772,6 +967,317 @@ void slab_stats_aggregate(struct thread_stats *stats, struct slab_stats *out) {
     }
 }
 
+/******************************* LOCK STATS ********************************/
+
+/* Counters for one lock. They are only changed by the thread holding the
+ * lock they describe, so they need no lock of their own. */
+typedef struct {
+    uint64_t acquired;
+    uint64_t contended;  /* the first trylock failed */
+    uint64_t wait_ns;
+    uint64_t hold_ns;
+    uint64_t held_since; /* 0 unless held and timed */
+} lockstats_t;
+
+#define MAX_TRACKED_LOCKS 8
+/* Hottest item lock stripes listed by "stats locks". */
+#define LOCK_STATS_TOP_STRIPES 10
+
+static struct {
+    pthread_mutex_t *mutex;
+    const char *name;
+    lockstats_t stats;
+} tracked_locks[MAX_TRACKED_LOCKS];
+static int tracked_lock_count = 0;
+static lockstats_t *item_lock_stats; /* one per stripe of item_locks */
+
+void lock_stats_register(pthread_mutex_t *mutex, const char *name) {
+    if (!settings.lock_stats || tracked_lock_count == MAX_TRACKED_LOCKS)
+        return;
+    tracked_locks[tracked_lock_count].mutex = mutex;
+    tracked_locks[tracked_lock_count].name = name;
+    tracked_lock_count++;
+}
+
+static lockstats_t *lock_stats_find(pthread_mutex_t *mutex) {
+    int i;
+    if (item_lock_stats != NULL && mutex >= item_locks &&
+        mutex < item_locks + item_lock_count) {
+        return &item_lock_stats[mutex - item_locks];
+    }
+    for (i = 0; i < tracked_lock_count; i++) {
+        if (tracked_locks[i].mutex == mutex)
+            return &tracked_locks[i].stats;
+    }
+    return NULL;
+}
+
+int mutex_lock_stats(pthread_mutex_t *mutex, const bool spin) {
+    lockstats_t *ls = lock_stats_find(mutex);
+    uint64_t start;
+
+    if (ls == NULL) {
+        if (spin) {
+            while (pthread_mutex_trylock(mutex));
+            return 0;
+        }
+        return pthread_mutex_lock(mutex);
+    }
+    if (pthread_mutex_trylock(mutex) == 0) {
+        ls->acquired++;
+        ls->held_since = latency_now();
+        return 0;
+    }
+    start = latency_now();
+    if (spin) {
+        while (pthread_mutex_trylock(mutex));
+    } else {
+        pthread_mutex_lock(mutex);
+    }
+    ls->acquired++;
+    ls->contended++;
+    ls->held_since = latency_now();
+    ls->wait_ns += ls->held_since - start;
+    return 0;
+}
+
+/* For locks taken without mutex_lock(), e.g. with a successful trylock. */
+void lock_stats_acquired(pthread_mutex_t *mutex) {
+    lockstats_t *ls = lock_stats_find(mutex);
+    if (ls != NULL) {
+        ls->acquired++;
+        ls->held_since = latency_now();
+    }
+}
+
+/* Called with the lock still held, just before it is released. */
+void lock_stats_release(pthread_mutex_t *mutex) {
+    lockstats_t *ls = lock_stats_find(mutex);
+    if (ls != NULL && ls->held_since != 0) {
+        ls->hold_ns += latency_now() - ls->held_since;
+        ls->held_since = 0;
+    }
+}
+
+/* pthread_cond_wait() that doesn't count the time asleep as held. */
+void mutex_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+    if (settings.lock_stats)
+        lock_stats_release(mutex);
+    pthread_cond_wait(cond, mutex);
+    if (settings.lock_stats)
+        lock_stats_acquired(mutex);
+}
+
+static void append_lock_stats(const char *name, const lockstats_t *ls,
+                              ADD_STAT add_stats, void *c) {
+    char key_str[STAT_KEY_LEN];
+    char val_str[STAT_VAL_LEN];
+    int klen = 0, vlen = 0;
+
+    APPEND_NUM_FMT_STAT("%s:%s", name, "acquired",
+                        "%llu", (unsigned long long)ls->acquired);
+    APPEND_NUM_FMT_STAT("%s:%s", name, "contended",
+                        "%llu", (unsigned long long)ls->contended);
+    APPEND_NUM_FMT_STAT("%s:%s", name, "wait_us",
+                        "%llu", (unsigned long long)ls->wait_ns / 1000);
+    APPEND_NUM_FMT_STAT("%s:%s", name, "hold_us",
+                        "%llu", (unsigned long long)ls->hold_ns / 1000);
+}
+
+/* Read without taking the locks, so counters may be slightly behind. */
+void lock_stats(ADD_STAT add_stats, void *c) {
+    lockstats_t total;
+    uint32_t top[LOCK_STATS_TOP_STRIPES];
+    int ntop = 0;
+    uint32_t i;
+    int j;
+
+    if (!settings.lock_stats) {
+        add_stats(NULL, 0, NULL, 0, c);
+        return;
+    }
+
+    for (j = 0; j < tracked_lock_count; j++) {
+        append_lock_stats(tracked_locks[j].name, &tracked_locks[j].stats,
+                          add_stats, c);
+    }
+
+    /* Sum the stripes, keeping the ones that were waited on longest. */
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < item_lock_count; i++) {
+        const lockstats_t *ls = &item_lock_stats[i];
+        total.acquired += ls->acquired;
+        total.contended += ls->contended;
+        total.wait_ns += ls->wait_ns;
+        total.hold_ns += ls->hold_ns;
+        if (ls->contended == 0)
+            continue;
+        if (ntop < LOCK_STATS_TOP_STRIPES) {
+            ntop++;
+        } else if (ls->wait_ns <= item_lock_stats[top[ntop - 1]].wait_ns) {
+            continue;
+        }
+        for (j = ntop - 1;
+             j > 0 && item_lock_stats[top[j - 1]].wait_ns < ls->wait_ns; j--)
+            top[j] = top[j - 1];
+        top[j] = i;
+    }
+    append_lock_stats("item_locks", &total, add_stats, c);
+    APPEND_STAT("item_locks:stripes", "%u", item_lock_count);
+    for (j = 0; j < ntop; j++) {
+        char name[32];
+        snprintf(name, sizeof(name), "item_lock_%u", top[j]);
+        append_lock_stats(name, &item_lock_stats[top[j]], add_stats, c);
+    }
+
+    add_stats(NULL, 0, NULL, 0, c);
+}
+
+static void lockstats_clear(lockstats_t *ls) {
+    /* Keep held_since, the lock may be held right now. */
+    ls->acquired = ls->contended = 0;
+    ls->wait_ns = ls->hold_ns = 0;
+}
+
+void lock_stats_reset(void) {
+    uint32_t i;
+    int j;
+    if (!settings.lock_stats)
+        return;
+    for (j = 0; j < tracked_lock_count; j++)
+        lockstats_clear(&tracked_locks[j].stats);
+    for (i = 0; i < item_lock_count; i++)
+        lockstats_clear(&item_lock_stats[i]);
+}
+
+/******************************* LATENCY STATS *****************************/
+
+/* Monotonic clock in nanoseconds, for timing commands. */
+uint64_t latency_now(void) {
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+    {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return (uint64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+    }
+}
+
+static int latency_bucket(const uint64_t ns) {
+    int msb = 0, idx;
+    if (ns < LATENCY_SUB_BUCKETS)
+        return (int)ns;
+#ifdef __GNUC__
+    msb = 63 - __builtin_clzll(ns);
+#else
+    {
+        uint64_t v = ns;
+        while (v >>= 1)
+            msb++;
+    }
+#endif
+    idx = (msb - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS +
+          (int)((ns >> (msb - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+    return idx < LATENCY_BUCKETS ? idx : LATENCY_BUCKETS - 1;
+}
+
+/* Smallest value that falls in the bucket. */
+static uint64_t latency_bucket_floor(const int idx) {
+    int power = idx / LATENCY_SUB_BUCKETS;
+    if (power == 0)
+        return idx;
+    return (uint64_t)(LATENCY_SUB_BUCKETS + idx % LATENCY_SUB_BUCKETS)
+        << (power - 1);
+}
+
+/* Only ever called by the thread that owns the histogram. Others read the
+ * buckets while it writes, so both sides use relaxed atomics, as with
+ * THR_STATS_ADD(). */
+void latency_record(LIBEVENT_THREAD *me, const enum latency_cmd cmd,
+                    const uint64_t start) {
+    uint64_t now = latency_now();
+    __atomic_fetch_add(
+        &me->latency.buckets[cmd][latency_bucket(now > start ? now - start : 0)],
+        1, __ATOMIC_RELAXED);
+}
+
+/* Merges the histograms of all worker threads. The owners keep writing while
+ * we read, so the result may be a few commands behind, but no lock is taken
+ * on the command path. */
+void threadlocal_latency_stats(ADD_STAT add_stats, void *c) {
+    static const char *names[LAT_MAX] = {
+        NULL, "get", "set", "delete", "incr", "touch"
+    };
+    static const struct {
+        const char *name;
+        double quantile;
+    } pcts[] = {
+        { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }, { "p999", 0.999 }
+    };
+    uint64_t merged[LATENCY_BUCKETS];
+    char key_str[STAT_KEY_LEN];
+    char val_str[STAT_VAL_LEN];
+    char usec[32];
+    int klen = 0, vlen = 0;
+    int cmd, ii, b, p;
+
+    for (cmd = LAT_NONE + 1; cmd < LAT_MAX; cmd++) {
+        uint64_t count = 0, seen = 0;
+
+        memset(merged, 0, sizeof(merged));
+        pthread_mutex_lock(&stats_base_lock);
+        for (ii = 0; ii < settings.num_threads; ++ii) {
+            uint64_t *buckets = threads[ii].latency.buckets[cmd];
+            for (b = 0; b < LATENCY_BUCKETS; b++)
+                merged[b] += THR_STATS_READ(buckets[b]) -
+                    threads[ii].latency_base.buckets[cmd][b];
+        }
+        pthread_mutex_unlock(&stats_base_lock);
+        for (b = 0; b < LATENCY_BUCKETS; b++)
+            count += merged[b];
+
+        APPEND_NUM_FMT_STAT("%s:%s", names[cmd], "count",
+                            "%llu", (unsigned long long)count);
+        for (p = 0, b = 0; p < sizeof(pcts) / sizeof(pcts[0]); p++) {
+            uint64_t rank = (uint64_t)(count * pcts[p].quantile);
+            uint64_t ns = 0;
+            if (count > 0) {
+                if (rank == count)
+                    rank--;
+                while (seen + merged[b] <= rank)
+                    seen += merged[b++];
+                /* Report the top of the bucket. */
+                ns = latency_bucket_floor(b + 1) - 1;
+            }
+            snprintf(usec, sizeof(usec), "%llu.%03llu",
+                     (unsigned long long)ns / 1000,
+                     (unsigned long long)ns % 1000);
+            APPEND_NUM_FMT_STAT("%s:%s", names[cmd], pcts[p].name,
+                                "%s", usec);
+        }
+    }
+
+    add_stats(NULL, 0, NULL, 0, c);
+}
+
+/* As with threadlocal_stats_reset(), the histograms are left to their
+ * owners and only the baseline moves. */
+void threadlocal_latency_reset(void) {
+    int ii, cmd, b;
+    pthread_mutex_lock(&stats_base_lock);
+    for (ii = 0; ii < settings.num_threads; ++ii) {
+        for (cmd = 0; cmd < LAT_MAX; cmd++) {
+            for (b = 0; b < LATENCY_BUCKETS; b++)
+                threads[ii].latency_base.buckets[cmd][b] =
+                    THR_STATS_READ(threads[ii].latency.buckets[cmd][b]);
+        }
+    }
+    pthread_mutex_unlock(&stats_base_lock);
+}
+
 /*
  * Initializes the thread subsystem, creating various worker threads.
  *
@@ -817,11 +1323,24 @@ void thread_init(int nthreads, struct event_base *main_base) {
     pthread_key_create(&item_lock_type_key, NULL);
     pthread_mutex_init(&item_global_lock, NULL);
 
-    threads = calloc(nthreads, sizeof(LIBEVENT_THREAD));
-    if (! threads) {
+    if (settings.lock_stats) {
+        item_lock_stats = calloc(item_lock_count, sizeof(lockstats_t));
+        if (! item_lock_stats) {
+            perror("Can't allocate item lock stats");
+            exit(1);
+        }
+        lock_stats_register(&cache_lock, "cache_lock");
+        lock_stats_register(&stats_lock, "stats_lock");
+        lock_stats_register(&item_global_lock, "item_global_lock");
+    }
+
+    /* Aligned so each thread's stats start on their own cache line */
+    if (posix_memalign((void **)&threads, 64,
+                       nthreads * sizeof(LIBEVENT_THREAD)) != 0) {
         perror("Can't allocate thread descriptors");
         exit(1);
     }
+    memset(threads, 0, nthreads * sizeof(LIBEVENT_THREAD));
 
     dispatcher_thread.base = main_base;
     dispatcher_thread.thread_id = pthread_self();
@@ -841,6 +1360,9 @@ void thread_init(int nthreads, struct event_base *main_base) {
         stats.reserved_fds += 5;
     }
 
+    if (settings.io_uring)
+        setup_urings(nthreads);
+
     /* Create threads after we've done all the libevent setup. */
     for (i = 0; i < nthreads; i++) {
         create_worker(worker_libevent, &threads[i]);
@@ -0,0 +1,614 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * io_uring worker loop, with -o io_uring.
+ *
+ * Normally a worker waits in epoll for its connections, then does a read()
+ * and a sendmsg() of its own for each request. With -o io_uring every
+ * worker has a ring instead. Each TCP or unix socket connection keeps a
+ * multishot recv armed, which receives into buffers the kernel picks from
+ * a ring of them shared by the thread, and responses go out as
+ * IORING_OP_SENDMSG. What is queued while a batch of completions is handled
+ * is submitted with a single io_uring_enter() at the end of it.
+ *
+ * The state machine does not change. uring_read() and uring_sendmsg() stand
+ * in for read() and sendmsg(): they return EAGAIN until a completion has
+ * come in, and the completion then runs drive_machine() through
+ * event_handler(). The ring's fd is watched by the thread's libevent base,
+ * so the notify pipe and UDP are handled as before.
+ *
+ * uring_read() copies out of the kernel's buffer as read() would, and what
+ * the connection does not take right away is moved to c->uring_spill so the
+ * buffer can go back to the ring. A connection that lets more than
+ * URING_SPILL_MAX pile up there has its recv cancelled until it catches up,
+ * as a full socket buffer would stop it with epoll.
+ *
+ * Completions point at their conn, so a closing connection shuts its socket
+ * down, which ends its recv, and is closed for real once the ring has
+ * nothing left for it.
+ *
+ * Without io_uring, or when the kernel refuses to set up a ring for any
+ * one of them, all the workers stay with libevent.
+ */
+#include "memcached.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#define URING_ENTRIES 1024      /* submission queue size */
+#define URING_BUFS 256          /* receive buffers per thread, a power of 2 */
+#define URING_BUF_SIZE 8192
+#define URING_BGID 0            /* their buffer group */
+#define URING_SPILL_MAX (256 * 1024)
+#define URING_ROUNDS 4          /* reap and submit passes per wake-up */
+
+/* What a completion is for, in the low bits of the conn pointer. */
+enum uring_op {
+    URING_RECV = 0,
+    URING_SEND,
+    URING_WAKE,
+    URING_CANCEL
+};
+#define URING_OP_MASK 3
+
+struct uring {
+    int fd;
+    LIBEVENT_THREAD *thread;
+    struct event event;
+    char *ring;
+    size_t ring_size;
+    /* submission queue */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_flags;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    unsigned sq_pending;    /* queued since the last io_uring_enter() */
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    /* completion queue */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    /* receive buffers */
+    struct io_uring_buf_ring *br;
+    size_t br_size;
+    uint16_t br_tail;
+    char *bufs;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+                              unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+                                 unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static uint64_t uring_data(conn *c, const enum uring_op op) {
+    return (uint64_t)(uintptr_t)c | op;
+}
+
+/* Hands receive buffer bid (back) to the kernel. */
+static void uring_buf_put(struct uring *r, const int bid) {
+    struct io_uring_buf *b = &r->br->bufs[r->br_tail & (URING_BUFS - 1)];
+
+    b->addr = (uintptr_t)(r->bufs + (size_t)bid * URING_BUF_SIZE);
+    b->len = URING_BUF_SIZE;
+    b->bid = bid;
+    r->br_tail++;
+    __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_submit(struct uring *r) {
+    unsigned flags = 0;
+    int ret;
+
+    /* A full completion queue leaves the rest with the kernel. */
+    if (__atomic_load_n(r->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW)
+        flags |= IORING_ENTER_GETEVENTS;
+    if (r->sq_pending == 0 && flags == 0)
+        return;
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    do {
+        ret = sys_io_uring_enter(r->fd, r->sq_pending, 0, flags);
+    } while (ret == -1 && errno == EINTR);
+    THR_STATS_INCR(r, uring_enters);
+    if (ret == -1) {
+        /* EAGAIN and EBUSY pass; the rest is tried again next time. */
+        if (settings.verbose > 0 && errno != EAGAIN && errno != EBUSY)
+            perror("io_uring_enter");
+        return;
+    }
+    THR_STATS_ADD(r, uring_sqes, ret);
+    r->sq_pending -= ret;
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *r) {
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    if (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >=
+        r->sq_entries) {
+        uring_submit(r);
+        if (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)
+            >= r->sq_entries)
+            return NULL;
+    }
+    idx = r->sq_local_tail & r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    r->sq_local_tail++;
+    r->sq_pending++;
+    return sqe;
+}
+
+static bool uring_arm_recv(conn *c) {
+    struct io_uring_sqe *sqe = uring_sqe(c->thread->uring);
+
+    if (sqe == NULL)
+        return false;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->sfd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = uring_data(c, URING_RECV);
+    c->uring_recv = true;
+    c->uring_ops++;
+    return true;
+}
+
+static void uring_cancel_recv(conn *c) {
+    struct io_uring_sqe *sqe;
+
+    if (!c->uring_recv || c->uring_cancel)
+        return;
+    if ((sqe = uring_sqe(c->thread->uring)) == NULL)
+        return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = uring_data(c, URING_RECV);
+    sqe->user_data = uring_data(c, URING_CANCEL);
+    c->uring_cancel = true;
+    c->uring_ops++;
+}
+
+static bool uring_wake(conn *c) {
+    struct io_uring_sqe *sqe;
+
+    if (c->uring_wake)
+        return true;
+    if ((sqe = uring_sqe(c->thread->uring)) == NULL)
+        return false;
+    sqe->opcode = IORING_OP_NOP;
+    sqe->fd = -1;
+    sqe->user_data = uring_data(c, URING_WAKE);
+    c->uring_wake = true;
+    c->uring_ops++;
+    return true;
+}
+
+/* Keeps what the connection left of a receive buffer. */
+static void uring_spill(conn *c, const char *buf, const int len) {
+    char *new_spill;
+    int size;
+
+    if (c->uring_spill_off > 0) {
+        memmove(c->uring_spill, c->uring_spill + c->uring_spill_off,
+                c->uring_spill_len);
+        c->uring_spill_off = 0;
+    }
+    if (c->uring_spill_len + len > c->uring_spill_size) {
+        size = c->uring_spill_size > 0 ? c->uring_spill_size : URING_BUF_SIZE;
+        while (size < c->uring_spill_len + len)
+            size *= 2;
+        new_spill = realloc(c->uring_spill, size);
+        if (new_spill == NULL) {
+            STATS_LOCK();
+            stats.malloc_fails++;
+            STATS_UNLOCK();
+            c->uring_eof = true;
+            c->uring_err = ENOMEM;
+            return;
+        }
+        c->uring_spill = new_spill;
+        c->uring_spill_size = size;
+    }
+    memcpy(c->uring_spill + c->uring_spill_len, buf, len);
+    c->uring_spill_len += len;
+    if (c->uring_spill_len >= URING_SPILL_MAX)
+        uring_cancel_recv(c);
+}
+
+/* Whatever a completion left to do for the connection. */
+static void uring_settle(conn *c) {
+    if (!c->uring)
+        return;
+    if (c->uring_closing) {
+        /* Nothing points at it any more; conn_close() can finish. */
+        if (c->uring_ops == 0)
+            event_handler(c->sfd, EV_READ, c);
+        return;
+    }
+    if (c->uring_sending)
+        return;
+    if (!c->uring_recv && !c->uring_eof &&
+        c->uring_spill_len < URING_SPILL_MAX && !uring_arm_recv(c)) {
+        c->uring_eof = true;
+        c->uring_err = EBUSY;
+    }
+    /* Waiting for input that is already here. */
+    switch (c->state) {
+    case conn_read:
+    case conn_new_cmd:
+    case conn_nread:
+    case conn_swallow:
+        if (c->uring_spill_len > 0 || c->uring_eof)
+            uring_wake(c);
+        break;
+    default:
+        break;
+    }
+}
+
+static void uring_recv_done(struct uring *r, conn *c,
+                            const struct io_uring_cqe *cqe) {
+    int bid = -1;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        c->uring_recv = false;
+        c->uring_ops--;
+    }
+
+    if (cqe->res > 0 && bid >= 0 && !c->uring_closing && !c->uring_eof) {
+        char *buf = r->bufs + (size_t)bid * URING_BUF_SIZE;
+        if (c->uring_sending) {
+            uring_spill(c, buf, cqe->res);
+        } else {
+            c->uring_buf = buf;
+            c->uring_buf_len = cqe->res;
+            event_handler(c->sfd, EV_READ, c);
+            if (c->uring && c->uring_buf_len > 0)
+                uring_spill(c, c->uring_buf, c->uring_buf_len);
+            c->uring_buf_len = 0;
+        }
+    } else if (cqe->res == 0 ||
+               (cqe->res < 0 && cqe->res != -ENOBUFS &&
+                cqe->res != -ECANCELED)) {
+        /* End of stream, or an error to report to the next read. */
+        c->uring_eof = true;
+        c->uring_err = cqe->res < 0 ? -cqe->res : 0;
+    }
+    if (bid >= 0)
+        uring_buf_put(r, bid);
+}
+
+static void uring_complete(struct uring *r, const struct io_uring_cqe *cqe) {
+    conn *c = (conn *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+
+    switch (cqe->user_data & URING_OP_MASK) {
+    case URING_RECV:
+        uring_recv_done(r, c, cqe);
+        break;
+    case URING_SEND:
+        c->uring_sending = false;
+        c->uring_ops--;
+        c->uring_sent = true;
+        c->uring_res = cqe->res;
+        if (!c->uring_closing)
+            event_handler(c->sfd, EV_WRITE, c);
+        break;
+    case URING_WAKE:
+        c->uring_wake = false;
+        c->uring_ops--;
+        if (!c->uring_closing && !c->uring_sending)
+            event_handler(c->sfd, EV_WRITE, c);
+        break;
+    case URING_CANCEL:
+        c->uring_cancel = false;
+        c->uring_ops--;
+        break;
+    }
+    uring_settle(c);
+}
+
+static int uring_reap(struct uring *r) {
+    struct io_uring_cqe cqe;
+    unsigned head = *r->cq_head;
+    int n = 0;
+
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = r->cqes[head & r->cq_mask];
+        head++;
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        uring_complete(r, &cqe);
+        n++;
+    }
+    return n;
+}
+
+/* The ring's fd is readable: there are completions. */
+static void uring_handler(const int fd, const short which, void *arg) {
+    struct uring *r = arg;
+    int rounds = 0;
+    int n;
+
+    /* Sends often complete inline while being submitted. */
+    do {
+        n = uring_reap(r);
+        uring_submit(r);
+    } while (n > 0 && ++rounds < URING_ROUNDS);
+}
+
+static void uring_free(struct uring *r) {
+    if (r->bufs)
+        free(r->bufs);
+    if (r->br)
+        munmap(r->br, r->br_size);
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_size);
+    if (r->ring)
+        munmap(r->ring, r->ring_size);
+    if (r->fd >= 0)
+        close(r->fd);
+    free(r);
+}
+
+bool uring_thread_init(LIBEVENT_THREAD *me) {
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    struct uring *r;
+    size_t sq_size, cq_size;
+    void *mem;
+    int i, err;
+
+    if ((r = calloc(1, sizeof(struct uring))) == NULL)
+        return false;
+    r->thread = me;
+    memset(&p, 0, sizeof(p));
+    if ((r->fd = sys_io_uring_setup(URING_ENTRIES, &p)) < 0)
+        goto fail;
+    /* 5.4 or later; provided buffer rings below need 5.19 anyway. */
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_NODROP)) {
+        errno = ENOSYS;
+        goto fail;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    mem = mmap(NULL, r->ring_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (mem == MAP_FAILED)
+        goto fail;
+    r->ring = mem;
+    r->sq_head = (unsigned *)(r->ring + p.sq_off.head);
+    r->sq_tail = (unsigned *)(r->ring + p.sq_off.tail);
+    r->sq_flags = (unsigned *)(r->ring + p.sq_off.flags);
+    r->sq_array = (unsigned *)(r->ring + p.sq_off.array);
+    r->sq_mask = *(unsigned *)(r->ring + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_local_tail = *r->sq_tail;
+    r->cq_head = (unsigned *)(r->ring + p.cq_off.head);
+    r->cq_tail = (unsigned *)(r->ring + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(r->ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(r->ring + p.cq_off.cqes);
+
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    mem = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (mem == MAP_FAILED)
+        goto fail;
+    r->sqes = mem;
+
+    /* The buffer ring has to be page aligned. */
+    r->br_size = URING_BUFS * sizeof(struct io_uring_buf);
+    mem = mmap(NULL, r->br_size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        goto fail;
+    r->br = mem;
+    if ((r->bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE)) == NULL)
+        goto fail;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)r->br;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = URING_BGID;
+    if (sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        goto fail;
+    for (i = 0; i < URING_BUFS; i++)
+        uring_buf_put(r, i);
+
+    event_set(&r->event, r->fd, EV_READ | EV_PERSIST, uring_handler, r);
+    event_base_set(me->base, &r->event);
+    if (event_add(&r->event, 0) == -1)
+        goto fail;
+    me->uring = r;
+    return true;
+
+fail:
+    err = errno;
+    uring_free(r);
+    errno = err;
+    return false;
+}
+
+/* Undoes uring_thread_init(), before the thread has any connections. */
+void uring_thread_free(LIBEVENT_THREAD *me) {
+    event_del(&me->uring->event);
+    uring_free(me->uring);
+    me->uring = NULL;
+}
+
+bool uring_conn_add(conn *c) {
+    if (event_del(&c->event) == -1)
+        return false;
+    c->uring = true;
+    c->uring_recv = c->uring_sending = c->uring_sent = false;
+    c->uring_wake = c->uring_cancel = false;
+    c->uring_eof = c->uring_closing = false;
+    c->uring_err = 0;
+    c->uring_ops = 0;
+    c->uring_buf_len = 0;
+    c->uring_spill_off = c->uring_spill_len = 0;
+    /* The ring has no way to hold items for MSG_ZEROCOPY. */
+    c->zerocopy = false;
+    if (!uring_arm_recv(c)) {
+        c->uring = false;
+        event_add(&c->event, 0);
+        return false;
+    }
+    uring_submit(c->thread->uring);
+    return true;
+}
+
+ssize_t uring_read(conn *c, void *buf, size_t count) {
+    size_t n, copied = 0;
+
+    if (c->uring_spill_len > 0) {
+        n = count < c->uring_spill_len ? count : c->uring_spill_len;
+        memcpy(buf, c->uring_spill + c->uring_spill_off, n);
+        c->uring_spill_off += n;
+        c->uring_spill_len -= n;
+        if (c->uring_spill_len == 0)
+            c->uring_spill_off = 0;
+        copied += n;
+    }
+    if (copied < count && c->uring_buf_len > 0) {
+        n = count - copied;
+        if (n > c->uring_buf_len)
+            n = c->uring_buf_len;
+        memcpy((char *)buf + copied, c->uring_buf, n);
+        c->uring_buf += n;
+        c->uring_buf_len -= n;
+        copied += n;
+    }
+    if (copied > 0)
+        return copied;
+    if (c->uring_eof) {
+        if (c->uring_err == 0)
+            return 0;
+        errno = c->uring_err;
+        return -1;
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+ssize_t uring_sendmsg(conn *c, struct msghdr *m) {
+    struct io_uring_sqe *sqe;
+
+    /* The completion of the one transmit() queued last time. */
+    if (c->uring_sent) {
+        c->uring_sent = false;
+        if (c->uring_res < 0) {
+            errno = -c->uring_res;
+            return -1;
+        }
+        return c->uring_res;
+    }
+    if ((sqe = uring_sqe(c->thread->uring)) == NULL) {
+        errno = EBUSY;
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->sfd;
+    sqe->addr = (uintptr_t)m;
+    sqe->len = 1;
+    sqe->user_data = uring_data(c, URING_SEND);
+    c->uring_sending = true;
+    c->uring_ops++;
+    errno = EAGAIN;
+    return -1;
+}
+
+bool uring_update_event(conn *c, const int new_flags) {
+    /* Reads are always armed; EV_WRITE asks to be run again soon. */
+    if ((new_flags & EV_WRITE) && !c->uring_sending)
+        return uring_wake(c);
+    return true;
+}
+
+bool uring_conn_close(conn *c) {
+    if (!c->uring_closing) {
+        c->uring_closing = true;
+        shutdown(c->sfd, SHUT_RDWR);
+    }
+    if (c->uring_ops > 0)
+        return false;
+    c->uring = false;
+    c->uring_closing = false;
+    c->uring_buf_len = 0;
+    c->uring_spill_off = c->uring_spill_len = 0;
+    return true;
+}
+
+void uring_conn_free(conn *c) {
+    free(c->uring_spill);
+    c->uring_spill = NULL;
+    c->uring_spill_size = 0;
+}
+
+#else
+
+/* Without io_uring the workers always use libevent. */
+bool uring_thread_init(LIBEVENT_THREAD *me) {
+    errno = ENOSYS;
+    return false;
+}
+
+void uring_thread_free(LIBEVENT_THREAD *me) {
+}
+
+bool uring_conn_add(conn *c) {
+    return false;
+}
+
+ssize_t uring_read(conn *c, void *buf, size_t count) {
+    errno = ENOSYS;
+    return -1;
+}
+
+ssize_t uring_sendmsg(conn *c, struct msghdr *m) {
+    errno = ENOSYS;
+    return -1;
+}
+
+bool uring_update_event(conn *c, const int new_flags) {
+    return true;
+}
+
+bool uring_conn_close(conn *c) {
+    return true;
+}
+
+void uring_conn_free(conn *c) {
+}
+
+#endif
@@ -0,0 +1,374 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Zero-copy sends of large values, with -o zerocopy.
+ *
+ * sendmsg() copies what it sends into socket buffers. With MSG_ZEROCOPY
+ * (Linux 4.14 and later) the kernel sends from our pages instead, and says
+ * on the socket's error queue when it is done with them. Only item data is
+ * sent that way: transmit() hands an iovec of at least settings.zerocopy
+ * bytes that lies inside an item of the response to sendmsg() on its own,
+ * as wbuf and the CAS suffixes are reused as soon as a response is out,
+ * however small the threshold. The items of such a response are then held
+ * here until the kernel has completed the last send that used them.
+ *
+ * Every zero-copy send that returns data gets the next number of a
+ * per-socket counter, and completions come back as ranges of those
+ * numbers, in order for TCP. Waiting notifications make the socket report
+ * an error to poll, so event_handler() reaps them before anything else.
+ *
+ * The kernel copies after all when it can't send from user pages, as on
+ * loopback, and the connection then goes back to plain sends. It also
+ * refuses zero-copy sends with ENOBUFS once the socket's option memory is
+ * used up; such sends are retried as copies. Both show as
+ * zerocopy_fallbacks.
+ *
+ * A connection may close while the kernel still sends from its items. Its
+ * socket is then kept open, shut down for writing so that the client still
+ * sees the end of the stream after the data, on a list of its thread with
+ * the held items. A timer of the thread reaps their completions until the
+ * last one is in, and only then closes the socket. A client that stops
+ * reading for ZEROCOPY_ORPHAN_TTL seconds gets its connection reset, which
+ * frees what the kernel still held.
+ */
+#include "memcached.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_ZEROCOPY
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <unistd.h>
+
+/* A held reference, released once send number seq has completed. */
+struct zerocopy_hold {
+    item *it;
+    uint32_t seq;
+};
+
+/* A closed connection whose items are still being sent from. */
+struct zerocopy_orphan {
+    int sfd;
+    uint32_t done;
+    rel_time_t closed;
+    bool reset;
+    struct zerocopy_hold *held;
+    int nheld;
+    struct zerocopy_orphan *next;
+};
+
+#define ZEROCOPY_ORPHAN_TTL 30
+#define ZEROCOPY_ORPHAN_USEC 10000
+
+void zerocopy_conn_init(conn *c) {
+    int flags = 1;
+
+    c->zerocopy = false;
+    c->zc_used = false;
+    c->zc_next = 0;
+    c->zc_done = 0;
+    c->zc_nheld = 0;
+    if (settings.zerocopy == 0 || c->transport != tcp_transport ||
+        c->state == conn_listening)
+        return;
+    /* Fails for unix domain sockets and older kernels, which copy. */
+    if (setsockopt(c->sfd, SOL_SOCKET, SO_ZEROCOPY, &flags,
+                   sizeof(flags)) == 0)
+        c->zerocopy = true;
+}
+
+static bool zerocopy_reserve(conn *c, const int n) {
+    struct zerocopy_hold *new_held;
+    int size = c->zc_size > 0 ? c->zc_size : 16;
+
+    if (c->zc_nheld + n <= c->zc_size)
+        return true;
+    while (size < c->zc_nheld + n)
+        size *= 2;
+    new_held = realloc(c->zc_held, sizeof(struct zerocopy_hold) * size);
+    if (new_held == NULL) {
+        STATS_LOCK();
+        stats.malloc_fails++;
+        STATS_UNLOCK();
+        return false;
+    }
+    c->zc_held = new_held;
+    c->zc_size = size;
+    return true;
+}
+
+/* Whether iov points into one of the items the response holds, which
+ * zerocopy_hold() can keep for the kernel. */
+static bool zerocopy_in_item(const conn *c, const struct iovec *iov) {
+    const char *p = iov->iov_base;
+    item *it;
+    int i;
+
+    for (i = -1; i < c->ileft; i++) {
+        it = i < 0 ? c->item : c->icurr[i];
+        if (it != NULL && p >= (char *)it &&
+            p + iov->iov_len <= (char *)it + ITEM_ntotal(it))
+            return true;
+    }
+    return false;
+}
+
+int zerocopy_prepare(conn *c, struct msghdr *m, int *hidden) {
+    int i;
+
+    *hidden = 0;
+    for (i = 0; i < m->msg_iovlen; i++) {
+        if (m->msg_iov[i].iov_len >= settings.zerocopy &&
+            zerocopy_in_item(c, &m->msg_iov[i]))
+            break;
+    }
+    if (i == m->msg_iovlen)
+        return 0;
+    if (i > 0) {
+        /* Copy what comes before it. */
+        *hidden = m->msg_iovlen - i;
+        m->msg_iovlen = i;
+        return 0;
+    }
+    /* Make sure the items can be held before the pages are lent out. */
+    if (!zerocopy_reserve(c, c->ileft + 1))
+        return 0;
+    *hidden = m->msg_iovlen - 1;
+    m->msg_iovlen = 1;
+    return MSG_ZEROCOPY;
+}
+
+ssize_t zerocopy_sent(conn *c, struct msghdr *m, const ssize_t res) {
+    if (res == -1 && errno == ENOBUFS) {
+        THR_STATS_INCR(c, zerocopy_fallbacks);
+        THR_STATS_INCR(c, sendmsg_calls);
+        return sendmsg(c->sfd, m, 0);
+    }
+    if (res > 0) {
+        c->zc_next++;
+        c->zc_used = true;
+        THR_STATS_ADD(c, zerocopy_bytes, res);
+    }
+    return res;
+}
+
+static void zerocopy_hold_item(conn *c, item *it) {
+    c->zc_held[c->zc_nheld].it = it;
+    c->zc_held[c->zc_nheld].seq = c->zc_next - 1;
+    c->zc_nheld++;
+}
+
+void zerocopy_hold(conn *c) {
+    if (!c->zc_used)
+        return;
+    c->zc_used = false;
+    /* zerocopy_prepare() made room for all of them. */
+    if (c->item) {
+        zerocopy_hold_item(c, c->item);
+        c->item = 0;
+    }
+    while (c->ileft > 0) {
+        zerocopy_hold_item(c, *(c->icurr));
+        c->icurr++;
+        c->ileft--;
+    }
+    zerocopy_reap(c);
+}
+
+/*
+ * Reads the completions waiting on the error queue of sfd, moving *done
+ * past the sends they cover. Returns how many of those the kernel copied.
+ */
+static uint32_t zerocopy_completions(const int sfd, uint32_t *done) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+    struct sock_extended_err *serr;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    uint32_t copied = 0;
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(sfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+            break;
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!((cmsg->cmsg_level == SOL_IP &&
+                   cmsg->cmsg_type == IP_RECVERR) ||
+                  (cmsg->cmsg_level == SOL_IPV6 &&
+                   cmsg->cmsg_type == IPV6_RECVERR)))
+                continue;
+            serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (serr->ee_errno != 0 ||
+                serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                copied += serr->ee_data - serr->ee_info + 1;
+            if ((int32_t)(serr->ee_data + 1 - *done) > 0)
+                *done = serr->ee_data + 1;
+        }
+    }
+    return copied;
+}
+
+/* Releases the held items whose sends have all completed, and returns how
+ * many are still held. */
+static int zerocopy_release(LIBEVENT_THREAD *me, struct zerocopy_hold *held,
+                            int nheld, const uint32_t done) {
+    int i, n;
+
+    for (n = 0; n < nheld; n++) {
+        if ((int32_t)(held[n].seq - done) >= 0)
+            break;
+        hotcache_release(me, held[n].it);
+    }
+    if (n > 0) {
+        nheld -= n;
+        for (i = 0; i < nheld; i++)
+            held[i] = held[n + i];
+    }
+    return nheld;
+}
+
+void zerocopy_reap(conn *c) {
+    uint32_t copied = zerocopy_completions(c->sfd, &c->zc_done);
+
+    /* The route can't send from our pages, so stop paying for the
+     * notifications. */
+    if (copied > 0) {
+        THR_STATS_ADD(c, zerocopy_fallbacks, copied);
+        c->zerocopy = false;
+    }
+    c->zc_nheld = zerocopy_release(c->thread, c->zc_held, c->zc_nheld,
+                                   c->zc_done);
+}
+
+static void zerocopy_orphans_reap(const int fd, const short which,
+                                  void *arg) {
+    LIBEVENT_THREAD *me = arg;
+    struct zerocopy_orphan **p = &me->zc_orphans;
+    struct zerocopy_orphan *o;
+    struct sockaddr sa;
+    struct timeval t = {0, ZEROCOPY_ORPHAN_USEC};
+
+    while ((o = *p) != NULL) {
+        zerocopy_completions(o->sfd, &o->done);
+        o->nheld = zerocopy_release(me, o->held, o->nheld, o->done);
+        if (o->nheld == 0) {
+            close(o->sfd);
+            *p = o->next;
+            free(o->held);
+            free(o);
+            continue;
+        }
+        if (!o->reset && current_time - o->closed > ZEROCOPY_ORPHAN_TTL) {
+            /* Drops the unsent data, and with it our pages. The socket
+             * stays open for the completions that follow. */
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_family = AF_UNSPEC;
+            connect(o->sfd, &sa, sizeof(sa));
+            o->reset = true;
+        }
+        p = &o->next;
+    }
+
+    if (me->zc_orphans != NULL)
+        evtimer_add(&me->zc_timer, &t);
+}
+
+/*
+ * The connection is going away. If the kernel still sends from some of its
+ * items, the socket is left to zerocopy_orphans_reap() and true returned,
+ * else the caller closes it.
+ */
+bool zerocopy_conn_close(conn *c) {
+    LIBEVENT_THREAD *me = c->thread;
+    struct zerocopy_orphan *o;
+    struct sockaddr sa;
+    struct timeval t = {0, ZEROCOPY_ORPHAN_USEC};
+    int i;
+
+    if (c->zc_nheld == 0)
+        return false;
+    zerocopy_reap(c);
+    if (c->zc_nheld == 0)
+        return false;
+
+    o = malloc(sizeof(*o));
+    if (o == NULL) {
+        STATS_LOCK();
+        stats.malloc_fails++;
+        STATS_UNLOCK();
+        /* With nowhere to wait, reset the connection first so that the
+         * kernel drops what it hasn't sent yet. */
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_family = AF_UNSPEC;
+        connect(c->sfd, &sa, sizeof(sa));
+        for (i = 0; i < c->zc_nheld; i++)
+            hotcache_release(me, c->zc_held[i].it);
+        c->zc_nheld = 0;
+        return false;
+    }
+    shutdown(c->sfd, SHUT_WR);
+    o->sfd = c->sfd;
+    o->done = c->zc_done;
+    o->closed = current_time;
+    o->reset = false;
+    o->held = c->zc_held;
+    o->nheld = c->zc_nheld;
+    c->zc_held = NULL;
+    c->zc_nheld = 0;
+    c->zc_size = 0;
+
+    if (me->zc_orphans == NULL) {
+        evtimer_set(&me->zc_timer, zerocopy_orphans_reap, me);
+        event_base_set(me->base, &me->zc_timer);
+        evtimer_add(&me->zc_timer, &t);
+    }
+    o->next = me->zc_orphans;
+    me->zc_orphans = o;
+    return true;
+}
+
+void zerocopy_conn_free(conn *c) {
+    free(c->zc_held);
+    c->zc_held = NULL;
+    c->zc_size = 0;
+}
+
+#else
+
+/* Without MSG_ZEROCOPY c->zerocopy is never set. */
+void zerocopy_conn_init(conn *c) {
+    c->zerocopy = false;
+    c->zc_used = false;
+    c->zc_next = c->zc_done = 0;
+    c->zc_nheld = 0;
+}
+
+int zerocopy_prepare(conn *c, struct msghdr *m, int *hidden) {
+    *hidden = 0;
+    return 0;
+}
+
+ssize_t zerocopy_sent(conn *c, struct msghdr *m, const ssize_t res) {
+    return res;
+}
+
+void zerocopy_hold(conn *c) {
+}
+
+void zerocopy_reap(conn *c) {
+}
+
+bool zerocopy_conn_close(conn *c) {
+    return false;
+}
+
+void zerocopy_conn_free(conn *c) {
+}
+
+#endif